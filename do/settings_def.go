@@ -294,6 +294,9 @@ var (
 		mkField("CustomScreenDPI", Int, 0,
 			"actual resolution of the main screen in DPI (if this value "+
 				"isn't positive, the system's UI setting is used)").setExpert().setVersion("2.5"),
+		mkField("RenderCacheSizeMB", Int, 0,
+			"maximum amount of memory in megabytes used for caching rendered pages (if this value "+
+				"isn't positive, it's based on the amount of installed memory)").setExpert().setVersion("3.4"),
 		mkEmptyLine(),
 
 		mkField("RememberStatePerDocument", Bool, true,
@@ -65,6 +65,7 @@
 // Almost equal to my initial code.
 
 #include "GScaler.h"
+#include "MMX.h"
 
 
 #ifdef HAVE_NAMESPACES
@@ -126,6 +127,34 @@ maxi(int x, int y)
 }
 
 
+#ifdef SSE2
+// Vertical interpolation of n bytes (a multiple of 16)
+// computing exactly what the interp[frac] tables compute.
+static void
+sse2_interp_line(unsigned char *dest, const unsigned char *lower,
+                 const unsigned char *upper, int n, int frac)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i f = _mm_set1_epi16((short)frac);
+  const __m128i d = _mm_set1_epi16(FRACSIZE2);
+  for (int i=0; i<n; i+=16)
+    {
+      __m128i l = _mm_loadu_si128((const __m128i*)(lower+i));
+      __m128i u = _mm_loadu_si128((const __m128i*)(upper+i));
+      __m128i l0 = _mm_unpacklo_epi8(l, zero);
+      __m128i l1 = _mm_unpackhi_epi8(l, zero);
+      __m128i u0 = _mm_unpacklo_epi8(u, zero);
+      __m128i u1 = _mm_unpackhi_epi8(u, zero);
+      u0 = _mm_mullo_epi16(_mm_sub_epi16(u0, l0), f);
+      u1 = _mm_mullo_epi16(_mm_sub_epi16(u1, l1), f);
+      u0 = _mm_add_epi16(l0, _mm_srai_epi16(_mm_add_epi16(u0, d), FRACBITS));
+      u1 = _mm_add_epi16(l1, _mm_srai_epi16(_mm_add_epi16(u1, d), FRACBITS));
+      _mm_storeu_si128((__m128i*)(dest+i), _mm_packus_epi16(u0, u1));
+    }
+}
+#endif
+
+
 
 
 
@@ -422,6 +451,8 @@ GBitmapScaler::scale( const GRect &provided_input, const GBitmap &input,
   gp2.resize(0);
   glbuffer.resize(0);
   prepare_interp();
+  if (MMXControl::sse2flag < 0)
+    MMXControl::enable_mmx();
   const int bufw = required_red.width();
   glbuffer.resize(bufw+2);
   gp1.resize(bufw);
@@ -452,7 +483,15 @@ GBitmapScaler::scale( const GRect &provided_input, const GBitmap &input,
         // Compute line
         unsigned char *dest = lbuffer+1;
         const short *deltas = & interp[fy&FRACMASK][256];
-        for(unsigned char const * const edest=(unsigned char const *)dest+bufw;
+#ifdef SSE2
+        if (MMXControl::sse2flag > 0)
+          {
+            int n = bufw & ~15;
+            sse2_interp_line(dest, lower, upper, n, fy&FRACMASK);
+            dest += n; lower += n; upper += n;
+          }
+#endif
+        for(unsigned char const * const edest=(unsigned char const *)lbuffer+1+bufw;
           dest<edest;upper++,lower++,dest++)
         {
           const int l = *lower;
@@ -616,6 +655,8 @@ GPixmapScaler::scale( const GRect &provided_input, const GPixmap &input,
   gp2.resize(0);
   glbuffer.resize(0);
   prepare_interp();
+  if (MMXControl::sse2flag < 0)
+    MMXControl::enable_mmx();
   const int bufw = required_red.width();
   glbuffer.resize(bufw+2);
   if (xshift>0 || yshift>0)
@@ -650,7 +691,16 @@ GPixmapScaler::scale( const GRect &provided_input, const GPixmap &input,
         // Compute line
         GPixel *dest = lbuffer+1;
         const short *deltas = & interp[fy&FRACMASK][256];
-        for(GPixel const * const edest = (GPixel const *)dest+bufw;
+#ifdef SSE2
+        if (MMXControl::sse2flag > 0)
+          {
+            int n = bufw & ~15;
+            sse2_interp_line((unsigned char*)dest, (const unsigned char*)lower,
+                             (const unsigned char*)upper, n*3, fy&FRACMASK);
+            dest += n; lower += n; upper += n;
+          }
+#endif
+        for(GPixel const * const edest = (GPixel const *)lbuffer+1+bufw;
           dest<edest;upper++,lower++,dest++)
         {
           const int lower_r = lower->r;
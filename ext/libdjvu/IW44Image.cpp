@@ -243,6 +243,146 @@ mmx_bv_2 ( short* &q, short* e, int s, int s3 )
 }
 #endif /* MMX */
 
+
+//////////////////////////////////////////////////////
+// SSE2 IMPLEMENTATION HELPERS
+//////////////////////////////////////////////////////
+
+
+// Note:
+// The SSE2 helpers compute the lifting filters with 32 bit
+// intermediates and truncate the results to 16 bits exactly
+// like the baseline code, so that both produce identical
+// coefficients.  They are also available on x64 where the
+// MMX helpers cannot be compiled.
+
+#ifdef SSE2
+
+// Sign extends the low (resp. high) 16 bits of each 32 bit word.
+#define SSE2_LO16(x) _mm_srai_epi32(_mm_slli_epi32(x,16),16)
+#define SSE2_HI16(x) _mm_srai_epi32(x,16)
+// Returns 32 bit words [n..n+3] of the concatenation [a,b]
+#define SSE2_ALIGN32(a,b,n) \
+  _mm_or_si128(_mm_srli_si128(a,4*(n)), _mm_slli_si128(b,16-4*(n)))
+
+static void
+sse2_bv_1 ( short* &q, short* e, int s, int s3 )
+{
+  const __m128i w9 = _mm_set1_epi16(9);
+  const __m128i w1 = _mm_set1_epi16(1);
+  const __m128i d16 = _mm_set1_epi32(16);
+  while (q+7 < e)
+    {
+      __m128i b = _mm_loadu_si128((const __m128i*)(q-s));
+      __m128i c = _mm_loadu_si128((const __m128i*)(q+s));
+      __m128i a = _mm_loadu_si128((const __m128i*)(q-s3));
+      __m128i d = _mm_loadu_si128((const __m128i*)(q+s3));
+      __m128i x0 = _mm_madd_epi16(_mm_unpacklo_epi16(b,c), w9);
+      __m128i x1 = _mm_madd_epi16(_mm_unpackhi_epi16(b,c), w9);
+      x0 = _mm_sub_epi32(x0, _mm_madd_epi16(_mm_unpacklo_epi16(a,d), w1));
+      x1 = _mm_sub_epi32(x1, _mm_madd_epi16(_mm_unpackhi_epi16(a,d), w1));
+      x0 = _mm_srai_epi32(_mm_add_epi32(x0, d16), 5);
+      x1 = _mm_srai_epi32(_mm_add_epi32(x1, d16), 5);
+      x0 = _mm_packs_epi32(SSE2_LO16(x0), SSE2_LO16(x1));
+      __m128i p = _mm_loadu_si128((const __m128i*)q);
+      _mm_storeu_si128((__m128i*)q, _mm_sub_epi16(p, x0));
+      q += 8;
+    }
+}
+
+
+static void
+sse2_bv_2 ( short* &q, short* e, int s, int s3 )
+{
+  const __m128i w9 = _mm_set1_epi16(9);
+  const __m128i w1 = _mm_set1_epi16(1);
+  const __m128i d8 = _mm_set1_epi32(8);
+  while (q+7 < e)
+    {
+      __m128i b = _mm_loadu_si128((const __m128i*)(q-s));
+      __m128i c = _mm_loadu_si128((const __m128i*)(q+s));
+      __m128i a = _mm_loadu_si128((const __m128i*)(q-s3));
+      __m128i d = _mm_loadu_si128((const __m128i*)(q+s3));
+      __m128i x0 = _mm_madd_epi16(_mm_unpacklo_epi16(b,c), w9);
+      __m128i x1 = _mm_madd_epi16(_mm_unpackhi_epi16(b,c), w9);
+      x0 = _mm_sub_epi32(x0, _mm_madd_epi16(_mm_unpacklo_epi16(a,d), w1));
+      x1 = _mm_sub_epi32(x1, _mm_madd_epi16(_mm_unpackhi_epi16(a,d), w1));
+      x0 = _mm_srai_epi32(_mm_add_epi32(x0, d8), 4);
+      x1 = _mm_srai_epi32(_mm_add_epi32(x1, d8), 4);
+      x0 = _mm_packs_epi32(SSE2_LO16(x0), SSE2_LO16(x1));
+      __m128i p = _mm_loadu_si128((const __m128i*)q);
+      _mm_storeu_si128((__m128i*)q, _mm_add_epi16(p, x0));
+      q += 8;
+    }
+}
+
+
+// Processes the generic case of filter_bh for scale 1 eight
+// even samples at a time.  The lifting state (a1..a3, b1..b3)
+// is read and updated so that the scalar loop can resume.
+static void
+sse2_bh_1 ( short* &q, short* e, int &a1, int &a2, int &a3, 
+            int &b1, int &b2, int &b3 )
+{
+  const __m128i d16 = _mm_set1_epi32(16);
+  const __m128i d8 = _mm_set1_epi32(8);
+  const __m128i lo16 = _mm_set1_epi32(0xffff);
+  while (q+20 <= e)
+    {
+      // Original samples around q[0..15]
+      __m128i l0 = _mm_loadu_si128((const __m128i*)(q-4));
+      __m128i l1 = _mm_loadu_si128((const __m128i*)(q+4));
+      __m128i l2 = _mm_loadu_si128((const __m128i*)(q+12));
+      __m128i e0 = SSE2_LO16(_mm_loadu_si128((const __m128i*)q));
+      __m128i e1 = SSE2_LO16(_mm_loadu_si128((const __m128i*)(q+8)));
+      __m128i o0 = SSE2_HI16(l0);   // q[-3], q[-1], q[1], q[3]
+      __m128i o1 = SSE2_HI16(l1);   // q[5] .. q[11]
+      __m128i o2 = SSE2_HI16(l2);   // q[13] .. q[19]
+      // 1-Lifting of the even samples
+      __m128i x, y;
+      x = _mm_add_epi32(SSE2_ALIGN32(o0,o1,1), SSE2_ALIGN32(o0,o1,2));
+      x = _mm_add_epi32(_mm_slli_epi32(x,3), x);
+      x = _mm_sub_epi32(x, _mm_add_epi32(o0, SSE2_ALIGN32(o0,o1,3)));
+      __m128i n0 = _mm_sub_epi32(e0, _mm_srai_epi32(_mm_add_epi32(x,d16),5));
+      x = _mm_add_epi32(SSE2_ALIGN32(o1,o2,1), SSE2_ALIGN32(o1,o2,2));
+      x = _mm_add_epi32(_mm_slli_epi32(x,3), x);
+      x = _mm_sub_epi32(x, _mm_add_epi32(o1, SSE2_ALIGN32(o1,o2,3)));
+      __m128i n1 = _mm_sub_epi32(e1, _mm_srai_epi32(_mm_add_epi32(x,d16),5));
+      // 2-Interpolation of the odd samples q[-3] .. q[11]
+      __m128i s0 = _mm_or_si128(_mm_setr_epi32(b1,b2,b3,0), 
+                                _mm_slli_si128(n0,12));
+      __m128i s1 = SSE2_ALIGN32(n0,n1,1);
+      __m128i s2 = _mm_srli_si128(n1,4);
+      x = _mm_add_epi32(SSE2_ALIGN32(s0,s1,1), SSE2_ALIGN32(s0,s1,2));
+      x = _mm_add_epi32(_mm_slli_epi32(x,3), x);
+      x = _mm_sub_epi32(x, _mm_add_epi32(s0, SSE2_ALIGN32(s0,s1,3)));
+      __m128i m0 = _mm_add_epi32(o0, _mm_srai_epi32(_mm_add_epi32(x,d8),4));
+      x = _mm_add_epi32(SSE2_ALIGN32(s1,s2,1), SSE2_ALIGN32(s1,s2,2));
+      x = _mm_add_epi32(_mm_slli_epi32(x,3), x);
+      x = _mm_sub_epi32(x, _mm_add_epi32(s1, SSE2_ALIGN32(s1,s2,3)));
+      __m128i m1 = _mm_add_epi32(o1, _mm_srai_epi32(_mm_add_epi32(x,d8),4));
+      // Store q[-4] .. q[11] interleaving even and odd samples
+      x = _mm_unpacklo_epi64(SSE2_LO16(l0), n0);
+      y = _mm_or_si128(_mm_and_si128(x,lo16), _mm_slli_epi32(m0,16));
+      _mm_storeu_si128((__m128i*)(q-4), y);
+      x = SSE2_ALIGN32(n0,n1,2);
+      y = _mm_or_si128(_mm_and_si128(x,lo16), _mm_slli_epi32(m1,16));
+      _mm_storeu_si128((__m128i*)(q+4), y);
+      // Store q[12], q[14] and update the lifting state
+      b1 = _mm_cvtsi128_si32(_mm_srli_si128(n1,4));
+      b2 = _mm_cvtsi128_si32(_mm_srli_si128(n1,8));
+      b3 = _mm_cvtsi128_si32(_mm_srli_si128(n1,12));
+      q[12] = (short)b2;
+      q[14] = (short)b3;
+      a1 = _mm_cvtsi128_si32(o2);
+      a2 = _mm_cvtsi128_si32(_mm_srli_si128(o2,4));
+      a3 = _mm_cvtsi128_si32(_mm_srli_si128(o2,8));
+      q += 16;
+    }
+}
+
+#endif /* SSE2 */
+
 static void 
 filter_bv(short *p, int w, int h, int rowsize, int scale)
 {
@@ -259,6 +399,10 @@ filter_bv(short *p, int w, int h, int rowsize, int scale)
         if (y>=3 && y+3<h)
           {
             // Generic case
+#ifdef SSE2
+            if (scale==1 && MMXControl::sse2flag>0)
+              sse2_bv_1(q, e, s, s3);
+#endif
 #ifdef MMX
             if (scale==1 && MMXControl::mmxflag>0)
               mmx_bv_1(q, e, s, s3);
@@ -321,6 +465,10 @@ filter_bv(short *p, int w, int h, int rowsize, int scale)
         if (y>=6 && y<h)
           {
             // Generic case
+#ifdef SSE2
+            if (scale==1 && MMXControl::sse2flag>0)
+              sse2_bv_2(q, e, s, s3);
+#endif
 #ifdef MMX
             if (scale==1 && MMXControl::mmxflag>0)
               mmx_bv_2(q, e, s, s3);
@@ -402,6 +550,10 @@ filter_bh(short *p, int w, int h, int rowsize, int scale)
           q[-s3] = q[-s3] + ((b1+b2+1)>>1);
           q += s+s;
         }
+#ifdef SSE2
+      if (scale==1 && MMXControl::sse2flag>0)
+        sse2_bh_1(q, e, a1, a2, a3, b1, b2, b3);
+#endif
       while (q+s3 < e)
         {
           // Generic case
@@ -1844,7 +1996,7 @@ IWPixmap::decode_iff(IFFByteStream &iff, int maxchunks)
 void
 IW44Image::Transform::filter_begin(int w, int h)
 {
-  if (MMXControl::mmxflag < 0)  
+  if (MMXControl::mmxflag < 0 || MMXControl::sse2flag < 0)
     MMXControl::enable_mmx();
 }
 
@@ -1902,14 +2054,102 @@ IW44Image::Transform::Decode::backward(short *p, int w, int h, int rowsize, int
 // COLOR TRANSFORM 
 //////////////////////////////////////////////////////
 
+#ifdef SSE2
+
+// Separates 16 interleaved three byte pixels into three planes.
+// Each round computes the perfect shuffle of the 48 bytes viewed
+// as a 16x3 matrix; four rounds amount to a transposition.
+static inline void
+sse2_load_planes(const unsigned char *p, __m128i &c0, __m128i &c1, __m128i &c2)
+{
+  __m128i t0 = _mm_loadu_si128((const __m128i*)p);
+  __m128i t1 = _mm_loadu_si128((const __m128i*)(p+16));
+  __m128i t2 = _mm_loadu_si128((const __m128i*)(p+32));
+  for (int i=0; i<4; i++)
+    {
+      __m128i u0 = _mm_unpacklo_epi8(t0, _mm_unpackhi_epi64(t1, t1));
+      __m128i u1 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t0, t0), t2);
+      __m128i u2 = _mm_unpacklo_epi8(t1, _mm_unpackhi_epi64(t2, t2));
+      t0 = u0; t1 = u1; t2 = u2;
+    }
+  c0 = t0; c1 = t1; c2 = t2;
+}
+
+// Inverse of sse2_load_planes.
+static inline void
+sse2_store_planes(unsigned char *p, __m128i c0, __m128i c1, __m128i c2)
+{
+  const __m128i lo8 = _mm_set1_epi16(0xff);
+  for (int i=0; i<4; i++)
+    {
+      __m128i u0 = _mm_packus_epi16(_mm_and_si128(c0, lo8), 
+                                    _mm_and_si128(c1, lo8));
+      __m128i u1 = _mm_packus_epi16(_mm_and_si128(c2, lo8), 
+                                    _mm_srli_epi16(c0, 8));
+      __m128i u2 = _mm_packus_epi16(_mm_srli_epi16(c1, 8), 
+                                    _mm_srli_epi16(c2, 8));
+      c0 = u0; c1 = u1; c2 = u2;
+    }
+  _mm_storeu_si128((__m128i*)p, c0);
+  _mm_storeu_si128((__m128i*)(p+16), c1);
+  _mm_storeu_si128((__m128i*)(p+32), c2);
+}
+
+// Pigeon transform of eight sign extended 16 bit samples.
+static inline void
+sse2_pigeon(__m128i y, __m128i b, __m128i r, __m128i &tr, __m128i &tg, __m128i &tb)
+{
+  const __m128i d128 = _mm_set1_epi16(128);
+  __m128i t1 = _mm_srai_epi16(b, 2);
+  __m128i t2 = _mm_add_epi16(r, _mm_srai_epi16(r, 1));
+  __m128i y128 = _mm_add_epi16(y, d128);
+  __m128i t3 = _mm_sub_epi16(y128, t1);
+  tr = _mm_add_epi16(y128, t2);
+  tg = _mm_sub_epi16(t3, _mm_srai_epi16(t2, 1));
+  tb = _mm_add_epi16(t3, _mm_slli_epi16(b, 1));
+}
+
+static void
+sse2_YCbCr_to_RGB(GPixel* &q, GPixel *e)
+{
+  while (q+16 <= e)
+    {
+      __m128i y, b, r;
+      sse2_load_planes((const unsigned char*)q, y, b, r);
+      __m128i r0, g0, b0, r1, g1, b1;
+      sse2_pigeon(_mm_srai_epi16(_mm_unpacklo_epi8(y, y), 8),
+                  _mm_srai_epi16(_mm_unpacklo_epi8(b, b), 8),
+                  _mm_srai_epi16(_mm_unpacklo_epi8(r, r), 8),
+                  r0, g0, b0);
+      sse2_pigeon(_mm_srai_epi16(_mm_unpackhi_epi8(y, y), 8),
+                  _mm_srai_epi16(_mm_unpackhi_epi8(b, b), 8),
+                  _mm_srai_epi16(_mm_unpackhi_epi8(r, r), 8),
+                  r1, g1, b1);
+      // Saturating packs clip the results to [0,255]
+      sse2_store_planes((unsigned char*)q, 
+                        _mm_packus_epi16(b0, b1),
+                        _mm_packus_epi16(g0, g1),
+                        _mm_packus_epi16(r0, r1));
+      q += 16;
+    }
+}
+
+#endif /* SSE2 */
+
 /* Converts YCbCr to RGB. */
 void 
 IW44Image::Transform::Decode::YCbCr_to_RGB(GPixel *p, int w, int h, int rowsize)
 {
+  if (MMXControl::sse2flag < 0)
+    MMXControl::enable_mmx();
   for (int i=0; i<h; i++,p+=rowsize)
     {
       GPixel *q = p;
-      for (int j=0; j<w; j++,q++)
+#ifdef SSE2
+      if (MMXControl::sse2flag > 0)
+        sse2_YCbCr_to_RGB(q, p+w);
+#endif
+      for (; q<p+w; q++)
         {
           signed char y = ((signed char*)q)[0];
           signed char b = ((signed char*)q)[1];
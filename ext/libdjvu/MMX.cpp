@@ -65,7 +65,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 
-#ifdef MMX
+#if defined(MMX) || defined(SSE2)
 # ifdef HAVE_CPUID_H
 #  include <cpuid.h>
 # endif
@@ -130,35 +130,59 @@ int MMXControl::mmxflag = -1;
 int MMXControl::mmxflag = 0;
 #endif
 
+#if defined(SSE2) && !defined(DISABLE_MMX)
+int MMXControl::sse2flag = -1;
+#else
+int MMXControl::sse2flag = 0;
+#endif
+
 int 
 MMXControl::disable_mmx()
 {
   mmxflag = 0;
+  sse2flag = 0;
   return mmxflag;
 }
 
 int 
 MMXControl::enable_mmx()
 {
+  // Flags are computed locally and stored once because
+  // decoders running in other threads may be testing them.
+  int mmx = 0;
+  int sse2 = 0;
   const char *envvar = getenv("LIBDJVU_DISABLE_MMX");
   if (envvar && envvar[0] && envvar[0]!='0')
-    return ((mmxflag = 0));
+    {
+      sse2flag = 0;
+      return ((mmxflag = 0));
+    }
   
-#if defined(MMX) && defined(__GNUC__) && defined(HAVE_CPUID_H)
+#if (defined(MMX) || defined(SSE2)) && defined(__GNUC__) && defined(HAVE_CPUID_H)
   unsigned int eax,ebx,ecx,edx;
   if (__get_cpuid(1,&eax,&ebx,&ecx,&edx))
-    if (edx & (1<<23))
-      return ((mmxflag = 1));
+    {
+      mmx = (edx & (1<<23)) ? 1 : 0;
+      sse2 = (edx & (1<<26)) ? 1 : 0;
+    }
 #endif
   
-#if defined(MMX) && defined(_MSC_VER) && defined(_WIN32)
+#if (defined(MMX) || defined(SSE2)) && defined(_MSC_VER) && defined(_WIN32)
   int cpuinfo[4];
   __cpuid(cpuinfo, 1);
-  if (cpuinfo[3] & (1<<23))
-    return ((mmxflag = 1));
+  mmx = (cpuinfo[3] & (1<<23)) ? 1 : 0;
+  sse2 = (cpuinfo[3] & (1<<26)) ? 1 : 0;
 #endif
-  
-  return ((mmxflag = 0));
+
+#ifndef MMX
+  mmx = 0;
+#endif
+#ifndef SSE2
+  sse2 = 0;
+#endif
+  sse2flag = sse2;
+  mmxflag = mmx;
+  return (mmx || sse2);
 }
 
 
@@ -64,6 +64,15 @@
 
 #include "DjVuGlobal.h"
 
+// SSE2 intrinsics (see below)
+#ifndef NO_MMX
+# if (defined(__GNUC__) && defined(__SSE2__)) || \
+     (defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64)))
+#  include <emmintrin.h>
+#  define SSE2 1
+# endif
+#endif
+
 #ifdef HAVE_NAMESPACES
 namespace DJVU {
 # ifdef NOT_DEFINED // Just to fool emacs c++ mode
@@ -80,8 +89,12 @@ namespace DJVU {
     Macro #MMX# is defined if the compiler supports the X86-MMX instructions.
     It does not mean however that the processor supports the instruction set.
     Variable #MMXControl::mmxflag# must be used to decide whether MMX.
-    instructions can be executed.  MMX instructions are entered in the middle
-    of C++ code using the following macros.  Examples can be found in
+    instructions can be executed.  Similarly macro #SSE2# is defined if the
+    compiler provides the SSE2 intrinsics of #<emmintrin.h># (this includes
+    64 bit targets where the MMX macros are not available) and variable
+    #MMXControl::sse2flag# tells whether they can be executed.  MMX
+    instructions are entered in the middle of C++ code using the following
+    macros.  Examples can be found in
     #"IWTransform.cpp"#.
 
     \begin{description}
@@ -131,6 +144,11 @@ class MMXControl
       code. Never modify the value of this variable.  Use #enable_mmx# or
       #disable_mmx# instead. */
   static int mmxflag;  // readonly
+  /** Contains a value greater than zero if the CPU supports the SSE2
+      instructions. A negative value means that you must call
+      \Ref{enable_mmx} and test the value again.  The same rules as for
+      #mmxflag# apply. */
+  static int sse2flag;  // readonly
 };
 
 //@}
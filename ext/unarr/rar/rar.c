@@ -71,6 +71,7 @@ static bool rar_parse_entry(ar_archive *ar, off64_t offset)
                 warn("Splitting files isn't really supported");
             ar->entry_size_uncompressed = (size_t)entry.size;
             ar->entry_filetime = ar_conv_dosdate_to_filetime(entry.dosdate);
+            ar->entry_solid = rar->entry.solid;
             if (!rar->entry.solid || rar->entry.method == METHOD_STORE || out_of_order) {
                 rar_clear_uncompress(&rar->uncomp);
                 memset(&rar->solid, 0, sizeof(rar->solid));
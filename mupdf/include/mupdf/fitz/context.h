@@ -98,8 +98,22 @@ typedef struct
 
 enum {
 	FZ_LOCK_ALLOC = 0,
+	/* The resource store is split into shards, each with its own lock
+	 * (FZ_LOCK_STORE being the first one's). These come before
+	 * FZ_LOCK_FREETYPE, as allocations (which may have to scavenge
+	 * the store) are made while holding any of the later locks. */
+	FZ_LOCK_STORE,
+	FZ_LOCK_STORE_SHARD_1,
+	FZ_LOCK_STORE_SHARD_2,
+	FZ_LOCK_STORE_SHARD_3,
 	FZ_LOCK_FREETYPE,
 	FZ_LOCK_GLYPHCACHE,
+	/* The glyph cache is split into shards, each with its own lock
+	 * (FZ_LOCK_GLYPHCACHE being the first one's), so that threads
+	 * rendering in parallel rarely wait for each other. */
+	FZ_LOCK_GLYPHCACHE_SHARD_1,
+	FZ_LOCK_GLYPHCACHE_SHARD_2,
+	FZ_LOCK_GLYPHCACHE_SHARD_3,
 	FZ_LOCK_MAX
 };
 
@@ -309,6 +323,34 @@ void fz_tune_image_decode(fz_context *ctx, fz_tune_image_decode_fn *image_decode
 */
 void fz_tune_image_scale(fz_context *ctx, fz_tune_image_scale_fn *image_scale, void *arg);
 
+/**
+	A job that can be run on any thread. It's called once for
+	each i in 0..count-1 and must not use the context.
+*/
+typedef void (fz_tune_parallel_job_fn)(void *job_arg, int i);
+
+/**
+	Run count jobs (in parallel if possible) and only return once
+	all of them have finished.
+
+	arg: The caller supplied opaque argument.
+
+	job, job_arg: The job to run count times.
+*/
+typedef void (fz_tune_run_parallel_fn)(void *arg, int count, fz_tune_parallel_job_fn *job, void *job_arg);
+
+/**
+	Set the function to use for splitting up the scaling of big
+	images between several threads (by bands of output rows).
+	By default all images are scaled on the calling thread.
+
+	run_parallel: Function to use (or NULL to scale on the calling
+	thread).
+
+	arg: Opaque argument to be passed to the function.
+*/
+void fz_tune_image_scale_parallel(fz_context *ctx, fz_tune_run_parallel_fn *run_parallel, void *arg);
+
 /**
 	Get the number of bits of antialiasing we are
 	using (for graphics). Between 0 and 8.
@@ -571,6 +613,9 @@ struct fz_context
 	/* unshared contexts */
 	fz_aa_context aa;
 	uint16_t seed48[7];
+	/* set while this context is scavenging the store (so that running
+	 * out of memory while doing so doesn't recurse) */
+	int scavenging;
 #if FZ_ENABLE_ICC
 	int icc_enabled;
 #endif
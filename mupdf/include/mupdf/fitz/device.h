@@ -8,6 +8,7 @@
 #include "mupdf/fitz/shade.h"
 #include "mupdf/fitz/path.h"
 #include "mupdf/fitz/text.h"
+#include "mupdf/fitz/output.h"
 
 /**
 	The different format handlers (pdf, xps etc) interpret pages to
@@ -371,6 +372,32 @@ enum
 */
 fz_device *fz_new_draw_device(fz_context *ctx, fz_matrix transform, fz_pixmap *dest);
 
+/**
+	Check that the SIMD versions of the span painters used by the
+	draw device give exactly the same results as the portable ones
+	and print how long each of them takes.
+
+	iterations: How often each painter is timed (0 to only check
+	the results).
+
+	Returns the number of mismatches found (i.e. 0 if all is well).
+*/
+int fz_test_span_painters(fz_context *ctx, fz_output *out, int iterations);
+
+/**
+	Check that the SIMD versions of the image scaler and scaling
+	in bands of rows (as done for big images when a function has
+	been set with fz_tune_image_scale_parallel) give exactly the
+	same results as the portable version, and print how long each
+	of them takes.
+
+	iterations: How often each variant is timed (0 to only check
+	the results).
+
+	Returns the number of mismatches found (i.e. 0 if all is well).
+*/
+int fz_test_scale_pixmap(fz_context *ctx, fz_output *out, int iterations);
+
 /**
 	Create a device to draw on a pixmap.
 
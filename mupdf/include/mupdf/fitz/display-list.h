@@ -117,4 +117,13 @@ fz_image *fz_new_image_from_display_list(fz_context *ctx, float w, float h, fz_d
 */
 int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list);
 
+/**
+	Return the number of bytes allocated for the nodes of a
+	display list (including the paths packed into it) plus the
+	storage used by the images it references (see fz_image_size).
+	Images used more than once are counted for every use. Doesn't
+	include the size of the fonts and shades it references.
+*/
+size_t fz_display_list_size(fz_context *ctx, const fz_display_list *list);
+
 #endif
@@ -46,6 +46,34 @@ void fz_render_t3_glyph_direct(fz_context *ctx, fz_device *dev, fz_font *font, i
 */
 void fz_prepare_t3_glyph(fz_context *ctx, fz_font *font, int gid);
 
+/**
+	Set the upper bound for the memory used by cached glyphs
+	(evicting the least recently used glyphs if it's exceeded
+	already).
+*/
+void fz_set_glyph_cache_size(fz_context *ctx, size_t max_size);
+
+/**
+	Statistics for the glyph cache (summed up over all of its
+	shards).
+*/
+typedef struct
+{
+	size_t size; /* memory used by the cached glyphs */
+	size_t max_size;
+	int entries;
+	int buckets;
+	int64_t hits;
+	int64_t misses;
+	int64_t evictions;
+	size_t evicted; /* memory freed by evictions */
+} fz_glyph_cache_stats;
+
+/**
+	Read the glyph cache's statistics (e.g. for benchmarking).
+*/
+void fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats);
+
 /**
 	Dump debug statistics for the glyph cache.
 */
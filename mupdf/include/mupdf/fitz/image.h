@@ -390,6 +390,17 @@ void fz_set_pixmap_image_tile(fz_context *ctx, fz_pixmap_image *cimg, fz_pixmap
 */
 fz_pixmap *fz_load_jpx(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspace *cs);
 
+/**
+	Like fz_load_jpx, but only decodes as many resolution levels
+	as are needed for a pixmap subsampled by 2^*l2factor.
+
+	l2factor: On entry, the amount of subsampling wanted (log2).
+	On exit, the amount of subsampling still to be done by the
+	caller (the returned pixmap is smaller by the difference).
+	NULL for a full resolution decode.
+*/
+fz_pixmap *fz_load_jpx_subsampled(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspace *cs, int *l2factor);
+
 /**
 	Exposed for CBZ.
 */
@@ -319,6 +319,8 @@ void fz_empty_store(fz_context *ctx);
 	allocator; when we fail to allocate memory, before returning a
 	failure to the caller, we try to scavenge space within the store
 	by evicting at least 'size' bytes. The allocator then retries.
+	Must not be called with FZ_LOCK_ALLOC (or any of the store's
+	locks) held.
 
 	size: The number of bytes we are trying to have free.
 
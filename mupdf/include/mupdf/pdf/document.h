@@ -76,6 +76,36 @@ pdf_document *pdf_open_document(fz_context *ctx, const char *filename);
 */
 pdf_document *pdf_open_document_with_stream(fz_context *ctx, fz_stream *file);
 
+/*
+	Opens a PDF document.
+
+	Same as pdf_open_document_with_stream, but restores the page
+	tree and a repaired cross reference table from an index created
+	by pdf_new_document_index for the same file, instead of walking
+	the page tree and repairing the file again.
+
+	An index which doesn't match the file is ignored (with a
+	warning). Only the file size is checked up front, the object
+	offsets are checked when the objects are loaded: if an object
+	isn't found where the index says it is, the file is repaired
+	after all (as if there had been no index). Looking up the index
+	by a key that's cheap to compute (e.g. the file's size and parts
+	of its content) is therefore safe.
+*/
+pdf_document *pdf_open_document_with_index(fz_context *ctx, fz_stream *file, fz_buffer *index);
+
+/*
+	Create an index for pdf_open_document_with_index of what's
+	slow to recover when opening a document: the page tree (if it
+	has been loaded with pdf_load_page_tree) and the cross
+	reference table (if it had to be repaired).
+
+	Call this right after opening and loading the page tree, before
+	any changes are made to the document. Returns NULL if there's
+	nothing worth indexing.
+*/
+fz_buffer *pdf_new_document_index(fz_context *ctx, pdf_document *doc);
+
 /*
 	Closes and frees an opened PDF document.
 
@@ -320,6 +350,10 @@ struct pdf_document
 	pdf_rev_page_map *rev_page_map;
 
 	int repair_attempted;
+	/* the repaired xref comes from a document index and hasn't been
+	 * contradicted by the file yet. An object that isn't found where
+	 * the index says it is makes us repair the file after all. */
+	int xref_from_index;
 
 	/* State indicating which file parsing method we are using */
 	int file_reading_linearly;
@@ -104,6 +104,12 @@ void fz_tune_image_scale(fz_context *ctx, fz_tune_image_scale_fn *image_scale, v
 	ctx->tuning->image_scale_arg = arg;
 }
 
+void fz_tune_image_scale_parallel(fz_context *ctx, fz_tune_run_parallel_fn *run_parallel, void *arg)
+{
+	ctx->tuning->image_scale_parallel = run_parallel;
+	ctx->tuning->image_scale_parallel_arg = arg;
+}
+
 static void fz_init_random_context(fz_context *ctx)
 {
 	if (!ctx)
@@ -188,6 +194,7 @@ fz_new_context_imp(const fz_alloc_context *alloc, const fz_locks_context *locks,
 
 	fz_init_error_context(ctx);
 	fz_init_aa_context(ctx);
+	fz_init_paint_simd();
 	fz_init_random_context(ctx);
 
 	/* Now initialise sections that are shared */
@@ -229,6 +236,7 @@ fz_clone_context(fz_context *ctx)
 
 	/* Reset error context to initial state. */
 	fz_init_error_context(new_ctx);
+	new_ctx->scavenging = 0;
 
 	/* Then keep lock checking happy by keeping shared contexts with new context */
 	fz_keep_document_handler_context(new_ctx);
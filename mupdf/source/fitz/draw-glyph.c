@@ -7,9 +7,16 @@
 #include <math.h>
 
 #define MAX_GLYPH_SIZE 256
-#define MAX_CACHE_SIZE (1024*1024)
-
+#define DEFAULT_CACHE_SIZE (4*1024*1024)
+
+/* The cache is split into shards by the glyph's hash. Each shard has its
+ * own lock, hash table and LRU list and gets an equal share of the cache's
+ * byte budget. A shard's hash table starts with GLYPH_HASH_LEN buckets and
+ * grows once it holds more than GLYPH_HASH_MAX_LOAD entries per bucket on
+ * average (CJK documents use tens of thousands of distinct glyphs). */
+#define GLYPH_CACHE_SHARDS (FZ_LOCK_GLYPHCACHE_SHARD_3 - FZ_LOCK_GLYPHCACHE + 1)
 #define GLYPH_HASH_LEN 509
+#define GLYPH_HASH_MAX_LOAD 2
 
 typedef struct
 {
@@ -32,17 +39,26 @@ typedef struct fz_glyph_cache_entry
 	fz_glyph *val;
 } fz_glyph_cache_entry;
 
-struct fz_glyph_cache
+typedef struct
 {
-	int refs;
+	int lock;
 	size_t total;
-#ifndef NDEBUG
-	int num_evictions;
-	ptrdiff_t evicted;
-#endif
-	fz_glyph_cache_entry *entry[GLYPH_HASH_LEN];
+	size_t max;
+	int count;
+	int len;
+	fz_glyph_cache_entry **entry;
 	fz_glyph_cache_entry *lru_head;
 	fz_glyph_cache_entry *lru_tail;
+	int64_t hits;
+	int64_t misses;
+	int64_t num_evictions;
+	size_t evicted;
+} fz_glyph_cache_shard;
+
+struct fz_glyph_cache
+{
+	int refs;
+	fz_glyph_cache_shard shard[GLYPH_CACHE_SHARDS];
 };
 
 static size_t
@@ -57,75 +73,148 @@ void
 fz_new_glyph_cache_context(fz_context *ctx)
 {
 	fz_glyph_cache *cache;
+	int i;
 
 	cache = fz_malloc_struct(ctx, fz_glyph_cache);
-	cache->total = 0;
+	fz_try(ctx)
+	{
+		for (i = 0; i < GLYPH_CACHE_SHARDS; i++)
+		{
+			fz_glyph_cache_shard *shard = &cache->shard[i];
+			shard->lock = FZ_LOCK_GLYPHCACHE + i;
+			shard->max = DEFAULT_CACHE_SIZE / GLYPH_CACHE_SHARDS;
+			shard->len = GLYPH_HASH_LEN;
+			shard->entry = fz_malloc_array(ctx, GLYPH_HASH_LEN, fz_glyph_cache_entry *);
+			memset(shard->entry, 0, GLYPH_HASH_LEN * sizeof(fz_glyph_cache_entry *));
+		}
+	}
+	fz_catch(ctx)
+	{
+		for (i = 0; i < GLYPH_CACHE_SHARDS; i++)
+			fz_free(ctx, cache->shard[i].entry);
+		fz_free(ctx, cache);
+		fz_rethrow(ctx);
+	}
 	cache->refs = 1;
 
 	ctx->glyph_cache = cache;
 }
 
-static void
-drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_entry *entry)
+static inline fz_glyph_cache_entry **
+bucket_for(fz_glyph_cache_shard *shard, unsigned hash)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
+	return &shard->entry[(hash / GLYPH_CACHE_SHARDS) % shard->len];
+}
 
+/* The shard's lock is always held when this function is called. */
+static void
+drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
+{
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	if (entry->lru_prev)
 		entry->lru_prev->lru_next = entry->lru_next;
 	else
-		cache->lru_head = entry->lru_next;
-	cache->total -= fz_glyph_size(ctx, entry->val);
+		shard->lru_head = entry->lru_next;
+	shard->total -= fz_glyph_size(ctx, entry->val);
+	shard->count--;
 	if (entry->bucket_next)
 		entry->bucket_next->bucket_prev = entry->bucket_prev;
 	if (entry->bucket_prev)
 		entry->bucket_prev->bucket_next = entry->bucket_next;
 	else
-		cache->entry[entry->hash] = entry->bucket_next;
+		*bucket_for(shard, entry->hash) = entry->bucket_next;
 	fz_drop_font(ctx, entry->key.font);
 	fz_drop_glyph(ctx, entry->val);
 	fz_free(ctx, entry);
 }
 
-/* The glyph cache lock is always held when this function is called. */
+/* The shard's lock is always held when this function is called. */
 static void
-do_purge(fz_context *ctx)
+evict_to_fit(fz_context *ctx, fz_glyph_cache_shard *shard)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
-	int i;
+	while (shard->lru_tail && shard->total > shard->max)
+	{
+		shard->num_evictions++;
+		shard->evicted += fz_glyph_size(ctx, shard->lru_tail->val);
+		drop_glyph_cache_entry(ctx, shard, shard->lru_tail);
+	}
+}
 
-	for (i = 0; i < GLYPH_HASH_LEN; i++)
+/* The shard's lock is always held when this function is called. */
+static void
+grow_shard(fz_context *ctx, fz_glyph_cache_shard *shard)
+{
+	fz_glyph_cache_entry **entry;
+	fz_glyph_cache_entry *e;
+	int len = shard->len * 2 + 1;
+
+	/* Carry on with the smaller table if this fails. */
+	entry = fz_calloc_no_throw(ctx, len, sizeof(fz_glyph_cache_entry *));
+	if (!entry)
+		return;
+	fz_free(ctx, shard->entry);
+	shard->entry = entry;
+	shard->len = len;
+
+	for (e = shard->lru_head; e; e = e->lru_next)
 	{
-		while (cache->entry[i])
-			drop_glyph_cache_entry(ctx, cache->entry[i]);
+		fz_glyph_cache_entry **bucket = bucket_for(shard, e->hash);
+		e->bucket_prev = NULL;
+		e->bucket_next = *bucket;
+		if (e->bucket_next)
+			e->bucket_next->bucket_prev = e;
+		*bucket = e;
 	}
+}
 
-	cache->total = 0;
+/* The shard's lock is always held when this function is called. */
+static void
+do_purge(fz_context *ctx, fz_glyph_cache_shard *shard)
+{
+	while (shard->lru_head)
+		drop_glyph_cache_entry(ctx, shard, shard->lru_head);
+
+	shard->total = 0;
 }
 
 void
 fz_purge_glyph_cache(fz_context *ctx)
 {
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	do_purge(ctx);
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	for (i = 0; i < GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_lock(ctx, cache->shard[i].lock);
+		do_purge(ctx, &cache->shard[i]);
+		fz_unlock(ctx, cache->shard[i].lock);
+	}
 }
 
 void
 fz_drop_glyph_cache_context(fz_context *ctx)
 {
+	fz_glyph_cache *cache;
+	int i;
+
 	if (!ctx || !ctx->glyph_cache)
 		return;
 
+	cache = ctx->glyph_cache;
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	ctx->glyph_cache->refs--;
-	if (ctx->glyph_cache->refs == 0)
+	cache->refs--;
+	if (cache->refs == 0)
 	{
-		do_purge(ctx);
-		fz_free(ctx, ctx->glyph_cache);
+		/* Nobody else can be using the other shards anymore. */
+		for (i = 0; i < GLYPH_CACHE_SHARDS; i++)
+		{
+			do_purge(ctx, &cache->shard[i]);
+			fz_free(ctx, cache->shard[i].entry);
+		}
+		fz_free(ctx, cache);
 		ctx->glyph_cache = NULL;
 	}
 	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
@@ -140,6 +229,22 @@ fz_keep_glyph_cache(fz_context *ctx)
 	return ctx->glyph_cache;
 }
 
+void
+fz_set_glyph_cache_size(fz_context *ctx, size_t max_size)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	for (i = 0; i < GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_glyph_cache_shard *shard = &cache->shard[i];
+		fz_lock(ctx, shard->lock);
+		shard->max = max_size / GLYPH_CACHE_SHARDS;
+		evict_to_fit(ctx, shard);
+		fz_unlock(ctx, shard->lock);
+	}
+}
+
 float
 fz_subpixel_adjust(fz_context *ctx, fz_matrix *ctm, fz_matrix *subpix_ctm, unsigned char *qe, unsigned char *qf)
 {
@@ -215,7 +320,7 @@ static unsigned do_hash(unsigned char *s, int len)
 }
 
 static inline void
-move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
+move_to_front(fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
 {
 	if (entry->lru_prev == NULL)
 		return; /* At front already */
@@ -225,26 +330,41 @@ move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	/* Relink */
-	entry->lru_next = cache->lru_head;
+	entry->lru_next = shard->lru_head;
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry;
-	cache->lru_head = entry;
+	shard->lru_head = entry;
 	entry->lru_prev = NULL;
 }
 
+/* The shard's lock is always held when this function is called. */
+static fz_glyph_cache_entry *
+find_entry(fz_glyph_cache_shard *shard, fz_glyph_key *key, unsigned hash)
+{
+	fz_glyph_cache_entry *entry = *bucket_for(shard, hash);
+	while (entry)
+	{
+		if (entry->hash == hash && memcmp(&entry->key, key, sizeof(*key)) == 0)
+			return entry;
+		entry = entry->bucket_next;
+	}
+	return NULL;
+}
+
 fz_glyph *
 fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colorspace *model, const fz_irect *scissor, int alpha, int aa)
 {
 	fz_glyph_cache *cache;
+	fz_glyph_cache_shard *shard;
 	fz_glyph_key key;
 	fz_matrix subpix_ctm;
 	fz_irect subpix_scissor;
 	float size;
 	fz_glyph *val;
 	int do_cache, locked, caching;
-	fz_glyph_cache_entry *entry;
+	fz_glyph_cache_entry *entry, **bucket;
 	unsigned hash;
 	int is_ft_font = !!fz_font_ft_face(ctx, font);
 
@@ -281,22 +401,33 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	key.d = subpix_ctm.d * 65536;
 	key.aa = aa;
 
-	hash = do_hash((unsigned char *)&key, sizeof(key)) % GLYPH_HASH_LEN;
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	entry = cache->entry[hash];
-	while (entry)
+	hash = do_hash((unsigned char *)&key, sizeof(key));
+	shard = &cache->shard[hash % GLYPH_CACHE_SHARDS];
+	fz_lock(ctx, shard->lock);
+	entry = find_entry(shard, &key, hash);
+	if (entry)
 	{
-		if (memcmp(&entry->key, &key, sizeof(key)) == 0)
-		{
-			move_to_front(cache, entry);
-			val = fz_keep_glyph(ctx, entry->val);
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-			return val;
-		}
-		entry = entry->bucket_next;
+		shard->hits++;
+		move_to_front(shard, entry);
+		val = fz_keep_glyph(ctx, entry->val);
+		fz_unlock(ctx, shard->lock);
+		return val;
 	}
-
-	locked = 1;
+	if (do_cache)
+		shard->misses++;
+
+	/* We drop the shard's lock while rendering the glyph, so that
+	 * other threads can still look up glyphs in it meanwhile (for
+	 * Type3 glyphs, this also allows them to render glyphs
+	 * recursively). The danger here is that some other thread
+	 * will come along, and want the same glyph too. If it does, we
+	 * may both end up rendering it. We cope with this later on, by
+	 * ensuring that only one gets inserted into the cache. If we
+	 * insert ours to find one already there, we abandon ours, and
+	 * use the one there already.
+	 */
+	fz_unlock(ctx, shard->lock);
+	locked = 0;
 	caching = 0;
 	val = NULL;
 
@@ -308,20 +439,7 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		}
 		else if (fz_font_t3_procs(ctx, font))
 		{
-			/* We drop the glyphcache here, and execute the t3
-			 * glyph code. The danger here is that some other
-			 * thread will come along, and want the same glyph
-			 * too. If it does, we may both end up rendering
-			 * pixmaps. We cope with this later on, by ensuring
-			 * that only one gets inserted into the cache. If
-			 * we insert ours to find one already there, we
-			 * abandon ours, and use the one there already.
-			 */
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-			locked = 0;
 			val = fz_render_t3_glyph(ctx, font, gid, subpix_ctm, model, scissor, aa);
-			fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-			locked = 1;
 		}
 		else
 		{
@@ -334,50 +452,43 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 				/* If we throw an exception whilst caching,
 				 * just ignore the exception and carry on. */
 				caching = 1;
-				if (!is_ft_font)
+				fz_lock(ctx, shard->lock);
+				locked = 1;
+
+				/* Someone else might have rendered in the meantime */
+				entry = find_entry(shard, &key, hash);
+				if (entry)
 				{
-					/* We had to unlock. Someone else might
-					 * have rendered in the meantime */
-					entry = cache->entry[hash];
-					while (entry)
-					{
-						if (memcmp(&entry->key, &key, sizeof(key)) == 0)
-						{
-							fz_drop_glyph(ctx, val);
-							move_to_front(cache, entry);
-							val = fz_keep_glyph(ctx, entry->val);
-							goto unlock_and_return_val;
-						}
-						entry = entry->bucket_next;
-					}
+					fz_drop_glyph(ctx, val);
+					move_to_front(shard, entry);
+					val = fz_keep_glyph(ctx, entry->val);
+					goto unlock_and_return_val;
 				}
 
+				if (shard->count >= shard->len * GLYPH_HASH_MAX_LOAD)
+					grow_shard(ctx, shard);
+
 				entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
 				entry->key = key;
 				entry->hash = hash;
-				entry->bucket_next = cache->entry[hash];
+				bucket = bucket_for(shard, hash);
+				entry->bucket_next = *bucket;
 				if (entry->bucket_next)
 					entry->bucket_next->bucket_prev = entry;
-				cache->entry[hash] = entry;
+				*bucket = entry;
 				entry->val = fz_keep_glyph(ctx, val);
 				fz_keep_font(ctx, key.font);
 
-				entry->lru_next = cache->lru_head;
+				entry->lru_next = shard->lru_head;
 				if (entry->lru_next)
 					entry->lru_next->lru_prev = entry;
 				else
-					cache->lru_tail = entry;
-				cache->lru_head = entry;
+					shard->lru_tail = entry;
+				shard->lru_head = entry;
 
-				cache->total += fz_glyph_size(ctx, val);
-				while (cache->total > MAX_CACHE_SIZE)
-				{
-#ifndef NDEBUG
-					cache->num_evictions++;
-					cache->evicted += fz_glyph_size(ctx, cache->lru_tail->val);
-#endif
-					drop_glyph_cache_entry(ctx, cache->lru_tail);
-				}
+				shard->count++;
+				shard->total += fz_glyph_size(ctx, val);
+				evict_to_fit(ctx, shard);
 			}
 		}
 unlock_and_return_val:
@@ -387,7 +498,7 @@ unlock_and_return_val:
 	fz_always(ctx)
 	{
 		if (locked)
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_unlock(ctx, shard->lock);
 	}
 	fz_catch(ctx)
 	{
@@ -437,11 +548,36 @@ fz_render_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm,
 }
 
 void
-fz_dump_glyph_cache_stats(fz_context *ctx, fz_output *out)
+fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
-	fz_write_printf(ctx, out, "Glyph Cache Size: %zu\n", cache->total);
-#ifndef NDEBUG
-	fz_write_printf(ctx, out, "Glyph Cache Evictions: %d (%zu bytes)\n", cache->num_evictions, cache->evicted);
-#endif
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_glyph_cache_shard *shard = &cache->shard[i];
+		fz_lock(ctx, shard->lock);
+		stats->size += shard->total;
+		stats->max_size += shard->max;
+		stats->entries += shard->count;
+		stats->buckets += shard->len;
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->num_evictions;
+		stats->evicted += shard->evicted;
+		fz_unlock(ctx, shard->lock);
+	}
+}
+
+void
+fz_dump_glyph_cache_stats(fz_context *ctx, fz_output *out)
+{
+	fz_glyph_cache_stats stats;
+	fz_get_glyph_cache_stats(ctx, &stats);
+	fz_write_printf(ctx, out, "Glyph Cache Size: %zu (of %zu)\n", stats.size, stats.max_size);
+	fz_write_printf(ctx, out, "Glyph Cache Entries: %d (%d buckets)\n", stats.entries, stats.buckets);
+	/* %ld is always 64 bit for fz_write_printf */
+	fz_write_printf(ctx, out, "Glyph Cache Hits: %ld, Misses: %ld\n", stats.hits, stats.misses);
+	fz_write_printf(ctx, out, "Glyph Cache Evictions: %ld (%zu bytes)\n", stats.evictions, stats.evicted);
 }
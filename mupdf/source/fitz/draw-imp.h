@@ -435,6 +435,23 @@ fz_solid_color_painter_t *fz_get_solid_color_painter(int n, const unsigned char
 fz_span_painter_t *fz_get_span_painter(int da, int sa, int n, int alpha, const fz_overprint * FZ_RESTRICT eop);
 fz_span_color_painter_t *fz_get_span_color_painter(int n, int da, const unsigned char * FZ_RESTRICT color, const fz_overprint * FZ_RESTRICT eop);
 
+/*
+	SIMD versions of some of the painters (see draw-paint-simd.c).
+	The lookups return NULL if there's none for the given level.
+*/
+enum
+{
+	FZ_SIMD_NONE,
+	FZ_SIMD_SSE2,
+	FZ_SIMD_AVX2
+};
+
+int fz_paint_simd_level(void);
+void fz_set_paint_simd_level(int level);
+fz_solid_color_painter_t *fz_get_solid_color_painter_simd(int level, int n, const unsigned char * FZ_RESTRICT color, int da);
+fz_span_painter_t *fz_get_span_painter_simd(int level, int da, int sa, int n, int alpha);
+fz_span_color_painter_t *fz_get_span_color_painter_simd(int level, int n, int da, const unsigned char * FZ_RESTRICT color);
+
 void fz_paint_image(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, const fz_irect * FZ_RESTRICT scissor, fz_pixmap * FZ_RESTRICT shape, fz_pixmap * FZ_RESTRICT group_alpha, fz_pixmap * FZ_RESTRICT img, fz_matrix ctm, int alpha, int lerp_allowed, int gridfit_as_tiled, const fz_overprint * FZ_RESTRICT eop);
 void fz_paint_image_with_color(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, const fz_irect * FZ_RESTRICT scissor, fz_pixmap * FZ_RESTRICT shape, fz_pixmap * FZ_RESTRICT group_alpha, fz_pixmap * FZ_RESTRICT img, fz_matrix ctm, const unsigned char * FZ_RESTRICT colorbv, int lerp_allowed, int gridfit_as_tiled, const fz_overprint * FZ_RESTRICT eop);
 
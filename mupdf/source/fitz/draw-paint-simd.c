@@ -0,0 +1,783 @@
+#include "mupdf/fitz.h"
+
+#include "context-imp.h"
+#include "draw-imp.h"
+
+#include <string.h>
+#include <time.h>
+
+/*
+
+SIMD versions of the span painters that dominate drawing into RGB
+pixmaps with alpha (which is what pages are rendered to for display):
+solid fills, blending a color through an antialiasing mask (for paths
+and glyphs) and compositing premultiplied spans (for images and groups).
+
+They give exactly the same results as the portable versions in
+draw-paint.c (fz_test_span_painters checks this), so which ones end up
+being used only depends on the CPU and never changes the output.
+
+All of them rely on FZ_BLEND(S, D, A) (and the related S + FZ_COMBINE(D, T))
+being exact in 16 bit arithmetic: ((S-D)*A + (D<<8)) is D*(256-A) + S*A,
+which is at most 255*256 and never negative, so it can be computed with
+wrapping 16 bit multiplications and additions.
+
+The best implementation supported by the CPU is picked when the first
+context is created.
+
+There are only x86 versions (SSE2 and AVX2). ARM64 builds use the portable
+painters: an FZ_SIMD_NEON level used to be detected there, but without any
+NEON painters behind it, it only made the reported level claim an
+acceleration that didn't exist, so it was dropped. NEON versions would add
+a new level after FZ_SIMD_AVX2 (see draw-imp.h) together with the painters.
+
+*/
+
+typedef unsigned char byte;
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define SIMD_X86
+#endif
+
+#ifdef SIMD_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <emmintrin.h>
+#include <immintrin.h>
+
+/* Allows using SSE2 and AVX2 intrinsics in single functions without
+ * having to compile the whole library for them (MSVC doesn't need this). */
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+#endif /* SIMD_X86 */
+
+/* Detected once when the first context is created. Racing threads
+ * detect the same level, so this doesn't need locking. */
+static int simd_max_level = -1;
+static int simd_level = FZ_SIMD_NONE;
+
+#ifdef SIMD_X86
+static void
+get_cpuid(int leaf, int regs[4])
+{
+#if defined(_MSC_VER)
+	__cpuidex(regs, leaf, 0);
+#else
+	unsigned int a, b, c, d;
+	__cpuid_count(leaf, 0, a, b, c, d);
+	regs[0] = (int)a;
+	regs[1] = (int)b;
+	regs[2] = (int)c;
+	regs[3] = (int)d;
+#endif
+}
+
+static uint64_t
+get_xcr0(void)
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned int a, d;
+	__asm__ volatile ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+	return ((uint64_t)d << 32) | a;
+#endif
+}
+
+static int
+detect_simd_level(void)
+{
+	int regs[4];
+	int max_leaf;
+
+	get_cpuid(0, regs);
+	max_leaf = regs[0];
+	if (max_leaf < 1)
+		return FZ_SIMD_NONE;
+	get_cpuid(1, regs);
+	if (!(regs[3] & (1 << 26)))
+		return FZ_SIMD_NONE;
+	/* AVX2 also needs the OS to preserve the YMM registers (OSXSAVE and AVX) */
+	if (max_leaf < 7 || !(regs[2] & (1 << 27)) || !(regs[2] & (1 << 28)))
+		return FZ_SIMD_SSE2;
+	if ((get_xcr0() & 6) != 6)
+		return FZ_SIMD_SSE2;
+	get_cpuid(7, regs);
+	if (!(regs[1] & (1 << 5)))
+		return FZ_SIMD_SSE2;
+	return FZ_SIMD_AVX2;
+}
+#else
+static int
+detect_simd_level(void)
+{
+	return FZ_SIMD_NONE;
+}
+#endif
+
+void
+fz_init_paint_simd(void)
+{
+	if (simd_max_level < 0)
+	{
+		int level = detect_simd_level();
+		simd_level = level;
+		simd_max_level = level;
+	}
+}
+
+int
+fz_paint_simd_level(void)
+{
+	return simd_level;
+}
+
+void
+fz_set_paint_simd_level(int level)
+{
+	fz_init_paint_simd();
+	simd_level = fz_clampi(level, FZ_SIMD_NONE, simd_max_level);
+}
+
+#if FZ_PLOTTERS_RGB
+
+/* Scalar versions for the pixels left over at the end of a span. rgba is
+ * the color with its alpha replaced by 255. */
+
+static inline void
+blend_pixel_3_da(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT rgba, int ma)
+{
+	dp[0] = FZ_BLEND(rgba[0], dp[0], ma);
+	dp[1] = FZ_BLEND(rgba[1], dp[1], ma);
+	dp[2] = FZ_BLEND(rgba[2], dp[2], ma);
+	dp[3] = FZ_BLEND(rgba[3], dp[3], ma);
+}
+
+static inline void
+paint_pixel_3_da_sa(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp)
+{
+	int t = FZ_EXPAND(sp[3]);
+	if (t == 0)
+		return;
+	t = 256 - t;
+	dp[0] = sp[0] + FZ_COMBINE(dp[0], t);
+	dp[1] = sp[1] + FZ_COMBINE(dp[1], t);
+	dp[2] = sp[2] + FZ_COMBINE(dp[2], t);
+	dp[3] = sp[3] + FZ_COMBINE(dp[3], t);
+}
+
+static inline void
+paint_pixel_3_da_sa_alpha(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT sp, int alpha)
+{
+	int masa = FZ_COMBINE(sp[3], alpha);
+	int t = FZ_EXPAND(255 - masa);
+	dp[0] = FZ_COMBINE(sp[0], alpha) + FZ_COMBINE(dp[0], t);
+	dp[1] = FZ_COMBINE(sp[1], alpha) + FZ_COMBINE(dp[1], t);
+	dp[2] = FZ_COMBINE(sp[2], alpha) + FZ_COMBINE(dp[2], t);
+	dp[3] = masa + FZ_COMBINE(dp[3], t);
+}
+
+static inline int32_t
+opaque_color_3(const byte * FZ_RESTRICT color, byte * FZ_RESTRICT rgba)
+{
+	int32_t v;
+	rgba[0] = color[0];
+	rgba[1] = color[1];
+	rgba[2] = color[2];
+	rgba[3] = 255;
+	memcpy(&v, rgba, 4);
+	return v;
+}
+
+#ifdef SIMD_X86
+
+/* FZ_BLEND(s, d, a) for 8 16 bit values */
+TARGET_SSE2 static inline __m128i
+blend_sse2(__m128i s, __m128i d, __m128i a)
+{
+	__m128i v = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(s, d), a), _mm_slli_epi16(d, 8));
+	return _mm_srli_epi16(v, 8);
+}
+
+/* 2 premultiplied pixels (as 16 bit values) s over d, leaving d
+ * unchanged where s is fully transparent */
+TARGET_SSE2 static inline __m128i
+over_sse2(__m128i s, __m128i d)
+{
+	__m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	__m128i t = _mm_sub_epi16(_mm_set1_epi16(256), _mm_add_epi16(sa, _mm_srli_epi16(sa, 7)));
+	__m128i v = _mm_add_epi16(s, _mm_srli_epi16(_mm_mullo_epi16(d, t), 8));
+	__m128i keep = _mm_cmpeq_epi16(sa, _mm_setzero_si128());
+	/* the portable version truncates when storing a byte */
+	v = _mm_and_si128(v, _mm_set1_epi16(0xFF));
+	return _mm_or_si128(_mm_and_si128(keep, d), _mm_andnot_si128(keep, v));
+}
+
+/* same as over_sse2 with s scaled by the (expanded) alpha */
+TARGET_SSE2 static inline __m128i
+over_alpha_sse2(__m128i s, __m128i d, __m128i alpha)
+{
+	__m128i masa, t, v;
+	s = _mm_srli_epi16(_mm_mullo_epi16(s, alpha), 8);
+	masa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	t = _mm_sub_epi16(_mm_set1_epi16(255), masa);
+	t = _mm_add_epi16(t, _mm_srli_epi16(t, 7));
+	v = _mm_add_epi16(s, _mm_srli_epi16(_mm_mullo_epi16(d, t), 8));
+	return _mm_and_si128(v, _mm_set1_epi16(0xFF));
+}
+
+TARGET_SSE2 static void
+paint_solid_color_3_da_sse2(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	byte rgba[4];
+	int sa = FZ_EXPAND(color[3]);
+	int32_t v = opaque_color_3(color, rgba);
+	if (sa == 0)
+		return;
+	if (sa == 256)
+	{
+		__m128i fill = _mm_set1_epi32(v);
+		for (; w >= 4; w -= 4, dp += 16)
+			_mm_storeu_si128((__m128i *)dp, fill);
+		for (; w > 0; w--, dp += 4)
+			memcpy(dp, rgba, 4);
+	}
+	else
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i c = _mm_unpacklo_epi8(_mm_set1_epi32(v), zero);
+		__m128i a = _mm_set1_epi16((short)sa);
+		for (; w >= 4; w -= 4, dp += 16)
+		{
+			__m128i d = _mm_loadu_si128((const __m128i *)dp);
+			__m128i lo = blend_sse2(c, _mm_unpacklo_epi8(d, zero), a);
+			__m128i hi = blend_sse2(c, _mm_unpackhi_epi8(d, zero), a);
+			_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+		}
+		for (; w > 0; w--, dp += 4)
+			blend_pixel_3_da(dp, rgba, sa);
+	}
+}
+
+TARGET_SSE2 static void
+paint_span_with_color_3_da_sse2(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	byte rgba[4];
+	int sa = FZ_EXPAND(color[3]);
+	int32_t v = opaque_color_3(color, rgba);
+	__m128i zero = _mm_setzero_si128();
+	__m128i fill = _mm_set1_epi32(v);
+	__m128i c = _mm_unpacklo_epi8(fill, zero);
+	__m128i a = _mm_set1_epi16((short)sa);
+	if (sa == 0)
+		return;
+	for (; w >= 4; w -= 4, dp += 16, mp += 4)
+	{
+		__m128i m, d, lo, hi;
+		uint32_t m4;
+		memcpy(&m4, mp, 4);
+		if (m4 == 0)
+			continue;
+		if (m4 == 0xFFFFFFFF && sa == 256)
+		{
+			_mm_storeu_si128((__m128i *)dp, fill);
+			continue;
+		}
+		/* FZ_EXPAND the mask and FZ_COMBINE it with the color's alpha */
+		m = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)m4), zero);
+		m = _mm_add_epi16(m, _mm_srli_epi16(m, 7));
+		if (sa != 256)
+			m = _mm_srli_epi16(_mm_mullo_epi16(m, a), 8);
+		/* repeat every pixel's mask value for its 4 components */
+		m = _mm_unpacklo_epi16(m, m);
+		d = _mm_loadu_si128((const __m128i *)dp);
+		lo = blend_sse2(c, _mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi32(m, m));
+		hi = blend_sse2(c, _mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi32(m, m));
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	}
+	for (; w > 0; w--, dp += 4, mp++)
+	{
+		int ma = FZ_EXPAND(*mp);
+		if (sa != 256)
+			ma = FZ_COMBINE(ma, sa);
+		blend_pixel_3_da(dp, rgba, ma);
+	}
+}
+
+TARGET_SSE2 static void
+paint_span_3_da_sa_sse2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i ones = _mm_set1_epi8(-1);
+	for (; w >= 4; w -= 4, dp += 16, sp += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)sp);
+		__m128i d, lo, hi;
+		/* every 4th bit is for an alpha byte */
+		if ((_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) & 0x8888) == 0x8888)
+			continue;
+		if ((_mm_movemask_epi8(_mm_cmpeq_epi8(s, ones)) & 0x8888) == 0x8888)
+		{
+			_mm_storeu_si128((__m128i *)dp, s);
+			continue;
+		}
+		d = _mm_loadu_si128((const __m128i *)dp);
+		lo = over_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+		hi = over_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	}
+	for (; w > 0; w--, dp += 4, sp += 4)
+		paint_pixel_3_da_sa(dp, sp);
+}
+
+TARGET_SSE2 static void
+paint_span_3_da_sa_alpha_sse2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a;
+	alpha = FZ_EXPAND(alpha);
+	a = _mm_set1_epi16((short)alpha);
+	for (; w >= 4; w -= 4, dp += 16, sp += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)sp);
+		__m128i d = _mm_loadu_si128((const __m128i *)dp);
+		__m128i lo = over_alpha_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), a);
+		__m128i hi = over_alpha_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), a);
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	}
+	for (; w > 0; w--, dp += 4, sp += 4)
+		paint_pixel_3_da_sa_alpha(dp, sp, alpha);
+}
+
+/* The AVX2 versions work on 8 pixels at a time. Unpacking and shuffling
+ * operates on each 128 bit half separately, so the 16 bit values are
+ * arranged exactly as for SSE2, just twice. The last few pixels are
+ * left to the SSE2 versions. */
+
+TARGET_AVX2 static inline __m256i
+blend_avx2(__m256i s, __m256i d, __m256i a)
+{
+	__m256i v = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(s, d), a), _mm256_slli_epi16(d, 8));
+	return _mm256_srli_epi16(v, 8);
+}
+
+TARGET_AVX2 static inline __m256i
+over_avx2(__m256i s, __m256i d)
+{
+	__m256i sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	__m256i t = _mm256_sub_epi16(_mm256_set1_epi16(256), _mm256_add_epi16(sa, _mm256_srli_epi16(sa, 7)));
+	__m256i v = _mm256_add_epi16(s, _mm256_srli_epi16(_mm256_mullo_epi16(d, t), 8));
+	__m256i keep = _mm256_cmpeq_epi16(sa, _mm256_setzero_si256());
+	v = _mm256_and_si256(v, _mm256_set1_epi16(0xFF));
+	return _mm256_blendv_epi8(v, d, keep);
+}
+
+TARGET_AVX2 static inline __m256i
+over_alpha_avx2(__m256i s, __m256i d, __m256i alpha)
+{
+	__m256i masa, t, v;
+	s = _mm256_srli_epi16(_mm256_mullo_epi16(s, alpha), 8);
+	masa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	t = _mm256_sub_epi16(_mm256_set1_epi16(255), masa);
+	t = _mm256_add_epi16(t, _mm256_srli_epi16(t, 7));
+	v = _mm256_add_epi16(s, _mm256_srli_epi16(_mm256_mullo_epi16(d, t), 8));
+	return _mm256_and_si256(v, _mm256_set1_epi16(0xFF));
+}
+
+TARGET_AVX2 static void
+paint_solid_color_3_da_avx2(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	byte rgba[4];
+	int sa = FZ_EXPAND(color[3]);
+	int32_t v = opaque_color_3(color, rgba);
+	if (sa == 0)
+		return;
+	if (sa == 256)
+	{
+		__m256i fill = _mm256_set1_epi32(v);
+		for (; w >= 8; w -= 8, dp += 32)
+			_mm256_storeu_si256((__m256i *)dp, fill);
+	}
+	else
+	{
+		__m256i zero = _mm256_setzero_si256();
+		__m256i c = _mm256_unpacklo_epi8(_mm256_set1_epi32(v), zero);
+		__m256i a = _mm256_set1_epi16((short)sa);
+		for (; w >= 8; w -= 8, dp += 32)
+		{
+			__m256i d = _mm256_loadu_si256((const __m256i *)dp);
+			__m256i lo = blend_avx2(c, _mm256_unpacklo_epi8(d, zero), a);
+			__m256i hi = blend_avx2(c, _mm256_unpackhi_epi8(d, zero), a);
+			_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+		}
+	}
+	/* avoid the penalty for mixing AVX and SSE instructions */
+	_mm256_zeroupper();
+	if (w > 0)
+		paint_solid_color_3_da_sse2(dp, n, w, color, da, eop);
+}
+
+TARGET_AVX2 static void
+paint_span_with_color_3_da_avx2(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	byte rgba[4];
+	int sa = FZ_EXPAND(color[3]);
+	int32_t v = opaque_color_3(color, rgba);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i fill = _mm256_set1_epi32(v);
+	__m256i c = _mm256_unpacklo_epi8(fill, zero);
+	__m256i a = _mm256_set1_epi32(sa);
+	if (sa == 0)
+		return;
+	for (; w >= 8; w -= 8, dp += 32, mp += 8)
+	{
+		__m256i m, d, lo, hi;
+		uint64_t m8;
+		memcpy(&m8, mp, 8);
+		if (m8 == 0)
+			continue;
+		if (m8 == ~(uint64_t)0 && sa == 256)
+		{
+			_mm256_storeu_si256((__m256i *)dp, fill);
+			continue;
+		}
+		/* one 32 bit value per pixel, i.e. pixels 0-3 and 4-7 in the two halves */
+		m = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)mp));
+		m = _mm256_add_epi32(m, _mm256_srli_epi32(m, 7));
+		if (sa != 256)
+			m = _mm256_srli_epi32(_mm256_mullo_epi32(m, a), 8);
+		/* repeat every pixel's mask value for its 4 components */
+		m = _mm256_or_si256(m, _mm256_slli_epi32(m, 16));
+		d = _mm256_loadu_si256((const __m256i *)dp);
+		lo = blend_avx2(c, _mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi32(m, m));
+		hi = blend_avx2(c, _mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi32(m, m));
+		_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+	}
+	_mm256_zeroupper();
+	if (w > 0)
+		paint_span_with_color_3_da_sse2(dp, mp, n, w, color, da, eop);
+}
+
+TARGET_AVX2 static void
+paint_span_3_da_sa_avx2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i ones = _mm256_set1_epi8(-1);
+	for (; w >= 8; w -= 8, dp += 32, sp += 32)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)sp);
+		__m256i d, lo, hi;
+		if (((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, zero)) & 0x88888888) == 0x88888888)
+			continue;
+		if (((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, ones)) & 0x88888888) == 0x88888888)
+		{
+			_mm256_storeu_si256((__m256i *)dp, s);
+			continue;
+		}
+		d = _mm256_loadu_si256((const __m256i *)dp);
+		lo = over_avx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+		hi = over_avx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+		_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+	}
+	_mm256_zeroupper();
+	if (w > 0)
+		paint_span_3_da_sa_sse2(dp, da, sp, sa, n, w, alpha, eop);
+}
+
+TARGET_AVX2 static void
+paint_span_3_da_sa_alpha_avx2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i a = _mm256_set1_epi16((short)FZ_EXPAND(alpha));
+	for (; w >= 8; w -= 8, dp += 32, sp += 32)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)sp);
+		__m256i d = _mm256_loadu_si256((const __m256i *)dp);
+		__m256i lo = over_alpha_avx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero), a);
+		__m256i hi = over_alpha_avx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero), a);
+		_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+	}
+	_mm256_zeroupper();
+	if (w > 0)
+		paint_span_3_da_sa_alpha_sse2(dp, da, sp, sa, n, w, alpha, eop);
+}
+
+#endif /* SIMD_X86 */
+
+#endif /* FZ_PLOTTERS_RGB */
+
+fz_solid_color_painter_t *
+fz_get_solid_color_painter_simd(int level, int n, const byte * FZ_RESTRICT color, int da)
+{
+#if FZ_PLOTTERS_RGB && defined(SIMD_X86)
+	if (n == 4 && da)
+	{
+		if (level == FZ_SIMD_AVX2)
+			return paint_solid_color_3_da_avx2;
+		if (level == FZ_SIMD_SSE2)
+			return paint_solid_color_3_da_sse2;
+	}
+#endif
+	return NULL;
+}
+
+fz_span_color_painter_t *
+fz_get_span_color_painter_simd(int level, int n, int da, const byte * FZ_RESTRICT color)
+{
+#if FZ_PLOTTERS_RGB && defined(SIMD_X86)
+	if (n == 4 && da)
+	{
+		if (level == FZ_SIMD_AVX2)
+			return paint_span_with_color_3_da_avx2;
+		if (level == FZ_SIMD_SSE2)
+			return paint_span_with_color_3_da_sse2;
+	}
+#endif
+	return NULL;
+}
+
+fz_span_painter_t *
+fz_get_span_painter_simd(int level, int da, int sa, int n, int alpha)
+{
+#if FZ_PLOTTERS_RGB && defined(SIMD_X86)
+	if (n == 3 && da && sa && alpha > 0)
+	{
+		if (level == FZ_SIMD_AVX2)
+			return alpha == 255 ? paint_span_3_da_sa_avx2 : paint_span_3_da_sa_alpha_avx2;
+		if (level == FZ_SIMD_SSE2)
+			return alpha == 255 ? paint_span_3_da_sa_sse2 : paint_span_3_da_sa_alpha_sse2;
+	}
+#endif
+	return NULL;
+}
+
+/* Conformance tests and benchmarks */
+
+enum
+{
+	TEST_SOLID_COLOR,
+	TEST_SPAN_WITH_COLOR,
+	TEST_SPAN,
+	TEST_SPAN_ALPHA,
+	TEST_COUNT
+};
+
+static const char *test_names[TEST_COUNT] =
+{
+	"solid_color_3_da",
+	"span_with_color_3_da",
+	"span_3_da_sa",
+	"span_3_da_sa_alpha",
+};
+
+static const char *level_names[] =
+{
+	"portable",
+	"SSE2",
+	"AVX2",
+};
+
+#define TEST_MAX_W 1024
+
+static unsigned int
+test_rand(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 16) & 0x7FFF;
+}
+
+/* Random bytes with runs of 0 and 255 (as in glyph masks and
+ * images with transparent and opaque parts). */
+static void
+test_fill(unsigned int *seed, byte *p, int len, int stride)
+{
+	int i = 0;
+	while (i < len)
+	{
+		int run = 1 + test_rand(seed) % 16;
+		int kind = test_rand(seed) % 3;
+		for (; run > 0 && i < len; run--, i++)
+		{
+			int k;
+			for (k = 0; k < stride; k++)
+			{
+				byte v = (byte)test_rand(seed);
+				if (k == stride - 1 && kind < 2)
+					v = kind ? 255 : 0;
+				p[i * stride + k] = v;
+			}
+		}
+	}
+}
+
+static int
+test_has_painter(int kind, int level)
+{
+	static const byte color[4] = { 0, 0, 0, 255 };
+	switch (kind)
+	{
+	case TEST_SOLID_COLOR:
+		return fz_get_solid_color_painter_simd(level, 4, color, 1) != NULL;
+	case TEST_SPAN_WITH_COLOR:
+		return fz_get_span_color_painter_simd(level, 4, 1, color) != NULL;
+	case TEST_SPAN:
+		return fz_get_span_painter_simd(level, 1, 1, 3, 255) != NULL;
+	default:
+		return fz_get_span_painter_simd(level, 1, 1, 3, 128) != NULL;
+	}
+}
+
+/* FZ_SIMD_NONE paints with the portable painters (as long as the
+ * current level is FZ_SIMD_NONE). */
+static void
+test_paint(int kind, int level, byte *dp, const byte *sp, const byte *mp, const byte *color, int alpha, int w)
+{
+	switch (kind)
+	{
+	case TEST_SOLID_COLOR:
+	{
+		fz_solid_color_painter_t *fn = level ? fz_get_solid_color_painter_simd(level, 4, color, 1) : fz_get_solid_color_painter(4, color, 1, NULL);
+		fn(dp, 4, w, color, 1, NULL);
+		break;
+	}
+	case TEST_SPAN_WITH_COLOR:
+	{
+		fz_span_color_painter_t *fn = level ? fz_get_span_color_painter_simd(level, 4, 1, color) : fz_get_span_color_painter(4, 1, color, NULL);
+		fn(dp, mp, 4, w, color, 1, NULL);
+		break;
+	}
+	default:
+	{
+		fz_span_painter_t *fn;
+		if (kind == TEST_SPAN)
+			alpha = 255;
+		fn = level ? fz_get_span_painter_simd(level, 1, 1, 3, alpha) : fz_get_span_painter(1, 1, 3, alpha, NULL);
+		fn(dp, 1, sp, 1, 3, w, alpha, NULL);
+		break;
+	}
+	}
+}
+
+static const int test_alphas[] = { 255, 0, 1, 128, 254 };
+
+/* Paints random spans of all lengths up to 70 (and a long one) at
+ * different alignments with the portable painter and the one for level
+ * and compares the results. Returns the number of mismatches. */
+static int
+test_level(int kind, int level)
+{
+	byte dst_ref[TEST_MAX_W * 4 + 16];
+	byte dst[TEST_MAX_W * 4 + 16];
+	byte src[TEST_MAX_W * 4 + 16];
+	byte mask[TEST_MAX_W + 16];
+	unsigned int seed = 1;
+	int failures = 0;
+	int w, i, ofs;
+
+	for (w = 1; w <= 71; w++)
+	{
+		int len = w <= 70 ? w : TEST_MAX_W;
+		for (i = 0; i < (int)nelem(test_alphas); i++)
+		{
+			for (ofs = 0; ofs < 4; ofs++)
+			{
+				byte color[4];
+				int alpha = test_alphas[i];
+				color[0] = (byte)test_rand(&seed);
+				color[1] = (byte)test_rand(&seed);
+				color[2] = (byte)test_rand(&seed);
+				color[3] = (byte)alpha;
+				test_fill(&seed, dst_ref + ofs, len, 4);
+				test_fill(&seed, src + ofs, len, 4);
+				test_fill(&seed, mask + ofs, len, 1);
+				memcpy(dst + ofs, dst_ref + ofs, len * 4);
+
+				/* the span painters aren't used for 0 alpha */
+				if (alpha == 0 && (kind == TEST_SPAN || kind == TEST_SPAN_ALPHA))
+					continue;
+				test_paint(kind, FZ_SIMD_NONE, dst_ref + ofs, src + ofs, mask + ofs, color, alpha, len);
+				test_paint(kind, level, dst + ofs, src + ofs, mask + ofs, color, alpha, len);
+				if (memcmp(dst_ref + ofs, dst + ofs, len * 4))
+					failures++;
+			}
+		}
+	}
+	return failures;
+}
+
+static float
+bench_level(int kind, int level, int iterations)
+{
+	static byte dst[TEST_MAX_W * 4 * 16];
+	static byte src[TEST_MAX_W * 4 * 16];
+	static byte mask[TEST_MAX_W * 16];
+	byte color[4] = { 0x20, 0x40, 0x80, 255 };
+	unsigned int seed = 1;
+	clock_t start;
+	int i, y;
+
+	test_fill(&seed, dst, TEST_MAX_W * 16, 4);
+	test_fill(&seed, src, TEST_MAX_W * 16, 4);
+	test_fill(&seed, mask, TEST_MAX_W * 16, 1);
+
+	start = clock();
+	for (i = 0; i < iterations; i++)
+	{
+		for (y = 0; y < 16; y++)
+		{
+			byte *dp = dst + y * TEST_MAX_W * 4;
+			const byte *sp = src + y * TEST_MAX_W * 4;
+			const byte *mp = mask + y * TEST_MAX_W;
+			/* also covers the blending with partially transparent colors */
+			color[3] = (byte)((i & 1) ? 255 : 200);
+			test_paint(kind, level, dp, sp, mp, color, 200, TEST_MAX_W);
+		}
+	}
+	return (float)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+}
+
+int
+fz_test_span_painters(fz_context *ctx, fz_output *out, int iterations)
+{
+	int failures = 0;
+	int old_level, kind, level;
+
+	fz_init_paint_simd();
+	old_level = fz_paint_simd_level();
+	fz_write_printf(ctx, out, "SIMD level: %s\n", level_names[simd_max_level]);
+
+	/* the portable painters are compared against the SIMD ones (which
+	 * give the same results, so this doesn't affect other threads) */
+	fz_set_paint_simd_level(FZ_SIMD_NONE);
+	for (kind = 0; kind < TEST_COUNT; kind++)
+	{
+		fz_write_printf(ctx, out, "%s:", test_names[kind]);
+		for (level = FZ_SIMD_NONE; level <= simd_max_level; level++)
+		{
+			if (level != FZ_SIMD_NONE)
+			{
+				int n;
+				if (!test_has_painter(kind, level))
+					continue;
+				n = test_level(kind, level);
+				if (n)
+					fz_write_printf(ctx, out, " %s: %d mismatches!", level_names[level], n);
+				failures += n;
+			}
+			if (iterations > 0)
+				fz_write_printf(ctx, out, " %s: %.2f ms", level_names[level], bench_level(kind, level, iterations));
+		}
+		fz_write_printf(ctx, out, "\n");
+	}
+	fz_set_paint_simd_level(old_level);
+
+	return failures;
+}
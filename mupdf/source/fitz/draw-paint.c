@@ -585,6 +585,12 @@ fz_get_solid_color_painter(int n, const byte * FZ_RESTRICT color, int da, const
 			return paint_solid_color_N_alpha_op;
 	}
 #endif /* FZ_ENABLE_SPOT_RENDERING */
+	if (fz_paint_simd_level() != FZ_SIMD_NONE)
+	{
+		fz_solid_color_painter_t *fn = fz_get_solid_color_painter_simd(fz_paint_simd_level(), n, color, da);
+		if (fn)
+			return fn;
+	}
 	switch (n-da)
 	{
 		case 0:
@@ -1002,6 +1008,12 @@ fz_get_span_color_painter(int n, int da, const byte * FZ_RESTRICT color, const f
 		return da ? paint_span_with_color_N_da_op : paint_span_with_color_N_op;
 	}
 #endif /* FZ_ENABLE_SPOT_RENDERING */
+	if (fz_paint_simd_level() != FZ_SIMD_NONE)
+	{
+		fz_span_color_painter_t *fn = fz_get_span_color_painter_simd(fz_paint_simd_level(), n, da, color);
+		if (fn)
+			return fn;
+	}
 	switch(n-da)
 	{
 	case 0: return da ? paint_span_with_color_0_da : NULL;
@@ -1987,6 +1999,12 @@ fz_get_span_painter(int da, int sa, int n, int alpha, const fz_overprint * FZ_RE
 			return NULL;
 	}
 #endif /* FZ_ENABLE_SPOT_RENDERING */
+	if (fz_paint_simd_level() != FZ_SIMD_NONE)
+	{
+		fz_span_painter_t *fn = fz_get_span_painter_simd(fz_paint_simd_level(), da, sa, n, alpha);
+		if (fn)
+			return fn;
+	}
 	switch (n)
 	{
 	case 0:
@@ -12,6 +12,7 @@ intermediate results rather than ints.
 
 #include "mupdf/fitz.h"
 
+#include "context-imp.h"
 #include "draw-imp.h"
 #include "pixmap-imp.h"
 
@@ -19,6 +20,19 @@ intermediate results rather than ints.
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
+#include <time.h>
+
+#if !defined(ARCH_ARM) && (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__))
+#define SCALE_SSE2
+#include <emmintrin.h>
+/* Allows using SSE2 intrinsics in single functions without having to
+ * compile the whole library for them (MSVC doesn't need this). */
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#else
+#define TARGET_SSE2
+#endif
+#endif
 
 /* Do we special case handling of single pixel high/wide images? The
  * 'purest' handling is given by not special casing them, but certain
@@ -1257,6 +1271,256 @@ scale_row_from_temp_alpha(unsigned char * FZ_RESTRICT dst, const unsigned char *
 }
 #endif
 
+#ifdef SCALE_SSE2
+/*
+SSE2 versions of the row scalers for the common cases of 1 to 4
+components. The sums are accumulated in 32 bit lanes from pairs of
+16 bit products (_mm_madd_epi16). This is exact as weights never exceed
+256, so they give the same results as the portable versions above
+(fz_test_scale_pixmap checks this).
+*/
+
+TARGET_SSE2 static inline int
+hsum_epi32(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(v);
+}
+
+/* Two weights as they're needed for multiplying pairs of values. */
+TARGET_SSE2 static inline __m128i
+weight_pair(int w0, int w1)
+{
+	return _mm_set1_epi32((int)(((unsigned int)w1 << 16) | ((unsigned int)w0 & 0xFFFF)));
+}
+
+TARGET_SSE2 static void
+scale_row_to_temp1_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	const __m128i zero = _mm_setzero_si128();
+	int step = 1;
+	int i;
+
+	assert(weights->n == 1);
+	if (weights->flip)
+	{
+		dst += weights->count - 1;
+		step = -1;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		const unsigned char *min = &src[*contrib++];
+		int len = *contrib++;
+		__m128i acc = zero;
+		int val;
+
+		for (; len >= 8; len -= 8)
+		{
+			__m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)min), zero);
+			__m128i w = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)contrib), _mm_loadu_si128((const __m128i *)(contrib + 4)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, w));
+			min += 8;
+			contrib += 8;
+		}
+		val = 128 + hsum_epi32(acc);
+		while (len-- > 0)
+			val += *min++ * *contrib++;
+		*dst = (unsigned char)(val>>8);
+		dst += step;
+	}
+}
+
+/* Loads one pixel of n <= 4 components as 16 bit values, each
+ * followed by a 0. */
+TARGET_SSE2 static inline __m128i
+load_pixel(const unsigned char *p, int n, __m128i zero)
+{
+	uint32_t v = 0;
+
+	memcpy(&v, p, n);
+	return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)v), zero), zero);
+}
+
+/* Loads two adjacent pixels of n <= 4 components as 16 bit values,
+ * interleaved as p0c0 p1c0 p0c1 p1c1 ... */
+TARGET_SSE2 static inline __m128i
+load_pixel_pair(const unsigned char *p, int n, __m128i zero)
+{
+	__m128i v;
+
+	if (n == 4)
+		v = _mm_loadl_epi64((const __m128i *)p);
+	else
+	{
+		uint32_t v0 = 0, v1 = 0;
+		memcpy(&v0, p, n);
+		memcpy(&v1, p + n, n);
+		v = _mm_unpacklo_epi32(_mm_cvtsi32_si128((int)v0), _mm_cvtsi32_si128((int)v1));
+	}
+	v = _mm_unpacklo_epi8(v, zero);
+	return _mm_unpacklo_epi16(v, _mm_srli_si128(v, 8));
+}
+
+/* The components of a pixel are summed in separate lanes, two source
+ * pixels at a time. */
+TARGET_SSE2 static inline void
+scale_row_to_temp_n_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int n)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(128);
+	int step = n;
+	int out[4];
+	int i, k;
+
+	assert(weights->n == n);
+	if (weights->flip)
+	{
+		dst += n * (weights->count - 1);
+		step = -n;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		const unsigned char *min = &src[n * *contrib++];
+		int len = *contrib++;
+		__m128i acc = round;
+
+		for (; len >= 2; len -= 2)
+		{
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(load_pixel_pair(min, n, zero), weight_pair(contrib[0], contrib[1])));
+			min += 2 * n;
+			contrib += 2;
+		}
+		if (len > 0)
+		{
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(load_pixel(min, n, zero), weight_pair(contrib[0], 0)));
+			contrib++;
+		}
+		_mm_storeu_si128((__m128i *)out, _mm_srai_epi32(acc, 8));
+		for (k = 0; k < n; k++)
+			dst[k] = (unsigned char)out[k];
+		dst += step;
+	}
+}
+
+TARGET_SSE2 static void
+scale_row_to_temp2_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	scale_row_to_temp_n_sse2(dst, src, weights, 2);
+}
+
+TARGET_SSE2 static void
+scale_row_to_temp3_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	scale_row_to_temp_n_sse2(dst, src, weights, 3);
+}
+
+TARGET_SSE2 static void
+scale_row_to_temp4_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights)
+{
+	scale_row_to_temp_n_sse2(dst, src, weights, 4);
+}
+
+/* Combines count bytes of len rows (each width bytes apart) starting at
+ * src, 16 bytes and two rows at a time. */
+TARGET_SSE2 static void
+scale_cols_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, int width, const int * FZ_RESTRICT contrib, int len, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(128);
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	int x, k;
+
+	for (x = 0; x + 16 <= count; x += 16)
+	{
+		const unsigned char *min = src + x;
+		__m128i a0 = round, a1 = round, a2 = round, a3 = round;
+
+		for (k = 0; k < len; k += 2)
+		{
+			__m128i r0 = _mm_loadu_si128((const __m128i *)min);
+			__m128i r1, w, lo0, hi0, lo1, hi1;
+
+			if (k + 1 < len)
+			{
+				r1 = _mm_loadu_si128((const __m128i *)(min + width));
+				w = weight_pair(contrib[k], contrib[k+1]);
+			}
+			else
+			{
+				r1 = zero;
+				w = weight_pair(contrib[k], 0);
+			}
+			lo0 = _mm_unpacklo_epi8(r0, zero);
+			hi0 = _mm_unpackhi_epi8(r0, zero);
+			lo1 = _mm_unpacklo_epi8(r1, zero);
+			hi1 = _mm_unpackhi_epi8(r1, zero);
+			a0 = _mm_add_epi32(a0, _mm_madd_epi16(_mm_unpacklo_epi16(lo0, lo1), w));
+			a1 = _mm_add_epi32(a1, _mm_madd_epi16(_mm_unpackhi_epi16(lo0, lo1), w));
+			a2 = _mm_add_epi32(a2, _mm_madd_epi16(_mm_unpacklo_epi16(hi0, hi1), w));
+			a3 = _mm_add_epi32(a3, _mm_madd_epi16(_mm_unpackhi_epi16(hi0, hi1), w));
+			min += 2 * width;
+		}
+		a0 = _mm_and_si128(_mm_srai_epi32(a0, 8), mask);
+		a1 = _mm_and_si128(_mm_srai_epi32(a1, 8), mask);
+		a2 = _mm_and_si128(_mm_srai_epi32(a2, 8), mask);
+		a3 = _mm_and_si128(_mm_srai_epi32(a3, 8), mask);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3)));
+	}
+	for (; x < count; x++)
+	{
+		const unsigned char *min = src + x;
+		int val = 128;
+
+		for (k = 0; k < len; k++)
+		{
+			val += *min * contrib[k];
+			min += width;
+		}
+		dst[x] = (unsigned char)(val>>8);
+	}
+}
+
+TARGET_SSE2 static void
+scale_row_from_temp_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row)
+{
+	const int *contrib = &weights->index[weights->index[row]];
+	int len;
+
+	contrib++; /* Skip min */
+	len = *contrib++;
+	scale_cols_sse2(dst, src, w * n, contrib, len, w * n);
+}
+
+TARGET_SSE2 static void
+scale_row_from_temp_alpha_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row)
+{
+	const int *contrib = &weights->index[weights->index[row]];
+	unsigned char buf[1024];
+	int chunk = (sizeof(buf) / n) * n;
+	int width = w * n;
+	int len, x, k, nn;
+
+	contrib++; /* Skip min */
+	len = *contrib++;
+	/* Scale in chunks of whole pixels, then spread them out to make room
+	 * for the alpha values. */
+	for (x = 0; x < width; x += chunk)
+	{
+		int count = fz_mini(chunk, width - x);
+		scale_cols_sse2(buf, src + x, width, contrib, len, count);
+		for (k = 0; k < count; k += n)
+		{
+			for (nn = 0; nn < n; nn++)
+				*dst++ = buf[k + nn];
+			*dst++ = 255;
+		}
+	}
+}
+#endif /* SCALE_SSE2 */
+
 #ifdef SINGLE_PIXEL_SPECIALS
 static void
 duplicate_single_pixel(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, int n, int forcealpha, int w, int h, int stride)
@@ -1523,21 +1787,101 @@ adjust_alpha_edges(fz_pixmap * FZ_RESTRICT pix, const fz_weights * FZ_RESTRICT r
 	}
 }
 
-fz_pixmap *
-fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h, const fz_irect *clip)
+typedef void (row_scale_in_fn)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights);
+typedef void (row_scale_out_fn)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row);
+
+/* How the scaling is done. None of these change the result. */
+typedef struct
 {
-	return fz_scale_pixmap_cached(ctx, src, x, y, w, h, clip, NULL, NULL);
+	int simd;	/* use the SSE2 row scalers if available */
+	int bands;	/* number of bands of output rows to scale separately (0 to decide by size) */
+	fz_tune_run_parallel_fn *run_parallel;
+	void *run_parallel_arg;
+} scale_options;
+
+/* Only images that take a while to scale are split up into bands
+ * (and each band has to be big enough to make up for scaling the
+ * source rows shared with its neighbours twice). */
+#define SCALE_PARALLEL_MIN_SIZE (2 * 1024 * 1024)
+#define SCALE_MIN_BAND_ROWS 32
+#define SCALE_MAX_BANDS 8
+
+static int
+scale_band_count(const scale_options *opts, const fz_pixmap *src, const fz_weights *rows, const fz_weights *cols)
+{
+	int64_t size;
+
+	if (opts->bands > 0)
+		return fz_clampi(opts->bands, 1, rows->count);
+	if (!opts->run_parallel)
+		return 1;
+	/* Roughly the number of bytes going through the horizontal and
+	 * the vertical pass. */
+	size = (int64_t)src->h * cols->count * src->n + (int64_t)rows->count * cols->count * src->n * rows->max_len;
+	if (size < SCALE_PARALLEL_MIN_SIZE)
+		return 1;
+	return fz_clampi(rows->count / SCALE_MIN_BAND_ROWS, 1, SCALE_MAX_BANDS);
 }
 
-fz_pixmap *
-fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y, float w, float h, const fz_irect *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y)
+typedef struct
+{
+	const fz_pixmap *src;
+	fz_pixmap *dst;
+	const fz_weights *rows;
+	const fz_weights *cols;
+	row_scale_in_fn *row_scale_in;
+	row_scale_out_fn *row_scale_out;
+	unsigned char *temp;	/* temp_span * temp_rows bytes for each band */
+	int temp_span;
+	int temp_rows;
+	int flip_y;
+	int bands;
+} scale_bands;
+
+/* Produces one band of output rows. Bands don't share any state, so
+ * they can be scaled on different threads. */
+static void
+scale_band(void *arg, int band)
+{
+	scale_bands *sb = (scale_bands *)arg;
+	const fz_pixmap *src = sb->src;
+	const fz_weights *contrib_rows = sb->rows;
+	unsigned char *temp = sb->temp + (size_t)sb->temp_span * sb->temp_rows * band;
+	int row = (int)((int64_t)contrib_rows->count * band / sb->bands);
+	int end = (int)((int64_t)contrib_rows->count * (band + 1) / sb->bands);
+	int max_row = contrib_rows->index[contrib_rows->index[row]];
+
+	for (; row < end; row++)
+	{
+		/*
+		Which source rows do we need to have scaled into the
+		temporary buffer in order to be able to do the final
+		scale?
+		*/
+		int row_index = contrib_rows->index[row];
+		int row_min = contrib_rows->index[row_index++];
+		int row_len = contrib_rows->index[row_index];
+		while (max_row < row_min+row_len)
+		{
+			/* Scale another row */
+			assert(max_row < src->h);
+			(*sb->row_scale_in)(&temp[sb->temp_span*(max_row % sb->temp_rows)], &src->samples[(sb->flip_y ? (src->h-1-max_row): max_row)*src->stride], sb->cols);
+			max_row++;
+		}
+
+		(*sb->row_scale_out)(&sb->dst->samples[row*sb->dst->stride], temp, contrib_rows, sb->cols->count, src->n, row);
+	}
+}
+
+static fz_pixmap *
+scale_pixmap(fz_context *ctx, const fz_pixmap *src, float x, float y, float w, float h, const fz_irect *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y, const scale_options *opts)
 {
 	fz_scale_filter *filter = &fz_scale_filter_simple;
 	fz_weights *contrib_rows = NULL;
 	fz_weights *contrib_cols = NULL;
 	fz_pixmap *output = NULL;
 	unsigned char *temp = NULL;
-	int max_row, temp_span, temp_rows, row;
+	int temp_span, temp_rows, bands, band;
 	int dst_w_int, dst_h_int, dst_x_int, dst_y_int;
 	int flip_x, flip_y, forcealpha;
 	fz_rect patch;
@@ -1751,16 +2095,18 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 	else
 #endif /* SINGLE_PIXEL_SPECIALS */
 	{
-		void (*row_scale_in)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights);
-		void (*row_scale_out)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row);
+		row_scale_in_fn *row_scale_in;
+		row_scale_out_fn *row_scale_out;
+		scale_bands sb;
 
 		temp_span = contrib_cols->count * src->n;
 		temp_rows = contrib_rows->max_len;
 		if (temp_span <= 0 || temp_rows > INT_MAX / temp_span)
 			goto cleanup;
+		bands = scale_band_count(opts, src, contrib_rows, contrib_cols);
 		fz_try(ctx)
 		{
-			temp = fz_calloc(ctx, (size_t)temp_span*temp_rows, sizeof(unsigned char));
+			temp = fz_calloc(ctx, (size_t)temp_span*temp_rows, bands);
 		}
 		fz_catch(ctx)
 		{
@@ -1790,26 +2136,45 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 			break;
 		}
 		row_scale_out = forcealpha ? scale_row_from_temp_alpha : scale_row_from_temp;
-		max_row = contrib_rows->index[contrib_rows->index[0]];
-		for (row = 0; row < contrib_rows->count; row++)
+#ifdef SCALE_SSE2
+		if (opts->simd)
 		{
-			/*
-			Which source rows do we need to have scaled into the
-			temporary buffer in order to be able to do the final
-			scale?
-			*/
-			int row_index = contrib_rows->index[row];
-			int row_min = contrib_rows->index[row_index++];
-			int row_len = contrib_rows->index[row_index];
-			while (max_row < row_min+row_len)
+			switch (src->n)
 			{
-				/* Scale another row */
-				assert(max_row < src->h);
-				(*row_scale_in)(&temp[temp_span*(max_row % temp_rows)], &src->samples[(flip_y ? (src->h-1-max_row): max_row)*src->stride], contrib_cols);
-				max_row++;
+			case 1:
+				row_scale_in = scale_row_to_temp1_sse2;
+				break;
+			case 2:
+				row_scale_in = scale_row_to_temp2_sse2;
+				break;
+			case 3:
+				row_scale_in = scale_row_to_temp3_sse2;
+				break;
+			case 4:
+				row_scale_in = scale_row_to_temp4_sse2;
+				break;
 			}
+			row_scale_out = forcealpha ? scale_row_from_temp_alpha_sse2 : scale_row_from_temp_sse2;
+		}
+#endif
 
-			(*row_scale_out)(&output->samples[row*output->stride], temp, contrib_rows, contrib_cols->count, src->n, row);
+		sb.src = src;
+		sb.dst = output;
+		sb.rows = contrib_rows;
+		sb.cols = contrib_cols;
+		sb.row_scale_in = row_scale_in;
+		sb.row_scale_out = row_scale_out;
+		sb.temp = temp;
+		sb.temp_span = temp_span;
+		sb.temp_rows = temp_rows;
+		sb.flip_y = flip_y;
+		sb.bands = bands;
+		if (bands > 1 && opts->run_parallel)
+			opts->run_parallel(opts->run_parallel_arg, bands, scale_band, &sb);
+		else
+		{
+			for (band = 0; band < bands; band++)
+				scale_band(&sb, band);
 		}
 		fz_free(ctx, temp);
 
@@ -1828,6 +2193,25 @@ cleanup:
 	return output;
 }
 
+fz_pixmap *
+fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h, const fz_irect *clip)
+{
+	return fz_scale_pixmap_cached(ctx, src, x, y, w, h, clip, NULL, NULL);
+}
+
+fz_pixmap *
+fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y, float w, float h, const fz_irect *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y)
+{
+	scale_options opts;
+	int level = fz_paint_simd_level();
+
+	opts.simd = level == FZ_SIMD_SSE2 || level == FZ_SIMD_AVX2;
+	opts.bands = 0;
+	opts.run_parallel = ctx->tuning->image_scale_parallel;
+	opts.run_parallel_arg = ctx->tuning->image_scale_parallel_arg;
+	return scale_pixmap(ctx, src, x, y, w, h, clip, cache_x, cache_y, &opts);
+}
+
 void
 fz_drop_scale_cache(fz_context *ctx, fz_scale_cache *sc)
 {
@@ -1842,3 +2226,169 @@ fz_new_scale_cache(fz_context *ctx)
 {
 	return fz_malloc_struct(ctx, fz_scale_cache);
 }
+
+/* Testing */
+
+static unsigned int
+test_rand(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 16) & 0x7fff;
+}
+
+static fz_pixmap *
+test_new_pixmap(fz_context *ctx, unsigned int *seed, int n, int w, int h)
+{
+	/* with or without alpha */
+	fz_colorspace *cs = n == 1 ? fz_device_gray(ctx) : n == 3 ? fz_device_rgb(ctx) : fz_device_cmyk(ctx);
+	fz_pixmap *pix = fz_new_pixmap(ctx, cs, w, h, NULL, test_rand(seed) & 1);
+	unsigned char *p = pix->samples;
+	size_t i, size = (size_t)pix->stride * h;
+
+	/* mostly smooth, so that rounding differences would show up */
+	for (i = 0; i < size; i++)
+		p[i] = (i % 7 == 0) ? (unsigned char)test_rand(seed) : (unsigned char)(i * 3 + (i / pix->stride));
+	return pix;
+}
+
+static int
+test_same_pixmap(const fz_pixmap *a, const fz_pixmap *b)
+{
+	int y;
+
+	if (!a || !b)
+		return a == b;
+	if (a->x != b->x || a->y != b->y || a->w != b->w || a->h != b->h || a->n != b->n)
+		return 0;
+	for (y = 0; y < a->h; y++)
+		if (memcmp(a->samples + y * a->stride, b->samples + y * b->stride, (size_t)a->w * a->n))
+			return 0;
+	return 1;
+}
+
+static int
+test_scale(fz_context *ctx, unsigned int *seed, int simd)
+{
+	static const int colorants[] = { 1, 3, 4 };
+	/* the bands are scaled one after the other */
+	scale_options variants[] = {
+		{ 0, 1, NULL, NULL },
+		{ 0, 3, NULL, NULL },
+		{ 0, 8, NULL, NULL },
+	};
+	fz_pixmap *src, *ref = NULL, *pix = NULL;
+	fz_irect clip, *cp = NULL;
+	float x, y, w, h;
+	scale_options opts = { 0, 1, NULL, NULL };
+	int i, failures = 0;
+
+	src = test_new_pixmap(ctx, seed, colorants[test_rand(seed) % 3], 2 + test_rand(seed) % 300, 2 + test_rand(seed) % 300);
+	/* up and down scales, flipped or not, at subpixel positions */
+	w = src->w * (0.05f + (test_rand(seed) % 400) / 100.0f);
+	h = src->h * (0.05f + (test_rand(seed) % 400) / 100.0f);
+	if (test_rand(seed) & 1)
+		w = -w;
+	if (test_rand(seed) & 1)
+		h = -h;
+	x = (test_rand(seed) % 64) / 8.0f;
+	y = (test_rand(seed) % 64) / 8.0f;
+	if (test_rand(seed) & 1)
+	{
+		clip.x0 = test_rand(seed) % 100;
+		clip.y0 = test_rand(seed) % 100;
+		clip.x1 = clip.x0 + 1 + test_rand(seed) % 600;
+		clip.y1 = clip.y0 + 1 + test_rand(seed) % 600;
+		cp = &clip;
+	}
+
+	variants[0].simd = simd;
+	variants[2].simd = simd;
+
+	fz_var(ref);
+	fz_var(pix);
+	fz_try(ctx)
+	{
+		ref = scale_pixmap(ctx, src, x, y, w, h, cp, NULL, NULL, &opts);
+		for (i = 0; i < (int)nelem(variants); i++)
+		{
+			pix = scale_pixmap(ctx, src, x, y, w, h, cp, NULL, NULL, &variants[i]);
+			if (!test_same_pixmap(ref, pix))
+				failures++;
+			fz_drop_pixmap(ctx, pix);
+			pix = NULL;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_drop_pixmap(ctx, ref);
+		fz_drop_pixmap(ctx, src);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return failures;
+}
+
+static float
+test_bench(fz_context *ctx, fz_pixmap *src, float scale, const scale_options *opts, int iterations)
+{
+	clock_t start = clock();
+	int i;
+
+	for (i = 0; i < iterations; i++)
+		fz_drop_pixmap(ctx, scale_pixmap(ctx, src, 0.5f, 0.5f, src->w * scale, src->h * scale, NULL, NULL, NULL, opts));
+	return (float)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+}
+
+int
+fz_test_scale_pixmap(fz_context *ctx, fz_output *out, int iterations)
+{
+	static const float scales[] = { 0.3f, 2.5f };
+	int level = fz_paint_simd_level();
+	int simd = level == FZ_SIMD_SSE2 || level == FZ_SIMD_AVX2;
+	unsigned int seed = 1;
+	int failures = 0;
+	int i, k;
+
+	for (i = 0; i < 200; i++)
+		failures += test_scale(ctx, &seed, simd);
+	fz_write_printf(ctx, out, "scale_pixmap: %d mismatches%s\n", failures, failures ? "!" : "");
+
+	if (iterations > 0)
+	{
+		fz_pixmap *src = test_new_pixmap(ctx, &seed, 3, 1500, 1500);
+		scale_options opts = { 0, 1, NULL, NULL };
+
+		fz_try(ctx)
+		{
+			for (k = 0; k < (int)nelem(scales); k++)
+			{
+				fz_write_printf(ctx, out, "scale_pixmap %d%%:", (int)(scales[k] * 100));
+				opts.simd = 0;
+				opts.bands = 1;
+				opts.run_parallel = NULL;
+				fz_write_printf(ctx, out, " portable: %.2f ms", test_bench(ctx, src, scales[k], &opts, iterations));
+				if (simd)
+				{
+					opts.simd = 1;
+					fz_write_printf(ctx, out, " SSE2: %.2f ms", test_bench(ctx, src, scales[k], &opts, iterations));
+				}
+				if (ctx->tuning->image_scale_parallel)
+				{
+					opts.bands = SCALE_MAX_BANDS;
+					opts.run_parallel = ctx->tuning->image_scale_parallel;
+					opts.run_parallel_arg = ctx->tuning->image_scale_parallel_arg;
+					fz_write_printf(ctx, out, " %d bands: %.2f ms", opts.bands, test_bench(ctx, src, scales[k], &opts, iterations));
+				}
+				fz_write_printf(ctx, out, "\n");
+			}
+		}
+		fz_always(ctx)
+			fz_drop_pixmap(ctx, src);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+	}
+
+	return failures;
+}
@@ -126,8 +126,9 @@ do_hash_insert(fz_context *ctx, fz_hash_table *table, const void *key, void *val
 	}
 }
 
-/* Entered with the lock taken, held throughout and at exit, UNLESS the lock
- * is the alloc lock in which case it may be momentarily dropped. */
+/* Entered with the lock taken, held throughout and at exit, except for
+ * momentarily dropping it while allocating (as allocations may have to
+ * scavenge the store, which takes the store's locks). */
 static void
 fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 {
@@ -143,21 +144,19 @@ fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 		return;
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (table->lock >= 0)
 		fz_unlock(ctx, table->lock);
 	newents = fz_malloc_no_throw(ctx, newsize * sizeof (fz_hash_entry));
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (table->lock >= 0)
 		fz_lock(ctx, table->lock);
 	if (table->lock >= 0)
 	{
 		if (table->size >= newsize)
 		{
 			/* Someone else fixed it before we could lock! */
-			if (table->lock == FZ_LOCK_ALLOC)
-				fz_unlock(ctx, table->lock);
+			fz_unlock(ctx, table->lock);
 			fz_free(ctx, newents);
-			if (table->lock == FZ_LOCK_ALLOC)
-				fz_lock(ctx, table->lock);
+			fz_lock(ctx, table->lock);
 			return;
 		}
 	}
@@ -176,10 +175,10 @@ fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 		}
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (table->lock >= 0)
 		fz_unlock(ctx, table->lock);
 	fz_free(ctx, oldents);
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (table->lock >= 0)
 		fz_lock(ctx, table->lock);
 }
 
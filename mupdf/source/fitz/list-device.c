@@ -119,6 +119,7 @@ struct fz_display_list
 	fz_rect mediabox;
 	size_t max;
 	size_t len;
+	size_t images_size;
 };
 
 typedef struct
@@ -1008,6 +1009,7 @@ fz_list_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix c
 			NULL, /* stroke */
 			&image2, /* private_data */
 			sizeof(image2)); /* private_data_len */
+		((fz_list_device *)dev)->list->images_size += fz_image_size(ctx, image);
 	}
 	fz_catch(ctx)
 	{
@@ -1039,6 +1041,7 @@ fz_list_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_mat
 			NULL, /* stroke */
 			&image2, /* private_data */
 			sizeof(image2)); /* private_data_len */
+		((fz_list_device *)dev)->list->images_size += fz_image_size(ctx, image);
 	}
 	fz_catch(ctx)
 	{
@@ -1069,6 +1072,7 @@ fz_list_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_mat
 			NULL, /* stroke */
 			&image2, /* private_data */
 			sizeof(image2)); /* private_data_len */
+		((fz_list_device *)dev)->list->images_size += fz_image_size(ctx, image);
 	}
 	fz_catch(ctx)
 	{
@@ -1504,6 +1508,7 @@ fz_new_display_list(fz_context *ctx, fz_rect mediabox)
 	list->mediabox = mediabox;
 	list->max = 0;
 	list->len = 0;
+	list->images_size = 0;
 	return list;
 }
 
@@ -1532,6 +1537,11 @@ int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list)
 	return !list || list->len == 0;
 }
 
+size_t fz_display_list_size(fz_context *ctx, const fz_display_list *list)
+{
+	return list ? list->max * sizeof(fz_display_node) + list->images_size : 0;
+}
+
 void
 fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_matrix top_ctm, fz_rect scissor, fz_cookie *cookie)
 {
@@ -378,6 +378,49 @@ template_copy_comp(unsigned char *dst0, int w, int h, int stride, const OPJ_INT3
 	}
 }
 
+/* Image coordinates at a resolution reduced by 2^factor (as openjpeg
+ * computes them when decoding with a resolution factor). */
+static inline OPJ_UINT32
+jpx_reduced(OPJ_UINT32 v, OPJ_UINT32 factor)
+{
+	return (OPJ_UINT32)(((OPJ_UINT64)v + (1u << factor) - 1) >> factor);
+}
+
+/* If the caller is going to subsample the image anyway, only decode the
+ * lower resolution levels (skipping most of the entropy decoding and the
+ * inverse wavelet transforms for the finer ones). Returns the amount of
+ * subsampling that openjpeg will do for us.
+ *
+ * Only the main header's coding style is known at this point. Tiles may
+ * override it with fewer resolution levels, in which case decoding fails
+ * and jpx_read_image retries at full resolution. */
+static int
+jpx_set_reduce(opj_codec_t *codec, int l2factor)
+{
+	opj_codestream_info_v2_t *info;
+	OPJ_UINT32 i;
+
+	if (l2factor <= 0)
+		return 0;
+
+	info = opj_get_cstr_info(codec);
+	if (!info)
+		return 0;
+	if (!info->m_default_tile_info.tccp_info)
+		l2factor = 0;
+	for (i = 0; i < info->nbcomps && l2factor > 0; i++)
+	{
+		OPJ_UINT32 numres = info->m_default_tile_info.tccp_info[i].numresolutions;
+		if ((OPJ_UINT32)l2factor >= numres)
+			l2factor = numres > 0 ? (int)numres - 1 : 0;
+	}
+	opj_destroy_cstr_info(&info);
+
+	if (l2factor <= 0 || !opj_set_decoded_resolution_factor(codec, (OPJ_UINT32)l2factor))
+		return 0;
+	return l2factor;
+}
+
 static void
 copy_jpx_to_pixmap(fz_context *ctx, fz_pixmap *img, opj_image_t *jpx)
 {
@@ -398,8 +441,8 @@ copy_jpx_to_pixmap(fz_context *ctx, fz_pixmap *img, opj_image_t *jpx)
 		OPJ_UINT32 cdy = comp->dy;
 		OPJ_UINT32 cw = comp->w;
 		OPJ_UINT32 ch = comp->h;
-		int32_t oy = safe_mul32(ctx, comp->y0, cdy) - jpx->y0;
-		int32_t ox = safe_mul32(ctx, comp->x0, cdx) - jpx->x0;
+		int32_t oy = safe_mul32(ctx, jpx_reduced(comp->y0, comp->factor), cdy) - jpx_reduced(jpx->y0, comp->factor);
+		int32_t ox = safe_mul32(ctx, jpx_reduced(comp->x0, comp->factor), cdx) - jpx_reduced(jpx->x0, comp->factor);
 		unsigned char *dst0 = dst + oy * stride;
 
 		if (comp->data == NULL)
@@ -417,24 +460,18 @@ copy_jpx_to_pixmap(fz_context *ctx, fz_pixmap *img, opj_image_t *jpx)
 	}
 }
 
-static fz_pixmap *
-jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_t size, fz_colorspace *defcs, int onlymeta)
+/* Decodes the image at a resolution reduced by up to 2^l2factor (see
+ * jpx_set_reduce). Returns NULL if decoding fails at a reduced resolution
+ * (so that the caller can retry at full resolution). */
+static opj_image_t *
+jpx_decode(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspace *defcs, int l2factor, int *reduce)
 {
-	fz_pixmap *img = NULL;
 	opj_dparameters_t params;
 	opj_codec_t *codec;
 	opj_image_t *jpx;
 	opj_stream_t *stream;
 	OPJ_CODEC_FORMAT format;
-	int a, n, k;
-	int w, h;
 	stream_block sb;
-	OPJ_UINT32 i;
-
-	fz_var(img);
-
-	if (size < 2)
-		fz_throw(ctx, FZ_ERROR_GENERIC, "not enough data to determine image format");
 
 	/* Check for SOC marker -- if found we have a bare J2K stream */
 	if (data[0] == 0xFF && data[1] == 0x4F)
@@ -475,11 +512,15 @@ jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Failed to read JPX header");
 	}
 
+	*reduce = jpx_set_reduce(codec, l2factor);
+
 	if (!opj_decode(codec, stream, jpx))
 	{
 		opj_stream_destroy(stream);
 		opj_destroy_codec(codec);
 		opj_image_destroy(jpx);
+		if (*reduce > 0)
+			return NULL;
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Failed to decode JPX image");
 	}
 
@@ -490,6 +531,32 @@ jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_
 	if (!jpx)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "opj_decode failed");
 
+	return jpx;
+}
+
+static fz_pixmap *
+jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_t size, fz_colorspace *defcs, int onlymeta, int *l2factor)
+{
+	fz_pixmap *img = NULL;
+	opj_image_t *jpx;
+	int a, n, k;
+	int w, h;
+	int reduce = 0;
+	OPJ_UINT32 i;
+
+	fz_var(img);
+
+	if (size < 2)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "not enough data to determine image format");
+
+	jpx = jpx_decode(ctx, data, size, defcs, l2factor ? *l2factor : 0, &reduce);
+	if (!jpx)
+	{
+		/* some tile has fewer resolution levels than the main header says */
+		fz_warn(ctx, "retrying to decode JPX image at full resolution");
+		jpx = jpx_decode(ctx, data, size, defcs, 0, &reduce);
+	}
+
 	/* Count number of alpha and color channels */
 	n = a = 0;
 	for (i = 0; i < jpx->numcomps; ++i)
@@ -509,8 +576,8 @@ jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_
 		}
 	}
 
-	w = state->width = jpx->x1 - jpx->x0;
-	h = state->height = jpx->y1 - jpx->y0;
+	w = state->width = jpx_reduced(jpx->x1, reduce) - jpx_reduced(jpx->x0, reduce);
+	h = state->height = jpx_reduced(jpx->y1, reduce) - jpx_reduced(jpx->y0, reduce);
 	state->xres = 72; /* openjpeg does not read the JPEG 2000 resc box */
 	state->yres = 72; /* openjpeg does not read the JPEG 2000 resc box */
 
@@ -599,11 +666,20 @@ jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_
 		fz_rethrow(ctx);
 	}
 
+	if (l2factor)
+		*l2factor -= reduce;
+
 	return img;
 }
 
 fz_pixmap *
 fz_load_jpx(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspace *defcs)
+{
+	return fz_load_jpx_subsampled(ctx, data, size, defcs, NULL);
+}
+
+fz_pixmap *
+fz_load_jpx_subsampled(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspace *defcs, int *l2factor)
 {
 	fz_jpxd state = { 0 };
 	fz_pixmap *pix = NULL;
@@ -611,7 +687,7 @@ fz_load_jpx(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspa
 	fz_try(ctx)
 	{
 		opj_lock(ctx);
-		pix = jpx_read_image(ctx, &state, data, size, defcs, 0);
+		pix = jpx_read_image(ctx, &state, data, size, defcs, 0, l2factor);
 	}
 	fz_always(ctx)
 		opj_unlock(ctx);
@@ -629,7 +705,7 @@ fz_load_jpx_info(fz_context *ctx, const unsigned char *data, size_t size, int *w
 	fz_try(ctx)
 	{
 		opj_lock(ctx);
-		jpx_read_image(ctx, &state, data, size, NULL, 1);
+		jpx_read_image(ctx, &state, data, size, NULL, 1, NULL);
 	}
 	fz_always(ctx)
 		opj_unlock(ctx);
@@ -651,6 +727,12 @@ fz_load_jpx(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspa
 	fz_throw(ctx, FZ_ERROR_GENERIC, "JPX support disabled");
 }
 
+fz_pixmap *
+fz_load_jpx_subsampled(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspace *defcs, int *l2factor)
+{
+	fz_throw(ctx, FZ_ERROR_GENERIC, "JPX support disabled");
+}
+
 void
 fz_load_jpx_info(fz_context *ctx, const unsigned char *data, size_t size, int *wp, int *hp, int *xresp, int *yresp, fz_colorspace **cspacep)
 {
@@ -18,22 +18,39 @@
  * except the _no_throw family which instead silently returns NULL.
  */
 
+static void *fz_malloc_default(void *opaque, size_t size);
+
+/*
+ * Custom allocators are called with FZ_LOCK_ALLOC held, as they might not be
+ * thread-safe. The default allocator (the C runtime's) is, so that threads don't
+ * have to wait for each other (or for whoever else holds FZ_LOCK_ALLOC) for it.
+ */
+static inline int
+alloc_needs_lock(fz_context *ctx)
+{
+#ifdef MEMENTO
+	return 1;
+#else
+	return ctx->alloc.malloc != fz_malloc_default;
+#endif
+}
+
 static void *
 do_scavenging_malloc(fz_context *ctx, size_t size)
 {
 	void *p;
 	int phase = 0;
+	int lock = alloc_needs_lock(ctx);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 	do {
+		if (lock)
+			fz_lock(ctx, FZ_LOCK_ALLOC);
 		p = ctx->alloc.malloc(ctx->alloc.user, size);
-		if (p != NULL)
-		{
+		if (lock)
 			fz_unlock(ctx, FZ_LOCK_ALLOC);
+		if (p != NULL)
 			return p;
-		}
 	} while (fz_store_scavenge(ctx, size, &phase));
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	return NULL;
 }
@@ -43,17 +60,17 @@ do_scavenging_realloc(fz_context *ctx, void *p, size_t size)
 {
 	void *q;
 	int phase = 0;
+	int lock = alloc_needs_lock(ctx);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 	do {
+		if (lock)
+			fz_lock(ctx, FZ_LOCK_ALLOC);
 		q = ctx->alloc.realloc(ctx->alloc.user, p, size);
-		if (q != NULL)
-		{
+		if (lock)
 			fz_unlock(ctx, FZ_LOCK_ALLOC);
+		if (q != NULL)
 			return q;
-		}
 	} while (fz_store_scavenge(ctx, size, &phase));
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	return NULL;
 }
@@ -137,9 +154,14 @@ fz_free(fz_context *ctx, void *p)
 {
 	if (p)
 	{
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		ctx->alloc.free(ctx->alloc.user, p);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		if (alloc_needs_lock(ctx))
+		{
+			fz_lock(ctx, FZ_LOCK_ALLOC);
+			ctx->alloc.free(ctx->alloc.user, p);
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
+		}
+		else
+			ctx->alloc.free(ctx->alloc.user, p);
 	}
 }
 
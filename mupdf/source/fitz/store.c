@@ -5,6 +5,13 @@
 #include <stdio.h>
 #include <string.h>
 
+/* The store is split into shards, so that threads looking up or storing
+ * unrelated items don't have to wait for each other. Each shard has its
+ * own lock (FZ_LOCK_STORE being the first one's), hash table and LRU list.
+ * An item's shard is picked by the hash of its key (or of its type, for
+ * keys that can't be hashed and have to be searched for by comparing). */
+#define STORE_SHARDS (FZ_LOCK_STORE_SHARD_3 - FZ_LOCK_STORE + 1)
+
 typedef struct fz_item
 {
 	void *key;
@@ -16,12 +23,12 @@ typedef struct fz_item
 	const fz_store_type *type;
 } fz_item;
 
-/* Every entry in fz_store is protected by the alloc lock */
-struct fz_store
+/* Every entry in a shard is protected by the shard's lock */
+typedef struct
 {
-	int refs;
+	int lock;
 
-	/* Every item in the store is kept in a doubly linked list, ordered
+	/* Every item in the shard is kept in a doubly linked list, ordered
 	 * by usage (so LRU entries are at the end). */
 	fz_item *head;
 	fz_item *tail;
@@ -30,32 +37,52 @@ struct fz_store
 	 * entries (those whose keys are indirect objects). */
 	fz_hash_table *hash;
 
+	size_t size;
+} fz_store_shard;
+
+/* The reference counts of the stored values and everything below but the
+ * shards are protected by the alloc lock. The alloc lock may be taken
+ * while holding a shard's lock, but not the other way around. */
+struct fz_store
+{
+	int refs;
+
+	fz_store_shard shard[STORE_SHARDS];
+
 	/* We keep track of the size of the store, and keep it below max. */
 	size_t max;
 	size_t size;
 
 	int defer_reap_count;
 	int needs_reaping;
-	int scavenging;
+
+	/* The shard to evict from next (protected by FZ_LOCK_ALLOC) */
+	int victim;
 };
 
 void
 fz_new_store_context(fz_context *ctx, size_t max)
 {
 	fz_store *store;
+	int i;
+
 	store = fz_malloc_struct(ctx, fz_store);
 	fz_try(ctx)
 	{
-		store->hash = fz_new_hash_table(ctx, 4096, sizeof(fz_store_hash), FZ_LOCK_ALLOC, NULL);
+		for (i = 0; i < STORE_SHARDS; i++)
+		{
+			store->shard[i].lock = FZ_LOCK_STORE + i;
+			store->shard[i].hash = fz_new_hash_table(ctx, 4096 / STORE_SHARDS, sizeof(fz_store_hash), FZ_LOCK_STORE + i, NULL);
+		}
 	}
 	fz_catch(ctx)
 	{
+		for (i = 0; i < STORE_SHARDS; i++)
+			fz_drop_hash_table(ctx, store->shard[i].hash);
 		fz_free(ctx, store);
 		fz_rethrow(ctx);
 	}
 	store->refs = 1;
-	store->head = NULL;
-	store->tail = NULL;
 	store->size = 0;
 	store->max = max;
 	store->defer_reap_count = 0;
@@ -63,6 +90,33 @@ fz_new_store_context(fz_context *ctx, size_t max)
 	ctx->store = store;
 }
 
+static fz_store_shard *
+shard_for_key(fz_store *store, fz_store_hash *hash, int use_hash, const fz_store_type *type)
+{
+	const unsigned char *s;
+	unsigned val = 2166136261u;
+	size_t i, len;
+
+	if (use_hash)
+	{
+		s = (const unsigned char *)hash;
+		len = sizeof(*hash);
+	}
+	else
+	{
+		/* Keys that can't be hashed are searched for through all items of
+		 * their shard, so keep all of those of a type together. */
+		s = (const unsigned char *)&type;
+		len = sizeof(type);
+	}
+	for (i = 0; i < len; i++)
+	{
+		val ^= s[i];
+		val *= 16777619u;
+	}
+	return &store->shard[val % STORE_SHARDS];
+}
+
 void *
 fz_keep_storable(fz_context *ctx, const fz_storable *sc)
 {
@@ -79,68 +133,81 @@ void *fz_keep_key_storable(fz_context *ctx, const fz_key_storable *sc)
 }
 
 /*
-	Entered with FZ_LOCK_ALLOC held.
-	Drops FZ_LOCK_ALLOC.
+	Entered with both the shard's lock and FZ_LOCK_ALLOC held.
+	Removes the item from the shard (and its size from the store's)
+	and drops the store's reference to its value. Returns whether
+	that was the last reference.
 */
-static void
-do_reap(fz_context *ctx)
+static int
+unlink_item(fz_context *ctx, fz_store_shard *shard, fz_item *item)
 {
 	fz_store *store = ctx->store;
-	fz_item *item, *prev, *remove;
 
-	if (store == NULL)
+	shard->size -= item->size;
+	store->size -= item->size;
+
+	/* Unlink from the linked list */
+	if (item->next)
+		item->next->prev = item->prev;
+	else
+		shard->tail = item->prev;
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		shard->head = item->next;
+
+	/* Remove from the hash table */
+	if (item->type->make_hash_key)
 	{
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		return;
+		fz_store_hash hash = { NULL };
+		hash.drop = item->val->drop;
+		if (item->type->make_hash_key(ctx, &hash, item->key))
+			fz_hash_remove(ctx, shard->hash, &hash);
 	}
 
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
-
-	ctx->store->needs_reaping = 0;
+	/* Drop a reference to the value */
+	if (item->val->refs > 0)
+		(void)Memento_dropRef(item->val);
+	return item->val->refs > 0 && --item->val->refs == 0;
+}
 
-	FZ_LOG_DUMP_STORE(ctx, "Before reaping store:\n");
+/*
+	Entered with no locks held.
+	Unlinks all items for which match returns non zero from the store
+	and drops them.
+*/
+static void
+remove_matching(fz_context *ctx, int (*match)(fz_context *ctx, void *arg, fz_item *item), void *arg)
+{
+	fz_store *store = ctx->store;
+	fz_item *item, *prev, *remove;
+	int i;
 
-	/* Reap the items */
 	remove = NULL;
-	for (item = store->tail; item; item = prev)
+	for (i = 0; i < STORE_SHARDS; i++)
 	{
-		prev = item->prev;
+		fz_store_shard *shard = &store->shard[i];
 
-		if (item->type->needs_reap == NULL || item->type->needs_reap(ctx, item->key) == 0)
-			continue;
+		fz_lock(ctx, shard->lock);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		for (item = shard->tail; item; item = prev)
+		{
+			prev = item->prev;
 
-		/* We have to drop it */
-		store->size -= item->size;
+			if (!match(ctx, arg, item))
+				continue;
 
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+			/* We have to drop it. Store whether to drop this value
+			 * or not in 'prev' */
+			item->prev = unlink_item(ctx, shard, item) ? item : NULL;
 
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
+			/* Store it in our removal chain - just singly linked */
+			item->next = remove;
+			remove = item;
 		}
-
-		/* Store whether to drop this value or not in 'prev' */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		item->prev = (item->val->refs > 0 && --item->val->refs == 0) ? item : NULL;
-
-		/* Store it in our removal chain - just singly linked */
-		item->next = remove;
-		remove = item;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, shard->lock);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	/* Now drop the remove chain */
 	for (item = remove; item != NULL; item = remove)
@@ -148,13 +215,40 @@ do_reap(fz_context *ctx)
 		remove = item->next;
 
 		/* Drop a reference to the value (freeing if required) */
-		if (item->prev)
+		if (item->prev) /* See above for our abuse of prev here */
 			item->val->drop(ctx, item->val);
 
 		/* Always drops the key and drop the item */
 		item->type->drop_key(ctx, item->key);
 		fz_free(ctx, item);
 	}
+}
+
+static int
+item_needs_reap(fz_context *ctx, void *arg, fz_item *item)
+{
+	return item->type->needs_reap != NULL && item->type->needs_reap(ctx, item->key) != 0;
+}
+
+/*
+	Entered with no locks held.
+*/
+static void
+do_reap(fz_context *ctx)
+{
+	fz_store *store = ctx->store;
+
+	if (store == NULL)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	store->needs_reaping = 0;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	FZ_LOG_DUMP_STORE(ctx, "Before reaping store:\n");
+
+	remove_matching(ctx, item_needs_reap, NULL);
+
 	FZ_LOG_DUMP_STORE(ctx, "After reaping store:\n");
 }
 
@@ -164,7 +258,7 @@ void fz_drop_key_storable(fz_context *ctx, const fz_key_storable *sc)
 	 * sanely throughout the code. */
 	fz_key_storable *s = (fz_key_storable *)sc;
 	int drop;
-	int unlock = 1;
+	int reap = 0;
 
 	if (s == NULL)
 		return;
@@ -178,20 +272,16 @@ void fz_drop_key_storable(fz_context *ctx, const fz_key_storable *sc)
 		if (!drop && s->storable.refs == s->store_key_refs)
 		{
 			if (ctx->store->defer_reap_count > 0)
-			{
 				ctx->store->needs_reaping = 1;
-			}
 			else
-			{
-				do_reap(ctx);
-				unlock = 0;
-			}
+				reap = 1;
 		}
 	}
 	else
 		drop = 0;
-	if (unlock)
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (reap)
+		do_reap(ctx);
 	/*
 		If we are dropping the last reference to an object, then
 		it cannot possibly be in the store (as the store always
@@ -250,176 +340,222 @@ void fz_drop_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 		s->storable.drop(ctx, &s->storable);
 }
 
+/*
+	Entered with the shard's lock held.
+	Drops then retakes it.
+*/
 static void
-evict(fz_context *ctx, fz_item *item)
+evict(fz_context *ctx, fz_store_shard *shard, fz_item *item)
 {
-	fz_store *store = ctx->store;
 	int drop;
 
-	store->size -= item->size;
-	/* Unlink from the linked list */
-	if (item->next)
-		item->next->prev = item->prev;
-	else
-		store->tail = item->prev;
-	if (item->prev)
-		item->prev->next = item->next;
-	else
-		store->head = item->next;
-
-	/* Drop a reference to the value (freeing if required) */
-	if (item->val->refs > 0)
-		(void)Memento_dropRef(item->val);
-	drop = (item->val->refs > 0 && --item->val->refs == 0);
-
-	/* Remove from the hash table */
-	if (item->type->make_hash_key)
-	{
-		fz_store_hash hash = { NULL };
-		hash.drop = item->val->drop;
-		if (item->type->make_hash_key(ctx, &hash, item->key))
-			fz_hash_remove(ctx, store->hash, &hash);
-	}
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	drop = unlink_item(ctx, shard, item);
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	fz_unlock(ctx, shard->lock);
 	if (drop)
 		item->val->drop(ctx, item->val);
 
 	/* Always drops the key and drop the item */
 	item->type->drop_key(ctx, item->key);
 	fz_free(ctx, item);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 }
 
-static size_t
-ensure_space(fz_context *ctx, size_t tofree)
+static void
+touch(fz_store_shard *shard, fz_item *item)
 {
-	fz_item *item, *prev;
-	size_t count;
-	fz_store *store = ctx->store;
-	fz_item *to_be_freed = NULL;
+	if (item->next != item)
+	{
+		/* Already in the list - unlink it */
+		if (item->next)
+			item->next->prev = item->prev;
+		else
+			shard->tail = item->prev;
+		if (item->prev)
+			item->prev->next = item->next;
+		else
+			shard->head = item->next;
+	}
+	/* Now relink it at the start of the LRU chain */
+	item->next = shard->head;
+	if (item->next)
+		item->next->prev = item;
+	else
+		shard->tail = item;
+	shard->head = item;
+	item->prev = NULL;
+}
+
+/*
+	Consider if we have blocks of the following sizes in a shard, from oldest
+	to newest:
+
+	A 32
+	B 64
+	C 128
+	D 256
+
+	Further suppose we need to free 97 bytes. Naively freeing blocks until we have
+	freed enough would mean we'd free A, B and C, when we could have freed just C.
+
+	We are forced into an n^2 algorithm by the need to drop the lock as part of the
+	eviction, so we might as well embrace it and go for a solution that properly
+	drops just C.
+
+	The algorithm used is to scan the list of blocks from oldest to newest, counting
+	how many bytes we can free in the blocks we pass. We stop this scan when we have
+	found enough blocks. We then free the largest block. This releases the lock
+	momentarily, which means we have to start the scan process all over again, so
+	we repeat. This guarantees we only evict a minimum of blocks, but does mean we
+	scan more blocks than we'd ideally like.
 
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+	The shards take turns at giving up a block, so that all of them keep their
+	recently used blocks for about equally long.
+ */
+static size_t
+evict_largest(fz_context *ctx, fz_store_shard *shard, size_t tofree)
+{
+	size_t suffix_size = 0;
+	size_t freed = 0;
+	fz_item *item, *largest = NULL;
 
-	/* First check that we *can* free tofree; if not, we'd rather not
-	 * cache this. */
-	count = 0;
-	for (item = store->tail; item; item = item->prev)
+	fz_lock(ctx, shard->lock);
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	/* Count through a suffix of objects in the shard until
+	 * we find enough to give us what we need to evict. */
+	for (item = shard->tail; item; item = item->prev)
 	{
 		if (item->val->refs == 1)
 		{
-			count += item->size;
-			if (count >= tofree)
+			/* This one is evictable */
+			suffix_size += item->size;
+			if (largest == NULL || item->size > largest->size)
+				largest = item;
+			if (suffix_size >= tofree)
 				break;
 		}
 	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
-	/* If we ran out of items to search, then we can never free enough */
-	if (item == NULL)
+	/* Nobody can find (and keep) the block in the meantime,
+	 * as that requires the shard's lock. */
+	if (largest)
 	{
-		return 0;
+		freed = largest->size;
+		evict(ctx, shard, largest); /* Drops then retakes lock */
 	}
+	fz_unlock(ctx, shard->lock);
 
-	/* Now move all the items to be freed onto 'to_be_freed' */
-	count = 0;
-	for (item = store->tail; item; item = prev)
-	{
-		prev = item->prev;
-		if (item->val->refs != 1)
-			continue;
-
-		store->size -= item->size;
-
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
+	return freed;
+}
 
-		/* Link into to_be_freed */
-		item->next = to_be_freed;
-		to_be_freed = item;
+/*
+	Entered with no locks held.
 
-		count += item->size;
-		if (count >= tofree)
-			break;
-	}
+	Threads that run out of memory at the same time scavenge
+	concurrently (the shards are locked individually), so that none of
+	them fails just because another one is scavenging already. Only
+	recursive scavenging on the same context is prevented.
+*/
+static int
+scavenge(fz_context *ctx, size_t tofree)
+{
+	fz_store *store = ctx->store;
+	size_t freed = 0;
+	int idle = 0;
+	int victim;
 
-	/* Now we can safely drop the lock and free our pending items. These
-	 * have all been removed from both the store list, and the hash table,
-	 * so they can't be 'found' by anyone else in the meantime. */
+	if (ctx->scavenging)
+		return 0;
+	ctx->scavenging = 1;
 
-	while (to_be_freed)
+	/* Stop once none of the shards has anything left to evict */
+	while (freed < tofree && idle < STORE_SHARDS)
 	{
-		fz_item *item = to_be_freed;
-		int drop;
-
-		to_be_freed = to_be_freed->next;
-
-		/* Drop a reference to the value (freeing if required) */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		drop = (item->val->refs > 0 && --item->val->refs == 0);
+		size_t evicted;
 
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		victim = store->victim;
+		store->victim = (victim + 1) % STORE_SHARDS;
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		if (drop)
-			item->val->drop(ctx, item->val);
 
-		/* Always drops the key and drop the item */
-		item->type->drop_key(ctx, item->key);
-		fz_free(ctx, item);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
+		evicted = evict_largest(ctx, &store->shard[victim], tofree - freed);
+		if (evicted == 0)
+			idle++;
+		else
+		{
+			if (freed == 0) {
+				FZ_LOG_DUMP_STORE(ctx, "Before scavenge:\n");
+			}
+			idle = 0;
+			freed += evicted;
+		}
 	}
 
-	return count;
+	if (freed != 0) {
+		FZ_LOG_DUMP_STORE(ctx, "After scavenge:\n");
+	}
+	ctx->scavenging = 0;
+	/* Success is managing to evict any blocks */
+	return freed != 0;
 }
 
+/*
+	Entered with no locks held.
+	Evicts items until the store fits within its maximum size again
+	(or there's nothing left that could be evicted).
+*/
 static void
-touch(fz_store *store, fz_item *item)
+ensure_space(fz_context *ctx)
 {
-	if (item->next != item)
+	fz_store *store = ctx->store;
+	size_t tofree = 0;
+	int reap;
+
+	/* First, do any outstanding reaping, even if defer_reap_count > 0 */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	reap = store->needs_reaping;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (reap)
+		do_reap(ctx);
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (store->size > store->max)
 	{
-		/* Already in the list - unlink it */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+		tofree = store->size - store->max;
+		FZ_LOG_STORE(ctx, "Store size exceeded: size=%zu, max=%zu\n", store->size, store->max);
 	}
-	/* Now relink it at the start of the LRU chain */
-	item->next = store->head;
-	if (item->next)
-		item->next->prev = item;
-	else
-		store->tail = item;
-	store->head = item;
-	item->prev = NULL;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	/* If we fail to free enough space, we used to 'unstore'
+	 * the new item, but that's wrong.
+	 * If we've already spent the memory to malloc it
+	 * then not putting it in the store just means that
+	 * a resource used multiple times will just be malloced
+	 * again. Better to put it in the store, have the
+	 * store account for it, and for it to potentially be reused.
+	 * When the caller drops the reference to it, it can then
+	 * be dropped from the store on the next attempt to store
+	 * anything else. */
+	if (tofree == 0)
+		return;
+
+	scavenge(ctx, tofree);
+	FZ_LOG_DUMP_STORE(ctx, "After eviction:\n");
 }
 
 void *
 fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_store_type *type)
 {
 	fz_item *item = NULL;
-	size_t size;
 	fz_storable *val = (fz_storable *)val_;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
+	int oversized;
 
 	if (!store)
 		return NULL;
@@ -438,14 +574,14 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 		hash.drop = val->drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	shard = shard_for_key(store, &hash, use_hash, type);
 
 	type->keep_key(ctx, key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 
 	/* Fill out the item. To start with, we always set item->next == item
-	 * and item->prev == item. This is so that we can spot items that have
-	 * been put into the hash table without having made it into the linked
-	 * list yet. */
+	 * and item->prev == item. This is so that touch can spot items that
+	 * haven't made it into the linked list yet. */
 	item->key = key;
 	item->val = val;
 	item->size = itemsize;
@@ -462,13 +598,13 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 		fz_try(ctx)
 		{
 			/* May drop and retake the lock */
-			existing = fz_hash_insert(ctx, store->hash, &hash, item);
+			existing = fz_hash_insert(ctx, shard->hash, &hash, item);
 		}
 		fz_catch(ctx)
 		{
 			/* Any error here means that item never made it into the
 			 * hash - so no one else can have a reference. */
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			fz_unlock(ctx, shard->lock);
 			fz_free(ctx, item);
 			type->drop_key(ctx, key);
 			return NULL;
@@ -477,76 +613,43 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 		{
 			/* There was one there already! Take a new reference
 			 * to the existing one, and drop our current one. */
+			fz_storable *existing_val = existing->val;
 			fz_warn(ctx, "found duplicate %s in the store", type->name);
-			touch(store, existing);
-			if (existing->val->refs > 0)
+			touch(shard, existing);
+			fz_lock(ctx, FZ_LOCK_ALLOC);
+			if (existing_val->refs > 0)
 			{
-				(void)Memento_takeRef(existing->val);
-				existing->val->refs++;
+				(void)Memento_takeRef(existing_val);
+				existing_val->refs++;
 			}
 			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			fz_unlock(ctx, shard->lock);
 			fz_free(ctx, item);
 			type->drop_key(ctx, key);
-			return existing->val;
+			return existing_val;
 		}
 	}
 
 	/* Now bump the ref */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
 	if (val->refs > 0)
 	{
 		(void)Memento_takeRef(val);
 		val->refs++;
 	}
-
-	/* If we haven't got an infinite store, check for space within it */
-	if (store->max != FZ_STORE_UNLIMITED)
-	{
-		/* FIXME: Overflow? */
-		size = store->size + itemsize;
-		if (size > store->max)
-		{
-			FZ_LOG_STORE(ctx, "Store size exceeded: item=%zu, size=%zu, max=%zu\n",
-				itemsize, store->size, store->max);
-			while (size > store->max)
-			{
-				size_t saved;
-
-				/* First, do any outstanding reaping, even if defer_reap_count > 0 */
-				if (store->needs_reaping)
-				{
-					do_reap(ctx); /* Drops alloc lock */
-					fz_lock(ctx, FZ_LOCK_ALLOC);
-				}
-				size = store->size + itemsize;
-				if (size <= store->max)
-					break;
-
-				/* ensure_space may drop, then retake the lock */
-				saved = ensure_space(ctx, size - store->max);
-				size -= saved;
-				if (saved == 0)
-				{
-					/* Failed to free any space. */
-					/* We used to 'unstore' it here, but that's wrong.
-					 * If we've already spent the memory to malloc it
-					 * then not putting it in the store just means that
-					 * a resource used multiple times will just be malloced
-					 * again. Better to put it in the store, have the
-					 * store account for it, and for it to potentially be reused.
-					 * When the caller drops the reference to it, it can then
-					 * be dropped from the store on the next attempt to store
-					 * anything else. */
-					break;
-				}
-			}
-			FZ_LOG_DUMP_STORE(ctx, "After eviction:\n");
-		}
-	}
+	/* FIXME: Overflow? */
 	store->size += itemsize;
+	oversized = store->max != FZ_STORE_UNLIMITED && store->size > store->max;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	shard->size += itemsize;
 
 	/* Regardless of whether it's indexed, it goes into the linked list */
-	touch(store, item);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	touch(shard, item);
+	fz_unlock(ctx, shard->lock);
+
+	/* If we haven't got an infinite store, check for space within it */
+	if (oversized)
+		ensure_space(ctx);
 
 	return NULL;
 }
@@ -555,7 +658,9 @@ void *
 fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_type *type)
 {
 	fz_item *item;
+	fz_storable *val;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
 
@@ -570,17 +675,18 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	shard = shard_for_key(store, &hash, use_hash, type);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirected objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, shard->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = shard->head; item; item = item->next)
 		{
 			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
@@ -588,21 +694,21 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_
 	}
 	if (item)
 	{
-		/* LRU the block. This also serves to ensure that any item
-		 * picked up from the hash before it has made it into the
-		 * linked list does not get whipped out again due to the
-		 * store being full. */
-		touch(store, item);
+		/* LRU the block. */
+		touch(shard, item);
 		/* And bump the refcount before returning */
-		if (item->val->refs > 0)
+		val = item->val;
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		if (val->refs > 0)
 		{
-			(void)Memento_takeRef(item->val);
-			item->val->refs++;
+			(void)Memento_takeRef(val);
+			val->refs++;
 		}
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		return (void *)item->val;
+		fz_unlock(ctx, shard->lock);
+		return (void *)val;
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_unlock(ctx, shard->lock);
 
 	return NULL;
 }
@@ -612,6 +718,7 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_stor
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	int dodrop;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
@@ -621,64 +728,54 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_stor
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	shard = shard_for_key(store, &hash, use_hash, type);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirect objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
-		if (item)
-			fz_hash_remove(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, shard->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = shard->head; item; item = item->next)
 			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
 	}
 	if (item)
 	{
-		/* Momentarily things can be in the hash table without being
-		 * in the list. Don't attempt to unlink these. We indicate
-		 * such items by setting item->next == item. */
-		if (item->next != item)
-		{
-			if (item->next)
-				item->next->prev = item->prev;
-			else
-				store->tail = item->prev;
-			if (item->prev)
-				item->prev->next = item->next;
-			else
-				store->head = item->next;
-		}
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		dodrop = (item->val->refs > 0 && --item->val->refs == 0);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		dodrop = unlink_item(ctx, shard, item);
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, shard->lock);
 		if (dodrop)
 			item->val->drop(ctx, item->val);
 		type->drop_key(ctx, item->key);
 		fz_free(ctx, item);
 	}
 	else
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, shard->lock);
 }
 
 void
 fz_empty_store(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
+	int i;
 
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 	/* Run through all the items in the store */
-	while (store->head)
-		evict(ctx, store->head); /* Drops then retakes lock */
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; i < STORE_SHARDS; i++)
+	{
+		fz_store_shard *shard = &store->shard[i];
+		fz_lock(ctx, shard->lock);
+		while (shard->head)
+			evict(ctx, shard, shard->head); /* Drops then retakes lock */
+		fz_unlock(ctx, shard->lock);
+	}
 }
 
 fz_store *
@@ -692,154 +789,107 @@ fz_keep_store_context(fz_context *ctx)
 void
 fz_drop_store_context(fz_context *ctx)
 {
+	int i;
+
 	if (!ctx)
 		return;
 	if (fz_drop_imp(ctx, ctx->store, &ctx->store->refs))
 	{
 		fz_empty_store(ctx);
-		fz_drop_hash_table(ctx, ctx->store->hash);
+		for (i = 0; i < STORE_SHARDS; i++)
+			fz_drop_hash_table(ctx, ctx->store->shard[i].hash);
 		fz_free(ctx, ctx->store);
 		ctx->store = NULL;
 	}
 }
 
+typedef struct
+{
+	fz_output *out;
+	int lock;
+} fz_debug_store_state;
+
 static void
-fz_debug_store_item(fz_context *ctx, void *state, void *key_, int keylen, void *item_)
+fz_debug_store_item(fz_context *ctx, void *state_, void *key_, int keylen, void *item_)
 {
 	unsigned char *key = key_;
 	fz_item *item = item_;
 	int i;
 	char buf[256];
-	fz_output *out = (fz_output *)state;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_debug_store_state *state = (fz_debug_store_state *)state_;
+	fz_unlock(ctx, state->lock);
 	item->type->format_key(ctx, buf, sizeof buf, item->key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	fz_write_printf(ctx, out, "STORE\thash[");
+	fz_lock(ctx, state->lock);
+	fz_write_printf(ctx, state->out, "STORE\thash[");
 	for (i=0; i < keylen; ++i)
-		fz_write_printf(ctx, out,"%02x", key[i]);
-	fz_write_printf(ctx, out, "][refs=%d][size=%d] key=%s val=%p\n", item->val->refs, (int)item->size, buf, (void *)item->val);
+		fz_write_printf(ctx, state->out,"%02x", key[i]);
+	fz_write_printf(ctx, state->out, "][refs=%d][size=%d] key=%s val=%p\n", item->val->refs, (int)item->size, buf, (void *)item->val);
 }
 
-static void
-fz_debug_store_locked(fz_context *ctx, fz_output *out)
+/*
+	Entered with the shard's lock held.
+*/
+static size_t
+fz_debug_store_shard(fz_context *ctx, fz_output *out, fz_store_shard *shard)
 {
 	fz_item *item, *next;
 	char buf[256];
-	fz_store *store = ctx->store;
 	size_t list_total = 0;
+	fz_debug_store_state state;
 
-	fz_write_printf(ctx, out, "STORE\t-- resource store contents --\n");
-
-	for (item = store->head; item; item = next)
+	for (item = shard->head; item; item = next)
 	{
 		next = item->next;
 		if (next)
 		{
+			fz_lock(ctx, FZ_LOCK_ALLOC);
 			(void)Memento_takeRef(next->val);
 			next->val->refs++;
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
 		}
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, shard->lock);
 		item->type->format_key(ctx, buf, sizeof buf, item->key);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
+		fz_lock(ctx, shard->lock);
 		fz_write_printf(ctx, out, "STORE\tstore[*][refs=%d][size=%d] key=%s val=%p\n",
 				item->val->refs, (int)item->size, buf, (void *)item->val);
 		list_total += item->size;
 		if (next)
 		{
+			fz_lock(ctx, FZ_LOCK_ALLOC);
 			(void)Memento_dropRef(next->val);
 			next->val->refs--;
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
 		}
 	}
 
 	fz_write_printf(ctx, out, "STORE\t-- resource store hash contents --\n");
-	fz_hash_for_each(ctx, store->hash, out, fz_debug_store_item);
-	fz_write_printf(ctx, out, "STORE\t-- end --\n");
+	state.out = out;
+	state.lock = shard->lock;
+	fz_hash_for_each(ctx, shard->hash, &state, fz_debug_store_item);
 
-	fz_write_printf(ctx, out, "STORE\tmax=%zu, size=%zu, actual size=%zu\n", store->max, store->size, list_total);
+	return list_total;
 }
 
 void
 fz_debug_store(fz_context *ctx, fz_output *out)
-{
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	fz_debug_store_locked(ctx, out);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-}
-
-/*
-	Consider if we have blocks of the following sizes in the store, from oldest
-	to newest:
-
-	A 32
-	B 64
-	C 128
-	D 256
-
-	Further suppose we need to free 97 bytes. Naively freeing blocks until we have
-	freed enough would mean we'd free A, B and C, when we could have freed just C.
-
-	We are forced into an n^2 algorithm by the need to drop the lock as part of the
-	eviction, so we might as well embrace it and go for a solution that properly
-	drops just C.
-
-	The algorithm used is to scan the list of blocks from oldest to newest, counting
-	how many bytes we can free in the blocks we pass. We stop this scan when we have
-	found enough blocks. We then free the largest block. This releases the lock
-	momentarily, which means we have to start the scan process all over again, so
-	we repeat. This guarantees we only evict a minimum of blocks, but does mean we
-	scan more blocks than we'd ideally like.
- */
-static int
-scavenge(fz_context *ctx, size_t tofree)
 {
 	fz_store *store = ctx->store;
-	size_t freed = 0;
-	fz_item *item;
-
-	if (store->scavenging)
-		return 0;
-
-	store->scavenging = 1;
+	size_t list_total = 0;
+	int i;
 
-	do
+	for (i = 0; i < STORE_SHARDS; i++)
 	{
-		/* Count through a suffix of objects in the store until
-		 * we find enough to give us what we need to evict. */
-		size_t suffix_size = 0;
-		fz_item *largest = NULL;
-
-		for (item = store->tail; item; item = item->prev)
-		{
-			if (item->val->refs == 1)
-			{
-				/* This one is evictable */
-				suffix_size += item->size;
-				if (largest == NULL || item->size > largest->size)
-					largest = item;
-				if (suffix_size >= tofree - freed)
-					break;
-			}
-		}
-
-		/* If there are no evictable blocks, we can't find anything to free. */
-		if (largest == NULL)
-			break;
-
-		/* Free largest. */
-		if (freed == 0) {
-			FZ_LOG_DUMP_STORE(ctx, "Before scavenge:\n");
-		}
-		freed += largest->size;
-		evict(ctx, largest); /* Drops then retakes lock */
+		fz_store_shard *shard = &store->shard[i];
+		fz_lock(ctx, shard->lock);
+		fz_write_printf(ctx, out, "STORE\t-- resource store contents (shard %d) --\n", i);
+		list_total += fz_debug_store_shard(ctx, out, shard);
+		fz_unlock(ctx, shard->lock);
 	}
-	while (freed < tofree);
+	fz_write_printf(ctx, out, "STORE\t-- end --\n");
 
-	if (freed != 0) {
-		FZ_LOG_DUMP_STORE(ctx, "After scavenge:\n");
-	}
-	store->scavenging = 0;
-	/* Success is managing to evict any blocks */
-	return freed != 0;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_write_printf(ctx, out, "STORE\tmax=%zu, size=%zu, actual size=%zu\n", store->max, store->size, list_total);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
 void
@@ -848,6 +898,7 @@ fz_drop_storable(fz_context *ctx, const fz_storable *sc)
 	/* Explicitly drop const to allow us to use const
 	 * sanely throughout the code. */
 	fz_storable *s = (fz_storable *)sc;
+	size_t tofree = 0;
 	int num;
 
 	if (s == NULL)
@@ -871,9 +922,12 @@ fz_drop_storable(fz_context *ctx, const fz_storable *sc)
 	 * size. Run a scavenge to check for this case. */
 	if (ctx->store->max != FZ_STORE_UNLIMITED)
 		if (num == 1 && ctx->store->size > ctx->store->max)
-			scavenge(ctx, ctx->store->size - ctx->store->max);
+			tofree = ctx->store->size - ctx->store->max;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
+	if (tofree > 0)
+		scavenge(ctx, tofree);
+
 	/* If we have no references to an object left, then
 	 * it cannot possibly be in the store (as the store always
 	 * keeps a ref to everything in it, and doesn't drop via
@@ -886,19 +940,13 @@ fz_drop_storable(fz_context *ctx, const fz_storable *sc)
 
 int fz_store_scavenge_external(fz_context *ctx, size_t size, int *phase)
 {
-	int ret;
-
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	ret = fz_store_scavenge(ctx, size, phase);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-
-	return ret;
+	return fz_store_scavenge(ctx, size, phase);
 }
 
 int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 {
 	fz_store *store;
-	size_t max;
+	size_t max, store_size;
 
 	store = ctx->store;
 	if (store == NULL)
@@ -906,29 +954,33 @@ int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 
 #ifdef DEBUG_SCAVENGING
 	fz_write_printf(ctx, fz_stdout(ctx), "Scavenging: store=%zu size=%zu phase=%d\n", store->size, size, *phase);
-	fz_debug_store_locked(ctx, fz_stdout(ctx));
+	fz_debug_store(ctx, fz_stdout(ctx));
 	Memento_stats();
 #endif
 	do
 	{
 		size_t tofree;
 
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		store_size = store->size;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+
 		/* Calculate 'max' as the maximum size of the store for this phase */
 		if (*phase >= 16)
 			max = 0;
 		else if (store->max != FZ_STORE_UNLIMITED)
 			max = store->max / 16 * (16 - *phase);
 		else
-			max = store->size / (16 - *phase) * (15 - *phase);
+			max = store_size / (16 - *phase) * (15 - *phase);
 		(*phase)++;
 
 		/* Slightly baroque calculations to avoid overflow */
-		if (size > SIZE_MAX - store->size)
+		if (size > SIZE_MAX - store_size)
 			tofree = SIZE_MAX - max;
-		else if (size + store->size > max)
+		else if (size + store_size > max)
 			continue;
 		else
-			tofree = size + store->size - max;
+			tofree = size + store_size - max;
 
 		if (scavenge(ctx, tofree))
 		{
@@ -955,7 +1007,7 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 {
 	int success;
 	fz_store *store;
-	size_t new_size;
+	size_t new_size, store_size;
 
 	if (percent >= 100)
 		return 1;
@@ -968,11 +1020,14 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 	fz_write_printf(ctx, fz_stdout(ctx), "fz_shrink_store: %zu\n", store->size/(1024*1024));
 #endif
 	fz_lock(ctx, FZ_LOCK_ALLOC);
+	store_size = store->size;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
-	new_size = (size_t)(((uint64_t)store->size * percent) / 100);
-	if (store->size > new_size)
-		scavenge(ctx, store->size - new_size);
+	new_size = (size_t)(((uint64_t)store_size * percent) / 100);
+	if (store_size > new_size)
+		scavenge(ctx, store_size - new_size);
 
+	fz_lock(ctx, FZ_LOCK_ALLOC);
 	success = (store->size <= new_size) ? 1 : 0;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 #ifdef DEBUG_SCAVENGING
@@ -982,74 +1037,31 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 	return success;
 }
 
-void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const fz_store_type *type)
+typedef struct
 {
-	fz_store *store;
-	fz_item *item, *prev, *remove;
-
-	store = ctx->store;
-	if (store == NULL)
-		return;
-
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-
-	/* Filter the items */
-	remove = NULL;
-	for (item = store->tail; item; item = prev)
-	{
-		prev = item->prev;
-		if (item->type != type)
-			continue;
-
-		if (fn(ctx, arg, item->key) == 0)
-			continue;
-
-		/* We have to drop it */
-		store->size -= item->size;
-
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
-
-		/* Store whether to drop this value or not in 'prev' */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		item->prev = (item->val->refs > 0 && --item->val->refs == 0) ? item : NULL;
+	fz_store_filter_fn *fn;
+	void *arg;
+	const fz_store_type *type;
+} fz_filter_store_state;
 
-		/* Store it in our removal chain - just singly linked */
-		item->next = remove;
-		remove = item;
-	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+static int
+item_matches_filter(fz_context *ctx, void *arg, fz_item *item)
+{
+	fz_filter_store_state *state = (fz_filter_store_state *)arg;
+	return item->type == state->type && state->fn(ctx, state->arg, item->key) != 0;
+}
 
-	/* Now drop the remove chain */
-	for (item = remove; item != NULL; item = remove)
-	{
-		remove = item->next;
+void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const fz_store_type *type)
+{
+	fz_filter_store_state state;
 
-		/* Drop a reference to the value (freeing if required) */
-		if (item->prev) /* See above for our abuse of prev here */
-			item->val->drop(ctx, item->val);
+	if (ctx->store == NULL)
+		return;
 
-		/* Always drops the key and drop the item */
-		item->type->drop_key(ctx, item->key);
-		fz_free(ctx, item);
-	}
+	state.fn = fn;
+	state.arg = arg;
+	state.type = type;
+	remove_matching(ctx, item_matches_filter, &state);
 }
 
 void fz_defer_reap_start(fz_context *ctx)
@@ -1072,10 +1084,9 @@ void fz_defer_reap_end(fz_context *ctx)
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 	--ctx->store->defer_reap_count;
 	reap = ctx->store->defer_reap_count == 0 && ctx->store->needs_reaping;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	if (reap)
-		do_reap(ctx); /* Drops FZ_LOCK_ALLOC */
-	else
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		do_reap(ctx);
 }
 
 #ifdef ENABLE_STORE_LOGGING
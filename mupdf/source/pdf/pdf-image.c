@@ -217,6 +217,99 @@ pdf_is_jpx_image(fz_context *ctx, pdf_obj *dict)
 	return 0;
 }
 
+/* Largest amount of subsampling to ask for when probing a JPX image. */
+#define JPX_PROBE_L2FACTOR 6
+
+/* A JPX image which is only decoded when needed and then only at the
+ * resolution it is drawn at (scanned pages with big JPX images are much
+ * faster to show at low zoom levels). */
+typedef struct
+{
+	fz_image super;
+	fz_buffer *buffer;
+	fz_colorspace *defcs;
+	int use_decode;
+	float decode[FZ_MAX_COLORS * 2];
+} pdf_jpx_image;
+
+static fz_pixmap *
+pdf_jpx_image_get_pixmap(fz_context *ctx, fz_image *image_, fz_irect *subarea, int w, int h, int *l2factor)
+{
+	pdf_jpx_image *image = (pdf_jpx_image *)image_;
+	fz_pixmap *pix;
+	unsigned char *data;
+	size_t len;
+
+	len = fz_buffer_storage(ctx, image->buffer, &data);
+	pix = fz_load_jpx_subsampled(ctx, data, len, image->defcs, l2factor);
+
+	if (image->use_decode)
+	{
+		fz_try(ctx)
+			fz_decode_tile(ctx, pix, image->decode);
+		fz_catch(ctx)
+		{
+			fz_drop_pixmap(ctx, pix);
+			fz_rethrow(ctx);
+		}
+	}
+
+	/* we always decode the whole image */
+	if (subarea)
+	{
+		subarea->x0 = 0;
+		subarea->y0 = 0;
+		subarea->x1 = image->super.w;
+		subarea->y1 = image->super.h;
+	}
+
+	return pix;
+}
+
+static size_t
+pdf_jpx_image_get_size(fz_context *ctx, fz_image *image_)
+{
+	pdf_jpx_image *image = (pdf_jpx_image *)image_;
+
+	if (image == NULL)
+		return 0;
+
+	return sizeof(pdf_jpx_image) + (image->buffer ? image->buffer->cap : 0);
+}
+
+static void
+pdf_drop_jpx_image(fz_context *ctx, fz_image *image_)
+{
+	pdf_jpx_image *image = (pdf_jpx_image *)image_;
+
+	fz_drop_buffer(ctx, image->buffer);
+	fz_drop_colorspace(ctx, image->defcs);
+}
+
+static fz_image *
+pdf_new_jpx_image(fz_context *ctx, int w, int h, fz_pixmap *probe, fz_colorspace *defcs, fz_buffer *buf, pdf_obj *decode, fz_image *mask)
+{
+	pdf_jpx_image *image;
+	int i;
+
+	image = fz_new_derived_image(ctx, w, h, 8, probe->colorspace,
+				probe->xres, probe->yres, 0, 0,
+				NULL, NULL, mask, pdf_jpx_image,
+				pdf_jpx_image_get_pixmap,
+				pdf_jpx_image_get_size,
+				pdf_drop_jpx_image);
+	image->buffer = fz_keep_buffer(ctx, buf);
+	image->defcs = fz_keep_colorspace(ctx, defcs);
+	if (decode)
+	{
+		image->use_decode = 1;
+		for (i = 0; i < FZ_MAX_COLORS * 2; i++)
+			image->decode[i] = pdf_array_get_real(ctx, decode, i);
+	}
+
+	return &image->super;
+}
+
 static fz_image *
 pdf_load_jpx(fz_context *ctx, pdf_document *doc, pdf_obj *dict, int forcemask)
 {
@@ -226,6 +319,8 @@ pdf_load_jpx(fz_context *ctx, pdf_document *doc, pdf_obj *dict, int forcemask)
 	pdf_obj *obj;
 	fz_image *mask = NULL;
 	fz_image *img = NULL;
+	int l2factor, reduce;
+	int w, h, lazy;
 
 	fz_var(pix);
 	fz_var(buf);
@@ -245,7 +340,25 @@ pdf_load_jpx(fz_context *ctx, pdf_document *doc, pdf_obj *dict, int forcemask)
 			colorspace = pdf_load_colorspace(ctx, obj);
 
 		len = fz_buffer_storage(ctx, buf, &data);
-		pix = fz_load_jpx(ctx, data, len, colorspace);
+
+		/* Decoding only the lowest resolution level is cheap and tells us
+		 * all we need to know about the image. If that isn't the full image,
+		 * the rest is decoded lazily (masks need the full tile right away). */
+		reduce = forcemask ? 0 : JPX_PROBE_L2FACTOR;
+		l2factor = reduce;
+		pix = fz_load_jpx_subsampled(ctx, data, len, colorspace, &l2factor);
+		reduce -= l2factor;
+		w = pdf_to_int(ctx, pdf_dict_geta(ctx, dict, PDF_NAME(Width), PDF_NAME(W)));
+		h = pdf_to_int(ctx, pdf_dict_geta(ctx, dict, PDF_NAME(Height), PDF_NAME(H)));
+		lazy = reduce > 0 && w > 0 && h > 0 && w < (1 << 24) && h < (1 << 24) &&
+			((w + (1 << reduce) - 1) >> reduce) == pix->w &&
+			((h + (1 << reduce) - 1) >> reduce) == pix->h;
+		if (reduce > 0 && !lazy)
+		{
+			fz_drop_pixmap(ctx, pix);
+			pix = NULL;
+			pix = fz_load_jpx(ctx, data, len, colorspace);
+		}
 
 		obj = pdf_dict_geta(ctx, dict, PDF_NAME(SMask), PDF_NAME(Mask));
 		if (pdf_is_dict(ctx, obj))
@@ -257,7 +370,13 @@ pdf_load_jpx(fz_context *ctx, pdf_document *doc, pdf_obj *dict, int forcemask)
 		}
 
 		obj = pdf_dict_geta(ctx, dict, PDF_NAME(Decode), PDF_NAME(D));
-		if (obj && !fz_colorspace_is_indexed(ctx, colorspace))
+		if (lazy)
+		{
+			if (fz_colorspace_is_indexed(ctx, colorspace))
+				obj = NULL;
+			img = pdf_new_jpx_image(ctx, w, h, pix, colorspace, buf, obj, mask);
+		}
+		else if (obj && !fz_colorspace_is_indexed(ctx, colorspace))
 		{
 			float decode[FZ_MAX_COLORS * 2];
 			int i;
@@ -268,7 +387,8 @@ pdf_load_jpx(fz_context *ctx, pdf_document *doc, pdf_obj *dict, int forcemask)
 			fz_decode_tile(ctx, pix, decode);
 		}
 
-		img = fz_new_image_from_pixmap(ctx, pix, mask);
+		if (!img)
+			img = fz_new_image_from_pixmap(ctx, pix, mask);
 	}
 	fz_always(ctx)
 	{
@@ -328,9 +328,15 @@ pdf_repair_xref(fz_context *ctx, pdf_document *doc)
 
 	pdf_discard_journal(ctx, doc->journal);
 
-	if (doc->repair_attempted)
+	if (doc->repair_attempted && !doc->xref_from_index)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Repair failed already - not trying again");
 	doc->repair_attempted = 1;
+	if (doc->xref_from_index)
+	{
+		/* the document index doesn't match the file after all */
+		doc->xref_from_index = 0;
+		pdf_drop_page_tree(ctx, doc);
+	}
 
 	doc->dirty = 1;
 
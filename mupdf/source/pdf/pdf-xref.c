@@ -1557,13 +1557,253 @@ pdf_load_linear(fz_context *ctx, pdf_document *doc)
 	}
 }
 
+/*
+ * Document index: the page tree and a repaired xref table, so that
+ * reopening a huge or damaged file doesn't have to recover them again.
+ *
+ * All integers are little endian:
+ *	magic, version, file size
+ *	page count, followed by (page, object) pairs sorted by object
+ *	xref length (0 if the xref didn't have to be repaired), followed by
+ *		(type, gen, num, ofs, stm_ofs) entries,
+ *		the length and text of the trailer dictionary and
+ *		the count of (object, length) pairs of corrected stream lengths
+ */
+
+#define PDF_INDEX_MAGIC 0x58444950 /* PIDX */
+#define PDF_INDEX_VERSION 1
+
+typedef struct
+{
+	const unsigned char *p;
+	const unsigned char *end;
+} pdf_index_reader;
+
+static int64_t
+pdf_read_index_int(fz_context *ctx, pdf_index_reader *r, int n)
+{
+	uint64_t v = 0;
+	int i;
+
+	if (r->end - r->p < n)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "truncated document index");
+	for (i = 0; i < n; i++)
+		v |= (uint64_t)r->p[i] << (8 * i);
+	r->p += n;
+	/* sign extend */
+	if (n < 8 && ((v >> (8 * n - 1)) & 1))
+		v |= ~(uint64_t)0 << (8 * n);
+	return (int64_t)v;
+}
+
+static const unsigned char *
+pdf_skip_index_bytes(fz_context *ctx, pdf_index_reader *r, int64_t n)
+{
+	const unsigned char *p = r->p;
+	if (n < 0 || r->end - r->p < n)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "truncated document index");
+	r->p += n;
+	return p;
+}
+
+/* Check that the index is for a file of this size and skip its header. */
+static int64_t
+pdf_open_index(fz_context *ctx, pdf_document *doc, fz_buffer *index, pdf_index_reader *r)
+{
+	int64_t file_size;
+
+	r->p = index->data;
+	r->end = index->data + index->len;
+	if (pdf_read_index_int(ctx, r, 4) != PDF_INDEX_MAGIC || pdf_read_index_int(ctx, r, 4) != PDF_INDEX_VERSION)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unknown document index format");
+
+	fz_seek(ctx, doc->file, 0, SEEK_END);
+	file_size = fz_tell(ctx, doc->file);
+	if (pdf_read_index_int(ctx, r, 8) != file_size)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "document index is for a different file");
+	return file_size;
+}
+
+/*
+ * Restore the xref table as pdf_repair_xref and pdf_repair_obj_stms left it.
+ * Returns 0 (with nothing loaded) if the index has no xref table or can't
+ * be used.
+ */
+static int
+pdf_load_xref_from_index(fz_context *ctx, pdf_document *doc, fz_buffer *index)
+{
+	pdf_index_reader r;
+	pdf_xref_entry *entry;
+	pdf_obj *trailer = NULL;
+	pdf_obj *dict;
+	fz_stream *stm = NULL;
+	const unsigned char *data;
+	int64_t file_size, n;
+	int i, num, len, xref_len = 0;
+
+	fz_var(trailer);
+	fz_var(stm);
+	fz_var(xref_len);
+
+	fz_try(ctx)
+	{
+		file_size = pdf_open_index(ctx, doc, index, &r);
+		n = pdf_read_index_int(ctx, &r, 4);
+		pdf_skip_index_bytes(ctx, &r, n * 8);
+		xref_len = (int)pdf_read_index_int(ctx, &r, 4);
+		if (xref_len < 0 || xref_len > PDF_MAX_OBJECT_NUMBER + 1)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "invalid xref length in document index");
+
+		if (xref_len > 0)
+		{
+			/* as pdf_repair_xref does, so that correcting stream
+			 * lengths below doesn't count as an edit */
+			doc->repair_attempted = 1;
+			doc->xref_from_index = 1;
+			doc->dirty = 1;
+			doc->file_size = file_size;
+
+			/* allocate the whole table at once */
+			pdf_get_populating_xref_entry(ctx, doc, xref_len - 1);
+			for (i = 0; i < xref_len; i++)
+			{
+				entry = pdf_get_populating_xref_entry(ctx, doc, i);
+				entry->type = (char)pdf_read_index_int(ctx, &r, 1);
+				entry->gen = (unsigned short)pdf_read_index_int(ctx, &r, 2);
+				entry->num = (int)pdf_read_index_int(ctx, &r, 4);
+				entry->ofs = pdf_read_index_int(ctx, &r, 8);
+				entry->stm_ofs = pdf_read_index_int(ctx, &r, 8);
+				if (entry->type != 0 && entry->type != 'f' && entry->type != 'n' && entry->type != 'o')
+					fz_throw(ctx, FZ_ERROR_GENERIC, "invalid xref entry in document index (%d 0 R)", i);
+				if (entry->type == 'n' && (entry->ofs <= 0 || entry->ofs >= file_size || entry->stm_ofs < 0 || entry->stm_ofs >= file_size))
+					fz_throw(ctx, FZ_ERROR_GENERIC, "object offset out of range in document index (%d 0 R)", i);
+				if (entry->type == 'o' && (entry->ofs <= 0 || entry->ofs >= xref_len))
+					fz_throw(ctx, FZ_ERROR_GENERIC, "invalid objstm reference in document index (%d 0 R)", i);
+			}
+
+			len = (int)pdf_read_index_int(ctx, &r, 4);
+			data = pdf_skip_index_bytes(ctx, &r, len);
+			stm = fz_open_memory(ctx, data, len);
+			trailer = pdf_parse_stm_obj(ctx, doc, stm, &doc->lexbuf.base);
+			if (!pdf_is_dict(ctx, trailer))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid trailer in document index");
+			pdf_set_populating_xref_trailer(ctx, doc, trailer);
+			pdf_prime_xref_index(ctx, doc);
+
+			n = pdf_read_index_int(ctx, &r, 4);
+			for (i = 0; i < n; i++)
+			{
+				num = (int)pdf_read_index_int(ctx, &r, 4);
+				len = (int)pdf_read_index_int(ctx, &r, 4);
+				if (num <= 0 || num >= xref_len || pdf_get_populating_xref_entry(ctx, doc, num)->type != 'n')
+					fz_throw(ctx, FZ_ERROR_GENERIC, "invalid stream length in document index (%d 0 R)", num);
+				dict = pdf_load_object(ctx, doc, num);
+				fz_try(ctx)
+					pdf_dict_put_int(ctx, dict, PDF_NAME(Length), len);
+				fz_always(ctx)
+					pdf_drop_obj(ctx, dict);
+				fz_catch(ctx)
+					fz_rethrow(ctx);
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, stm);
+		pdf_drop_obj(ctx, trailer);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "ignoring document index: %s", fz_caught_message(ctx));
+		pdf_drop_xref_sections(ctx, doc);
+		if (doc->xref_index)
+			memset(doc->xref_index, 0, sizeof(int) * doc->max_xref_len);
+		doc->repair_attempted = 0;
+		doc->xref_from_index = 0;
+		doc->dirty = 0;
+		xref_len = 0;
+	}
+
+	return xref_len > 0;
+}
+
+static void
+pdf_load_page_tree_from_index(fz_context *ctx, pdf_document *doc, fz_buffer *index)
+{
+	pdf_index_reader r;
+	pdf_rev_page_map *map;
+	unsigned char *seen = NULL;
+	int i, n, xref_len;
+
+	if (doc->rev_page_map)
+		return;
+
+	pdf_open_index(ctx, doc, index, &r);
+	n = (int)pdf_read_index_int(ctx, &r, 4);
+	if (n == 0)
+		return;
+	if (n < 0 || n != pdf_count_pages(ctx, doc))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "page count doesn't match document index");
+
+	xref_len = pdf_xref_len(ctx, doc);
+	map = fz_malloc_array(ctx, n, pdf_rev_page_map);
+	fz_var(seen);
+	fz_try(ctx)
+	{
+		seen = fz_calloc(ctx, n, 1);
+		for (i = 0; i < n; i++)
+		{
+			map[i].page = (int)pdf_read_index_int(ctx, &r, 4);
+			map[i].object = (int)pdf_read_index_int(ctx, &r, 4);
+			if (map[i].page < 0 || map[i].page >= n || seen[map[i].page] ||
+				map[i].object <= 0 || map[i].object >= xref_len ||
+				(i > 0 && map[i].object < map[i-1].object))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "invalid page tree in document index");
+			seen[map[i].page] = 1;
+		}
+	}
+	fz_always(ctx)
+		fz_free(ctx, seen);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, map);
+		fz_rethrow(ctx);
+	}
+
+	doc->rev_page_map = map;
+	doc->rev_page_count = n;
+}
+
+static void
+pdf_append_index_int64(fz_context *ctx, fz_buffer *buf, int64_t x)
+{
+	fz_append_int32_le(ctx, buf, (int)(x & 0xffffffff));
+	fz_append_int32_le(ctx, buf, (int)(x >> 32));
+}
+
+/* Stream lengths that pdf_repair_xref corrected in the cached objects. */
+static int
+pdf_index_stream_length(fz_context *ctx, pdf_document *doc, pdf_xref_entry *entry, int *len)
+{
+	pdf_obj *obj;
+
+	/* pdf_repair_xref doesn't correct lengths in encrypted files */
+	if (doc->crypt || entry->type != 'n' || !entry->stm_ofs || !entry->obj)
+		return 0;
+	obj = pdf_dict_get(ctx, entry->obj, PDF_NAME(Length));
+	if (pdf_is_indirect(ctx, obj) || !pdf_is_int(ctx, obj))
+		return 0;
+	*len = pdf_to_int(ctx, obj);
+	return 1;
+}
+
 /*
  * Initialize and load xref tables.
  * If password is not null, try to decrypt.
  */
 
 static void
-pdf_init_document(fz_context *ctx, pdf_document *doc)
+pdf_init_document(fz_context *ctx, pdf_document *doc, fz_buffer *index)
 {
 	pdf_obj *encrypt, *id;
 	pdf_obj *dict = NULL;
@@ -1603,7 +1843,10 @@ pdf_init_document(fz_context *ctx, pdf_document *doc)
 		 * and has set us back to non-progressive mode), load normally.
 		 */
 		if (!doc->file_reading_linearly)
-			pdf_load_xref(ctx, doc);
+		{
+			if (!index || !pdf_load_xref_from_index(ctx, doc, index))
+				pdf_load_xref(ctx, doc);
+		}
 	}
 	fz_catch(ctx)
 	{
@@ -2233,7 +2476,7 @@ object_updated:
 			x->num = 0;
 			x->stm_ofs = 0;
 			x->obj = NULL;
-			try_repair = (doc->repair_attempted == 0);
+			try_repair = (doc->repair_attempted == 0 || doc->xref_from_index);
 		}
 
 		if (try_repair)
@@ -2665,11 +2908,17 @@ pdf_new_document(fz_context *ctx, fz_stream *file)
 
 pdf_document *
 pdf_open_document_with_stream(fz_context *ctx, fz_stream *file)
+{
+	return pdf_open_document_with_index(ctx, file, NULL);
+}
+
+pdf_document *
+pdf_open_document_with_index(fz_context *ctx, fz_stream *file, fz_buffer *index)
 {
 	pdf_document *doc = pdf_new_document(ctx, file);
 	fz_try(ctx)
 	{
-		pdf_init_document(ctx, doc);
+		pdf_init_document(ctx, doc, index);
 	}
 	fz_catch(ctx)
 	{
@@ -2680,9 +2929,97 @@ pdf_open_document_with_stream(fz_context *ctx, fz_stream *file)
 		fz_drop_document(ctx, &doc->super);
 		fz_throw(ctx, caught, "%s", message);
 	}
+
+	if (index)
+	{
+		fz_try(ctx)
+			pdf_load_page_tree_from_index(ctx, doc, index);
+		fz_catch(ctx)
+			fz_warn(ctx, "ignoring page tree from document index: %s", fz_caught_message(ctx));
+	}
 	return doc;
 }
 
+fz_buffer *
+pdf_new_document_index(fz_context *ctx, pdf_document *doc)
+{
+	pdf_xref *xref = doc->num_xref_sections == 1 ? &doc->xref_sections[0] : NULL;
+	pdf_xref_entry *entry;
+	fz_buffer *buf = NULL;
+	fz_buffer *trailer = NULL;
+	fz_output *out = NULL;
+	int i, len, xref_len = 0, num_lengths = 0;
+
+	/* only a repaired xref is worth saving (and it's always a single solid section) */
+	if (doc->repair_attempted && xref && xref->subsec && !xref->subsec->next && xref->subsec->start == 0 && !doc->local_xref)
+		xref_len = xref->subsec->len;
+	if (xref_len == 0 && !doc->rev_page_map)
+		return NULL;
+
+	fz_var(buf);
+	fz_var(trailer);
+	fz_var(out);
+
+	fz_try(ctx)
+	{
+		buf = fz_new_buffer(ctx, 1024);
+		fz_append_int32_le(ctx, buf, PDF_INDEX_MAGIC);
+		fz_append_int32_le(ctx, buf, PDF_INDEX_VERSION);
+		fz_seek(ctx, doc->file, 0, SEEK_END);
+		pdf_append_index_int64(ctx, buf, fz_tell(ctx, doc->file));
+
+		fz_append_int32_le(ctx, buf, doc->rev_page_map ? doc->rev_page_count : 0);
+		for (i = 0; doc->rev_page_map && i < doc->rev_page_count; i++)
+		{
+			fz_append_int32_le(ctx, buf, doc->rev_page_map[i].page);
+			fz_append_int32_le(ctx, buf, doc->rev_page_map[i].object);
+		}
+
+		fz_append_int32_le(ctx, buf, xref_len);
+		if (xref_len > 0)
+		{
+			for (i = 0; i < xref_len; i++)
+			{
+				entry = &xref->subsec->table[i];
+				fz_append_byte(ctx, buf, entry->type);
+				fz_append_int16_le(ctx, buf, entry->gen);
+				fz_append_int32_le(ctx, buf, entry->num);
+				pdf_append_index_int64(ctx, buf, entry->ofs);
+				pdf_append_index_int64(ctx, buf, entry->stm_ofs);
+				num_lengths += pdf_index_stream_length(ctx, doc, entry, &len);
+			}
+
+			trailer = fz_new_buffer(ctx, 256);
+			out = fz_new_output_with_buffer(ctx, trailer);
+			pdf_print_obj(ctx, out, xref->trailer, 1, 0);
+			fz_close_output(ctx, out);
+			fz_append_int32_le(ctx, buf, (int)trailer->len);
+			fz_append_buffer(ctx, buf, trailer);
+
+			fz_append_int32_le(ctx, buf, num_lengths);
+			for (i = 0; i < xref_len; i++)
+			{
+				if (pdf_index_stream_length(ctx, doc, &xref->subsec->table[i], &len))
+				{
+					fz_append_int32_le(ctx, buf, i);
+					fz_append_int32_le(ctx, buf, len);
+				}
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, out);
+		fz_drop_buffer(ctx, trailer);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_rethrow(ctx);
+	}
+	return buf;
+}
+
 pdf_document *
 pdf_open_document(fz_context *ctx, const char *filename)
 {
@@ -2696,7 +3033,7 @@ pdf_open_document(fz_context *ctx, const char *filename)
 	{
 		file = fz_open_file(ctx, filename);
 		doc = pdf_new_document(ctx, file);
-		pdf_init_document(ctx, doc);
+		pdf_init_document(ctx, doc, NULL);
 	}
 	fz_always(ctx)
 	{
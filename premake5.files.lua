@@ -444,6 +444,8 @@ function sumatrapdf_files()
     "Print.*",
     "ProgressUpdateUI.*",
     "RenderCache.*",
+    "RenderCacheBudget.*",
+    "RenderCacheDisk.*",
     "resource.h",
     "SaveAsPdf.*",
     "Scratch.*",
@@ -547,8 +549,10 @@ function utils_files()
     "ScopedWin.h",
     "SerializeTxt.*",
     "SettingsUtil.*",
+    "SharedFile.*",
     "SquareTreeParser.*",
     "StrconvUtil.*",
+    "StrFind.*",
     "StrFormat.*",
     "StringViewUtil.*",
     "StrSlice.*",
@@ -672,6 +676,7 @@ function mupdf_files()
     "draw-glyph.c",
     "draw-mesh.c",
     "draw-paint.c",
+    "draw-paint-simd.c",
     "draw-path.c",
     "draw-rasterize.c",
     "draw-scale-simple.c",
@@ -939,6 +944,7 @@ function test_util_files()
     "SettingsUtil.*",
     "Log.*",
     "StrconvUtil.*",
+    "StrFind.*",
     "StrFormat.*",
     "StringViewUtil.*",
     "StrUtil.*",
@@ -958,6 +964,8 @@ function test_util_files()
     "EngineBase.*",
     "DisplayMode.*",
     "Flags.*",
+    "RenderCacheBudget.*",
+    "RenderCacheDisk.*",
     "SumatraConfig.*",
     "SettingsStructs.*",
     "SumatraUnitTests.cpp",
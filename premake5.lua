@@ -647,6 +647,20 @@ workspace "SumatraPDF"
       "version", "windowscodecs"
     }
 
+  project "djvubench"
+    kind "ConsoleApp"
+    language "C++"
+    cppdialect "C++latest"
+    regconf()
+    includedirs { "src", "ext/libdjvu" }
+    disablewarnings { "4100", "4267", "4457" }
+    files { "src/tools/djvubench.cpp" }
+    links { "utils", "unrar", "mupdf", "unarrlib", "libwebp", "libdjvu" }
+    links {
+      "comctl32", "gdiplus", "msimg32", "shlwapi",
+      "version", "windowscodecs"
+    }
+
   project "test_util"
     kind "ConsoleApp"
     language "C++"
@@ -654,8 +668,10 @@ workspace "SumatraPDF"
     regconf()
     disablewarnings { "4838" }
     defines { "NO_LIBMUPDF" }
-    includedirs { "src" }
+    includedirs { "src", "ext/zlib" }
     test_util_files()
+    -- for zlib
+    links { "mupdf-libs" }
     links { "gdiplus", "comctl32", "shlwapi", "Version" }
 
   project "logview"
@@ -32,6 +32,7 @@
 #include "EbookController.h"
 #include "Theme.h"
 #include "GlobalPrefs.h"
+#include "RenderCacheBudget.h"
 #include "RenderCache.h"
 #include "ProgressUpdateUI.h"
 #include "TextSelection.h"
@@ -23,7 +23,12 @@ struct ControllerCallback {
     virtual void UpdateScrollbars(Size canvas) = 0;
     virtual void RequestRendering(int pageNo) = 0;
     virtual void CleanUp(DisplayModel* dm) = 0;
+    // waits for everything rendered (or extracted) in the background for dm
+    virtual void CancelRendering(DisplayModel* dm) = 0;
     virtual void RenderThumbnail(DisplayModel* dm, Size size, const onBitmapRenderedCb&) = 0;
+    // called on a background thread once the engine has laid out all pages
+    // (tells the UI to call DisplayModel::UpdatePageCount)
+    virtual void HandleFinishedLayout(DisplayModel* dm) = 0;
     // ChmModel //
     // tell the UI to move focus back to the main window
     // (if always == false, then focus is only moved if it's inside
@@ -299,6 +299,47 @@ DisplayModel::DisplayModel(EngineBase* engine, ControllerCallback* cb) : Control
     textCache = new DocumentTextCache(engine);
     textSelection = new TextSelection(engine, textCache);
     textSearch = new TextSearch(engine, textCache);
+
+    engine->SetLayoutFinishedCb([this] { this->cb->HandleFinishedLayout(this); });
+}
+
+// applies the final page count of an engine which has been laying out its
+// pages in the background (the search thread must not be running)
+bool DisplayModel::UpdatePageCount() {
+    ScrollState ss = GetScrollState();
+    int oldPageCount = PageCount();
+    if (!engine->UpdatePageCount()) {
+        return false;
+    }
+
+    int pageCount = PageCount();
+    if (pageCount < oldPageCount) {
+        // don't keep rendering pages which no longer exist
+        cb->CleanUp(this);
+    } else if (pageCount > oldPageCount) {
+        // text might still be extracted into textCache in the background
+        cb->CancelRendering(this);
+    }
+    if (pageCount != oldPageCount) {
+        // these contain data for each page
+        delete textSearch;
+        delete textSelection;
+        delete textCache;
+        textCache = new DocumentTextCache(engine);
+        textSelection = new TextSelection(engine, textCache);
+        textSearch = new TextSearch(engine, textCache);
+
+        free(pagesInfo);
+        pagesInfo = nullptr;
+        startPage = limitValue(startPage, 1, pageCount);
+        BuildPagesInfo();
+    }
+    Relayout(zoomVirtual, rotation);
+
+    ss.page = limitValue(ss.page, 1, pageCount);
+    SetScrollState(ss);
+    RemoveInvalidNavPoints();
+    return true;
 }
 
 DisplayModel::~DisplayModel() {
@@ -1838,7 +1879,11 @@ void DisplayModel::Navigate(int dir) {
 void DisplayModel::CopyNavHistory(DisplayModel& orig) {
     navHistory = orig.navHistory;
     navHistoryIdx = orig.navHistoryIdx;
-    // remove navigation history entries for all no longer valid pages
+    RemoveInvalidNavPoints();
+}
+
+// remove navigation history entries for all no longer valid pages
+void DisplayModel::RemoveInvalidNavPoints() {
     for (size_t i = navHistory.size(); i > 0; i--) {
         if (!ValidPageNo(navHistory.at(i - 1).page)) {
             navHistory.RemoveAt(i - 1);
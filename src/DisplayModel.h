@@ -175,6 +175,7 @@ struct DisplayModel : public Controller {
     void SetScrollState(ScrollState state);
 
     void CopyNavHistory(DisplayModel& orig);
+    bool UpdatePageCount();
 
     void SetInitialViewSettings(DisplayMode displayMode, int newStartPage, Size viewPort, int screenDPI);
     void SetDisplayR2L(bool r2l);
@@ -197,6 +198,7 @@ struct DisplayModel : public Controller {
     void RecalcVisibleParts() const;
     void RenderVisibleParts();
     void AddNavPoint();
+    void RemoveInvalidNavPoints();
     RectF GetContentBox(int pageNo) const;
     void CalcZoomReal(float zoomVirtual);
     void GoToPage(int pageNo, int scrollY, bool addNavPt = false, int scrollX = -1);
@@ -465,6 +465,7 @@ bool EpubDoc::Load() {
         auto pathA = ToUtf8Temp(fullPath);
         ReportIf(str::FindChar(pathA.Get(), '"'));
         str::TransCharsInPlace(pathA.Get(), "\"", "'");
+        spineOffsets.Append(htmlData.size());
         htmlData.AppendFmt("<pagebreak page_path=\"%s\" page_marker />", pathA.Get());
         htmlData.Append(html.data);
     }
@@ -517,6 +518,12 @@ std::span<u8> EpubDoc::GetHtmlData() const {
     return htmlData.AsSpan();
 }
 
+// each spine item starts with a <pagebreak page_path="..." page_marker /> tag
+// and can be laid out independently from the others
+const Vec<size_t>& EpubDoc::GetSpineOffsets() const {
+    return spineOffsets;
+}
+
 ImageData* EpubDoc::GetImageData(const char* fileName, const char* pagePath) {
     ScopedCritSec scope(&zipAccess);
 
@@ -25,6 +25,8 @@ class EpubDoc {
     CRITICAL_SECTION zipAccess;
 
     str::Str htmlData;
+    // offsets into htmlData at which the individual spine items start
+    Vec<size_t> spineOffsets;
     Vec<ImageData2> images;
     AutoFreeWstr tocPath;
     AutoFreeWstr fileName;
@@ -43,6 +45,7 @@ class EpubDoc {
     ~EpubDoc();
 
     [[nodiscard]] std::span<u8> GetHtmlData() const;
+    [[nodiscard]] const Vec<size_t>& GetSpineOffsets() const;
 
     ImageData* GetImageData(const char* fileName, const char* pagePath);
     std::span<u8> GetFileData(const char* relPath, const char* pagePath);
@@ -5,6 +5,7 @@
 #include "utils/BaseUtil.h"
 #include "utils/ScopedWin.h"
 #include "utils/WinUtil.h"
+#include "utils/CryptoUtil.h"
 #include "utils/Log.h"
 
 #include "wingui/TreeModel.h"
@@ -482,6 +483,14 @@ int EngineBase::PageCount() const {
     return pageCount;
 }
 
+void EngineBase::SetLayoutFinishedCb(__unused const std::function<void()>& cb) {
+    // most engines know their final page count right after loading
+}
+
+bool EngineBase::UpdatePageCount() {
+    return false;
+}
+
 RectF EngineBase::PageContentBox(int pageNo, __unused RenderTarget target) {
     return PageMediabox(pageNo);
 }
@@ -490,6 +499,15 @@ bool EngineBase::SaveFileAsPDF(__unused const char* pdfFileName, __unused bool i
     return false;
 }
 
+bool EngineBase::GetFileDigest(u8 digest[16]) {
+    AutoFree data = GetFileData();
+    if (data.empty()) {
+        return false;
+    }
+    CalcMD5Digest((const u8*)data.Get(), data.size(), digest);
+    return true;
+}
+
 bool EngineBase::IsImageCollection() const {
     return isImageCollection;
 }
@@ -543,6 +561,10 @@ const WCHAR* EngineBase::FileName() const {
     return fileNameBase.Get();
 }
 
+void EngineBase::PreloadPageElements(__unused int pageNo) {
+    // most engines extract page elements when loading a page
+}
+
 RenderedBitmap* EngineBase::GetImageForPageElement(IPageElement*) {
     CrashMe();
     return nullptr;
@@ -309,6 +309,10 @@ class EngineBase {
     PageLayoutType preferredLayout = Layout_Single;
     float fileDPI = 96.0f;
     bool isImageCollection{false};
+    // set for engines whose clones would have to do all the work of loading the
+    // document again (e.g. ebooks laying out all pages), so that they're used from
+    // several threads at once instead of being cloned for rendering or indexing
+    bool isExpensiveToClone{false};
     bool allowsPrinting{true};
     bool allowsCopyingText{true};
     bool isPasswordProtected{false};
@@ -326,6 +330,15 @@ class EngineBase {
     // number of pages the loaded document contains
     [[nodiscard]] int PageCount() const;
 
+    // engines which lay out their pages in the background (cf. EngineEbook) start out
+    // with an estimated PageCount(). cb is called on the layout thread as soon as the
+    // layout has completed (or right away, if it already has)
+    virtual void SetLayoutFinishedCb(const std::function<void()>& cb);
+    // applies the final page count once the layout has completed (must be called
+    // on the UI thread, cf. DisplayModel::UpdatePageCount). Returns true if
+    // PageCount() or the Table of Contents' destinations might have changed
+    virtual bool UpdatePageCount();
+
     // the box containing the visible page content (usually RectF(0, 0, pageWidth, pageHeight))
     virtual RectF PageMediabox(int pageNo) = 0;
     // the box inside PageMediabox that actually contains any relevant content
@@ -345,6 +358,9 @@ class EngineBase {
     // (e.g. for saving again when the file has already been deleted)
     // caller needs to free() the result
     virtual std::span<u8> GetFileData() = 0;
+    // calculates the MD5 digest of the current file's content
+    // (e.g. for identifying the file in the persistent render cache)
+    virtual bool GetFileDigest(u8 digest[16]);
 
     // saves a copy of the current file under a different name (overwriting an existing file)
     // (includeUserAnnots only has an effect if SupportsAnnotation(true) returns true)
@@ -385,6 +401,10 @@ class EngineBase {
     // returns the element at a given point or nullptr if there's none
     // caller must delete the result
     virtual IPageElement* GetElementAtPos(int pageNo, PointF pt) = 0;
+    // extracts page elements (links, images, comments) ahead of time, so that
+    // GetElements() and GetElementAtPos() don't have to do it on first use.
+    // called from a background thread after a page has been rendered
+    virtual void PreloadPageElements(int pageNo);
 
     // creates a PageDestination from a name (or nullptr for invalid names)
     // caller must delete the result
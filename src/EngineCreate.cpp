@@ -66,7 +66,7 @@ bool IsSupportedFileType(Kind kind, bool enableEngineEbooks) {
 }
 
 static EngineBase* CreateEngineForKind(Kind kind, const WCHAR* path, PasswordUI* pwdUI, bool enableChmEngine,
-                                       bool enableEngineEbooks) {
+                                       bool enableEngineEbooks, bool lazyLayout) {
     if (!kind) {
         return nullptr;
     }
@@ -108,11 +108,11 @@ static EngineBase* CreateEngineForKind(Kind kind, const WCHAR* path, PasswordUI*
     }
 
     if (kind == kindFileEpub) {
-        engine = CreateEpubEngineFromFile(path);
+        engine = CreateEpubEngineFromFile(path, lazyLayout);
     } else if (kind == kindFileFb2) {
-        engine = CreateFb2EngineFromFile(path);
+        engine = CreateFb2EngineFromFile(path, lazyLayout);
     } else if (kind == kindFileMobi) {
-        engine = CreateMobiEngineFromFile(path);
+        engine = CreateMobiEngineFromFile(path, lazyLayout);
     } else if (kind == kindFilePalmDoc) {
         engine = CreatePdbEngineFromFile(path);
     } else if (kind == kindFileHTML) {
@@ -121,20 +121,21 @@ static EngineBase* CreateEngineForKind(Kind kind, const WCHAR* path, PasswordUI*
     return engine;
 }
 
-EngineBase* CreateEngine(const WCHAR* path, PasswordUI* pwdUI, bool enableChmEngine, bool enableEngineEbooks) {
+EngineBase* CreateEngine(const WCHAR* path, PasswordUI* pwdUI, bool enableChmEngine, bool enableEngineEbooks,
+                         bool lazyLayout) {
     CrashIf(!path);
 
     // try to open with the engine guess from file name
     // if that fails, try to guess the file type based on content
     Kind kind = GuessFileTypeFromName(path);
-    EngineBase* engine = CreateEngineForKind(kind, path, pwdUI, enableChmEngine, enableEngineEbooks);
+    EngineBase* engine = CreateEngineForKind(kind, path, pwdUI, enableChmEngine, enableEngineEbooks, lazyLayout);
     if (engine) {
         return engine;
     }
 
     Kind newKind = GuessFileTypeFromContent(path);
     if (kind != newKind) {
-        engine = CreateEngineForKind(newKind, path, pwdUI, enableChmEngine, enableEngineEbooks);
+        engine = CreateEngineForKind(newKind, path, pwdUI, enableChmEngine, enableEngineEbooks, lazyLayout);
     }
     return engine;
 }
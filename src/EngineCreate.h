@@ -6,8 +6,10 @@ enum class AnnotationType;
 
 bool IsSupportedFileType(Kind kind, bool enableEngineEbooks);
 
+// lazyLayout allows ebook engines to lay out pages in the background
+// (cf. EngineBase::SetLayoutFinishedCb and EngineBase::UpdatePageCount)
 EngineBase* CreateEngine(const WCHAR* filePath, PasswordUI* pwdUI = nullptr, bool enableChmEngine = true,
-                         bool enableEngineEbooks = true);
+                         bool enableEngineEbooks = true, bool lazyLayout = false);
 
 bool EngineSupportsAnnotations(EngineBase*);
 bool EngineGetAnnotations(EngineBase*, Vec<Annotation*>*);
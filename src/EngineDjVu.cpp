@@ -126,33 +126,38 @@ static TocItem* newDjVuTocItem(TocItem* parent, const char* title, const char* l
     return res;
 }
 
+// ddjvu_context_create sets up libdjvu's global state and
+// the process' locale, so contexts are created one at a time
+struct DjVuGlobalLock {
+    CRITICAL_SECTION cs;
+
+    DjVuGlobalLock() {
+        InitializeCriticalSection(&cs);
+    }
+    ~DjVuGlobalLock() {
+        DeleteCriticalSection(&cs);
+    }
+};
+
+static DjVuGlobalLock gDjVuGlobalLock;
+// number of live DjVuContexts (protected by gDjVuGlobalLock)
+static int gDjVuContextCount = 0;
+
+// every document has its own context so that documents decode and
+// render in parallel instead of one page at a time for all of them
 struct DjVuContext {
     ddjvu_context_t* ctx = nullptr;
-    int refCount = 1;
+    // protects ctx and all ddjvu objects created with it
     CRITICAL_SECTION lock;
 
     DjVuContext() {
         InitializeCriticalSection(&lock);
+        ScopedCritSec scope(&gDjVuGlobalLock.cs);
         ctx = ddjvu_context_create("DjVuEngine");
         // reset the locale to "C" as most other code expects
         setlocale(LC_ALL, "C");
         CrashIf(!ctx);
-    }
-
-    int AddRef() {
-        EnterCriticalSection(&lock);
-        ++refCount;
-        int res = refCount;
-        LeaveCriticalSection(&lock);
-        return res;
-    }
-
-    int Release() {
-        EnterCriticalSection(&lock);
-        CrashIf(refCount <= 0);
-        --refCount;
-        LeaveCriticalSection(&lock);
-        return refCount;
+        gDjVuContextCount++;
     }
 
     ~DjVuContext() {
@@ -162,6 +167,9 @@ struct DjVuContext {
         }
         LeaveCriticalSection(&lock);
         DeleteCriticalSection(&lock);
+
+        ScopedCritSec scope(&gDjVuGlobalLock.cs);
+        gDjVuContextCount--;
     }
 
     void SpinMessageLoop(bool wait = true) const {
@@ -201,34 +209,33 @@ struct DjVuContext {
     }
 };
 
-// TODO: make it non-static because it accesses other static state
-// in djvu which got deleted first
-static DjVuContext* gDjVuContext;
-
-static DjVuContext* GetDjVuContext() {
-    if (!gDjVuContext) {
-        gDjVuContext = new DjVuContext();
-    } else {
-        gDjVuContext->AddRef();
-    }
-    return gDjVuContext;
+void CleanupDjVuEngine() {
+    CrashIf(gDjVuContextCount != 0);
+    minilisp_finish();
 }
 
-static void ReleaseDjVuContext() {
-    CrashIf(!gDjVuContext);
-    int refCount = gDjVuContext->Release();
-    if (refCount != 0) {
-        return;
-    }
-}
+// upper bound for the memory used by the decoded pages of a document
+// (there's only one cache per document, see EngineDjVu::EngineDjVu)
+#define DJVU_PAGE_CACHE_BYTES (128 * 1024 * 1024)
 
-void CleanupDjVuEngine() {
-    if (gDjVuContext) {
-        CrashIf(gDjVuContext->refCount != 0);
-        delete gDjVuContext;
-        gDjVuContext = nullptr;
+// a decoded page, kept so that re-zooming, rotating or rendering
+// another tile of it only has to call ddjvu_page_render again
+struct DjVuCachedPage {
+    int pageNo = 0;
+    ddjvu_page_t* page = nullptr;
+    size_t bytes = 0;
+};
+
+// rough upper bound for the size of a decoded page: IW44 layers keep their
+// wavelet coefficients (2 bytes for each of up to 3 color planes per pixel)
+// while JB2 masks keep their shapes as 1-bit bitmaps
+static size_t DecodedDjVuPageSize(ddjvu_page_t* page) {
+    size_t dx = (size_t)ddjvu_page_get_width(page);
+    size_t dy = (size_t)ddjvu_page_get_height(page);
+    if (DDJVU_PAGETYPE_BITONAL == ddjvu_page_get_type(page)) {
+        return dx * dy / 8 + 1;
     }
-    minilisp_finish();
+    return dx * dy * 2 * 3;
 }
 
 class EngineDjVu : public EngineBase {
@@ -268,10 +275,15 @@ class EngineDjVu : public EngineBase {
     static EngineBase* CreateFromStream(IStream* stream);
 
   protected:
+    DjVuContext* djvu = nullptr;
     IStream* stream = nullptr;
 
     RectF* mediaboxes = nullptr;
 
+    // most recently used last, protected by djvu->lock
+    Vec<DjVuCachedPage> pageCache;
+    size_t pageCacheBytes = 0;
+
     ddjvu_document_t* doc = nullptr;
     miniexp_t outline = miniexp_nil;
     miniexp_t* annos = nullptr;
@@ -287,6 +299,7 @@ class EngineDjVu : public EngineBase {
     bool Load(IStream* stream);
     bool FinishLoading();
     bool LoadMediaboxes();
+    ddjvu_page_t* GetDecodedPage(int pageNo);
 };
 
 EngineDjVu::EngineDjVu() {
@@ -294,15 +307,23 @@ EngineDjVu::EngineDjVu() {
     defaultFileExt = L".djvu";
     // DPI isn't constant for all pages and thus premultiplied
     fileDPI = 300.0f;
-    GetDjVuContext();
+    // all access is serialized by djvu->lock anyway, so rendering threads
+    // share the engine (and its cache of decoded pages) instead of each
+    // decoding the same pages in their own clone
+    isExpensiveToClone = true;
+    djvu = new DjVuContext();
 }
 
 EngineDjVu::~EngineDjVu() {
-    ScopedCritSec scope(&gDjVuContext->lock);
+    EnterCriticalSection(&djvu->lock);
 
     delete tocTree;
     free(mediaboxes);
 
+    for (DjVuCachedPage& cached : pageCache) {
+        ddjvu_page_release(cached.page);
+    }
+
     if (annos) {
         for (int i = 0; i < pageCount; i++) {
             if (annos[i]) {
@@ -320,7 +341,9 @@ EngineDjVu::~EngineDjVu() {
     if (stream) {
         stream->Release();
     }
-    ReleaseDjVuContext();
+
+    LeaveCriticalSection(&djvu->lock);
+    delete djvu;
 }
 
 EngineBase* EngineDjVu::Clone() {
@@ -435,12 +458,12 @@ bool EngineDjVu::LoadMediaboxes() {
 
 bool EngineDjVu::Load(const WCHAR* fileName) {
     SetFileName(fileName);
-    doc = gDjVuContext->OpenFile(fileName);
+    doc = djvu->OpenFile(fileName);
     return FinishLoading();
 }
 
 bool EngineDjVu::Load(IStream* stream) {
-    doc = gDjVuContext->OpenStream(stream);
+    doc = djvu->OpenStream(stream);
     return FinishLoading();
 }
 
@@ -449,10 +472,10 @@ bool EngineDjVu::FinishLoading() {
         return false;
     }
 
-    ScopedCritSec scope(&gDjVuContext->lock);
+    ScopedCritSec scope(&djvu->lock);
 
     while (!ddjvu_document_decoding_done(doc)) {
-        gDjVuContext->SpinMessageLoop();
+        djvu->SpinMessageLoop();
     }
 
     if (ddjvu_document_decoding_error(doc)) {
@@ -472,7 +495,7 @@ bool EngineDjVu::FinishLoading() {
             ddjvu_status_t status;
             ddjvu_pageinfo_t info;
             while ((status = ddjvu_document_get_pageinfo(doc, i, &info)) < DDJVU_JOB_OK) {
-                gDjVuContext->SpinMessageLoop();
+                djvu->SpinMessageLoop();
             }
             if (DDJVU_JOB_OK == status) {
                 float dx = (float)info.width * GetFileDPI() / (float)info.dpi;
@@ -488,7 +511,7 @@ bool EngineDjVu::FinishLoading() {
     }
 
     while ((outline = ddjvu_document_get_outline(doc)) == miniexp_dummy) {
-        gDjVuContext->SpinMessageLoop();
+        djvu->SpinMessageLoop();
     }
     if (!miniexp_consp(outline) || miniexp_car(outline) != miniexp_symbol("bookmarks")) {
         ddjvu_miniexp_release(doc, outline);
@@ -500,7 +523,7 @@ bool EngineDjVu::FinishLoading() {
         ddjvu_status_t status;
         ddjvu_fileinfo_s info;
         while ((status = ddjvu_document_get_fileinfo(doc, i, &info)) < DDJVU_JOB_OK) {
-            gDjVuContext->SpinMessageLoop();
+            djvu->SpinMessageLoop();
         }
         if (DDJVU_JOB_OK == status && info.type == 'P' && info.pageno >= 0) {
             fileInfos.Append(info);
@@ -547,8 +570,43 @@ RenderedBitmap* EngineDjVu::CreateRenderedBitmap(const char* bmpData, Size size,
     return new RenderedBitmap(hbmp, size, hMap);
 }
 
+// must be called with djvu->lock held. The page stays owned by
+// pageCache and is valid until the next call
+ddjvu_page_t* EngineDjVu::GetDecodedPage(int pageNo) {
+    for (size_t i = 0; i < pageCache.size(); i++) {
+        if (pageCache.at(i).pageNo == pageNo) {
+            DjVuCachedPage cached = pageCache.PopAt(i);
+            pageCache.Append(cached);
+            return cached.page;
+        }
+    }
+
+    ddjvu_page_t* page = ddjvu_page_create_by_pageno(doc, pageNo - 1);
+    if (!page) {
+        return nullptr;
+    }
+    while (!ddjvu_page_decoding_done(page)) {
+        djvu->SpinMessageLoop();
+    }
+    if (ddjvu_page_decoding_error(page)) {
+        ddjvu_page_release(page);
+        return nullptr;
+    }
+
+    size_t bytes = DecodedDjVuPageSize(page);
+    // always keep the page that's just been decoded, even if it's over budget
+    while (pageCache.size() > 0 && pageCacheBytes + bytes > DJVU_PAGE_CACHE_BYTES) {
+        DjVuCachedPage evicted = pageCache.PopAt(0);
+        ddjvu_page_release(evicted.page);
+        pageCacheBytes -= evicted.bytes;
+    }
+    pageCache.Append({pageNo, page, bytes});
+    pageCacheBytes += bytes;
+    return page;
+}
+
 RenderedBitmap* EngineDjVu::RenderPage(RenderPageArgs& args) {
-    ScopedCritSec scope(&gDjVuContext->lock);
+    ScopedCritSec scope(&djvu->lock);
     auto pageRect = args.pageRect;
     auto zoom = args.zoom;
     auto pageNo = args.pageNo;
@@ -558,16 +616,10 @@ RenderedBitmap* EngineDjVu::RenderPage(RenderPageArgs& args) {
     Rect full = Transform(PageMediabox(pageNo), pageNo, zoom, rotation).Round();
     screen = full.Intersect(screen);
 
-    ddjvu_page_t* page = ddjvu_page_create_by_pageno(doc, pageNo - 1);
+    ddjvu_page_t* page = GetDecodedPage(pageNo);
     if (!page) {
         return nullptr;
     }
-    while (!ddjvu_page_decoding_done(page)) {
-        gDjVuContext->SpinMessageLoop();
-    }
-    if (ddjvu_page_decoding_error(page)) {
-        return nullptr;
-    }
 
     ddjvu_page_rotation_t rot = DDJVU_ROTATE_0;
     switch (rotation) {
@@ -597,7 +649,6 @@ RenderedBitmap* EngineDjVu::RenderPage(RenderPageArgs& args) {
 
     defer {
         ddjvu_format_release(fmt);
-        ddjvu_page_release(page);
     };
 
     int topToBottom = TRUE;
@@ -629,20 +680,13 @@ RenderedBitmap* EngineDjVu::RenderPage(RenderPageArgs& args) {
 }
 
 RectF EngineDjVu::PageContentBox(int pageNo, __unused RenderTarget target) {
-    ScopedCritSec scope(&gDjVuContext->lock);
+    ScopedCritSec scope(&djvu->lock);
 
     RectF pageRc = PageMediabox(pageNo);
-    ddjvu_page_t* page = ddjvu_page_create_by_pageno(doc, pageNo - 1);
+    ddjvu_page_t* page = GetDecodedPage(pageNo);
     if (!page) {
         return pageRc;
     }
-
-    while (!ddjvu_page_decoding_done(page)) {
-        gDjVuContext->SpinMessageLoop();
-    }
-    if (ddjvu_page_decoding_error(page)) {
-        return pageRc;
-    }
     ddjvu_page_set_rotation(page, DDJVU_ROTATE_0);
 
     // render the page in 8-bit grayscale up to 250x250 px in size
@@ -650,7 +694,6 @@ RectF EngineDjVu::PageContentBox(int pageNo, __unused RenderTarget target) {
 
     defer {
         ddjvu_format_release(fmt);
-        ddjvu_page_release(page);
     };
 
     ddjvu_format_set_row_order(fmt, /* top_to_bottom */ TRUE);
@@ -840,11 +883,11 @@ bool EngineDjVu::ExtractPageText(miniexp_t item, str::WStr& extracted, Vec<Rect>
 
 PageText EngineDjVu::ExtractPageText(int pageNo) {
     const WCHAR* lineSep = L"\n";
-    ScopedCritSec scope(&gDjVuContext->lock);
+    ScopedCritSec scope(&djvu->lock);
 
     miniexp_t pagetext;
     while ((pagetext = ddjvu_document_get_pagetext(doc, pageNo - 1, nullptr)) == miniexp_dummy) {
-        gDjVuContext->SpinMessageLoop();
+        djvu->SpinMessageLoop();
     }
     if (miniexp_nil == pagetext) {
         return {};
@@ -867,7 +910,7 @@ PageText EngineDjVu::ExtractPageText(int pageNo) {
     ddjvu_status_t status;
     ddjvu_pageinfo_t info;
     while ((status = ddjvu_document_get_pageinfo(doc, pageNo - 1, &info)) < DDJVU_JOB_OK) {
-        gDjVuContext->SpinMessageLoop();
+        djvu->SpinMessageLoop();
     }
     float dpiFactor = 1.0;
     if (DDJVU_JOB_OK == status) {
@@ -899,16 +942,16 @@ PageText EngineDjVu::ExtractPageText(int pageNo) {
 Vec<IPageElement*>* EngineDjVu::GetElements(int pageNo) {
     CrashIf(pageNo < 1 || pageNo > PageCount());
     if (annos && miniexp_dummy == annos[pageNo - 1]) {
-        ScopedCritSec scope(&gDjVuContext->lock);
+        ScopedCritSec scope(&djvu->lock);
         while ((annos[pageNo - 1] = ddjvu_document_get_pageanno(doc, pageNo - 1)) == miniexp_dummy) {
-            gDjVuContext->SpinMessageLoop();
+            djvu->SpinMessageLoop();
         }
     }
     if (!annos || !annos[pageNo - 1]) {
         return nullptr;
     }
 
-    ScopedCritSec scope(&gDjVuContext->lock);
+    ScopedCritSec scope(&djvu->lock);
 
     auto els = new Vec<IPageElement*>();
     Rect page = PageMediabox(pageNo).Round();
@@ -916,7 +959,7 @@ Vec<IPageElement*>* EngineDjVu::GetElements(int pageNo) {
     ddjvu_status_t status;
     ddjvu_pageinfo_t info;
     while ((status = ddjvu_document_get_pageinfo(doc, pageNo - 1, &info)) < DDJVU_JOB_OK) {
-        gDjVuContext->SpinMessageLoop();
+        djvu->SpinMessageLoop();
     }
     float dpiFactor = 1.0;
     if (DDJVU_JOB_OK == status) {
@@ -1098,7 +1141,7 @@ TocTree* EngineDjVu::GetToc() {
     if (tocTree) {
         return tocTree;
     }
-    ScopedCritSec scope(&gDjVuContext->lock);
+    ScopedCritSec scope(&djvu->lock);
     int idCounter = 0;
     TocItem* root = BuildTocTree(nullptr, outline, idCounter);
     if (!root) {
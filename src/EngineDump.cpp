@@ -2,19 +2,30 @@
    License: GPLv3 */
 
 #include "utils/BaseUtil.h"
+
+#include <psapi.h>
+
+extern "C" {
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+}
+
 #include "utils/ScopedWin.h"
 #include "utils/CmdLineParser.h"
 #include "utils/FileUtil.h"
 #include "utils/GdiPlusUtil.h"
 #include "mui/MiniMui.h"
 #include "utils/TgaReader.h"
+#include "utils/Timer.h"
 #include "utils/WinUtil.h"
 
 #include "wingui/TreeModel.h"
 
 #include "EngineBase.h"
 #include "EngineDjVu.h"
+#include "EngineFzUtil.h"
 #include "EngineCreate.h"
+#include "EnginePdf.h"
 #include "PdfCreator.h"
 
 void _submitDebugReportIfFunc(__unused bool cond, __unused const char* condStr) {
@@ -473,6 +484,227 @@ class PasswordHolder : public PasswordUI {
     }
 };
 
+// -bench measures how long it takes to open the document and to load,
+// render and extract the text of every page. Every page is rendered and
+// its text extracted <iterations> times, so that the results are stable
+// enough for comparing builds
+struct BenchStats {
+    int n = 0;
+    double minMs = 0;
+    double medianMs = 0;
+    double p95Ms = 0;
+};
+
+struct BenchPageResult {
+    int pageNo = 0;
+    double loadMs = 0;
+    BenchStats render;
+    BenchStats text;
+};
+
+// note: sorts samples
+static BenchStats CalcBenchStats(Vec<double>& samples) {
+    BenchStats res;
+    res.n = samples.isize();
+    if (res.n == 0) {
+        return res;
+    }
+    std::sort(samples.begin(), samples.end());
+    res.minMs = samples[0];
+    res.medianMs = samples[res.n / 2];
+    int p95 = (int)ceil(res.n * 0.95) - 1;
+    res.p95Ms = samples[limitValue(p95, 0, res.n - 1)];
+    return res;
+}
+
+static size_t GetPeakMemoryUsage() {
+    PROCESS_MEMORY_COUNTERS pmc{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return 0;
+    }
+    return pmc.PeakWorkingSetSize;
+}
+
+static void OutBenchStats(FILE* out, const char* name, const BenchStats& stats) {
+    fprintf(out, "%s: min %.2f ms, median %.2f ms, p95 %.2f ms\n", name, stats.minMs, stats.medianMs, stats.p95Ms);
+}
+
+static void AppendJsonStats(str::Str& json, const char* name, const BenchStats& stats) {
+    json.AppendFmt("\"%s\": {\"n\": %d, \"min\": %.3f, \"median\": %.3f, \"p95\": %.3f}", name, stats.n, stats.minMs,
+                   stats.medianMs, stats.p95Ms);
+}
+
+static void AppendJsonString(str::Str& json, const char* s) {
+    json.AppendChar('"');
+    for (; s && *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            json.AppendChar('\\');
+        }
+        json.AppendChar(*s);
+    }
+    json.AppendChar('"');
+}
+
+// glyphCacheMB overrides the size of the glyph cache, if > 0
+static bool BenchDocument(const WCHAR* filePath, PasswordUI* pwdUI, int iterations, float zoom, int glyphCacheMB,
+                          const WCHAR* jsonPath) {
+    Vec<double> openSamples;
+    EngineBase* engine = nullptr;
+    for (int i = 0; i < iterations; i++) {
+        delete engine;
+        auto t = TimeGet();
+        engine = CreateEngine(filePath, pwdUI);
+        openSamples.Append(TimeSinceInMs(t));
+        if (!engine) {
+            ErrOut("Error: Couldn't create an engine for %s!", path::GetBaseNameTemp(filePath));
+            return false;
+        }
+    }
+
+    if (glyphCacheMB > 0) {
+        EnginePdfSetGlyphCacheSize(engine, (size_t)glyphCacheMB * 1024 * 1024);
+    }
+
+    int nPages = engine->PageCount();
+    int nFailed = 0;
+    Vec<BenchPageResult> pages;
+    Vec<double> allLoad, allRender, allText;
+    for (int pageNo = 1; pageNo <= nPages; pageNo++) {
+        BenchPageResult res;
+        res.pageNo = pageNo;
+
+        // engines keep loaded pages, so loading can only be measured once
+        auto t = TimeGet();
+        engine->BenchLoadPage(pageNo);
+        res.loadMs = TimeSinceInMs(t);
+        allLoad.Append(res.loadMs);
+
+        Vec<double> renderSamples, textSamples;
+        for (int i = 0; i < iterations; i++) {
+            // otherwise all but the first iteration would replay the
+            // page's cached display list instead of interpreting it
+            EnginePdfClearPageRunCache(engine);
+            t = TimeGet();
+            RenderPageArgs args(pageNo, zoom, 0);
+            RenderedBitmap* bmp = engine->RenderPage(args);
+            renderSamples.Append(TimeSinceInMs(t));
+            if (!bmp) {
+                nFailed++;
+            }
+            delete bmp;
+
+            t = TimeGet();
+            PageText pageText = engine->ExtractPageText(pageNo);
+            textSamples.Append(TimeSinceInMs(t));
+            FreePageText(&pageText);
+        }
+        allRender.Append(renderSamples.LendData(), renderSamples.size());
+        allText.Append(textSamples.LendData(), textSamples.size());
+        res.render = CalcBenchStats(renderSamples);
+        res.text = CalcBenchStats(textSamples);
+        pages.Append(res);
+    }
+    AutoFree engineKind = str::Dup(engine->kind);
+    FzPageRunCacheStats runStats;
+    bool hasRunStats = EnginePdfGetPageRunCacheStats(engine, &runStats);
+    fz_glyph_cache_stats glyphStats{};
+    bool hasGlyphStats = EnginePdfGetGlyphCacheStats(engine, &glyphStats);
+    delete engine;
+
+    BenchStats open = CalcBenchStats(openSamples);
+    BenchStats load = CalcBenchStats(allLoad);
+    BenchStats render = CalcBenchStats(allRender);
+    BenchStats text = CalcBenchStats(allText);
+    size_t peakMemory = GetPeakMemoryUsage();
+
+    auto pathA = ToUtf8Temp(filePath);
+    // with -json -, stdout only gets the JSON so that it can be piped
+    FILE* out = str::Eq(jsonPath, L"-") ? stderr : stdout;
+    fprintf(out, "file: %s\n", pathA.Get());
+    fprintf(out, "pages: %d, iterations: %d, zoom: %.2f\n", nPages, iterations, zoom);
+    OutBenchStats(out, "open", open);
+    OutBenchStats(out, "load", load);
+    OutBenchStats(out, "render", render);
+    OutBenchStats(out, "text", text);
+    fprintf(out, "peak memory: %d KB\n", (int)(peakMemory / 1024));
+    if (hasRunStats) {
+        fprintf(out, "page run cache: %d hits, %d misses, %d evictions, %.2f ms saved\n", (int)runStats.hits,
+                (int)runStats.misses, (int)runStats.evictions, runStats.interpretMsSaved);
+    }
+    if (hasGlyphStats) {
+        fprintf(out, "glyph cache: %d of %d KB, %d glyphs, %lld hits, %lld misses, %lld evictions\n",
+                (int)(glyphStats.size / 1024), (int)(glyphStats.max_size / 1024), glyphStats.entries,
+                (long long)glyphStats.hits, (long long)glyphStats.misses, (long long)glyphStats.evictions);
+    }
+    if (nFailed > 0) {
+        fprintf(out, "failed renders: %d\n", nFailed);
+    }
+
+    if (!jsonPath) {
+        return nFailed == 0;
+    }
+    str::Str json(4096);
+    json.Append("{\n  \"file\": ");
+    AppendJsonString(json, pathA.Get());
+    json.Append(",\n  \"engine\": ");
+    AppendJsonString(json, engineKind.Get());
+    json.AppendFmt(",\n  \"pages\": %d,\n  \"iterations\": %d,\n  \"zoom\": %.3f,\n", nPages, iterations, zoom);
+    json.AppendFmt("  \"peakMemoryKB\": %d,\n  \"failedRenders\": %d,\n  ", (int)(peakMemory / 1024), nFailed);
+    if (hasRunStats) {
+        json.AppendFmt("\"pageRunCache\": {\"hits\": %d, \"misses\": %d, \"evictions\": %d, \"msSaved\": %.3f},\n  ",
+                       (int)runStats.hits, (int)runStats.misses, (int)runStats.evictions, runStats.interpretMsSaved);
+    }
+    if (hasGlyphStats) {
+        json.AppendFmt("\"glyphCache\": {\"sizeKB\": %d, \"maxSizeKB\": %d, \"glyphs\": %d, \"hits\": %lld, "
+                       "\"misses\": %lld, \"evictions\": %lld},\n  ",
+                       (int)(glyphStats.size / 1024), (int)(glyphStats.max_size / 1024), glyphStats.entries,
+                       (long long)glyphStats.hits, (long long)glyphStats.misses, (long long)glyphStats.evictions);
+    }
+    AppendJsonStats(json, "open", open);
+    json.Append(",\n  ");
+    AppendJsonStats(json, "load", load);
+    json.Append(",\n  ");
+    AppendJsonStats(json, "render", render);
+    json.Append(",\n  ");
+    AppendJsonStats(json, "text", text);
+    json.Append(",\n  \"perPage\": [");
+    for (size_t i = 0; i < pages.size(); i++) {
+        BenchPageResult& res = pages[i];
+        json.AppendFmt("%s\n    {\"page\": %d, \"load\": %.3f, ", i > 0 ? "," : "", res.pageNo, res.loadMs);
+        AppendJsonStats(json, "render", res.render);
+        json.Append(", ");
+        AppendJsonStats(json, "text", res.text);
+        json.Append("}");
+    }
+    json.Append("\n  ]\n}\n");
+
+    if (str::Eq(jsonPath, L"-")) {
+        Out1(json.Get());
+        return nFailed == 0;
+    }
+    if (!file::WriteFile(jsonPath, json.AsSpan())) {
+        ErrOut("Error: Couldn't write %s!", jsonPath);
+        return false;
+    }
+    return nFailed == 0;
+}
+
+// -testpainters checks that mupdf's SIMD span painters and image scaler give
+// the same results as the portable ones and (given iterations) compares
+// their speed
+static bool TestPainters(int iterations) {
+    fz_context* ctx = fz_new_context(nullptr, nullptr, FZ_STORE_UNLIMITED);
+    if (!ctx) {
+        ErrOut1("Error: Couldn't create a mupdf context!");
+        return false;
+    }
+    fz_install_parallel_image_scaling(ctx);
+    int nFailed = fz_test_span_painters(ctx, fz_stdout(ctx), iterations);
+    nFailed += fz_test_scale_pixmap(ctx, fz_stdout(ctx), iterations);
+    fz_drop_context(ctx);
+    return nFailed == 0;
+}
+
 int main(__unused int argc, __unused char** argv) {
     setlocale(LC_ALL, "C");
     DisableDataExecution();
@@ -482,9 +714,17 @@ int main(__unused int argc, __unused char** argv) {
     if (argList.size() < 2) {
     Usage:
         ErrOut("%s [-pwd <password>][-quick][-render <path-%%d.tga>] <filename>", path::GetBaseNameTemp(argList.at(0)));
+        ErrOut("%s [-pwd <password>] -bench <iterations> [-zoom <percent>][-glyphcache <MB>][-json <path>] <filename>",
+               path::GetBaseNameTemp(argList.at(0)));
+        ErrOut("%s -testpainters [<iterations>]", path::GetBaseNameTemp(argList.at(0)));
         return 2;
     }
 
+    if (str::Eq(argList.at(1), L"-testpainters")) {
+        int iterations = argList.size() > 2 ? _wtoi(argList.at(2)) : 0;
+        return TestPainters(iterations) ? 0 : 1;
+    }
+
     AutoFreeWstr filePath;
     WCHAR* password = nullptr;
     bool fullDump = true;
@@ -492,6 +732,9 @@ int main(__unused int argc, __unused char** argv) {
     float renderZoom = 1.f;
     bool loadOnly = false, silent = false;
     int breakAlloc = 0;
+    int benchIterations = 0;
+    WCHAR* benchJsonPath = nullptr;
+    int glyphCacheMB = 0;
 
     for (size_t i = 1; i < argList.size(); i++) {
         if (str::Eq(argList.at(i), L"-pwd") && i + 1 < argList.size() && !password) {
@@ -514,6 +757,17 @@ int main(__unused int argc, __unused char** argv) {
         } else if (str::Eq(argList.at(i), L"-full")) {
             // -full is for backward compatibility
             fullDump = true;
+        } else if (str::Eq(argList.at(i), L"-bench") && i + 1 < argList.size()) {
+            benchIterations = std::max(_wtoi(argList.at(++i)), 1);
+        } else if (str::Eq(argList.at(i), L"-glyphcache") && i + 1 < argList.size()) {
+            glyphCacheMB = _wtoi(argList.at(++i));
+        } else if (str::Eq(argList.at(i), L"-json") && i + 1 < argList.size()) {
+            benchJsonPath = argList.at(++i);
+        } else if (str::Eq(argList.at(i), L"-zoom") && i + 1 < argList.size()) {
+            float zoom;
+            if (str::Parse(argList.at(++i), L"%f%%%$", &zoom) && zoom > 0.f) {
+                renderZoom = zoom / 100.f;
+            }
         } else if (str::Eq(argList.at(i), L"-breakalloc") && i + 1 < argList.size()) {
             breakAlloc = _wtoi(argList.at(++i));
         } else if (!filePath) {
@@ -554,6 +808,10 @@ int main(__unused int argc, __unused char** argv) {
     }
 
     PasswordHolder pwdUI(password);
+    if (benchIterations > 0) {
+        bool ok = BenchDocument(filePath, &pwdUI, benchIterations, renderZoom, glyphCacheMB, benchJsonPath);
+        return ok ? 0 : 1;
+    }
     EngineBase* engine = CreateEngine(filePath, &pwdUI);
 #if 0
     bool isEngineDjVu = IsOfKind(engine, kindEngineDjVu);
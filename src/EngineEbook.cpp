@@ -14,6 +14,7 @@
 #include "utils/HtmlPullParser.h"
 #include "mui/Mui.h"
 #include "utils/PalmDbReader.h"
+#include "utils/ThreadUtil.h"
 #include "utils/TrivialHtmlParser.h"
 #include "utils/WinUtil.h"
 #include "utils/ZipUtil.h"
@@ -76,6 +77,20 @@ class EbookAbortCookie : public AbortCookie {
     }
 };
 
+// number of pages laid out before a document is shown,
+// if the remaining ones are laid out in the background
+#define EBOOK_LAYOUT_FIRST_PAGES 16
+// maximum number of threads laying out the chapters of a single document
+#define EBOOK_LAYOUT_MAX_THREADS 8
+
+class EbookPageSource;
+class EbookLayoutThread;
+
+// creates a formatter for (a part of) a document's html data. Formatters must be
+// created and deleted on the thread laying out their pages, as the Graphics
+// they measure text with belongs to that thread (cf. AllocGraphicsForMeasureText)
+using EbookFormatterFactory = std::function<HtmlFormatter*(std::span<u8> html)>;
+
 class EngineEbook : public EngineBase {
   public:
     EngineEbook();
@@ -103,7 +118,32 @@ class EngineEbook : public EngineBase {
 
     bool BenchLoadPage(int pageNo) override;
 
+    void SetLayoutFinishedCb(const std::function<void()>& cb) override;
+    bool UpdatePageCount() override;
+
+    // same as GetNamedDest but doesn't wait for the remaining pages to be laid out
+    virtual PageDestination* FindNamedDest(const WCHAR* name);
+
+    // called by EbookLayoutThread
+    bool LayoutNextPage(EbookPageSource* source);
+    void OnLayoutFinished(bool cancelled);
+
   protected:
+    // set if pages may be laid out on a background thread
+    // (in which case pageCount starts out as an estimate)
+    bool lazyLayout = false;
+    EbookLayoutThread* layoutThread = nullptr;
+    // protects pages, anchors and baseAnchors while pages are being laid out
+    CRITICAL_SECTION layoutAccess;
+    // signalled whenever a page has been laid out
+    CONDITION_VARIABLE pageLaidOut;
+    bool layoutFinished = true;
+    // EbookPageSource::Progress after the most recently laid out page
+    float layoutProgress = 0.f;
+    std::function<void()> layoutFinishedCb;
+    // stands in for pages beyond the final page count, in case it's been estimated too high
+    HtmlPage blankPage;
+
     Vec<HtmlPage*>* pages = nullptr;
     Vec<PageAnchor> anchors;
     // contains for each page the last anchor indicating
@@ -118,8 +158,15 @@ class EngineEbook : public EngineBase {
     float pageBorder;
 
     void GetTransform(Matrix& m, float zoom, int rotation);
-    bool ExtractPageAnchors();
+    bool Layout(std::span<u8> html, const EbookFormatterFactory& newFormatter, bool skipEmptyPages);
+    bool Layout(EbookPageSource* source);
+    bool WaitForLayout();
+    void StopLayout();
+    void ExtractPageAnchors(int pageNo);
     WCHAR* ExtractFontList();
+    // re-resolves the destinations of a ToC built before all pages had been laid out
+    virtual void UpdateToc() {
+    }
 
     virtual PageElement* CreatePageLink(DrawInstr* link, Rect rect, int pageNo);
 
@@ -168,16 +215,318 @@ static TocItem* newEbookTocItem(TocItem* parent, const WCHAR* title, PageDestina
     return res;
 }
 
+// produces the pages of a document in order for EngineEbook::Layout
+class EbookPageSource {
+  public:
+    virtual ~EbookPageSource() = default;
+    // returns nullptr after the last page
+    virtual HtmlPage* Next() = 0;
+    // returns the fraction (0 to 1) of the html data covered by the pages returned so far
+    virtual float Progress() = 0;
+    // makes a (blocked) call to Next return nullptr as soon as possible
+    virtual void Abort() {
+    }
+};
+
+// lays out a document's pages with a single formatter, which is created by the
+// first call to Next (so must be deleted on the thread calling Next)
+class FormatterPageSource : public EbookPageSource {
+    std::span<u8> html;
+    EbookFormatterFactory newFormatter;
+    HtmlFormatter* formatter = nullptr;
+    bool skipEmptyPages = false;
+
+  public:
+    FormatterPageSource(std::span<u8> html, const EbookFormatterFactory& newFormatter, bool skipEmptyPages)
+        : html(html), newFormatter(newFormatter), skipEmptyPages(skipEmptyPages) {
+    }
+    ~FormatterPageSource() override {
+        delete formatter;
+    }
+
+    HtmlPage* Next() override {
+        if (!formatter) {
+            formatter = newFormatter(html);
+        }
+        return formatter->Next(skipEmptyPages);
+    }
+    float Progress() override {
+        return formatter ? formatter->Progress() : 0.f;
+    }
+};
+
+struct EbookChapter {
+    std::span<u8> html;
+    // offset of html within the document's html data
+    int offset = 0;
+    // owned until they're returned by ChapterPageSource::Next
+    Vec<HtmlPage*> pages;
+    bool laidOut = false;
+};
+
+class ChapterLayoutThread;
+
+// lays out the chapters of a document (e.g. the spine items of an EPUB document)
+// in parallel, each one with its own formatter and thus its own text measurer,
+// and returns their pages stitched together in order
+class ChapterPageSource : public EbookPageSource {
+    Vec<EbookChapter*> chapters;
+    EbookFormatterFactory newFormatter;
+    bool skipEmptyPages = false;
+    size_t totalLen = 0;
+
+    Vec<ChapterLayoutThread*> threads;
+    LONG nChaptersClaimed = 0;
+    // protects chapters' pages and laidOut
+    CRITICAL_SECTION access;
+    CONDITION_VARIABLE chapterLaidOut;
+
+    // the chapter and page within it to be returned next
+    size_t currChapter = 0;
+    size_t currPage = 0;
+    size_t stitchedLen = 0;
+    bool aborted = false;
+
+  public:
+    ChapterPageSource(std::span<u8> html, const Vec<size_t>& chapterOffsets, const EbookFormatterFactory& newFormatter,
+                      bool skipEmptyPages);
+    ~ChapterPageSource() override;
+
+    HtmlPage* Next() override;
+    float Progress() override;
+    void Abort() override;
+
+    // called by ChapterLayoutThread
+    EbookChapter* ClaimChapter();
+    HtmlFormatter* NewFormatter(EbookChapter* chapter);
+    bool SkipEmptyPages() const;
+    void OnChapterLaidOut(EbookChapter* chapter, Vec<HtmlPage*>& pages);
+};
+
+// lays out the chapters claimed from a ChapterPageSource
+class ChapterLayoutThread : public ThreadBase {
+  public:
+    ChapterPageSource* source = nullptr;
+
+    explicit ChapterLayoutThread(ChapterPageSource* source);
+    ~ChapterLayoutThread() override = default;
+
+    // ThreadBase
+    void Run() override;
+};
+
+ChapterLayoutThread::ChapterLayoutThread(ChapterPageSource* source) : ThreadBase("ChapterLayoutThread") {
+    this->source = source;
+}
+
+void ChapterLayoutThread::Run() {
+    while (!WasCancelRequested()) {
+        EbookChapter* chapter = source->ClaimChapter();
+        if (!chapter) {
+            break;
+        }
+        HtmlFormatter* formatter = source->NewFormatter(chapter);
+        Vec<HtmlPage*> pages;
+        while (!WasCancelRequested()) {
+            HtmlPage* page = formatter->Next(source->SkipEmptyPages());
+            if (!page) {
+                break;
+            }
+            // make reparseIdx relative to the document's html data
+            page->reparseIdx += chapter->offset;
+            pages.Append(page);
+        }
+        delete formatter;
+        source->OnChapterLaidOut(chapter, pages);
+    }
+}
+
+ChapterPageSource::ChapterPageSource(std::span<u8> html, const Vec<size_t>& chapterOffsets,
+                                     const EbookFormatterFactory& newFormatter, bool skipEmptyPages)
+    : newFormatter(newFormatter), skipEmptyPages(skipEmptyPages) {
+    InitializeCriticalSection(&access);
+    InitializeConditionVariable(&chapterLaidOut);
+
+    for (size_t i = 0; i < chapterOffsets.size(); i++) {
+        size_t start = chapterOffsets.at(i);
+        size_t end = i + 1 < chapterOffsets.size() ? chapterOffsets.at(i + 1) : html.size();
+        CrashIf(start > end || end > html.size());
+        EbookChapter* chapter = new EbookChapter();
+        chapter->html = html.subspan(start, end - start);
+        chapter->offset = (int)start;
+        chapters.Append(chapter);
+        totalLen += chapter->html.size();
+    }
+
+    SYSTEM_INFO si{};
+    GetSystemInfo(&si);
+    int nThreads = limitValue((int)si.dwNumberOfProcessors, 1, EBOOK_LAYOUT_MAX_THREADS);
+    nThreads = std::min(nThreads, chapters.isize());
+    for (int i = 0; i < nThreads; i++) {
+        auto thread = new ChapterLayoutThread(this);
+        threads.Append(thread);
+        thread->Start();
+    }
+}
+
+ChapterPageSource::~ChapterPageSource() {
+    for (auto thread : threads) {
+        thread->RequestCancel();
+    }
+    for (auto thread : threads) {
+        thread->Join();
+        delete thread;
+    }
+    for (EbookChapter* chapter : chapters) {
+        DeleteVecMembers(chapter->pages);
+        delete chapter;
+    }
+    DeleteCriticalSection(&access);
+}
+
+// chapters are claimed in order, so that the first ones are
+// laid out first (and Next has to wait as little as possible)
+EbookChapter* ChapterPageSource::ClaimChapter() {
+    LONG n = InterlockedIncrement(&nChaptersClaimed);
+    if ((size_t)n > chapters.size()) {
+        return nullptr;
+    }
+    return chapters.at((size_t)n - 1);
+}
+
+HtmlFormatter* ChapterPageSource::NewFormatter(EbookChapter* chapter) {
+    return newFormatter(chapter->html);
+}
+
+bool ChapterPageSource::SkipEmptyPages() const {
+    return skipEmptyPages;
+}
+
+// takes ownership of pages (which is reset)
+void ChapterPageSource::OnChapterLaidOut(EbookChapter* chapter, Vec<HtmlPage*>& pages) {
+    ScopedCritSec scope(&access);
+    chapter->pages.Append(pages.LendData(), pages.size());
+    chapter->laidOut = true;
+    pages.Reset();
+    WakeAllConditionVariable(&chapterLaidOut);
+}
+
+HtmlPage* ChapterPageSource::Next() {
+    ScopedCritSec scope(&access);
+    while (currChapter < chapters.size()) {
+        EbookChapter* chapter = chapters.at(currChapter);
+        while (!chapter->laidOut && !aborted) {
+            SleepConditionVariableCS(&chapterLaidOut, &access, INFINITE);
+        }
+        if (aborted) {
+            return nullptr;
+        }
+        if (currPage < chapter->pages.size()) {
+            HtmlPage* page = chapter->pages.at(currPage);
+            chapter->pages.at(currPage++) = nullptr;
+            return page;
+        }
+        stitchedLen += chapter->html.size();
+        currChapter++;
+        currPage = 0;
+    }
+    return nullptr;
+}
+
+float ChapterPageSource::Progress() {
+    ScopedCritSec scope(&access);
+    if (currChapter >= chapters.size() || totalLen == 0) {
+        return 1.f;
+    }
+    // the current chapter has been laid out completely, so its number of pages is known
+    EbookChapter* chapter = chapters.at(currChapter);
+    size_t len = stitchedLen;
+    if (chapter->pages.size() > 0) {
+        len += chapter->html.size() * currPage / chapter->pages.size();
+    }
+    return (float)len / (float)totalLen;
+}
+
+void ChapterPageSource::Abort() {
+    {
+        ScopedCritSec scope(&access);
+        aborted = true;
+        WakeAllConditionVariable(&chapterLaidOut);
+    }
+    for (auto thread : threads) {
+        thread->RequestCancel();
+    }
+}
+
+// lays out the pages of a document in the background for EngineEbook::Layout,
+// so that the first pages can be shown right away. The source is deleted on
+// this thread as well, as that's where its formatter has been created
+class EbookLayoutThread : public ThreadBase {
+  public:
+    EngineEbook* engine = nullptr;
+    EbookPageSource* source = nullptr;
+    // protects source (which is deleted at the end of Run)
+    CRITICAL_SECTION sourceAccess;
+
+    EbookLayoutThread(EngineEbook* engine, EbookPageSource* source);
+    ~EbookLayoutThread() override;
+
+    void AbortSource();
+
+    // ThreadBase
+    void Run() override;
+};
+
+EbookLayoutThread::EbookLayoutThread(EngineEbook* engine, EbookPageSource* source) : ThreadBase("EbookLayoutThread") {
+    this->engine = engine;
+    this->source = source;
+    InitializeCriticalSection(&sourceAccess);
+}
+
+EbookLayoutThread::~EbookLayoutThread() {
+    // only still set if the thread has never run
+    delete source;
+    DeleteCriticalSection(&sourceAccess);
+}
+
+void EbookLayoutThread::AbortSource() {
+    ScopedCritSec scope(&sourceAccess);
+    if (source) {
+        source->Abort();
+    }
+}
+
+void EbookLayoutThread::Run() {
+    while (!WasCancelRequested() && engine->LayoutNextPage(source)) {
+        // keep going until all pages have been laid out
+    }
+    EbookPageSource* toDelete = nullptr;
+    {
+        ScopedCritSec scope(&sourceAccess);
+        toDelete = source;
+        source = nullptr;
+    }
+    delete toDelete;
+    engine->OnLayoutFinished(WasCancelRequested());
+}
+
 EngineEbook::EngineEbook() {
     pageCount = 0;
     // "B Format" paperback
     pageRect = RectF(0, 0, 5.12f * GetFileDPI(), 7.8f * GetFileDPI());
     pageBorder = 0.4f * GetFileDPI();
     preferredLayout = Layout_Book;
+    // rendering a laid out page is cheap compared to laying out a clone's pages
+    isExpensiveToClone = true;
     InitializeCriticalSection(&pagesAccess);
+    InitializeCriticalSection(&layoutAccess);
+    InitializeConditionVariable(&pageLaidOut);
 }
 
 EngineEbook::~EngineEbook() {
+    // usually already stopped by the derived class (before deleting its doc)
+    StopLayout();
+
     EnterCriticalSection(&pagesAccess);
 
     if (pages) {
@@ -187,6 +536,7 @@ EngineEbook::~EngineEbook() {
 
     LeaveCriticalSection(&pagesAccess);
     DeleteCriticalSection(&pagesAccess);
+    DeleteCriticalSection(&layoutAccess);
 }
 
 RectF EngineEbook::PageMediabox(__unused int pageNo) {
@@ -230,39 +580,172 @@ void EngineEbook::GetTransform(Matrix& m, float zoom, int rotation) {
     GetBaseTransform(m, ToGdipRectF(pageRect), zoom, rotation);
 }
 
-Vec<DrawInstr>* EngineEbook::GetHtmlPage(int pageNo) {
-    CrashIf(pageNo < 1 || PageCount() < pageNo);
-    if (pageNo < 1 || PageCount() < pageNo) {
-        return nullptr;
+bool EngineEbook::Layout(std::span<u8> html, const EbookFormatterFactory& newFormatter, bool skipEmptyPages) {
+    return Layout(new FormatterPageSource(html, newFormatter, skipEmptyPages));
+}
+
+// lays out all pages or (for lazyLayout) waits for only the first few ones, in which
+// case the remaining ones are laid out on a background thread and pageCount is
+// estimated until UpdatePageCount is called. Takes ownership of source
+bool EngineEbook::Layout(EbookPageSource* source) {
+    pages = new Vec<HtmlPage*>();
+    if (!lazyLayout) {
+        while (LayoutNextPage(source)) {
+            // keep going until all pages have been laid out
+        }
+        delete source;
+        pageCount = (int)pages->size();
+        return pageCount > 0;
+    }
+
+    // the first pages are laid out on the layout thread as well, so that
+    // the formatter is only ever used on the thread that has created it
+    layoutFinished = false;
+    layoutThread = new EbookLayoutThread(this, source);
+    layoutThread->Start();
+
+    bool finished;
+    size_t nPages;
+    float progress;
+    {
+        ScopedCritSec scope(&layoutAccess);
+        while (!layoutFinished && pages->size() < EBOOK_LAYOUT_FIRST_PAGES) {
+            SleepConditionVariableCS(&pageLaidOut, &layoutAccess, INFINITE);
+        }
+        finished = layoutFinished;
+        nPages = pages->size();
+        progress = layoutProgress;
     }
-    return &pages->at(pageNo - 1)->instructions;
+    if (finished) {
+        StopLayout();
+        pageCount = (int)pages->size();
+        return pageCount > 0;
+    }
+
+    // extrapolate from how much of the html data the first pages cover
+    // (a document mostly consisting of images might lead to a far too high
+    // estimate, so don't assume more than 1000 times as many pages)
+    progress = std::max(progress, 0.001f);
+    pageCount = std::max((int)nPages, (int)ceilf(nPages / progress));
+    return true;
 }
 
-bool EngineEbook::ExtractPageAnchors() {
-    ScopedCritSec scope(&pagesAccess);
+// returns false if all pages had already been laid out
+bool EngineEbook::WaitForLayout() {
+    ScopedCritSec scope(&layoutAccess);
+    if (layoutFinished) {
+        return false;
+    }
+    while (!layoutFinished) {
+        SleepConditionVariableCS(&pageLaidOut, &layoutAccess, INFINITE);
+    }
+    return true;
+}
 
-    DrawInstr* baseAnchor = nullptr;
-    for (int pageNo = 1; pageNo <= pageCount; pageNo++) {
-        Vec<DrawInstr>* pageInstrs = GetHtmlPage(pageNo);
-        if (!pageInstrs) {
+void EngineEbook::StopLayout() {
+    if (!layoutThread) {
+        return;
+    }
+    layoutThread->RequestCancel();
+    layoutThread->AbortSource();
+    layoutThread->Join();
+    delete layoutThread;
+    layoutThread = nullptr;
+}
+
+bool EngineEbook::LayoutNextPage(EbookPageSource* source) {
+    HtmlPage* page = source->Next();
+    if (!page) {
+        return false;
+    }
+    float progress = source->Progress();
+
+    ScopedCritSec scope(&layoutAccess);
+    pages->Append(page);
+    layoutProgress = progress;
+    ExtractPageAnchors((int)pages->size());
+    WakeAllConditionVariable(&pageLaidOut);
+    return true;
+}
+
+void EngineEbook::OnLayoutFinished(bool cancelled) {
+    std::function<void()> cb;
+    {
+        ScopedCritSec scope(&layoutAccess);
+        layoutFinished = true;
+        // wake up all threads waiting for pages beyond the final page count
+        WakeAllConditionVariable(&pageLaidOut);
+        cb = layoutFinishedCb;
+    }
+    if (cb && !cancelled) {
+        cb();
+    }
+}
+
+void EngineEbook::SetLayoutFinishedCb(const std::function<void()>& cb) {
+    if (!layoutThread) {
+        return;
+    }
+    {
+        ScopedCritSec scope(&layoutAccess);
+        if (!layoutFinished) {
+            layoutFinishedCb = cb;
+            return;
+        }
+    }
+    cb();
+}
+
+bool EngineEbook::UpdatePageCount() {
+    if (!layoutThread) {
+        return false;
+    }
+    {
+        ScopedCritSec scope(&layoutAccess);
+        if (!layoutFinished) {
             return false;
         }
+    }
+    StopLayout();
+    pageCount = (int)pages->size();
+    UpdateToc();
+    return true;
+}
 
-        for (size_t k = 0; k < pageInstrs->size(); k++) {
-            DrawInstr* i = &pageInstrs->at(k);
-            if (DrawInstrType::Anchor != i->type) {
-                continue;
-            }
-            anchors.Append(PageAnchor(i, pageNo));
-            if (k < 2 && str::StartsWith(i->str.s + i->str.len, "\" page_marker />")) {
-                baseAnchor = i;
-            }
+Vec<DrawInstr>* EngineEbook::GetHtmlPage(int pageNo) {
+    CrashIf(pageNo < 1);
+    if (pageNo < 1) {
+        return nullptr;
+    }
+
+    ScopedCritSec scope(&layoutAccess);
+    while ((size_t)pageNo > pages->size() && !layoutFinished) {
+        SleepConditionVariableCS(&pageLaidOut, &layoutAccess, INFINITE);
+    }
+    if ((size_t)pageNo > pages->size()) {
+        // the page count was an estimate and is about to be updated
+        return &blankPage.instructions;
+    }
+    return &pages->at(pageNo - 1)->instructions;
+}
+
+// must be called with layoutAccess held, right after page pageNo has been laid out
+void EngineEbook::ExtractPageAnchors(int pageNo) {
+    DrawInstr* baseAnchor = baseAnchors.size() > 0 ? baseAnchors.Last() : nullptr;
+    Vec<DrawInstr>* pageInstrs = &pages->at(pageNo - 1)->instructions;
+    for (size_t k = 0; k < pageInstrs->size(); k++) {
+        DrawInstr* i = &pageInstrs->at(k);
+        if (DrawInstrType::Anchor != i->type) {
+            continue;
+        }
+        anchors.Append(PageAnchor(i, pageNo));
+        if (k < 2 && str::StartsWith(i->str.s + i->str.len, "\" page_marker />")) {
+            baseAnchor = i;
         }
-        baseAnchors.Append(baseAnchor);
     }
+    baseAnchors.Append(baseAnchor);
 
     CrashIf(baseAnchors.size() != pages->size());
-    return true;
 }
 
 RectF EngineEbook::Transform(const RectF& rect, __unused int pageNo, float zoom, int rotation, bool inverse) {
@@ -428,7 +911,11 @@ PageElement* EngineEbook::CreatePageLink(DrawInstr* link, Rect rect, int pageNo)
         return newEbookLink(link, rect, nullptr, pageNo);
     }
 
-    DrawInstr* baseAnchor = baseAnchors.at(pageNo - 1);
+    DrawInstr* baseAnchor = nullptr;
+    {
+        ScopedCritSec scope(&layoutAccess);
+        baseAnchor = baseAnchors.at(pageNo - 1);
+    }
     if (baseAnchor) {
         AutoFree basePath(str::Dup(baseAnchor->str.s, baseAnchor->str.len));
         AutoFree relPath(ResolveHtmlEntities(link->str.s, link->str.len));
@@ -510,12 +997,23 @@ IPageElement* EngineEbook::GetElementAtPos(int pageNo, PointF pt) {
 }
 
 PageDestination* EngineEbook::GetNamedDest(const WCHAR* name) {
+    PageDestination* dest = FindNamedDest(name);
+    // the destination might be on a page that hasn't been laid out yet
+    if (!dest && WaitForLayout()) {
+        dest = FindNamedDest(name);
+    }
+    return dest;
+}
+
+PageDestination* EngineEbook::FindNamedDest(const WCHAR* name) {
     auto nameA(ToUtf8Temp(name));
     const char* id = nameA.Get();
     if (str::FindChar(id, '#')) {
         id = str::FindChar(id, '#') + 1;
     }
 
+    ScopedCritSec scope(&layoutAccess);
+
     // if the name consists of both path and ID,
     // try to first skip to the page with the desired
     // path before looking for the ID to allow
@@ -552,7 +1050,8 @@ PageDestination* EngineEbook::GetNamedDest(const WCHAR* name) {
     }
 
     // don't fail if an ID doesn't exist in a merged document
-    if (basePageNo != 0) {
+    // (unless it's on a page that hasn't been laid out yet)
+    if (basePageNo != 0 && layoutFinished) {
         RectF rect(0, pageBorder, pageRect.dx, 10);
         rect.Inflate(-pageBorder, 0);
         return newSimpleDest(basePageNo, rect);
@@ -627,13 +1126,13 @@ static void AppendTocItem(TocItem*& root, TocItem* item, int level) {
 }
 
 class EbookTocBuilder : public EbookTocVisitor {
-    EngineBase* engine = nullptr;
+    EngineEbook* engine = nullptr;
     TocItem* root = nullptr;
     int idCounter = 0;
     bool isIndex = false;
 
   public:
-    explicit EbookTocBuilder(EngineBase* engine) {
+    explicit EbookTocBuilder(EngineEbook* engine) {
         this->engine = engine;
     }
 
@@ -654,11 +1153,13 @@ void EbookTocBuilder::Visit(const WCHAR* name, const WCHAR* url, int level) {
     } else if (url::IsAbsolute(url)) {
         dest = newSimpleDest(0, RectF(), str::Dup(url));
     } else {
-        dest = engine->GetNamedDest(url);
+        // destinations on pages that haven't been laid out yet
+        // are filled in later by EngineEbook::UpdateToc
+        dest = engine->FindNamedDest(url);
         if (!dest && str::FindChar(url, '%')) {
             AutoFreeWstr decodedUrl(str::Dup(url));
             url::DecodeInPlace(decodedUrl);
-            dest = engine->GetNamedDest(decodedUrl);
+            dest = engine->FindNamedDest(decodedUrl);
         }
     }
 
@@ -672,6 +1173,16 @@ void EbookTocBuilder::Visit(const WCHAR* name, const WCHAR* url, int level) {
     AppendTocItem(root, item, level);
 }
 
+// copies the destinations from a ToC built after all pages have been laid out
+// into one built before (which is updated in place, since it might be displayed)
+static void UpdateTocItems(TocItem* item, TocItem* updated) {
+    for (; item && updated; item = item->next, updated = updated->next) {
+        std::swap(item->dest, updated->dest);
+        item->pageNo = updated->pageNo;
+        UpdateTocItems(item->child, updated->child);
+    }
+}
+
 /* EngineBase for handling EPUB documents */
 
 class EngineEpub : public EngineEbook {
@@ -689,7 +1200,7 @@ class EngineEpub : public EngineEbook {
 
     TocTree* GetToc() override;
 
-    static EngineBase* CreateFromFile(const WCHAR* fileName);
+    static EngineBase* CreateFromFile(const WCHAR* fileName, bool lazyLayout = false);
     static EngineBase* CreateFromStream(IStream* stream);
 
   protected:
@@ -700,6 +1211,7 @@ class EngineEpub : public EngineEbook {
     bool Load(const WCHAR* fileName);
     bool Load(IStream* stream);
     bool FinishLoading();
+    void UpdateToc() override;
 };
 
 EngineEpub::EngineEpub() : EngineEbook() {
@@ -708,6 +1220,7 @@ EngineEpub::EngineEpub() : EngineEbook() {
 }
 
 EngineEpub::~EngineEpub() {
+    StopLayout();
     delete doc;
     delete tocTree;
     if (stream) {
@@ -751,30 +1264,36 @@ bool EngineEpub::FinishLoading() {
         return false;
     }
 
-    HtmlFormatterArgs args{};
-    args.htmlStr = doc->GetHtmlData();
-    args.pageDx = (float)pageRect.dx - 2 * pageBorder;
-    args.pageDy = (float)pageRect.dy - 2 * pageBorder;
-    args.SetFontName(GetDefaultFontName());
-    args.fontSize = GetDefaultFontSize();
-    args.textAllocator = &allocator;
-    args.textRenderMethod = mui::TextRenderMethod::GdiplusQuick;
-
-    pages = EpubFormatter(&args, doc).FormatAllPages(false);
-
-    // must set pageCount before ExtractPageAnchors
-    pageCount = (int)pages->size();
-    if (!ExtractPageAnchors()) {
-        return false;
-    }
-
     if (doc->IsRTL()) {
         preferredLayout = (PageLayoutType)(Layout_Book | Layout_R2L);
     } else {
         preferredLayout = Layout_Book;
     }
 
-    return pageCount > 0;
+    float pageDx = (float)pageRect.dx - 2 * pageBorder;
+    float pageDy = (float)pageRect.dy - 2 * pageBorder;
+    float fontSize = GetDefaultFontSize();
+    // called on ChapterLayoutThreads for laying out the spine items in parallel
+    // or on the EbookLayoutThread (allocator is thread-safe and EpubDoc
+    // serializes access to its data)
+    auto newFormatter = [this, pageDx, pageDy, fontSize](std::span<u8> html) -> HtmlFormatter* {
+        HtmlFormatterArgs args{};
+        args.htmlStr = html;
+        args.pageDx = pageDx;
+        args.pageDy = pageDy;
+        args.SetFontName(GetDefaultFontName());
+        args.fontSize = fontSize;
+        args.textAllocator = &allocator;
+        args.textRenderMethod = mui::TextRenderMethod::GdiplusQuick;
+        return new EpubFormatter(&args, doc);
+    };
+
+    std::span<u8> html = doc->GetHtmlData();
+    const Vec<size_t>& spineOffsets = doc->GetSpineOffsets();
+    if (spineOffsets.size() < 2 || spineOffsets.at(0) != 0) {
+        return Layout(html, newFormatter, false);
+    }
+    return Layout(new ChapterPageSource(html, spineOffsets, newFormatter, false));
 }
 
 std::span<u8> EngineEpub::GetFileData() {
@@ -812,8 +1331,19 @@ TocTree* EngineEpub::GetToc() {
     return tocTree;
 }
 
-EngineBase* EngineEpub::CreateFromFile(const WCHAR* fileName) {
+void EngineEpub::UpdateToc() {
+    if (!tocTree) {
+        return;
+    }
+    EbookTocBuilder builder(this);
+    doc->ParseToc(&builder);
+    UpdateTocItems(tocTree->root, builder.GetRoot());
+    delete builder.GetRoot();
+}
+
+EngineBase* EngineEpub::CreateFromFile(const WCHAR* fileName, bool lazyLayout) {
     EngineEpub* engine = new EngineEpub();
+    engine->lazyLayout = lazyLayout;
     if (!engine->Load(fileName)) {
         delete engine;
         return nullptr;
@@ -830,8 +1360,8 @@ EngineBase* EngineEpub::CreateFromStream(IStream* stream) {
     return engine;
 }
 
-EngineBase* CreateEpubEngineFromFile(const WCHAR* fileName) {
-    return EngineEpub::CreateFromFile(fileName);
+EngineBase* CreateEpubEngineFromFile(const WCHAR* fileName, bool lazyLayout) {
+    return EngineEpub::CreateFromFile(fileName, lazyLayout);
 }
 
 EngineBase* CreateEpubEngineFromStream(IStream* stream) {
@@ -847,6 +1377,7 @@ class EngineFb2 : public EngineEbook {
         defaultFileExt = L".fb2";
     }
     virtual ~EngineFb2() {
+        StopLayout();
         delete tocTree;
         delete doc;
     }
@@ -864,7 +1395,7 @@ class EngineFb2 : public EngineEbook {
 
     TocTree* GetToc() override;
 
-    static EngineBase* CreateFromFile(const WCHAR* fileName);
+    static EngineBase* CreateFromFile(const WCHAR* fileName, bool lazyLayout = false);
     static EngineBase* CreateFromStream(IStream* stream);
 
   protected:
@@ -874,6 +1405,7 @@ class EngineFb2 : public EngineEbook {
     bool Load(const WCHAR* fileName);
     bool Load(IStream* stream);
     bool FinishLoading();
+    void UpdateToc() override;
 };
 
 bool EngineFb2::Load(const WCHAR* fileName) {
@@ -892,26 +1424,26 @@ bool EngineFb2::FinishLoading() {
         return false;
     }
 
-    HtmlFormatterArgs args;
-    args.htmlStr = doc->GetXmlData();
-    args.pageDx = (float)pageRect.dx - 2 * pageBorder;
-    args.pageDy = (float)pageRect.dy - 2 * pageBorder;
-    args.SetFontName(GetDefaultFontName());
-    args.fontSize = GetDefaultFontSize();
-    args.textAllocator = &allocator;
-    args.textRenderMethod = mui::TextRenderMethod::GdiplusQuick;
-
     if (doc->IsZipped()) {
         defaultFileExt = L".fb2z";
     }
 
-    pages = Fb2Formatter(&args, doc).FormatAllPages(false);
-    // must set pageCount before ExtractPageAnchors
-    pageCount = (int)pages->size();
-    if (!ExtractPageAnchors()) {
-        return false;
-    }
-    return pageCount > 0;
+    float pageDx = (float)pageRect.dx - 2 * pageBorder;
+    float pageDy = (float)pageRect.dy - 2 * pageBorder;
+    float fontSize = GetDefaultFontSize();
+    // called on the thread laying out the pages
+    auto newFormatter = [this, pageDx, pageDy, fontSize](std::span<u8> html) -> HtmlFormatter* {
+        HtmlFormatterArgs args;
+        args.htmlStr = html;
+        args.pageDx = pageDx;
+        args.pageDy = pageDy;
+        args.SetFontName(GetDefaultFontName());
+        args.fontSize = fontSize;
+        args.textAllocator = &allocator;
+        args.textRenderMethod = mui::TextRenderMethod::GdiplusQuick;
+        return new Fb2Formatter(&args, doc);
+    };
+    return Layout(doc->GetXmlData(), newFormatter, false);
 }
 
 TocTree* EngineFb2::GetToc() {
@@ -928,8 +1460,19 @@ TocTree* EngineFb2::GetToc() {
     return tocTree;
 }
 
-EngineBase* EngineFb2::CreateFromFile(const WCHAR* fileName) {
+void EngineFb2::UpdateToc() {
+    if (!tocTree) {
+        return;
+    }
+    EbookTocBuilder builder(this);
+    doc->ParseToc(&builder);
+    UpdateTocItems(tocTree->root, builder.GetRoot());
+    delete builder.GetRoot();
+}
+
+EngineBase* EngineFb2::CreateFromFile(const WCHAR* fileName, bool lazyLayout) {
     EngineFb2* engine = new EngineFb2();
+    engine->lazyLayout = lazyLayout;
     if (!engine->Load(fileName)) {
         delete engine;
         return nullptr;
@@ -946,8 +1489,8 @@ EngineBase* EngineFb2::CreateFromStream(IStream* stream) {
     return engine;
 }
 
-EngineBase* CreateFb2EngineFromFile(const WCHAR* fileName) {
-    return EngineFb2::CreateFromFile(fileName);
+EngineBase* CreateFb2EngineFromFile(const WCHAR* fileName, bool lazyLayout) {
+    return EngineFb2::CreateFromFile(fileName, lazyLayout);
 }
 
 EngineBase* CreateFb2EngineFromStream(IStream* stream) {
@@ -965,6 +1508,7 @@ class EngineMobi : public EngineEbook {
         defaultFileExt = L".mobi";
     }
     ~EngineMobi() override {
+        StopLayout();
         delete tocTree;
         delete doc;
     }
@@ -980,10 +1524,10 @@ class EngineMobi : public EngineEbook {
         return prop != DocumentProperty::FontList ? doc->GetProperty(prop) : ExtractFontList();
     }
 
-    PageDestination* GetNamedDest(const WCHAR* name) override;
+    PageDestination* FindNamedDest(const WCHAR* name) override;
     TocTree* GetToc() override;
 
-    static EngineBase* CreateFromFile(const WCHAR* fileName);
+    static EngineBase* CreateFromFile(const WCHAR* fileName, bool lazyLayout = false);
     static EngineBase* CreateFromStream(IStream* stream);
 
   protected:
@@ -993,6 +1537,7 @@ class EngineMobi : public EngineEbook {
     bool Load(const WCHAR* fileName);
     bool Load(IStream* stream);
     bool FinishLoading();
+    void UpdateToc() override;
 };
 
 bool EngineMobi::Load(const WCHAR* fileName) {
@@ -1011,33 +1556,41 @@ bool EngineMobi::FinishLoading() {
         return false;
     }
 
-    HtmlFormatterArgs args;
-    args.htmlStr = doc->GetHtmlData();
-    args.pageDx = (float)pageRect.dx - 2 * pageBorder;
-    args.pageDy = (float)pageRect.dy - 2 * pageBorder;
-    args.SetFontName(GetDefaultFontName());
-    args.fontSize = GetDefaultFontSize();
-    args.textAllocator = &allocator;
-    args.textRenderMethod = mui::TextRenderMethod::GdiplusQuick;
-
-    pages = MobiFormatter(&args, doc).FormatAllPages();
-    // must set pageCount before ExtractPageAnchors
-    pageCount = (int)pages->size();
-    if (!ExtractPageAnchors()) {
-        return false;
-    }
-    return pageCount > 0;
+    float pageDx = (float)pageRect.dx - 2 * pageBorder;
+    float pageDy = (float)pageRect.dy - 2 * pageBorder;
+    float fontSize = GetDefaultFontSize();
+    // called on the thread laying out the pages
+    auto newFormatter = [this, pageDx, pageDy, fontSize](std::span<u8> html) -> HtmlFormatter* {
+        HtmlFormatterArgs args;
+        args.htmlStr = html;
+        args.pageDx = pageDx;
+        args.pageDy = pageDy;
+        args.SetFontName(GetDefaultFontName());
+        args.fontSize = fontSize;
+        args.textAllocator = &allocator;
+        args.textRenderMethod = mui::TextRenderMethod::GdiplusQuick;
+        return new MobiFormatter(&args, doc);
+    };
+    return Layout(doc->GetHtmlData(), newFormatter, true);
 }
 
-PageDestination* EngineMobi::GetNamedDest(const WCHAR* name) {
+PageDestination* EngineMobi::FindNamedDest(const WCHAR* name) {
     int filePos = _wtoi(name);
     if (filePos < 0 || 0 == filePos && *name != '0') {
         return nullptr;
     }
     int pageNo;
-    for (pageNo = 1; pageNo < PageCount(); pageNo++) {
-        if (pages->at(pageNo)->reparseIdx > filePos) {
-            break;
+    {
+        ScopedCritSec scope(&layoutAccess);
+        int nPages = (int)pages->size();
+        for (pageNo = 1; pageNo < nPages; pageNo++) {
+            if (pages->at(pageNo)->reparseIdx > filePos) {
+                break;
+            }
+        }
+        // filePos might be on a page that hasn't been laid out yet
+        if (pageNo == nPages && !layoutFinished) {
+            return nullptr;
         }
     }
     CrashIf(pageNo < 1 || pageNo > PageCount());
@@ -1080,8 +1633,19 @@ TocTree* EngineMobi::GetToc() {
     return tocTree;
 }
 
-EngineBase* EngineMobi::CreateFromFile(const WCHAR* fileName) {
+void EngineMobi::UpdateToc() {
+    if (!tocTree) {
+        return;
+    }
+    EbookTocBuilder builder(this);
+    doc->ParseToc(&builder);
+    UpdateTocItems(tocTree->root, builder.GetRoot());
+    delete builder.GetRoot();
+}
+
+EngineBase* EngineMobi::CreateFromFile(const WCHAR* fileName, bool lazyLayout) {
     EngineMobi* engine = new EngineMobi();
+    engine->lazyLayout = lazyLayout;
     if (!engine->Load(fileName)) {
         delete engine;
         return nullptr;
@@ -1098,8 +1662,8 @@ EngineBase* EngineMobi::CreateFromStream(IStream* stream) {
     return engine;
 }
 
-EngineBase* CreateMobiEngineFromFile(const WCHAR* fileName) {
-    return EngineMobi::CreateFromFile(fileName);
+EngineBase* CreateMobiEngineFromFile(const WCHAR* fileName, bool lazyLayout) {
+    return EngineMobi::CreateFromFile(fileName, lazyLayout);
 }
 
 EngineBase* CreateMobiEngineFromStream(IStream* stream) {
@@ -1149,23 +1713,22 @@ bool EnginePdb::Load(const WCHAR* fileName) {
         return false;
     }
 
-    HtmlFormatterArgs args;
-    args.htmlStr = doc->GetHtmlData();
-    args.pageDx = (float)pageRect.dx - 2 * pageBorder;
-    args.pageDy = (float)pageRect.dy - 2 * pageBorder;
-    args.SetFontName(GetDefaultFontName());
-    args.fontSize = GetDefaultFontSize();
-    args.textAllocator = &allocator;
-    args.textRenderMethod = mui::TextRenderMethod::GdiplusQuick;
-
-    pages = HtmlFormatter(&args).FormatAllPages();
-    // must set pageCount before ExtractPageAnchors
-    pageCount = (int)pages->size();
-    if (!ExtractPageAnchors()) {
-        return false;
-    }
-
-    return pageCount > 0;
+    float pageDx = (float)pageRect.dx - 2 * pageBorder;
+    float pageDy = (float)pageRect.dy - 2 * pageBorder;
+    float fontSize = GetDefaultFontSize();
+    // called on the thread laying out the pages
+    auto newFormatter = [this, pageDx, pageDy, fontSize](std::span<u8> html) -> HtmlFormatter* {
+        HtmlFormatterArgs args;
+        args.htmlStr = html;
+        args.pageDx = pageDx;
+        args.pageDy = pageDy;
+        args.SetFontName(GetDefaultFontName());
+        args.fontSize = fontSize;
+        args.textAllocator = &allocator;
+        args.textRenderMethod = mui::TextRenderMethod::GdiplusQuick;
+        return new HtmlFormatter(&args);
+    };
+    return Layout(doc->GetHtmlData(), newFormatter, true);
 }
 
 TocTree* EnginePdb::GetToc() {
@@ -1471,23 +2034,22 @@ bool EngineChm::Load(const WCHAR* fileName) {
     char* html = ChmHtmlCollector(doc).GetHtml();
     dataCache = new ChmDataCache(doc, html);
 
-    HtmlFormatterArgs args;
-    args.htmlStr = dataCache->GetHtmlData();
-    args.pageDx = (float)pageRect.dx - 2 * pageBorder;
-    args.pageDy = (float)pageRect.dy - 2 * pageBorder;
-    args.SetFontName(GetDefaultFontName());
-    args.fontSize = GetDefaultFontSize();
-    args.textAllocator = &allocator;
-    args.textRenderMethod = mui::TextRenderMethod::GdiplusQuick;
-
-    pages = ChmFormatter(&args, dataCache).FormatAllPages(false);
-    // must set pageCount before ExtractPageAnchors
-    pageCount = (int)pages->size();
-    if (!ExtractPageAnchors()) {
-        return false;
-    }
-
-    return pageCount > 0;
+    float pageDx = (float)pageRect.dx - 2 * pageBorder;
+    float pageDy = (float)pageRect.dy - 2 * pageBorder;
+    float fontSize = GetDefaultFontSize();
+    // called on the thread laying out the pages
+    auto newFormatter = [this, pageDx, pageDy, fontSize](std::span<u8> html) -> HtmlFormatter* {
+        HtmlFormatterArgs args;
+        args.htmlStr = html;
+        args.pageDx = pageDx;
+        args.pageDy = pageDy;
+        args.SetFontName(GetDefaultFontName());
+        args.fontSize = fontSize;
+        args.textAllocator = &allocator;
+        args.textRenderMethod = mui::TextRenderMethod::GdiplusQuick;
+        return new ChmFormatter(&args, dataCache);
+    };
+    return Layout(dataCache->GetHtmlData(), newFormatter, false);
 }
 
 PageDestination* EngineChm::GetNamedDest(const WCHAR* name) {
@@ -1609,23 +2171,22 @@ bool EngineHtml::Load(const WCHAR* fileName) {
         return false;
     }
 
-    HtmlFormatterArgs args;
-    args.htmlStr = doc->GetHtmlData();
-    args.pageDx = (float)pageRect.dx - 2 * pageBorder;
-    args.pageDy = (float)pageRect.dy - 2 * pageBorder;
-    args.SetFontName(GetDefaultFontName());
-    args.fontSize = GetDefaultFontSize();
-    args.textAllocator = &allocator;
-    args.textRenderMethod = mui::TextRenderMethod::Gdiplus;
-
-    pages = HtmlFileFormatter(&args, doc).FormatAllPages(false);
-    // must set pageCount before ExtractPageAnchors
-    pageCount = (int)pages->size();
-    if (!ExtractPageAnchors()) {
-        return false;
-    }
-
-    return pageCount > 0;
+    float pageDx = (float)pageRect.dx - 2 * pageBorder;
+    float pageDy = (float)pageRect.dy - 2 * pageBorder;
+    float fontSize = GetDefaultFontSize();
+    // called on the thread laying out the pages
+    auto newFormatter = [this, pageDx, pageDy, fontSize](std::span<u8> html) -> HtmlFormatter* {
+        HtmlFormatterArgs args;
+        args.htmlStr = html;
+        args.pageDx = pageDx;
+        args.pageDy = pageDy;
+        args.SetFontName(GetDefaultFontName());
+        args.fontSize = fontSize;
+        args.textAllocator = &allocator;
+        args.textRenderMethod = mui::TextRenderMethod::Gdiplus;
+        return new HtmlFileFormatter(&args, doc);
+    };
+    return Layout(doc->GetHtmlData(), newFormatter, false);
 }
 
 static PageDestination* newRemoteHtmlDest(const WCHAR* relativeURL) {
@@ -1724,23 +2285,22 @@ bool EngineTxt::Load(const WCHAR* fileName) {
         pageRect = RectF(0, 0, 8.5f * GetFileDPI(), 11.f * GetFileDPI());
     }
 
-    HtmlFormatterArgs args;
-    args.htmlStr = doc->GetHtmlData();
-    args.pageDx = (float)pageRect.dx - 2 * pageBorder;
-    args.pageDy = (float)pageRect.dy - 2 * pageBorder;
-    args.SetFontName(GetDefaultFontName());
-    args.fontSize = GetDefaultFontSize();
-    args.textAllocator = &allocator;
-    args.textRenderMethod = mui::TextRenderMethod::Gdiplus;
-
-    pages = TxtFormatter(&args).FormatAllPages(false);
-    // must set pageCount before ExtractPageAnchors
-    pageCount = (int)pages->size();
-    if (!ExtractPageAnchors()) {
-        return false;
-    }
-
-    return pageCount > 0;
+    float pageDx = (float)pageRect.dx - 2 * pageBorder;
+    float pageDy = (float)pageRect.dy - 2 * pageBorder;
+    float fontSize = GetDefaultFontSize();
+    // called on the thread laying out the pages
+    auto newFormatter = [this, pageDx, pageDy, fontSize](std::span<u8> html) -> HtmlFormatter* {
+        HtmlFormatterArgs args;
+        args.htmlStr = html;
+        args.pageDx = pageDx;
+        args.pageDy = pageDy;
+        args.SetFontName(GetDefaultFontName());
+        args.fontSize = fontSize;
+        args.textAllocator = &allocator;
+        args.textRenderMethod = mui::TextRenderMethod::Gdiplus;
+        return new TxtFormatter(&args);
+    };
+    return Layout(doc->GetHtmlData(), newFormatter, false);
 }
 
 TocTree* EngineTxt::GetToc() {
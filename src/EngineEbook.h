@@ -1,11 +1,11 @@
 /* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
    License: GPLv3 */
 
-EngineBase* CreateEpubEngineFromFile(const WCHAR* fileName);
+EngineBase* CreateEpubEngineFromFile(const WCHAR* fileName, bool lazyLayout = false);
 EngineBase* CreateEpubEngineFromStream(IStream* stream);
-EngineBase* CreateFb2EngineFromFile(const WCHAR* fileName);
+EngineBase* CreateFb2EngineFromFile(const WCHAR* fileName, bool lazyLayout = false);
 EngineBase* CreateFb2EngineFromStream(IStream* stream);
-EngineBase* CreateMobiEngineFromFile(const WCHAR* fileName);
+EngineBase* CreateMobiEngineFromFile(const WCHAR* fileName, bool lazyLayout = false);
 EngineBase* CreateMobiEngineFromStream(IStream* stream);
 EngineBase* CreatePdbEngineFromFile(const WCHAR* fileName);
 EngineBase* CreateChmEngineFromFile(const WCHAR* fileName);
@@ -13,10 +13,12 @@ extern "C" {
 #include "utils/FileUtil.h"
 #include "utils/HtmlParserLookup.h"
 #include "utils/HtmlPullParser.h"
+#include "utils/SharedFile.h"
 #include "utils/TrivialHtmlParser.h"
 #include "utils/WinUtil.h"
 #include "utils/ZipUtil.h"
 #include "utils/Log.h"
+#include "utils/Timer.h"
 
 #include "AppColors.h"
 #include "wingui/TreeModel.h"
@@ -26,11 +28,6 @@ extern "C" {
 
 // extensions to Fitz that are usable for both PDF and XPS
 
-// maximum size of a file that's entirely loaded into memory before parsed
-// and displayed; larger files will be kept open while they're displayed
-// so that their content can be loaded on demand in order to preserve memory
-#define MAX_MEMORY_FILE_SIZE (32 * 1024 * 1024)
-
 RectF ToRectFl(fz_rect rect) {
     return RectF::FromXY(rect.x0, rect.y0, rect.x1, rect.y1);
 }
@@ -168,45 +165,59 @@ void* fz_memdup(fz_context* ctx, void* p, size_t size) {
     return res;
 }
 
-fz_stream* fz_open_file2(fz_context* ctx, const WCHAR* filePath) {
-    fz_stream* stm = nullptr;
-    auto path = ToUtf8Temp(filePath);
-    i64 fileSize = file::GetSize(path.AsView());
-    // load small files entirely into memory so that they can be
-    // overwritten even by programs that don't open files with FILE_SHARE_READ
-    if (fileSize > 0 && fileSize < MAX_MEMORY_FILE_SIZE) {
-        auto dataTmp = file::ReadFileWithAllocator(filePath, nullptr);
-        if (dataTmp.empty()) {
-            // failed to read
-            return nullptr;
-        }
+static int NextSharedFile(__unused fz_context* ctx, __unused fz_stream* stm, __unused size_t max) {
+    // the whole file is always available
+    return EOF;
+}
 
-        // TODO: we copy so that the memory ends up in chunk allocated
-        // by libmupdf so that it works across dll boundaries.
-        // We can either use  fz_new_buffer_from_shared_data
-        // and free the data on the side or create Allocator that
-        // uses fz_malloc_no_throw and pass it to ReadFileWithAllocator
-        size_t size = dataTmp.size();
-        void* data = fz_memdup(ctx, (void*)dataTmp.data(), size);
-        if (!data) {
-            return nullptr;
-        }
-        str::Free(dataTmp.data());
+// like seek_buffer in stream-open.c but without limiting offsets to 2 GB
+static void SeekSharedFile(__unused fz_context* ctx, fz_stream* stm, i64 offset, int whence) {
+    SharedFile* file = (SharedFile*)stm->state;
+    u8* start = file->data.data();
+    i64 size = (i64)file->data.size();
+    if (whence == SEEK_CUR) {
+        offset += (i64)(stm->rp - start);
+    } else if (whence == SEEK_END) {
+        offset += size;
+    }
+    offset = limitValue(offset, (i64)0, size);
+    stm->rp = start + offset;
+}
 
-        fz_buffer* buf = fz_new_buffer_from_data(ctx, (u8*)data, size);
-        fz_var(buf);
-        fz_try(ctx) {
-            stm = fz_open_buffer(ctx, buf);
-        }
-        fz_always(ctx) {
-            fz_drop_buffer(ctx, buf);
-        }
-        fz_catch(ctx) {
-            stm = nullptr;
-        }
-        return stm;
+static void DropSharedFile(__unused fz_context* ctx, void* state) {
+    SharedFile* file = (SharedFile*)state;
+    file->Release();
+}
+
+// takes ownership of the reference to file
+static fz_stream* FzOpenSharedFile(fz_context* ctx, SharedFile* file) {
+    fz_stream* stm = nullptr;
+    fz_try(ctx) {
+        // calls DropSharedFile if it throws
+        stm = fz_new_stream(ctx, file, NextSharedFile, DropSharedFile);
+        stm->seek = SeekSharedFile;
+        stm->rp = file->data.data();
+        stm->wp = file->data.data() + file->data.size();
+        stm->pos = (i64)file->data.size();
+    }
+    fz_catch(ctx) {
+        stm = nullptr;
     }
+    return stm;
+}
 
+// the file's content is shared between all engines that have the same file open
+// (e.g. clones used for printing). Big files are memory-mapped and only paged in
+// as needed, smaller files are read into memory so that they can be overwritten
+// even by programs that don't open files with FILE_SHARE_READ
+fz_stream* fz_open_file2(fz_context* ctx, const WCHAR* filePath) {
+    SharedFile* file = SharedFile::Open(filePath);
+    if (file) {
+        return FzOpenSharedFile(ctx, file);
+    }
+
+    // e.g. big files on network drives
+    fz_stream* stm = nullptr;
     fz_try(ctx) {
         stm = fz_open_file_w(ctx, filePath);
     }
@@ -216,6 +227,23 @@ fz_stream* fz_open_file2(fz_context* ctx, const WCHAR* filePath) {
     return stm;
 }
 
+// the content of a stream opened by fz_open_file2 doesn't change while it's open
+// (it's either a copy of the file or a mapping of a file that other programs can't
+// write to, see SharedFile), so it can be hashed without the context (and without
+// holding the engine's lock).
+// returns false for all other streams
+bool fz_shared_file_fingerprint(fz_stream* stm, u8 digest[16]) {
+    if (!stm || stm->next != NextSharedFile) {
+        return false;
+    }
+    SharedFile* file = (SharedFile*)stm->state;
+    fz_md5 md5;
+    fz_md5_init(&md5);
+    fz_md5_update(&md5, file->data.data(), file->data.size());
+    fz_md5_final(&md5, digest);
+    return true;
+}
+
 std::span<u8> fz_extract_stream_data(fz_context* ctx, fz_stream* stream) {
     fz_seek(ctx, stream, 0, 2);
     i64 fileLen = fz_tell(ctx, stream);
@@ -236,31 +264,27 @@ std::span<u8> fz_extract_stream_data(fz_context* ctx, fz_stream* stream) {
     return {res, size};
 }
 
-void fz_stream_fingerprint(fz_context* ctx, fz_stream* stm, u8 digest[16]) {
-    i64 fileLen = -1;
-    fz_buffer* buf = nullptr;
+bool fz_stream_fingerprint(fz_context* ctx, fz_stream* stm, u8 digest[16]) {
+    // hash the stream in chunks instead of reading it all into memory
+    // (this is also used for the disk cache of big documents)
+    u8 chunk[64 * 1024];
+    fz_md5 md5;
+    fz_md5_init(&md5);
 
     fz_try(ctx) {
-        fz_seek(ctx, stm, 0, 2);
-        fileLen = fz_tell(ctx, stm);
         fz_seek(ctx, stm, 0, 0);
-        buf = fz_read_all(ctx, stm, fileLen);
+        size_t n;
+        while ((n = fz_read(ctx, stm, chunk, sizeof(chunk))) > 0) {
+            fz_md5_update(&md5, chunk, n);
+        }
     }
     fz_catch(ctx) {
         fz_warn(ctx, "couldn't read stream data, using a nullptr fingerprint instead");
         ZeroMemory(digest, 16);
-        return;
+        return false;
     }
-    CrashIf(nullptr == buf);
-    u8* data;
-    size_t size = fz_buffer_extract(ctx, buf, &data);
-    CrashIf((size_t)fileLen != size);
-    fz_drop_buffer(ctx, buf);
-
-    fz_md5 md5;
-    fz_md5_init(&md5);
-    fz_md5_update(&md5, data, size);
     fz_md5_final(&md5, digest);
+    return true;
 }
 
 // try to produce an 8-bit palette for saving some memory
@@ -434,6 +458,261 @@ RenderedBitmap* new_rendered_fz_pixmap(fz_context* ctx, fz_pixmap* pixmap) {
     return new RenderedBitmap(hbmp, Size(w, h), hMap);
 }
 
+// creates a BGRA pixmap whose samples are the bits of a new DIB section, so that
+// the draw device renders straight into the bitmap that ends up on screen without
+// any conversion or copying (as opposed to new_rendered_fz_pixmap).
+// throws if the DIB section can't be created (e.g. when running out of GDI resources)
+void fz_new_dib_pixmap(fz_context* ctx, fz_irect bbox, FzDibPixmap* dib) {
+    CrashIf(dib->pix || dib->hbmp);
+    int w = bbox.x1 - bbox.x0;
+    int h = bbox.y1 - bbox.y0;
+    if (w <= 0 || h <= 0 || (u64)w * (u64)h * 4 > (u64)INT_MAX) {
+        fz_throw(ctx, FZ_ERROR_GENERIC, "invalid bitmap size %d x %d", w, h);
+    }
+    int stride = w * 4;
+    DWORD imgSize = (DWORD)stride * (DWORD)h;
+
+    BITMAPINFO bmi{};
+    BITMAPINFOHEADER* bmih = &bmi.bmiHeader;
+    bmih->biSize = sizeof(*bmih);
+    bmih->biWidth = w;
+    bmih->biHeight = -h;
+    bmih->biPlanes = 1;
+    bmih->biCompression = BI_RGB;
+    bmih->biBitCount = 32;
+    bmih->biSizeImage = imgSize;
+
+    void* data = nullptr;
+    HANDLE hMap = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, imgSize, nullptr);
+    HBITMAP hbmp = CreateDIBSection(nullptr, &bmi, DIB_RGB_COLORS, &data, hMap, 0);
+    if (!hbmp || !data) {
+        if (hbmp) {
+            DeleteObject(hbmp);
+        }
+        if (hMap) {
+            CloseHandle(hMap);
+        }
+        fz_throw(ctx, FZ_ERROR_GENERIC, "CreateDIBSection failed for %d x %d", w, h);
+    }
+    dib->hbmp = hbmp;
+    dib->hMap = hMap;
+
+    fz_try(ctx) {
+        // the pixmap doesn't own the samples, they're freed with the DIB section
+        dib->pix = fz_new_pixmap_with_data(ctx, fz_device_bgr(ctx), w, h, nullptr, 1, stride, (u8*)data);
+        dib->pix->x = bbox.x0;
+        dib->pix->y = bbox.y0;
+    }
+    fz_catch(ctx) {
+        fz_drop_dib_pixmap(ctx, dib);
+        fz_rethrow(ctx);
+    }
+}
+
+// transfers the DIB section from dib to the returned bitmap
+RenderedBitmap* new_rendered_dib_pixmap(fz_context* ctx, FzDibPixmap* dib) {
+    CrashIf(!dib->pix || !dib->hbmp);
+    Size size(dib->pix->w, dib->pix->h);
+    RenderedBitmap* res = new RenderedBitmap(dib->hbmp, size, dib->hMap);
+    fz_drop_pixmap(ctx, dib->pix);
+    *dib = {};
+    return res;
+}
+
+void fz_drop_dib_pixmap(fz_context* ctx, FzDibPixmap* dib) {
+    fz_drop_pixmap(ctx, dib->pix);
+    if (dib->hbmp) {
+        DeleteObject(dib->hbmp);
+    }
+    if (dib->hMap) {
+        CloseHandle(dib->hMap);
+    }
+    *dib = {};
+}
+
+struct FzParallelJobs {
+    fz_tune_parallel_job_fn* job = nullptr;
+    void* jobArg = nullptr;
+    int count = 0;
+    LONG nClaimed = 0;
+};
+
+static void RunClaimedJobs(FzParallelJobs* jobs) {
+    for (;;) {
+        LONG i = InterlockedIncrement(&jobs->nClaimed) - 1;
+        if (i >= jobs->count) {
+            return;
+        }
+        jobs->job(jobs->jobArg, (int)i);
+    }
+}
+
+static void CALLBACK FzParallelWorkCallback(__unused PTP_CALLBACK_INSTANCE inst, void* data, __unused PTP_WORK work) {
+    RunClaimedJobs((FzParallelJobs*)data);
+}
+
+// the number of processors doesn't change while we're running
+static int GetCpuCount() {
+    static int nCpus = 0;
+    if (nCpus == 0) {
+        SYSTEM_INFO si{};
+        GetSystemInfo(&si);
+        nCpus = std::max((int)si.dwNumberOfProcessors, 1);
+    }
+    return nCpus;
+}
+
+// runs the jobs on the Windows thread pool. The calling thread claims jobs
+// as well, so that all of them get done even if the pool is busy (e.g. with
+// the jobs of other rendering threads)
+void FzRunParallel(int count, fz_tune_parallel_job_fn* job, void* jobArg) {
+    FzParallelJobs jobs;
+    jobs.job = job;
+    jobs.jobArg = jobArg;
+    jobs.count = count;
+
+    int nHelpers = std::min(count, GetCpuCount()) - 1;
+    PTP_WORK work = nullptr;
+    if (nHelpers > 0) {
+        work = CreateThreadpoolWork(FzParallelWorkCallback, &jobs, nullptr);
+    }
+    for (int i = 0; work && i < nHelpers; i++) {
+        SubmitThreadpoolWork(work);
+    }
+    RunClaimedJobs(&jobs);
+    if (work) {
+        // all jobs have been claimed, so helpers that haven't started yet
+        // would have nothing left to do
+        WaitForThreadpoolWorkCallbacks(work, TRUE);
+        CloseThreadpoolWork(work);
+    }
+}
+
+void FzEnterLock(CRITICAL_SECTION* cs, FzLockStats* stats) {
+    if (TryEnterCriticalSection(cs)) {
+        return;
+    }
+    auto start = TimeGet();
+    EnterCriticalSection(cs);
+    // updated while holding the lock, so no need for interlocked operations
+    stats->waits++;
+    stats->waitTicks += TimeGet().QuadPart - start.QuadPart;
+}
+
+void FzLogLockStats(FzLockStats stats[FZ_LOCK_MAX]) {
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    for (int i = 0; i < FZ_LOCK_MAX; i++) {
+        if (stats[i].waits == 0) {
+            continue;
+        }
+        double waitMs = (double)stats[i].waitTicks * 1000.0 / (double)freq.QuadPart;
+        dbglogf("mupdf lock %d: waited %d times for %.2f ms\n", i, (int)stats[i].waits, waitMs);
+    }
+}
+
+static void fz_run_parallel_threadpool(__unused void* arg, int count, fz_tune_parallel_job_fn* job, void* jobArg) {
+    FzRunParallel(count, job, jobArg);
+}
+
+void fz_install_parallel_image_scaling(fz_context* ctx) {
+    fz_tune_image_scale_parallel(ctx, fz_run_parallel_threadpool, nullptr);
+}
+
+int FzRenderBandCount(fz_irect bbox) {
+    int w = bbox.x1 - bbox.x0;
+    int h = bbox.y1 - bbox.y0;
+    if ((i64)w * h < BANDED_RENDER_MIN_PIXELS) {
+        return 1;
+    }
+    int nCpus = GetCpuCount();
+    if (nCpus < 2) {
+        return 1;
+    }
+    // more bands than cores, so that cores done with simple bands
+    // can help out with the complex ones
+    int nBands = std::min(nCpus * 2, h / BANDED_RENDER_MIN_BAND_HEIGHT);
+    return limitValue(nBands, 1, BANDED_RENDER_MAX_BANDS);
+}
+
+struct FzRenderBands {
+    fz_display_list** lists = nullptr;
+    int nLists = 0;
+    fz_pixmap* pix = nullptr;
+    fz_matrix ctm{};
+    fz_cookie* cookie = nullptr;
+    // one clone of the engine's context per band
+    fz_context* ctxs[BANDED_RENDER_MAX_BANDS] = {};
+    int nBands = 0;
+    LONG nFailed = 0;
+};
+
+static void RenderBand(void* arg, int band) {
+    FzRenderBands* rb = (FzRenderBands*)arg;
+    fz_context* ctx = rb->ctxs[band];
+    fz_pixmap* pix = rb->pix;
+    int y0 = pix->h * band / rb->nBands;
+    int y1 = pix->h * (band + 1) / rb->nBands;
+
+    fz_pixmap* bandPix = nullptr;
+    fz_device* dev = nullptr;
+    fz_var(bandPix);
+    fz_var(dev);
+    fz_try(ctx) {
+        // draws directly into the band's rows of pix
+        u8* samples = pix->samples + (size_t)y0 * pix->stride;
+        bandPix = fz_new_pixmap_with_data(ctx, pix->colorspace, pix->w, y1 - y0, pix->seps, pix->alpha,
+                                          (int)pix->stride, samples);
+        bandPix->x = pix->x;
+        bandPix->y = pix->y + y0;
+        fz_rect cliprect = fz_rect_from_irect(fz_pixmap_bbox(ctx, bandPix));
+        dev = fz_new_draw_device(ctx, fz_identity, bandPix);
+        for (int i = 0; i < rb->nLists; i++) {
+            fz_run_display_list(ctx, rb->lists[i], dev, rb->ctm, cliprect, rb->cookie);
+        }
+        fz_close_device(ctx, dev);
+    }
+    fz_always(ctx) {
+        fz_drop_device(ctx, dev);
+        fz_drop_pixmap(ctx, bandPix);
+    }
+    fz_catch(ctx) {
+        InterlockedIncrement(&rb->nFailed);
+    }
+}
+
+void FzRunDisplayListsBanded(fz_context* ctx, fz_display_list** lists, int nLists, fz_pixmap* pix, fz_matrix ctm,
+                             int nBands, fz_cookie* cookie) {
+    FzRenderBands rb;
+    rb.lists = lists;
+    rb.nLists = nLists;
+    rb.pix = pix;
+    rb.ctm = ctm;
+    // all bands share the cookie, so that aborting stops all of them
+    // (its progress counters are only approximate)
+    rb.cookie = cookie;
+    rb.nBands = limitValue(std::min(nBands, pix->h), 1, BANDED_RENDER_MAX_BANDS);
+
+    for (int i = 0; i < rb.nBands; i++) {
+        rb.ctxs[i] = fz_clone_context(ctx);
+        if (!rb.ctxs[i]) {
+            for (int j = 0; j < i; j++) {
+                fz_drop_context(rb.ctxs[j]);
+            }
+            fz_throw(ctx, FZ_ERROR_GENERIC, "cannot clone context for banded rendering");
+        }
+    }
+
+    FzRunParallel(rb.nBands, RenderBand, &rb);
+
+    for (int i = 0; i < rb.nBands; i++) {
+        fz_drop_context(rb.ctxs[i]);
+    }
+    if (rb.nFailed > 0) {
+        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot render %d of %d bands", (int)rb.nFailed, rb.nBands);
+    }
+}
+
 static inline int wchars_per_rune(int rune) {
     if (rune & 0x1F0000) {
         return 2;
@@ -1034,3 +1313,71 @@ COLORREF ColorRefFromPdfFloat(fz_context* ctx, int n, float color[4]) {
     CrashIf(true);
     return 0;
 }
+
+FzPageRun* FzPageRunCacheGet(FzPageRunCache* cache, int pageNo) {
+    int n = cache->runs.isize();
+    for (int i = 0; i < n; i++) {
+        FzPageRun* run = cache->runs[i];
+        if (run->pageNo != pageNo) {
+            continue;
+        }
+        // move to the end as the most recently used
+        cache->runs.RemoveAt(i);
+        cache->runs.Append(run);
+        cache->stats.hits++;
+        cache->stats.interpretMsSaved += run->interpretMs;
+        return run;
+    }
+    cache->stats.misses++;
+    return nullptr;
+}
+
+static void FzPageRunDrop(fz_context* ctx, FzPageRunCache* cache, int idx) {
+    FzPageRun* run = cache->runs[idx];
+    cache->runs.RemoveAt(idx);
+    CrashIf(run->bytes > cache->usedBytes);
+    cache->usedBytes -= run->bytes;
+    fz_drop_display_list(ctx, run->list);
+    delete run;
+}
+
+// takes a reference to list (if it's cached), the caller still has to drop its own.
+// returns false if the list is too big to be cached
+bool FzPageRunCacheAdd(fz_context* ctx, FzPageRunCache* cache, int pageNo, fz_display_list* list, float interpretMs) {
+    size_t bytes = fz_display_list_size(ctx, list);
+    if (bytes > cache->maxBytes) {
+        return false;
+    }
+    FzPageRunCacheRemove(ctx, cache, pageNo);
+    while (cache->runs.size() > 0) {
+        bool isFull = cache->runs.size() >= MAX_PAGE_RUN_CACHE;
+        if (!isFull && cache->usedBytes + bytes <= cache->maxBytes) {
+            break;
+        }
+        FzPageRunDrop(ctx, cache, 0);
+        cache->stats.evictions++;
+    }
+
+    FzPageRun* run = new FzPageRun();
+    run->pageNo = pageNo;
+    run->list = fz_keep_display_list(ctx, list);
+    run->bytes = bytes;
+    run->interpretMs = interpretMs;
+    cache->runs.Append(run);
+    cache->usedBytes += bytes;
+    return true;
+}
+
+void FzPageRunCacheRemove(fz_context* ctx, FzPageRunCache* cache, int pageNo) {
+    for (int i = cache->runs.isize() - 1; i >= 0; i--) {
+        if (cache->runs[i]->pageNo == pageNo) {
+            FzPageRunDrop(ctx, cache, i);
+        }
+    }
+}
+
+void FzPageRunCacheFree(fz_context* ctx, FzPageRunCache* cache) {
+    while (cache->runs.size() > 0) {
+        FzPageRunDrop(ctx, cache, cache->runs.isize() - 1);
+    }
+}
@@ -47,6 +47,44 @@ struct FzPageInfo {
     bool commentsNeedRebuilding{false};
 };
 
+// a page's content stream recorded into a display list, so that rendering
+// at a different zoom level, rotation or as a tile only has to replay it
+struct FzPageRun {
+    int pageNo = 0;
+    fz_display_list* list = nullptr;
+    size_t bytes = 0;
+    // how long it took to interpret the content stream
+    float interpretMs = 0.f;
+};
+
+struct FzPageRunCacheStats {
+    i64 hits = 0;
+    i64 misses = 0;
+    i64 evictions = 0;
+    // interpretation time saved by replaying cached display lists
+    double interpretMsSaved = 0;
+};
+
+// implemented in EnginePdf.cpp, return false if engine isn't a PDF engine
+bool EnginePdfGetGlyphCacheStats(EngineBase* engine, fz_glyph_cache_stats* statsOut);
+bool EnginePdfSetGlyphCacheSize(EngineBase* engine, size_t maxSize);
+
+// least recently used FzPageRun are evicted when either MAX_PAGE_RUN_CACHE
+// or maxBytes is exceeded. Setting maxBytes to 0 disables the cache.
+// Must only be accessed under the ctxAccess lock of the owning engine.
+struct FzPageRunCache {
+    // most recently used at the end
+    Vec<FzPageRun*> runs;
+    size_t maxBytes = MAX_PAGE_RUN_MEMORY;
+    size_t usedBytes = 0;
+    FzPageRunCacheStats stats;
+};
+
+FzPageRun* FzPageRunCacheGet(FzPageRunCache* cache, int pageNo);
+bool FzPageRunCacheAdd(fz_context* ctx, FzPageRunCache* cache, int pageNo, fz_display_list* list, float interpretMs);
+void FzPageRunCacheRemove(fz_context* ctx, FzPageRunCache* cache, int pageNo);
+void FzPageRunCacheFree(fz_context* ctx, FzPageRunCache* cache);
+
 struct LinkRectList {
     WStrVec links;
     Vec<fz_rect> coords;
@@ -64,11 +102,53 @@ WCHAR* pdf_clean_string(WCHAR* string);
 
 fz_stream* fz_open_istream(fz_context* ctx, IStream* stream);
 fz_stream* fz_open_file2(fz_context* ctx, const WCHAR* filePath);
-void fz_stream_fingerprint(fz_context* ctx, fz_stream* stm, u8 digest[16]);
+bool fz_stream_fingerprint(fz_context* ctx, fz_stream* stm, u8 digest[16]);
+bool fz_shared_file_fingerprint(fz_stream* stm, u8 digest[16]);
 std::span<u8> fz_extract_stream_data(fz_context* ctx, fz_stream* stream);
 
 RenderedBitmap* new_rendered_fz_pixmap(fz_context* ctx, fz_pixmap* pixmap);
 
+// a pixmap rendering directly into the bits of a DIB section
+struct FzDibPixmap {
+    fz_pixmap* pix = nullptr;
+    HBITMAP hbmp = nullptr;
+    HANDLE hMap = nullptr;
+};
+
+void fz_new_dib_pixmap(fz_context* ctx, fz_irect bbox, FzDibPixmap* dib);
+RenderedBitmap* new_rendered_dib_pixmap(fz_context* ctx, FzDibPixmap* dib);
+void fz_drop_dib_pixmap(fz_context* ctx, FzDibPixmap* dib);
+
+// how often and how long threads had to wait for one of mupdf's locks (FZ_LOCK_*)
+struct FzLockStats {
+    i64 waits = 0;
+    i64 waitTicks = 0;
+};
+
+// enters the critical section backing one of mupdf's locks, recording the wait
+// in stats if another thread holds it
+void FzEnterLock(CRITICAL_SECTION* cs, FzLockStats* stats);
+// logs the stats of the locks that had to be waited for
+void FzLogLockStats(FzLockStats stats[FZ_LOCK_MAX]);
+
+// runs job(jobArg, i) for i in 0..count-1 on the thread pool and waits for all of them
+void FzRunParallel(int count, fz_tune_parallel_job_fn* job, void* jobArg);
+// splits up scaling big images between the cores
+void fz_install_parallel_image_scaling(fz_context* ctx);
+
+// pages of at least this many pixels are drawn in bands on several threads
+#define BANDED_RENDER_MIN_PIXELS (1024 * 1024)
+// every band runs through the whole display list, so bands mustn't be too small
+#define BANDED_RENDER_MIN_BAND_HEIGHT 128
+#define BANDED_RENDER_MAX_BANDS 16
+
+// returns the number of bands to draw a page of this size in (1 for drawing it at once)
+int FzRenderBandCount(fz_irect bbox);
+// draws the display lists into pix in nBands horizontal bands, in parallel
+// (on cloned contexts, so the caller's ctxAccess can stay held)
+void FzRunDisplayListsBanded(fz_context* ctx, fz_display_list** lists, int nLists, fz_pixmap* pix, fz_matrix ctm,
+                             int nBands, fz_cookie* cookie);
+
 WCHAR* fz_text_page_to_str(fz_stext_page* text, Rect** coordsOut);
 
 LinkRectList* LinkifyText(const WCHAR* pageText, Rect* coords);
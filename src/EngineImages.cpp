@@ -13,6 +13,7 @@
 #include "utils/JsonParser.h"
 #include "utils/WinUtil.h"
 #include "utils/Timer.h"
+#include "utils/ThreadUtil.h"
 #include "utils/DirIter.h"
 #include "utils/Log.h"
 
@@ -853,9 +854,307 @@ EngineBase* CreateImageDirEngineFromFile(const WCHAR* fileName) {
 
 ///// CbxEngine handles comic book files (either .cbz, .cbr, .cb7 or .cbt) /////
 
+// maximum amount of memory used for caching image data extracted from the archive
+#define CBX_DATA_CACHE_SIZE (64 * 1024 * 1024)
+// number of pages following the last loaded page to extract in the background
+#define CBX_READ_AHEAD_PAGES 4
+// that many bytes are usually enough to determine an image's dimensions
+#define CBX_IMAGE_HEADER_SIZE (64 * 1024)
+
+// image data of a page, as extracted from the archive. It's shared between
+// the data cache and the threads decoding it, refs is protected by
+// CbxArchive::dataCacheAccess
+struct CbxPageData {
+    int pageNo = 0;
+    int refs = 1;
+    std::span<u8> data;
+};
+
+class CbxReadAheadThread;
+
+// the archive of a comic book and the image data recently extracted from it.
+// It's shared between an EngineCbx and its clones, so that they don't each
+// keep a cache and a read ahead thread for the same document
+class CbxArchive {
+  public:
+    explicit CbxArchive(MultiFormatArchive* arch);
+
+    void AddRef();
+    void Release();
+
+    // caller must DropPageData() the result
+    CbxPageData* GetPageData(int pageNo);
+    void DropPageData(CbxPageData* pd);
+    std::span<u8> GetPageDataHeader(int pageNo);
+    bool IsPageDataCached(int pageNo);
+    void ReadAheadFrom(int pageNo);
+    // called from CbxReadAheadThread
+    void PrefetchPageData(int pageNo);
+
+    // page images are extracted on demand, so the archive is kept open for
+    // as long as it's used by an engine. access to arch must be protected with
+    // archiveAccess (after initialization)
+    MultiFormatArchive* arch = nullptr;
+    CRITICAL_SECTION archiveAccess;
+    Vec<MultiFormatArchive::FileInfo*> files;
+
+    // image data of recently used pages, most recently used at the end.
+    // protected by dataCacheAccess, which may be acquired while holding
+    // archiveAccess but not the other way around
+    CRITICAL_SECTION dataCacheAccess;
+    Vec<CbxPageData*> dataCache;
+    size_t dataCacheSize = 0;
+
+    CbxReadAheadThread* readAheadThread = nullptr;
+
+  private:
+    ~CbxArchive();
+
+    CbxPageData* FindCachedPageData(int pageNo);
+    CbxPageData* ExtractPageData(int pageNo);
+    bool AddToDataCache(CbxPageData* pd, bool evict);
+
+    LONG refCount = 1;
+};
+
+// extracts the image data of the pages following the most recently loaded
+// page, so that paging forward doesn't have to wait for the archive
+class CbxReadAheadThread : public ThreadBase {
+  public:
+    CbxArchive* cbx = nullptr;
+    HANDLE wakeUp = nullptr;
+    // first page to extract, 0 if there's nothing to do
+    LONG startPageNo = 0;
+
+    explicit CbxReadAheadThread(CbxArchive* cbx);
+    ~CbxReadAheadThread() override;
+
+    void ReadAheadFrom(int pageNo);
+    void Stop();
+
+    // ThreadBase
+    void Run() override;
+};
+
+CbxReadAheadThread::CbxReadAheadThread(CbxArchive* cbx) : ThreadBase("CbxReadAheadThread") {
+    this->cbx = cbx;
+    wakeUp = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+}
+
+CbxReadAheadThread::~CbxReadAheadThread() {
+    CloseHandle(wakeUp);
+}
+
+void CbxReadAheadThread::ReadAheadFrom(int pageNo) {
+    InterlockedExchange(&startPageNo, pageNo);
+    SetEvent(wakeUp);
+}
+
+void CbxReadAheadThread::Stop() {
+    RequestCancel();
+    SetEvent(wakeUp);
+    Join();
+}
+
+void CbxReadAheadThread::Run() {
+    for (;;) {
+        WaitForSingleObject(wakeUp, INFINITE);
+        int pageNo = (int)InterlockedExchange(&startPageNo, 0);
+        for (int i = 0; i < CBX_READ_AHEAD_PAGES && pageNo > 0; i++) {
+            // abandon this run if we've been asked to read ahead from a different page
+            if (WasCancelRequested() || InterlockedAdd(&startPageNo, 0) != 0) {
+                break;
+            }
+            cbx->PrefetchPageData(pageNo + i);
+        }
+        if (WasCancelRequested()) {
+            return;
+        }
+    }
+}
+
+CbxArchive::CbxArchive(MultiFormatArchive* arch) {
+    this->arch = arch;
+    InitializeCriticalSection(&archiveAccess);
+    InitializeCriticalSection(&dataCacheAccess);
+}
+
+CbxArchive::~CbxArchive() {
+    if (readAheadThread) {
+        readAheadThread->Stop();
+        delete readAheadThread;
+    }
+    delete arch;
+
+    for (CbxPageData* pd : dataCache) {
+        DropPageData(pd);
+    }
+    DeleteCriticalSection(&dataCacheAccess);
+    DeleteCriticalSection(&archiveAccess);
+}
+
+void CbxArchive::AddRef() {
+    InterlockedIncrement(&refCount);
+}
+
+void CbxArchive::Release() {
+    if (InterlockedDecrement(&refCount) == 0) {
+        delete this;
+    }
+}
+
+void CbxArchive::ReadAheadFrom(int pageNo) {
+    if (readAheadThread) {
+        readAheadThread->ReadAheadFrom(pageNo);
+    }
+}
+
+CbxPageData* CbxArchive::FindCachedPageData(int pageNo) {
+    ScopedCritSec scope(&dataCacheAccess);
+    int n = dataCache.isize();
+    for (int i = 0; i < n; i++) {
+        CbxPageData* pd = dataCache[i];
+        if (pd->pageNo != pageNo) {
+            continue;
+        }
+        // keep the list Most Recently Used last
+        dataCache.RemoveAt(i);
+        dataCache.Append(pd);
+        pd->refs++;
+        return pd;
+    }
+    return nullptr;
+}
+
+bool CbxArchive::IsPageDataCached(int pageNo) {
+    ScopedCritSec scope(&dataCacheAccess);
+    for (CbxPageData* pd : dataCache) {
+        if (pd->pageNo == pageNo) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void CbxArchive::DropPageData(CbxPageData* pd) {
+    if (!pd) {
+        return;
+    }
+    ScopedCritSec scope(&dataCacheAccess);
+    CrashIf(pd->refs <= 0);
+    pd->refs--;
+    if (pd->refs == 0) {
+        free(pd->data.data());
+        delete pd;
+    }
+}
+
+// the cache holds its own reference to pd. If !evict, pd is only added
+// if it fits without evicting other pages
+bool CbxArchive::AddToDataCache(CbxPageData* pd, bool evict) {
+    ScopedCritSec scope(&dataCacheAccess);
+    if (IsPageDataCached(pd->pageNo)) {
+        return false;
+    }
+    size_t size = pd->data.size();
+    if (!evict && dataCacheSize + size > CBX_DATA_CACHE_SIZE) {
+        return false;
+    }
+    // an image bigger than the whole cache still replaces all other images
+    while (dataCache.size() > 0 && dataCacheSize + size > CBX_DATA_CACHE_SIZE) {
+        CbxPageData* oldest = dataCache[0];
+        dataCache.RemoveAt(0);
+        dataCacheSize -= oldest->data.size();
+        DropPageData(oldest);
+    }
+    pd->refs++;
+    dataCache.Append(pd);
+    dataCacheSize += size;
+    return true;
+}
+
+CbxPageData* CbxArchive::ExtractPageData(int pageNo) {
+    ScopedCritSec scope(&archiveAccess);
+    // the read ahead thread might have extracted it while we were waiting
+    CbxPageData* pd = FindCachedPageData(pageNo);
+    if (pd) {
+        return pd;
+    }
+    size_t fileId = files[pageNo - 1]->fileId;
+    std::span<u8> data = arch->GetFileDataById(fileId);
+    if (data.empty()) {
+        return nullptr;
+    }
+    pd = new CbxPageData();
+    pd->pageNo = pageNo;
+    pd->data = data;
+    AddToDataCache(pd, true);
+    return pd;
+}
+
+// returns the image data for a page, either from the cache or freshly
+// extracted from the archive
+CbxPageData* CbxArchive::GetPageData(int pageNo) {
+    CrashIf((pageNo < 1) || (pageNo > files.isize()));
+    CbxPageData* pd = FindCachedPageData(pageNo);
+    if (!pd) {
+        pd = ExtractPageData(pageNo);
+    }
+    return pd;
+}
+
+void CbxArchive::PrefetchPageData(int pageNo) {
+    if (pageNo < 1 || pageNo > files.isize()) {
+        return;
+    }
+    ScopedCritSec scope(&archiveAccess);
+    if (IsPageDataCached(pageNo)) {
+        return;
+    }
+    size_t fileId = files[pageNo - 1]->fileId;
+    std::span<u8> data = arch->GetFileDataById(fileId);
+    if (data.empty()) {
+        return;
+    }
+    CbxPageData* pd = new CbxPageData();
+    pd->pageNo = pageNo;
+    pd->data = data;
+    AddToDataCache(pd, true);
+    DropPageData(pd);
+}
+
+// returns the beginning of a page's image data, which is usually enough for
+// determining its size. caller must free() the result
+std::span<u8> CbxArchive::GetPageDataHeader(int pageNo) {
+    ScopedCritSec scope(&archiveAccess);
+    auto* fileInfo = files[pageNo - 1];
+    if (!fileInfo->isSolid) {
+        return arch->GetFileDataPartById(fileInfo->fileId, CBX_IMAGE_HEADER_SIZE);
+    }
+    // entries of a solid archive can't be skipped, so reading the following
+    // pages requires uncompressing all of this one anyway. Keep it around
+    // for rendering, as long as that doesn't evict any other page
+    std::span<u8> data = arch->GetFileDataById(fileInfo->fileId);
+    if (data.empty()) {
+        return {};
+    }
+    size_t headerSize = std::min(data.size(), (size_t)CBX_IMAGE_HEADER_SIZE);
+    u8* header = (u8*)memdup(data.data(), headerSize);
+    CbxPageData* pd = new CbxPageData();
+    pd->pageNo = pageNo;
+    pd->data = data;
+    AddToDataCache(pd, false);
+    DropPageData(pd);
+    if (!header) {
+        return {};
+    }
+    return {header, headerSize};
+}
+
 class EngineCbx : public EngineImages, public json::ValueVisitor {
   public:
-    EngineCbx(MultiFormatArchive* arch);
+    explicit EngineCbx(MultiFormatArchive* arch);
+    explicit EngineCbx(CbxArchive* cbx);
     ~EngineCbx() override;
 
     EngineBase* Clone() override;
@@ -874,9 +1173,6 @@ class EngineCbx : public EngineImages, public json::ValueVisitor {
     static EngineBase* CreateFromFile(const WCHAR* path);
     static EngineBase* CreateFromStream(IStream* stream);
 
-    // an image for each page
-    Vec<ImageData> images;
-
   protected:
     Bitmap* LoadBitmapForPage(int pageNo, bool& deleteAfterUse) override;
     RectF LoadMediabox(int pageNo) override;
@@ -885,12 +1181,10 @@ class EngineCbx : public EngineImages, public json::ValueVisitor {
     bool LoadFromStream(IStream* stream);
     bool FinishLoading();
 
-    ImageData GetImageData(int pageNo);
     void ParseComicInfoXml(std::span<u8> xmlData);
 
-    // access to cbxFile must be protected after initialization (with cacheAccess)
-    MultiFormatArchive* cbxFile = nullptr;
-    Vec<MultiFormatArchive::FileInfo*> files;
+    // shared with clones
+    CbxArchive* cbx = nullptr;
     TocTree* tocTree = nullptr;
 
     // not owned
@@ -909,34 +1203,47 @@ class EngineCbx : public EngineImages, public json::ValueVisitor {
 
 // TODO: refactor so that doesn't have to keep <arch>
 EngineCbx::EngineCbx(MultiFormatArchive* arch) {
-    cbxFile = arch;
+    cbx = new CbxArchive(arch);
+    kind = kindEngineComicBooks;
+}
+
+EngineCbx::EngineCbx(CbxArchive* cbx) {
+    cbx->AddRef();
+    this->cbx = cbx;
     kind = kindEngineComicBooks;
 }
 
 EngineCbx::~EngineCbx() {
     delete tocTree;
-
-    // can be set in error conditions but generally is
-    // deleted in FinishLoading
-    delete cbxFile;
-
-    for (auto&& img : images) {
-        free(img.data);
-    }
+    cbx->Release();
 }
 
+// clones share the archive and the image data extracted from it instead
+// of opening the archive again
 EngineBase* EngineCbx::Clone() {
-    if (fileStream) {
-        ScopedComPtr<IStream> stm;
-        HRESULT res = fileStream->Clone(&stm);
-        if (SUCCEEDED(res)) {
-            return CreateFromStream(stm);
-        }
-    }
+    auto* clone = new EngineCbx(cbx);
     if (FileName()) {
-        return CreateFromFile(FileName());
+        clone->SetFileName(FileName());
     }
-    return nullptr;
+    if (fileStream) {
+        clone->fileStream = fileStream.Get();
+        clone->fileStream->AddRef();
+    }
+    clone->fileDPI = fileDPI;
+    clone->defaultFileExt = defaultFileExt;
+    clone->defaultExt = defaultExt;
+    clone->pageCount = pageCount;
+    clone->mediaboxes = mediaboxes;
+    if (tocTree) {
+        clone->tocTree = CloneTocTree(tocTree, false);
+    }
+    clone->propTitle.SetCopy(propTitle);
+    clone->propAuthors = propAuthors;
+    clone->propDate.SetCopy(propDate);
+    clone->propModDate.SetCopy(propModDate);
+    clone->propCreator.SetCopy(propCreator);
+    clone->propSummary.SetCopy(propSummary);
+    return clone;
 }
 
 bool EngineCbx::LoadFromFile(const WCHAR* file) {
@@ -980,6 +1287,7 @@ static const WCHAR* GetExtFromArchiveType(MultiFormatArchive* cbxFile) {
 }
 
 bool EngineCbx::FinishLoading() {
+    MultiFormatArchive* cbxFile = cbx->arch;
     CrashIf(!cbxFile);
     if (!cbxFile) {
         return false;
@@ -1040,18 +1348,16 @@ bool EngineCbx::FinishLoading() {
     std::sort(pageFiles.begin(), pageFiles.end(), cmpArchFileInfoByName);
 
     mediaboxes.AppendBlanks(nFiles);
-    files = std::move(pageFiles);
+    cbx->files = std::move(pageFiles);
     pageCount = (int)nFiles;
     if (pageCount == 0) {
-        delete cbxFile;
-        cbxFile = nullptr;
         return false;
     }
 
     TocItem* root = nullptr;
     TocItem* curr = nullptr;
     for (int i = 0; i < pageCount; i++) {
-        std::string_view fname = pageFiles[i]->name;
+        std::string_view fname = cbx->files[i]->name;
         auto name = ToWstrTemp(fname);
         const WCHAR* baseName = path::GetBaseNameTemp(name.Get());
         TocItem* ti = new TocItem(nullptr, baseName, i + 1);
@@ -1065,17 +1371,10 @@ bool EngineCbx::FinishLoading() {
     }
     tocTree = new TocTree(root);
 
-    for (int i = 0; i < pageCount; i++) {
-        size_t fileId = files[i]->fileId;
-        std::span<u8> sv = cbxFile->GetFileDataById(fileId);
-        ImageData img;
-        img.data = (char*)sv.data();
-        img.len = sv.size();
-        images.Append(img);
-    }
-
-    delete cbxFile;
-    cbxFile = nullptr;
+    // pages are only extracted when needed (see CbxArchive::GetPageData)
+    // instead of uncompressing the whole archive up front
+    cbx->readAheadThread = new CbxReadAheadThread(cbx);
+    cbx->readAheadThread->Start();
 
     return true;
 }
@@ -1084,11 +1383,6 @@ TocTree* EngineCbx::GetToc() {
     return tocTree;
 }
 
-ImageData EngineCbx::GetImageData(int pageNo) {
-    CrashIf((pageNo < 1) || (pageNo > PageCount()));
-    return images[pageNo - 1];
-}
-
 static char* GetTextContent(HtmlPullParser& parser) {
     HtmlToken* tok = parser.Next();
     if (!tok || !tok->IsText()) {
@@ -1180,8 +1474,9 @@ bool EngineCbx::SaveFileAsPDF(const char* pdfFileName, __unused bool includeUser
     bool ok = true;
     PdfCreator* c = new PdfCreator();
     for (int i = 1; i <= PageCount() && ok; i++) {
-        ImageData img = GetImageData(i);
-        ok = c->AddPageFromImageData(img.data, img.size(), GetFileDPI());
+        CbxPageData* pd = cbx->GetPageData(i);
+        ok = pd && c->AddPageFromImageData((char*)pd->data.data(), pd->data.size(), GetFileDPI());
+        cbx->DropPageData(pd);
     }
     if (ok) {
         c->CopyProperties(this);
@@ -1221,12 +1516,16 @@ Bitmap* EngineCbx::LoadBitmapForPage(int pageNo, bool& deleteAfterUse) {
         auto dur = TimeSinceInMs(timeStart);
         logf("EngineCbx::LoadBitmapForPage(page: %d) took %.2f\n", pageNo, dur);
     };
-    ImageData img = GetImageData(pageNo);
-    if (img.data) {
-        deleteAfterUse = true;
-        return BitmapFromData(img.AsSpan());
+    CbxPageData* pd = cbx->GetPageData(pageNo);
+    cbx->ReadAheadFrom(pageNo + 1);
+    if (!pd) {
+        return nullptr;
     }
-    return nullptr;
+    // the image data is copied, so it doesn't have to outlive the bitmap
+    deleteAfterUse = true;
+    Bitmap* bmp = BitmapFromData(pd->data);
+    cbx->DropPageData(pd);
+    return bmp;
 }
 
 RectF EngineCbx::LoadMediabox(int pageNo) {
@@ -1238,12 +1537,21 @@ RectF EngineCbx::LoadMediabox(int pageNo) {
         return mbox;
     }
 
-    ImageData img = GetImageData(pageNo);
-    if (img.data) {
-        Size size = BitmapSizeFromData(img.AsSpan());
-        return RectF(0, 0, (float)size.dx, (float)size.dy);
+    // this is called for all pages during layout, so only uncompress
+    // as much of the image as is needed for determining its size
+    AutoFree header = cbx->GetPageDataHeader(pageNo);
+    Size size;
+    if (header.data) {
+        size = BitmapSizeFromData({(u8*)header.data, header.len});
     }
-    return RectF();
+    if (size.IsEmpty()) {
+        CbxPageData* pd = cbx->GetPageData(pageNo);
+        if (pd) {
+            size = BitmapSizeFromData(pd->data);
+        }
+        cbx->DropPageData(pd);
+    }
+    return RectF(0, 0, (float)size.dx, (float)size.dy);
 }
 
 EngineBase* EngineCbx::CreateFromFile(const WCHAR* path) {
@@ -70,8 +70,12 @@ class EngineMupdf : public EngineBase {
     // protected critical section in order to avoid deadlocks
     CRITICAL_SECTION* ctxAccess;
     CRITICAL_SECTION pagesAccess;
+    // not one of mupdf's locks, so that threads drawing with cloned
+    // contexts don't have to wait for whoever holds ctxAccess
+    CRITICAL_SECTION ctxAccessCs;
 
     CRITICAL_SECTION mutexes[FZ_LOCK_MAX];
+    FzLockStats lockStats[FZ_LOCK_MAX];
 
     RenderedBitmap* GetPageImage(int pageNo, RectF rect, int imageIdx);
 
@@ -98,7 +102,7 @@ class EngineMupdf : public EngineBase {
 
 static void fz_lock_context_cs(void* user, int lock) {
     EngineMupdf* e = (EngineMupdf*)user;
-    EnterCriticalSection(&e->mutexes[lock]);
+    FzEnterLock(&e->mutexes[lock], &e->lockStats[lock]);
 }
 
 static void fz_unlock_context_cs(void* user, int lock) {
@@ -127,13 +131,15 @@ EngineMupdf::EngineMupdf() {
         InitializeCriticalSection(&mutexes[i]);
     }
     InitializeCriticalSection(&pagesAccess);
-    ctxAccess = &mutexes[FZ_LOCK_ALLOC];
+    InitializeCriticalSection(&ctxAccessCs);
+    ctxAccess = &ctxAccessCs;
 
     fz_locks_ctx.user = this;
     fz_locks_ctx.lock = fz_lock_context_cs;
     fz_locks_ctx.unlock = fz_unlock_context_cs;
     ctx = fz_new_context(nullptr, &fz_locks_ctx, FZ_STORE_DEFAULT);
     installFitzErrorCallbacks(ctx);
+    fz_install_parallel_image_scaling(ctx);
 
     pdf_install_load_system_font_funcs(ctx);
 }
@@ -163,10 +169,12 @@ EngineMupdf::~EngineMupdf() {
     drop_cached_fonts_for_ctx(ctx);
     fz_drop_context(ctx);
 
+    FzLogLockStats(lockStats);
     for (size_t i = 0; i < dimof(mutexes); i++) {
-        LeaveCriticalSection(&mutexes[i]);
         DeleteCriticalSection(&mutexes[i]);
     }
+    LeaveCriticalSection(ctxAccess);
+    DeleteCriticalSection(ctxAccess);
     LeaveCriticalSection(&pagesAccess);
     DeleteCriticalSection(&pagesAccess);
 }
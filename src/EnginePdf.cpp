@@ -16,6 +16,7 @@ extern "C" {
 #include "utils/TrivialHtmlParser.h"
 #include "utils/WinUtil.h"
 #include "utils/ZipUtil.h"
+#include "utils/Timer.h"
 #include "utils/Log.h"
 #include "utils/LogDbg.h"
 
@@ -321,7 +322,7 @@ bool PdfLink::SaveEmbedded(LinkSaverUI& saveUI) {
 
 static void fz_lock_context_cs(void* user, int lock) {
     EnginePdf* e = (EnginePdf*)user;
-    EnterCriticalSection(&e->mutexes[lock]);
+    FzEnterLock(&e->mutexes[lock], &e->lockStats[lock]);
 }
 
 static void fz_unlock_context_cs(void* user, int lock) {
@@ -350,13 +351,15 @@ EnginePdf::EnginePdf() {
         InitializeCriticalSection(&mutexes[i]);
     }
     InitializeCriticalSection(&pagesAccess);
-    ctxAccess = &mutexes[FZ_LOCK_ALLOC];
+    InitializeCriticalSection(&ctxAccessCs);
+    ctxAccess = &ctxAccessCs;
 
     fz_locks_ctx.user = this;
     fz_locks_ctx.lock = fz_lock_context_cs;
     fz_locks_ctx.unlock = fz_unlock_context_cs;
     ctx = fz_new_context(nullptr, &fz_locks_ctx, FZ_STORE_DEFAULT);
     installFitzErrorCallbacks(ctx);
+    fz_install_parallel_image_scaling(ctx);
 
     pdf_install_load_system_font_funcs(ctx);
 }
@@ -379,6 +382,13 @@ EnginePdf::~EnginePdf() {
         DeleteVecMembers(pi->comments);
     }
 
+    auto& stats = runCache.stats;
+    if (stats.hits + stats.misses > 0) {
+        dbglogf("page run cache: %d hits, %d misses, %d evictions, %.2f ms saved\n", (int)stats.hits,
+                (int)stats.misses, (int)stats.evictions, stats.interpretMsSaved);
+    }
+    FzPageRunCacheFree(ctx, &runCache);
+
     fz_drop_outline(ctx, outline);
     fz_drop_outline(ctx, attachments);
     pdf_drop_obj(ctx, _info);
@@ -394,10 +404,12 @@ EnginePdf::~EnginePdf() {
     delete _pageLabels;
     delete tocTree;
 
+    FzLogLockStats(lockStats);
     for (size_t i = 0; i < dimof(mutexes); i++) {
-        LeaveCriticalSection(&mutexes[i]);
         DeleteCriticalSection(&mutexes[i]);
     }
+    LeaveCriticalSection(ctxAccess);
+    DeleteCriticalSection(ctxAccess);
     LeaveCriticalSection(&pagesAccess);
     DeleteCriticalSection(&pagesAccess);
 }
@@ -470,6 +482,107 @@ const WCHAR* ParseEmbeddedStreamNumber(const WCHAR* path, int* streamNoOut) {
     return path2;
 }
 
+// where indexes of damaged or slow to open documents are kept (see SetPdfIndexDir)
+static AutoFreeWstr gPdfIndexDir;
+
+void SetPdfIndexDir(const WCHAR* dir) {
+    gPdfIndexDir.SetCopy(dir);
+}
+
+// how much of a document's beginning and end is hashed for its index key
+#define PDF_INDEX_KEY_BYTES (16 * 1024)
+
+// identifies a document by its size, its header and its end (which contains
+// the trailer and startxref and changes with every incremental update), so
+// that opening it doesn't require hashing the whole file. The index itself
+// contains the file size and is rejected if it doesn't match. Should another
+// file still have the same key, mupdf notices that objects aren't where the
+// index says they are and repairs the file instead
+static bool GetPdfIndexKey(fz_context* ctx, fz_stream* stm, u8 key[16]) {
+    u8 buf[PDF_INDEX_KEY_BYTES];
+    fz_md5 md5;
+    fz_md5_init(&md5);
+    fz_try(ctx) {
+        fz_seek(ctx, stm, 0, 2);
+        i64 size = fz_tell(ctx, stm);
+        fz_md5_update_int64(&md5, size);
+        fz_seek(ctx, stm, 0, 0);
+        size_t n = fz_read(ctx, stm, buf, sizeof(buf));
+        fz_md5_update(&md5, buf, n);
+        if (size > (i64)sizeof(buf)) {
+            fz_seek(ctx, stm, std::max(size - (i64)sizeof(buf), (i64)sizeof(buf)), 0);
+            n = fz_read(ctx, stm, buf, sizeof(buf));
+            fz_md5_update(&md5, buf, n);
+        }
+        fz_seek(ctx, stm, 0, 0);
+    }
+    fz_catch(ctx) {
+        return false;
+    }
+    fz_md5_final(&md5, key);
+    return true;
+}
+
+// the index of a document is named after its key (see GetPdfIndexKey)
+static WCHAR* GetPdfIndexPath(const u8 key[16]) {
+    if (!gPdfIndexDir) {
+        return nullptr;
+    }
+    AutoFree hex(str::MemToHex(key, 16));
+    AutoFreeWstr name(strconv::AnsiToWstr(hex));
+    return str::Format(L"%s\\%s.xref", gPdfIndexDir.Get(), name.Get());
+}
+
+static fz_buffer* LoadPdfIndex(fz_context* ctx, const u8 key[16]) {
+    AutoFreeWstr path(GetPdfIndexPath(key));
+    if (!path || !file::Exists(path)) {
+        return nullptr;
+    }
+    AutoFree data = file::ReadFile(path);
+    if (data.empty()) {
+        return nullptr;
+    }
+    fz_buffer* index = nullptr;
+    fz_try(ctx) {
+        index = fz_new_buffer_from_copied_data(ctx, (const u8*)data.Get(), data.size());
+    }
+    fz_catch(ctx) {
+        return nullptr;
+    }
+    // the indexes which haven't been used for the longest time are deleted on exit
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    file::SetModificationTime(path, now);
+    return index;
+}
+
+static void SavePdfIndex(fz_context* ctx, pdf_document* doc, const u8 key[16]) {
+    AutoFreeWstr path(GetPdfIndexPath(key));
+    if (!path || !dir::CreateAll(gPdfIndexDir)) {
+        return;
+    }
+    fz_buffer* index = nullptr;
+    fz_var(index);
+    fz_try(ctx) {
+        index = pdf_new_document_index(ctx, doc);
+    }
+    fz_catch(ctx) {
+        fz_warn(ctx, "couldn't create a document index");
+    }
+    if (!index) {
+        return;
+    }
+    // write to a temporary file first, so that there are no truncated indexes
+    // if we're interrupted (a leftover temporary file is removed by
+    // RenderCacheDiskCleanUp, as it also ends in .xref)
+    AutoFreeWstr tmpPath(str::Join(path, L".tmp.xref"));
+    bool ok = file::WriteFile(tmpPath, {index->data, index->len});
+    if (!ok || !MoveFileExW(tmpPath, path, MOVEFILE_REPLACE_EXISTING)) {
+        file::Delete(tmpPath);
+    }
+    fz_drop_buffer(ctx, index);
+}
+
 // <filePath> should end with embed marks, which is a stream number
 // inside pdf file
 // TODO: provide PasswordUI?
@@ -601,16 +714,31 @@ bool EnginePdf::LoadFromStream(fz_stream* stm, PasswordUI* pwdUI) {
         return false;
     }
 
+    // the index of a damaged or huge file saves repairing it and walking its page tree
+    // again (the full digest of the file is only computed when it's needed)
+    hasIndexKey = false;
+    fz_buffer* index = nullptr;
+    if (gPdfIndexDir) {
+        hasIndexKey = GetPdfIndexKey(ctx, stm, indexKey);
+        if (hasIndexKey) {
+            index = LoadPdfIndex(ctx, indexKey);
+        }
+    }
+    loadedFromIndex = index != nullptr;
+
+    auto timeStart = TimeGet();
     fz_try(ctx) {
-        pdf_document* doc = pdf_open_document_with_stream(ctx, stm);
+        pdf_document* doc = pdf_open_document_with_index(ctx, stm, index);
         _doc = (fz_document*)doc;
     }
     fz_always(ctx) {
         fz_drop_stream(ctx, stm);
+        fz_drop_buffer(ctx, index);
     }
     fz_catch(ctx) {
         return false;
     }
+    loadMs = TimeSinceInMs(timeStart);
 
     _docStream = stm;
 
@@ -625,7 +753,7 @@ bool EnginePdf::LoadFromStream(fz_stream* stm, PasswordUI* pwdUI) {
 
     u8 digest[16 + 32] = {0};
     pdf_document* doc = (pdf_document*)_doc;
-    fz_stream_fingerprint(ctx, doc->file, digest);
+    GetFileDigest(digest);
 
     bool ok = false, saveKey = false;
     while (!ok) {
@@ -739,6 +867,7 @@ bool EnginePdf::FinishLoading() {
     ScopedCritSec scope(ctxAccess);
 
     bool loadPageTreeFailed = false;
+    auto timeStart = TimeGet();
     fz_try(ctx) {
         pdf_load_page_tree(ctx, doc);
     }
@@ -746,6 +875,7 @@ bool EnginePdf::FinishLoading() {
         fz_warn(ctx, "pdf_load_page_tree() failed");
         loadPageTreeFailed = true;
     }
+    loadMs += TimeSinceInMs(timeStart);
 
     int nPages = doc->rev_page_count;
     if (nPages != pageCount) {
@@ -804,6 +934,11 @@ bool EnginePdf::FinishLoading() {
             pageInfo->mediabox = ToRectFl(mbox);
             pageInfo->pageNo = pageNo + 1;
         }
+
+        bool slowToLoad = pdf_was_repaired(ctx, doc) || loadMs >= PDF_INDEX_MIN_LOAD_MS;
+        if (hasIndexKey && !loadedFromIndex && slowToLoad) {
+            SavePdfIndex(ctx, doc, indexKey);
+        }
     }
 
     fz_try(ctx) {
@@ -1299,7 +1434,9 @@ RectF EnginePdf::Transform(const RectF& rect, int pageNo, float zoom, int rotati
 RenderedBitmap* EnginePdf::RenderPage(RenderPageArgs& args) {
     auto pageNo = args.pageNo;
 
-    FzPageInfo* pageInfo = GetFzPageInfo(pageNo, false);
+    // extracting text, links and images roughly doubles the time until
+    // first paint of text-heavy pages, so it's deferred to PreloadPageElements
+    FzPageInfo* pageInfo = GetFzPageInfo(pageNo, true);
     if (!pageInfo || !pageInfo->page) {
         return nullptr;
     }
@@ -1330,16 +1467,23 @@ RenderedBitmap* EnginePdf::RenderPage(RenderPageArgs& args) {
     fz_matrix ctm = viewctm(page, zoom, rotation);
     fz_irect bbox = fz_round_rect(fz_transform_rect(pRect, ctm));
 
-    fz_colorspace* colorspace = fz_device_rgb(ctx);
     fz_irect ibounds = bbox;
     fz_rect cliprect = fz_rect_from_irect(bbox);
 
-    fz_pixmap* pix = nullptr;
+    FzDibPixmap dib;
     fz_device* dev = nullptr;
+    fz_display_list* list = nullptr;
+    fz_display_list* annotsList = nullptr;
+    fz_device* listDev = nullptr;
     RenderedBitmap* bitmap = nullptr;
 
+    fz_var(dib.pix);
+    fz_var(dib.hbmp);
+    fz_var(dib.hMap);
     fz_var(dev);
-    fz_var(pix);
+    fz_var(list);
+    fz_var(annotsList);
+    fz_var(listDev);
     fz_var(bitmap);
 
     const char* usage = "View";
@@ -1349,23 +1493,70 @@ RenderedBitmap* EnginePdf::RenderPage(RenderPageArgs& args) {
             break;
     }
 
+    // only the content stream is cached: it's the expensive part and unlike
+    // annotations and form fields it doesn't change while the document is open.
+    // optional content depends on usage, so only cache what is rendered for viewing
+    bool useRunCache = (args.target == RenderTarget::View) && (runCache.maxBytes > 0);
+    FzPageRun* run = nullptr;
+    if (useRunCache) {
+        run = FzPageRunCacheGet(&runCache, pageNo);
+    }
+    // big pages are recorded into display lists which are then drawn
+    // in bands on all cores
+    int nBands = FzRenderBandCount(ibounds);
+
     fz_try(ctx) {
-        pix = fz_new_pixmap_with_bbox(ctx, colorspace, ibounds, nullptr, 1);
+        // render directly into the bitmap's memory
+        fz_new_dib_pixmap(ctx, ibounds, &dib);
         // initialize with white background
-        fz_clear_pixmap_with_value(ctx, pix, 0xff);
-        // TODO: in printing different style. old code use pdf_run_page_with_usage(), with usage ="View"
-        // or "Print". "Export" is not used
-        dev = fz_new_draw_device(ctx, fz_identity, pix);
-        pdf_document* doc = pdf_document_from_fz_document(ctx, _doc);
-        pdf_run_page_with_usage(ctx, pdfpage, dev, ctm, usage, fzcookie);
-        bitmap = new_rendered_fz_pixmap(ctx, pix);
-        fz_close_device(ctx, dev);
+        fz_clear_pixmap_with_value(ctx, dib.pix, 0xff);
+        if (!run && (useRunCache || nBands > 1)) {
+            auto timeStart = TimeGet();
+            list = fz_new_display_list(ctx, fz_bound_page(ctx, page));
+            listDev = fz_new_list_device(ctx, list);
+            pdf_run_page_contents_with_usage(ctx, pdfpage, listDev, fz_identity, usage, fzcookie);
+            fz_close_device(ctx, listDev);
+            fz_drop_device(ctx, listDev);
+            listDev = nullptr;
+            float interpretMs = (float)TimeSinceInMs(timeStart);
+            // an aborted page is only partially recorded
+            if (useRunCache && (!fzcookie || !fzcookie->abort)) {
+                FzPageRunCacheAdd(ctx, &runCache, pageNo, list, interpretMs);
+            }
+        }
+        fz_display_list* contents = run ? run->list : list;
+        if (nBands > 1) {
+            annotsList = fz_new_display_list(ctx, fz_bound_page(ctx, page));
+            listDev = fz_new_list_device(ctx, annotsList);
+            pdf_run_page_annots_with_usage(ctx, pdfpage, listDev, fz_identity, usage, fzcookie);
+            pdf_run_page_widgets_with_usage(ctx, pdfpage, listDev, fz_identity, usage, fzcookie);
+            fz_close_device(ctx, listDev);
+            fz_display_list* lists[] = {contents, annotsList};
+            FzRunDisplayListsBanded(ctx, lists, (int)dimof(lists), dib.pix, ctm, nBands, fzcookie);
+        } else {
+            // TODO: in printing different style. old code use pdf_run_page_with_usage(), with usage ="View"
+            // or "Print". "Export" is not used
+            dev = fz_new_draw_device(ctx, fz_identity, dib.pix);
+            if (contents) {
+                fz_run_display_list(ctx, contents, dev, ctm, cliprect, fzcookie);
+            } else {
+                pdf_run_page_contents_with_usage(ctx, pdfpage, dev, ctm, usage, fzcookie);
+            }
+            pdf_run_page_annots_with_usage(ctx, pdfpage, dev, ctm, usage, fzcookie);
+            pdf_run_page_widgets_with_usage(ctx, pdfpage, dev, ctm, usage, fzcookie);
+            fz_close_device(ctx, dev);
+        }
+        bitmap = new_rendered_dib_pixmap(ctx, &dib);
     }
     fz_always(ctx) {
         if (dev) {
             fz_drop_device(ctx, dev);
         }
-        fz_drop_pixmap(ctx, pix);
+        fz_drop_device(ctx, listDev);
+        fz_drop_display_list(ctx, annotsList);
+        fz_drop_display_list(ctx, list);
+        // no-op if the bitmap has been created
+        fz_drop_dib_pixmap(ctx, &dib);
     }
     fz_catch(ctx) {
         delete bitmap;
@@ -1374,13 +1565,25 @@ RenderedBitmap* EnginePdf::RenderPage(RenderPageArgs& args) {
     return bitmap;
 }
 
-IPageElement* EnginePdf::GetElementAtPos(int pageNo, PointF pt) {
+// page elements are usually extracted in the background after the page has
+// been rendered (see PreloadPageElements). If that hasn't happened (yet) because
+// the preload request was dropped or is still queued, extract them now so that
+// links and tooltips work. That only happens once per page
+FzPageInfo* EnginePdf::GetFzPageInfoWithElements(int pageNo) {
     FzPageInfo* pageInfo = GetFzPageInfoFast(pageNo);
+    if (!pageInfo) {
+        pageInfo = GetFzPageInfo(pageNo, false);
+    }
+    return pageInfo;
+}
+
+IPageElement* EnginePdf::GetElementAtPos(int pageNo, PointF pt) {
+    FzPageInfo* pageInfo = GetFzPageInfoWithElements(pageNo);
     return FzGetElementAtPos(pageInfo, pt);
 }
 
 Vec<IPageElement*>* EnginePdf::GetElements(int pageNo) {
-    auto pageInfo = GetFzPageInfoFast(pageNo);
+    auto pageInfo = GetFzPageInfoWithElements(pageNo);
     auto res = new Vec<IPageElement*>();
     FzGetElements(res, pageInfo);
     if (res->IsEmpty()) {
@@ -1390,6 +1593,10 @@ Vec<IPageElement*>* EnginePdf::GetElements(int pageNo) {
     return res;
 }
 
+void EnginePdf::PreloadPageElements(int pageNo) {
+    GetFzPageInfo(pageNo, false);
+}
+
 RenderedBitmap* EnginePdf::GetImageForPageElement(IPageElement* ipel) {
     PageElement* pel = (PageElement*)ipel;
     auto r = pel->rect;
@@ -1725,6 +1932,34 @@ WCHAR* EnginePdf::GetProperty(DocumentProperty prop) {
     return nullptr;
 };
 
+bool EnginePdf::GetFileDigest(u8 digest[16]) {
+    fz_stream* file = nullptr;
+    {
+        ScopedCritSec scope(ctxAccess);
+        if (hasFileDigest) {
+            memcpy(digest, fileDigest, 16);
+            return true;
+        }
+        pdf_document* doc = pdf_document_from_fz_document(ctx, _doc);
+        if (!doc || !doc->file) {
+            return false;
+        }
+        file = doc->file;
+    }
+
+    // hashing big files takes a while, so don't block rendering meanwhile
+    bool ok = fz_shared_file_fingerprint(file, digest);
+    ScopedCritSec scope(ctxAccess);
+    if (!ok) {
+        ok = fz_stream_fingerprint(ctx, file, digest);
+    }
+    if (ok) {
+        memcpy(fileDigest, digest, 16);
+        hasFileDigest = true;
+    }
+    return ok;
+}
+
 std::span<u8> EnginePdf::GetFileData() {
     std::span<u8> res;
     ScopedCritSec scope(ctxAccess);
@@ -1957,6 +2192,47 @@ bool EnginePdfHasUnsavedAnnotations(EngineBase* engine) {
     return pdfdoc->dirty;
 }
 
+bool EnginePdfGetPageRunCacheStats(EngineBase* engine, FzPageRunCacheStats* statsOut) {
+    EnginePdf* epdf = AsEnginePdf(engine);
+    if (!epdf) {
+        return false;
+    }
+    ScopedCritSec scope(epdf->ctxAccess);
+    *statsOut = epdf->runCache.stats;
+    return true;
+}
+
+bool EnginePdfGetGlyphCacheStats(EngineBase* engine, fz_glyph_cache_stats* statsOut) {
+    EnginePdf* epdf = AsEnginePdf(engine);
+    if (!epdf) {
+        return false;
+    }
+    ScopedCritSec scope(epdf->ctxAccess);
+    fz_get_glyph_cache_stats(epdf->ctx, statsOut);
+    return true;
+}
+
+// the glyph cache is shared by all clones of the engine
+bool EnginePdfSetGlyphCacheSize(EngineBase* engine, size_t maxSize) {
+    EnginePdf* epdf = AsEnginePdf(engine);
+    if (!epdf) {
+        return false;
+    }
+    ScopedCritSec scope(epdf->ctxAccess);
+    fz_set_glyph_cache_size(epdf->ctx, maxSize);
+    return true;
+}
+
+// keeps the statistics
+void EnginePdfClearPageRunCache(EngineBase* engine) {
+    EnginePdf* epdf = AsEnginePdf(engine);
+    if (!epdf) {
+        return;
+    }
+    ScopedCritSec scope(epdf->ctxAccess);
+    FzPageRunCacheFree(epdf->ctx, &epdf->runCache);
+}
+
 static bool IsAllowedAnnot(AnnotationType tp, AnnotationType* allowed) {
     if (!allowed) {
         return true;
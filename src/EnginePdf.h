@@ -1,7 +1,18 @@
 /* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
    License: GPLv3 */
 
+// relative to the app's data directory (next to the cached pages)
+#define PDF_INDEX_DIR_NAME L"sumatrapdfcache\\xref"
+// upper bound for the size of all document indexes together
+#define PDF_INDEX_MAX_BYTES (32 * 1024 * 1024)
+// documents which had to be repaired or took longer than this
+// to open and paginate get an index
+#define PDF_INDEX_MIN_LOAD_MS 250
+
 bool IsPdfEngineSupportedFileType(Kind);
+// enables indexes of damaged or slow to open documents (stored in dir) which
+// save repairing them and walking their page tree when they're opened again
+void SetPdfIndexDir(const WCHAR* dir);
 EngineBase* CreateEnginePdfFromFile(const WCHAR* path, PasswordUI* pwdUI = nullptr);
 EngineBase* CreateEnginePdfFromStream(IStream* stream, PasswordUI* pwdUI = nullptr);
 
@@ -10,6 +21,10 @@ const WCHAR* ParseEmbeddedStreamNumber(const WCHAR* path, int* streamNoOut);
 Annotation* EnginePdfCreateAnnotation(EngineBase*, AnnotationType type, int pageNo, PointF pos);
 int EnginePdfGetAnnotations(EngineBase*, Vec<Annotation*>*);
 bool EnginePdfHasUnsavedAnnotations(EngineBase*);
+struct FzPageRunCacheStats;
+// returns false if engine isn't a PDF engine
+bool EnginePdfGetPageRunCacheStats(EngineBase*, FzPageRunCacheStats* statsOut);
+void EnginePdfClearPageRunCache(EngineBase*);
 bool EnginePdfSaveUpdated(EngineBase* engine, std::string_view path,
                           std::function<void(std::string_view)> showErrorFunc);
 Annotation* EnginePdfGetAnnotationAtPos(EngineBase*, int pageNo, PointF pos, AnnotationType* allowedAnnots);
@@ -13,6 +13,7 @@ class EnginePdf : public EngineBase {
     RectF Transform(const RectF& rect, int pageNo, float zoom, int rotation, bool inverse = false) override;
 
     std::span<u8> GetFileData() override;
+    bool GetFileDigest(u8 digest[16]) override;
     bool SaveFileAs(const char* copyFileName, bool includeUserAnnots = false) override;
     bool SaveFileAsPdf(const char* pdfFileName, bool includeUserAnnots = false);
     PageText ExtractPageText(int pageNo) override;
@@ -24,6 +25,7 @@ class EnginePdf : public EngineBase {
 
     Vec<IPageElement*>* GetElements(int pageNo) override;
     IPageElement* GetElementAtPos(int pageNo, PointF pt) override;
+    void PreloadPageElements(int pageNo) override;
     RenderedBitmap* GetImageForPageElement(IPageElement*) override;
 
     PageDestination* GetNamedDest(const WCHAR* name) override;
@@ -41,8 +43,12 @@ class EnginePdf : public EngineBase {
     // protected critical section in order to avoid deadlocks
     CRITICAL_SECTION* ctxAccess;
     CRITICAL_SECTION pagesAccess;
+    // not one of mupdf's locks, so that threads drawing with cloned
+    // contexts don't have to wait for whoever holds ctxAccess
+    CRITICAL_SECTION ctxAccessCs;
 
     CRITICAL_SECTION mutexes[FZ_LOCK_MAX];
+    FzLockStats lockStats[FZ_LOCK_MAX];
 
     RenderedBitmap* GetPageImage(int pageNo, RectF rect, int imageIdx);
 
@@ -51,6 +57,8 @@ class EnginePdf : public EngineBase {
     fz_document* _doc = nullptr;
     fz_stream* _docStream = nullptr;
     Vec<FzPageInfo> _pages;
+    // display lists of recently rendered pages, protected by ctxAccess
+    FzPageRunCache runCache;
     fz_outline* outline = nullptr;
     fz_outline* attachments = nullptr;
     pdf_obj* _info = nullptr;
@@ -58,6 +66,17 @@ class EnginePdf : public EngineBase {
 
     TocTree* tocTree = nullptr;
 
+    // digest of the file's content, protected by ctxAccess
+    u8 fileDigest[16]{};
+    bool hasFileDigest = false;
+    // identifies the document's index (see SetPdfIndexDir)
+    u8 indexKey[16]{};
+    bool hasIndexKey = false;
+    // whether the document was opened with an index
+    bool loadedFromIndex = false;
+    // time spent opening the document and walking its page tree
+    double loadMs = 0;
+
     bool Load(const WCHAR* filePath, PasswordUI* pwdUI = nullptr);
     bool Load(IStream* stream, PasswordUI* pwdUI = nullptr);
     // TODO(port): fz_stream can no-longer be re-opened (fz_clone_stream)
@@ -66,6 +85,7 @@ class EnginePdf : public EngineBase {
     bool FinishLoading();
 
     FzPageInfo* GetFzPageInfoFast(int pageNo);
+    FzPageInfo* GetFzPageInfoWithElements(int pageNo);
     FzPageInfo* GetFzPageInfo(int pageNo, bool loadQuick);
     fz_matrix viewctm(int pageNo, float zoom, int rotation);
     fz_matrix viewctm(fz_page* page, float zoom, int rotation) const;
@@ -204,6 +204,7 @@ class EngineXps : public EngineBase {
     RectF Transform(const RectF& rect, int pageNo, float zoom, int rotation, bool inverse = false) override;
 
     std::span<u8> GetFileData() override;
+    bool GetFileDigest(u8 digest[16]) override;
     bool SaveFileAs(const char* copyFileName, bool includeUserAnnots = false) override;
     PageText ExtractPageText(int pageNo) override;
     bool HasClipOptimizations(int pageNo) override;
@@ -230,7 +231,11 @@ class EngineXps : public EngineBase {
     // protected critical section in order to avoid deadlocks
     CRITICAL_SECTION* ctxAccess;
     CRITICAL_SECTION pagesAccess;
+    // not one of mupdf's locks, so that threads drawing with cloned
+    // contexts don't have to wait for whoever holds ctxAccess
+    CRITICAL_SECTION ctxAccessCs;
     CRITICAL_SECTION mutexes[FZ_LOCK_MAX];
+    FzLockStats lockStats[FZ_LOCK_MAX];
 
     fz_context* ctx = nullptr;
     fz_locks_context fz_locks_ctx;
@@ -267,7 +272,7 @@ class EngineXps : public EngineBase {
 
 static void fz_lock_context_cs(void* user, int lock) {
     EngineXps* e = (EngineXps*)user;
-    EnterCriticalSection(&e->mutexes[lock]);
+    FzEnterLock(&e->mutexes[lock], &e->lockStats[lock]);
 }
 
 static void fz_unlock_context_cs(void* user, int lock) {
@@ -293,13 +298,15 @@ EngineXps::EngineXps() {
         InitializeCriticalSection(&mutexes[i]);
     }
     InitializeCriticalSection(&pagesAccess);
-    ctxAccess = &mutexes[FZ_LOCK_ALLOC];
+    InitializeCriticalSection(&ctxAccessCs);
+    ctxAccess = &ctxAccessCs;
 
     fz_locks_ctx.user = this;
     fz_locks_ctx.lock = fz_lock_context_cs;
     fz_locks_ctx.unlock = fz_unlock_context_cs;
     ctx = fz_new_context(nullptr, &fz_locks_ctx, FZ_STORE_DEFAULT);
     installFitzErrorCallbacks(ctx);
+    fz_install_parallel_image_scaling(ctx);
 }
 
 EngineXps::~EngineXps() {
@@ -332,10 +339,12 @@ EngineXps::~EngineXps() {
 
     delete tocTree;
 
+    FzLogLockStats(lockStats);
     for (size_t i = 0; i < dimof(mutexes); i++) {
-        LeaveCriticalSection(&mutexes[i]);
         DeleteCriticalSection(&mutexes[i]);
     }
+    LeaveCriticalSection(ctxAccess);
+    DeleteCriticalSection(ctxAccess);
     LeaveCriticalSection(&pagesAccess);
     DeleteCriticalSection(&pagesAccess);
 }
@@ -639,36 +648,54 @@ RenderedBitmap* EngineXps::RenderPage(RenderPageArgs& args) {
     fz_matrix ctm = viewctm(page, args.zoom, args.rotation);
     fz_irect bbox = fz_round_rect(fz_transform_rect(pRect, ctm));
 
-    fz_colorspace* colorspace = fz_device_rgb(ctx);
     fz_irect ibounds = bbox;
     fz_rect cliprect = fz_rect_from_irect(bbox);
 
-    fz_pixmap* pix = nullptr;
+    FzDibPixmap dib;
     fz_device* dev = nullptr;
+    fz_display_list* list = nullptr;
     RenderedBitmap* bitmap = nullptr;
 
+    fz_var(dib.pix);
+    fz_var(dib.hbmp);
+    fz_var(dib.hMap);
     fz_var(dev);
-    fz_var(pix);
+    fz_var(list);
     fz_var(bitmap);
 
+    // big pages are recorded into a display list which is then drawn
+    // in bands on all cores
+    int nBands = FzRenderBandCount(ibounds);
+
     fz_try(ctx) {
-        pix = fz_new_pixmap_with_bbox(ctx, colorspace, ibounds, nullptr, 1);
+        // render directly into the bitmap's memory
+        fz_new_dib_pixmap(ctx, ibounds, &dib);
         // initialize with white background
-        fz_clear_pixmap_with_value(ctx, pix, 0xff);
-
-        // TODO: in printing different style. old code use pdf_run_page_with_usage(), with usage ="View"
-        // or "Print". "Export" is not used
-        dev = fz_new_draw_device(ctx, fz_identity, pix);
-        // TODO: use fz_infinite_rect instead of cliprect?
-        fz_run_page(ctx, page, dev, ctm, fzcookie);
-        bitmap = new_rendered_fz_pixmap(ctx, pix);
-        fz_close_device(ctx, dev);
+        fz_clear_pixmap_with_value(ctx, dib.pix, 0xff);
+
+        if (nBands > 1) {
+            list = fz_new_display_list(ctx, fz_bound_page(ctx, page));
+            dev = fz_new_list_device(ctx, list);
+            fz_run_page(ctx, page, dev, fz_identity, fzcookie);
+            fz_close_device(ctx, dev);
+            FzRunDisplayListsBanded(ctx, &list, 1, dib.pix, ctm, nBands, fzcookie);
+        } else {
+            // TODO: in printing different style. old code use pdf_run_page_with_usage(), with usage ="View"
+            // or "Print". "Export" is not used
+            dev = fz_new_draw_device(ctx, fz_identity, dib.pix);
+            // TODO: use fz_infinite_rect instead of cliprect?
+            fz_run_page(ctx, page, dev, ctm, fzcookie);
+            fz_close_device(ctx, dev);
+        }
+        bitmap = new_rendered_dib_pixmap(ctx, &dib);
     }
     fz_always(ctx) {
         if (dev) {
             fz_drop_device(ctx, dev);
         }
-        fz_drop_pixmap(ctx, pix);
+        fz_drop_display_list(ctx, list);
+        // no-op if the bitmap has been created
+        fz_drop_dib_pixmap(ctx, &dib);
     }
     fz_catch(ctx) {
         delete bitmap;
@@ -677,6 +704,18 @@ RenderedBitmap* EngineXps::RenderPage(RenderPageArgs& args) {
     return bitmap;
 }
 
+bool EngineXps::GetFileDigest(u8 digest[16]) {
+    if (!_docStream) {
+        return false;
+    }
+    // hashing big files takes a while, so don't block rendering meanwhile
+    if (fz_shared_file_fingerprint(_docStream, digest)) {
+        return true;
+    }
+    ScopedCritSec scope(ctxAccess);
+    return fz_stream_fingerprint(ctx, _docStream, digest);
+}
+
 std::span<u8> EngineXps::GetFileData() {
     std::span<u8> res;
     ScopedCritSec scope(ctxAccess);
@@ -11,6 +11,7 @@
 #include "wingui/TreeModel.h"
 
 #include "EngineBase.h"
+#include "EngineCreate.h"
 #include "DisplayMode.h"
 #include "SettingsStructs.h"
 #include "FileHistory.h"
@@ -193,22 +194,33 @@ void SetThumbnail(FileState* ds, RenderedBitmap* bmp) {
     SaveThumbnail(*ds);
 }
 
-void SaveThumbnail(FileState& ds) {
-    if (!ds.thumbnail) {
-        return;
-    }
-
-    AutoFreeWstr bmpPath(GetThumbnailPath(ds.filePath));
+static void SaveThumbnailForFile(const WCHAR* filePath, RenderedBitmap* thumbnail) {
+    AutoFreeWstr bmpPath(GetThumbnailPath(filePath));
     if (!bmpPath) {
         return;
     }
     AutoFreeWstr thumbsPath(path::GetDir(bmpPath));
-    if (dir::Create(thumbsPath)) {
-        CrashIf(!str::EndsWithI(bmpPath, L".png"));
-        Gdiplus::Bitmap bmp(ds.thumbnail->GetBitmap(), nullptr);
-        CLSID tmpClsid = GetEncoderClsid(L"image/png");
-        bmp.Save(bmpPath.Get(), &tmpClsid, nullptr);
+    if (!dir::Create(thumbsPath)) {
+        return;
+    }
+    CrashIf(!str::EndsWithI(bmpPath, L".png"));
+    // write to a temporary file first, so that there are no truncated thumbnails
+    // if we're interrupted (a leftover temporary file is removed by
+    // CleanUpThumbnailCache, as it also ends in .png)
+    AutoFreeWstr tmpPath(str::Join(bmpPath, L".tmp.png"));
+    Gdiplus::Bitmap bmp(thumbnail->GetBitmap(), nullptr);
+    CLSID tmpClsid = GetEncoderClsid(L"image/png");
+    Gdiplus::Status status = bmp.Save(tmpPath.Get(), &tmpClsid, nullptr);
+    if (status != Gdiplus::Ok || !MoveFileExW(tmpPath, bmpPath, MOVEFILE_REPLACE_EXISTING)) {
+        file::Delete(tmpPath);
+    }
+}
+
+void SaveThumbnail(FileState& ds) {
+    if (!ds.thumbnail) {
+        return;
     }
+    SaveThumbnailForFile(ds.filePath, ds.thumbnail);
 }
 
 void RemoveThumbnail(FileState& ds) {
@@ -223,3 +235,166 @@ void RemoveThumbnail(FileState& ds) {
     delete ds.thumbnail;
     ds.thumbnail = nullptr;
 }
+
+bool GetThumbnailPageRect(EngineBase* engine, Size size, float* zoom, RectF* pageRect) {
+    RectF rect = engine->PageMediabox(1);
+    if (rect.IsEmpty()) {
+        return false;
+    }
+
+    rect = engine->Transform(rect, 1, 1.0f, 0);
+    *zoom = size.dx / (float)rect.dx;
+    if (rect.dy > (float)size.dy / *zoom) {
+        rect.dy = (float)size.dy / *zoom;
+    }
+    *pageRect = engine->Transform(rect, 1, 1.0f, 0, true);
+    return true;
+}
+
+void CollectMissingThumbnails(FileHistory& fileHistory, WStrVec& filePaths) {
+    // the same documents as the ones whose thumbnails CleanUpThumbnailCache keeps
+    Vec<FileState*> list;
+    fileHistory.GetFrequencyOrder(list);
+    for (size_t i = 0; i < list.size() && i < FILE_HISTORY_MAX_FREQUENT * 2; i++) {
+        FileState* ds = list.at(i);
+        if (!ds->filePath || HasThumbnail(*ds)) {
+            continue;
+        }
+        // don't wake up network shares or removable drives
+        if (!path::IsOnFixedDrive(ds->filePath) || !file::Exists(ds->filePath)) {
+            continue;
+        }
+        filePaths.Append(str::Dup(ds->filePath));
+    }
+}
+
+// set by CancelCreatingThumbnails
+static LONG gCancelThumbnails = 0;
+// number of running CreateThumbnails calls
+static LONG gThumbnailBatchCount = 0;
+
+static bool WasThumbnailCreationCancelled() {
+    return InterlockedCompareExchange(&gCancelThumbnails, 0, 0) != 0;
+}
+
+struct ThumbnailBatch {
+    const WStrVec* filePaths = nullptr;
+    const onThumbnailCreatedCb* onCreated = nullptr;
+    LONG nextIdx = -1;
+    // limits how many documents are read from disk at the same time
+    HANDLE loadSemaphore = nullptr;
+};
+
+static RenderedBitmap* RenderThumbnailForFile(ThumbnailBatch* batch, const WCHAR* filePath) {
+    // no PasswordUI, so that password protected documents are skipped.
+    // Ebooks and CHM documents are laid out by their controllers instead
+    WaitForSingleObject(batch->loadSemaphore, INFINITE);
+    EngineBase* engine = CreateEngine(filePath, nullptr, false, false);
+    ReleaseSemaphore(batch->loadSemaphore, 1, nullptr);
+    if (!engine) {
+        return nullptr;
+    }
+
+    RenderedBitmap* bmp = nullptr;
+    float zoom;
+    RectF pageRect;
+    if (GetThumbnailPageRect(engine, Size(THUMBNAIL_DX, THUMBNAIL_DY), &zoom, &pageRect)) {
+        RenderPageArgs args(1, zoom, 0, &pageRect);
+        bmp = engine->RenderPage(args);
+    }
+    delete engine;
+
+    if (bmp && bmp->Size().IsEmpty()) {
+        delete bmp;
+        bmp = nullptr;
+    }
+    return bmp;
+}
+
+static DWORD WINAPI ThumbnailBatchThread(LPVOID data) {
+    ThumbnailBatch* batch = (ThumbnailBatch*)data;
+    // lowers the I/O (and CPU) priority so that the batch doesn't slow down
+    // loading the documents the user is actually opening
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    for (;;) {
+        int idx = (int)InterlockedIncrement(&batch->nextIdx);
+        if (idx >= batch->filePaths->isize()) {
+            break;
+        }
+        if (WasThumbnailCreationCancelled()) {
+            break;
+        }
+        const WCHAR* filePath = batch->filePaths->at(idx);
+        RenderedBitmap* bmp = RenderThumbnailForFile(batch, filePath);
+        if (!bmp) {
+            continue;
+        }
+        // loading and rendering might've taken a while
+        if (WasThumbnailCreationCancelled()) {
+            delete bmp;
+            break;
+        }
+        SaveThumbnailForFile(filePath, bmp);
+        if (*batch->onCreated) {
+            (*batch->onCreated)(filePath, bmp);
+        } else {
+            delete bmp;
+        }
+    }
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    return 0;
+}
+
+void CreateThumbnails(const WStrVec& filePaths, const onThumbnailCreatedCb& onCreated) {
+    if (filePaths.size() == 0) {
+        return;
+    }
+    // counted before checking for cancelation, so that CancelCreatingThumbnails
+    // either waits for this batch or this batch sees the cancelation
+    InterlockedIncrement(&gThumbnailBatchCount);
+    if (WasThumbnailCreationCancelled()) {
+        InterlockedDecrement(&gThumbnailBatchCount);
+        return;
+    }
+    ThumbnailBatch batch;
+    batch.filePaths = &filePaths;
+    batch.onCreated = &onCreated;
+    batch.loadSemaphore = CreateSemaphoreW(nullptr, THUMBNAIL_BATCH_MAX_LOADING, THUMBNAIL_BATCH_MAX_LOADING, nullptr);
+    if (!batch.loadSemaphore) {
+        InterlockedDecrement(&gThumbnailBatchCount);
+        return;
+    }
+
+    SYSTEM_INFO si{};
+    GetSystemInfo(&si);
+    int nThreads = limitValue((int)si.dwNumberOfProcessors, 1, THUMBNAIL_BATCH_MAX_THREADS);
+    nThreads = std::min(nThreads, filePaths.isize());
+    HANDLE threads[THUMBNAIL_BATCH_MAX_THREADS];
+    int nStarted = 0;
+    for (int i = 0; i < nThreads; i++) {
+        threads[nStarted] = CreateThread(nullptr, 0, ThumbnailBatchThread, &batch, 0, nullptr);
+        if (threads[nStarted]) {
+            nStarted++;
+        }
+    }
+    if (nStarted == 0) {
+        // render on this thread instead
+        ThumbnailBatchThread(&batch);
+    } else {
+        WaitForMultipleObjects(nStarted, threads, TRUE, INFINITE);
+    }
+    for (int i = 0; i < nStarted; i++) {
+        CloseHandle(threads[i]);
+    }
+    CloseHandle(batch.loadSemaphore);
+    InterlockedDecrement(&gThumbnailBatchCount);
+}
+
+void CancelCreatingThumbnails() {
+    InterlockedExchange(&gCancelThumbnails, 1);
+    // documents which are already being rendered are finished first
+    // (which should take long only very rarely)
+    while (InterlockedCompareExchange(&gThumbnailBatchCount, 0, 0) > 0) {
+        Sleep(10);
+    }
+}
@@ -5,8 +5,27 @@
 #define THUMBNAIL_DX 212
 #define THUMBNAIL_DY 150
 
+// upper bound for the number of documents CreateThumbnails renders in parallel
+#define THUMBNAIL_BATCH_MAX_THREADS 4
+// upper bound for the number of documents CreateThumbnails loads from disk at once
+#define THUMBNAIL_BATCH_MAX_LOADING 2
+
 void CleanUpThumbnailCache(const FileHistory& fileHistory);
 
+// calculates the zoom and the part of page 1 to render for a thumbnail of the given size
+bool GetThumbnailPageRect(EngineBase* engine, Size size, float* zoom, RectF* pageRect);
+// collects the paths of the documents in file history which should
+// have a thumbnail but don't have one yet (must be called on the UI thread)
+void CollectMissingThumbnails(FileHistory& fileHistory, WStrVec& filePaths);
+// called on a worker thread for every created thumbnail (takes ownership of bmp)
+using onThumbnailCreatedCb = std::function<void(const WCHAR* filePath, RenderedBitmap* bmp)>;
+// loads the documents in parallel, renders their first page and saves the thumbnails
+// (blocks until all documents have been processed)
+void CreateThumbnails(const WStrVec& filePaths, const onThumbnailCreatedCb& onCreated);
+// makes all running (and future) CreateThumbnails calls stop after the documents
+// they're currently rendering and waits for them to return (e.g. at shutdown)
+void CancelCreatingThumbnails();
+
 bool LoadThumbnail(FileState& ds);
 bool HasThumbnail(FileState& ds);
 // takes ownership of bmp
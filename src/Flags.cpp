@@ -310,6 +310,11 @@ void ParseCommandLine(const WCHAR* cmdLine, Flags& i) {
             i.showConsole = true;
             continue;
         }
+        if (isArg(L"create-thumbnails")) {
+            i.createThumbnails = true;
+            i.exitImmediately = true;
+            continue;
+        }
         if (isArg(L"install")) {
             i.install = true;
             continue;
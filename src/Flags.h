@@ -16,6 +16,8 @@ struct Flags {
     //   only benchmark loading of the catalog
     WStrVec pathsToBenchmark;
     bool exitWhenDone{false};
+    // -create-thumbnails: renders the missing start page thumbnails and exits
+    bool createThumbnails{false};
     bool printDialog{false};
     WCHAR* printerName{nullptr};
     WCHAR* printSettings{nullptr};
@@ -2,6 +2,7 @@
    License: Simplified BSD (see COPYING.BSD) */
 
 #include "utils/BaseUtil.h"
+#include "utils/Dict.h"
 #include "utils/GdiPlusUtil.h"
 #include "utils/HtmlParserLookup.h"
 #include "utils/CssParser.h"
@@ -706,6 +707,113 @@ static bool CanBreakWordOnChar(WCHAR c) {
     return false;
 }
 
+// maximum number of words (over all fonts) whose bounding boxes are cached,
+// words not yet cached are measured every time afterwards
+#define WORD_WIDTH_CACHE_MAX_WORDS (256 * 1024)
+
+// bounding boxes of words measured with a single font and text render method
+struct WordWidthCacheFont {
+    mui::CachedFont* font = nullptr;
+    mui::TextRenderMethod method = mui::TextRenderMethod::Gdi;
+    // maps the (interned) UTF-8 words to their index in bboxes
+    dict::MapStrToInt indices{1024};
+    // dx is -1 while a word is being measured
+    Vec<RectF> bboxes;
+};
+
+// measuring text dominates the time it takes to lay out a document and the same
+// words are measured again and again, so the results are shared by all formatters
+// (on all threads) and reused when a document is laid out again (e.g. after
+// the window has been resized). CachedFont objects live forever, so their
+// addresses identify them
+struct WordWidthCache {
+    CRITICAL_SECTION cs;
+    Vec<WordWidthCacheFont*> fonts;
+    WordWidthCacheStats stats;
+
+    WordWidthCache() {
+        InitializeCriticalSection(&cs);
+    }
+    ~WordWidthCache() {
+        DeleteVecMembers(fonts);
+        DeleteCriticalSection(&cs);
+    }
+
+    WordWidthCacheFont* GetFont(mui::CachedFont* font, mui::TextRenderMethod method);
+};
+
+static WordWidthCache& GetWordWidthCache() {
+    // initialized (thread-safely) on first use
+    static WordWidthCache cache;
+    return cache;
+}
+
+// must be called with cs held
+WordWidthCacheFont* WordWidthCache::GetFont(mui::CachedFont* font, mui::TextRenderMethod method) {
+    for (WordWidthCacheFont* f : fonts) {
+        if (f->font == font && f->method == method) {
+            return f;
+        }
+    }
+    WordWidthCacheFont* f = new WordWidthCacheFont();
+    f->font = font;
+    f->method = method;
+    fonts.Append(f);
+    stats.nFonts++;
+    return f;
+}
+
+float WordWidthCacheStats::HitRate() const {
+    i64 total = hits + misses;
+    if (total == 0) {
+        return 0.f;
+    }
+    return (float)hits / (float)total;
+}
+
+WordWidthCacheStats GetWordWidthCacheStats() {
+    WordWidthCache& cache = GetWordWidthCache();
+    ScopedCritSec scope(&cache.cs);
+    return cache.stats;
+}
+
+// returns the bounding box of the UTF-8 word (of which s is the UTF-16 version
+// to be measured), measuring it with textMeasure only if it isn't cached yet
+static RectF MeasureWord(mui::ITextRender* textMeasure, mui::CachedFont* font, const char* word, size_t wordLen,
+                         const WCHAR* s, size_t sLen) {
+    WordWidthCache& cache = GetWordWidthCache();
+    auto key = str::DupTemp(word, wordLen);
+    WordWidthCacheFont* f = nullptr;
+    int idx = -1;
+    {
+        ScopedCritSec scope(&cache.cs);
+        f = cache.GetFont(font, textMeasure->method);
+        if (f->indices.Get(key, &idx)) {
+            RectF bbox = f->bboxes.at(idx);
+            if (bbox.dx >= 0) {
+                cache.stats.hits++;
+                return bbox;
+            }
+            // another thread is measuring this word right now
+            idx = -1;
+        } else if (cache.stats.nWords < WORD_WIDTH_CACHE_MAX_WORDS) {
+            idx = f->bboxes.isize();
+            f->indices.Insert(key, idx);
+            f->bboxes.Append(RectF(0, 0, -1, 0));
+            cache.stats.nWords++;
+        }
+        cache.stats.misses++;
+    }
+
+    textMeasure->SetFont(font);
+    RectF bbox = textMeasure->Measure(s, sLen);
+    if (idx >= 0) {
+        ScopedCritSec scope(&cache.cs);
+        f->bboxes.at(idx) = bbox;
+    }
+    return bbox;
+}
+
 // a text run is a string of consecutive text with uniform style
 void HtmlFormatter::EmitTextRun(const char* s, const char* end) {
     currReparseIdx = s - htmlParser->Start();
@@ -732,14 +840,14 @@ void HtmlFormatter::EmitTextRun(const char* s, const char* end) {
         if (0 == strLen) {
             break;
         }
-        textMeasure->SetFont(CurrFont());
-        RectF bbox = textMeasure->Measure(buf, strLen);
+        RectF bbox = MeasureWord(textMeasure, CurrFont(), s, end - s, buf, strLen);
         if (bbox.dx <= pageDx - currX) {
             AppendInstr(DrawInstr::Str(s, end - s, bbox, dirRtl));
             currX += bbox.dx;
             break;
         }
         // get len That Fits the remaining space in the line
+        textMeasure->SetFont(CurrFont());
         size_t lenThatFits = StringLenForWidth(textMeasure, buf, strLen, pageDx - currX);
         // try to prevent a break in the middle of a word
         if (lenThatFits > 0) {
@@ -1396,6 +1504,13 @@ Vec<HtmlPage*>* HtmlFormatter::FormatAllPages(bool skipEmptyPages) {
     return pages;
 }
 
+float HtmlFormatter::Progress() const {
+    if (finishedParsing || htmlParser->Len() == 0) {
+        return 1.f;
+    }
+    return (float)currReparseIdx / (float)htmlParser->Len();
+}
+
 // TODO: draw link in the appropriate format (blue text, underlined, should show hand cursor when
 // mouse is over a link. There's a slight complication here: we only get explicit information about
 // strings, not about the whitespace and we should underline the whitespace as well. Also the text
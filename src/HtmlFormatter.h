@@ -310,6 +310,9 @@ class HtmlFormatter {
 
     HtmlPage* Next(bool skipEmptyPages = true);
     Vec<HtmlPage*>* FormatAllPages(bool skipEmptyPages = true);
+    // fraction of the html data laid out by Next() so far (for estimating
+    // the total page count of a document that is being laid out lazily)
+    [[nodiscard]] float Progress() const;
 };
 
 void DrawHtmlPage(Graphics* g, mui::ITextRender* textDraw, Vec<DrawInstr>* drawInstructions, float offX, float offY,
@@ -317,4 +320,17 @@ void DrawHtmlPage(Graphics* g, mui::ITextRender* textDraw, Vec<DrawInstr>* drawI
 
 mui::TextRenderMethod GetTextRenderMethod();
 void SetTextRenderMethod(mui::TextRenderMethod method);
+
+// counters of the cache of measured words shared by all HtmlFormatters
+struct WordWidthCacheStats {
+    i64 hits = 0;
+    i64 misses = 0;
+    // number of distinct words cached (over all fonts)
+    size_t nWords = 0;
+    size_t nFonts = 0;
+
+    [[nodiscard]] float HitRate() const;
+};
+
+WordWidthCacheStats GetWordWidthCacheStats();
 HtmlFormatterArgs* CreateFormatterDefaultArgs(int dx, int dy, Allocator* textAllocator = nullptr);
@@ -3,6 +3,7 @@
 
 #include "utils/BaseUtil.h"
 #include "utils/ScopedWin.h"
+#include "utils/FileUtil.h"
 #include "utils/WinUtil.h"
 #include "utils/Timer.h"
 
@@ -15,8 +16,11 @@
 #include "Controller.h"
 #include "DisplayModel.h"
 #include "GlobalPrefs.h"
+#include "RenderCacheBudget.h"
 #include "RenderCache.h"
+#include "RenderCacheDisk.h"
 #include "TextSelection.h"
+#include "AppTools.h"
 
 #include "utils/Log.h"
 #define NO_LOG
@@ -24,10 +28,10 @@
 
 #pragma warning(disable : 28159) // silence /analyze: Consider using 'GetTickCount64' instead of 'GetTickCount'
 
-// TODO: remove this and always conserve memory?
-/* Define if you want to conserve memory by always freeing cached bitmaps
-   for pages not visible. Disabling this might lead to pages not rendering
-   due to insufficient (GDI) memory. */
+/* Define if you want to conserve memory by freeing cached tiles of a page
+   rendered at a different resolution once it's been painted at the current
+   one. Bitmaps for pages that aren't visible are kept until the memory
+   budget requires evicting them (see FreeIfOverBudget). */
 #define CONSERVE_MEMORY
 
 bool gShowTileLayout = false;
@@ -43,18 +47,40 @@ RenderCache::RenderCache() : maxTileSize({GetSystemMetrics(SM_CXSCREEN), GetSyst
     InitializeCriticalSection(&cacheAccess);
     InitializeCriticalSection(&requestAccess);
 
+    SetMemoryBudget(0);
+
     startRendering = CreateEvent(nullptr, FALSE, FALSE, nullptr);
-    renderThread = CreateThread(nullptr, 0, RenderCacheThread, this, 0, 0);
-    CrashIf(nullptr == renderThread);
+
+    // use one rendering thread per core
+    SYSTEM_INFO si{};
+    GetSystemInfo(&si);
+    nWorkers = limitValue((int)si.dwNumberOfProcessors, 1, MAX_RENDER_THREADS);
+    for (int i = 0; i < nWorkers; i++) {
+        RenderWorker* worker = &workers[i];
+        worker->cache = this;
+        worker->thread = CreateThread(nullptr, 0, RenderCacheThread, worker, 0, 0);
+        CrashIf(nullptr == worker->thread);
+    }
+
+    startPreloading = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    preloadThread = CreateThread(nullptr, 0, PreloadThread, this, 0, 0);
+    CrashIf(nullptr == preloadThread);
+    SetThreadPriority(preloadThread, THREAD_PRIORITY_BELOW_NORMAL);
 }
 
 RenderCache::~RenderCache() {
     EnterCriticalSection(&requestAccess);
     EnterCriticalSection(&cacheAccess);
 
-    CloseHandle(renderThread);
+    for (int i = 0; i < nWorkers; i++) {
+        CrashIf(workers[i].curReq);
+        CloseHandle(workers[i].thread);
+    }
     CloseHandle(startRendering);
-    CrashIf(curReq || 0 != requestCount || 0 != cacheCount);
+    CloseHandle(preloadThread);
+    CloseHandle(startPreloading);
+    CrashIf(0 != requestCount || 0 != cacheCount);
+    DeleteVecMembers(diskCaches);
 
     LeaveCriticalSection(&cacheAccess);
     DeleteCriticalSection(&cacheAccess);
@@ -62,6 +88,23 @@ RenderCache::~RenderCache() {
     DeleteCriticalSection(&requestAccess);
 }
 
+void RenderCache::SetMemoryBudget(int sizeMB) {
+    constexpr u64 kMB = 1024 * 1024;
+    u64 maxBytes = (u64)sizeMB * kMB;
+    if (sizeMB <= 0) {
+        // use 1/8th of installed memory but stay within reasonable bounds
+        // (and within the much smaller address space of 32-bit processes)
+        MEMORYSTATUSEX ms{};
+        ms.dwLength = sizeof(ms);
+        u64 physMem = GlobalMemoryStatusEx(&ms) ? ms.ullTotalPhys : 0;
+        u64 maxDefault = (sizeof(void*) == 8 ? 1024 : 256) * kMB;
+        maxBytes = limitValue(physMem / 8, 128 * kMB, maxDefault);
+    }
+    ScopedCritSec scope(&cacheAccess);
+    budget.maxBytes = (size_t)maxBytes;
+    dbglogf("RenderCache::SetMemoryBudget: %d MB\n", (int)(maxBytes / kMB));
+}
+
 /* Find a bitmap for a page defined by <dm> and <pageNo> and optionally also
    <rotation> and <zoom> in the cache - call DropCacheEntry when you
    no longer need a found entry. */
@@ -73,6 +116,7 @@ BitmapCacheEntry* RenderCache::Find(DisplayModel* dm, int pageNo, int rotation,
         if ((dm == e->dm) && (pageNo == e->pageNo) && (rotation == e->rotation) &&
             (INVALID_ZOOM == zoom || zoom == e->zoom) && (!tile || e->tile == *tile)) {
             e->refs++;
+            e->lastUsed = budget.Touch();
             CrashIf(i != e->cacheIdx);
             return e;
         }
@@ -110,6 +154,7 @@ bool RenderCache::DropCacheEntry(BitmapCacheEntry* entry) {
     dbglogf("RenderCache::DropCacheEntry: pageNo: %d, rotation: %d, zoom: %.2f\n", entry->pageNo, entry->rotation,
             entry->zoom);
 
+    budget.Removed(entry->bytes);
     delete entry;
 
     // fast removal by replacing freed item with the item at the end
@@ -125,43 +170,77 @@ bool RenderCache::DropCacheEntry(BitmapCacheEntry* entry) {
     return true;
 }
 
-static bool FreeIfFull(RenderCache* rc, const PageRenderRequest& req) {
-    int n = rc->cacheCount;
-    if (n < MAX_BITMAPS_CACHED) {
-        return true;
+// how much memory a rendered bitmap takes
+static size_t GetBitmapBytes(RenderedBitmap* bmp) {
+    HBITMAP hbmp = bmp ? bmp->GetBitmap() : nullptr;
+    if (!hbmp) {
+        return 0;
+    }
+    BITMAP info{};
+    if (!GetObject(hbmp, sizeof(info), &info)) {
+        Size size = bmp->Size();
+        return (size_t)size.dx * (size_t)size.dy * 4;
     }
+    return (size_t)info.bmWidthBytes * (size_t)info.bmHeight;
+}
 
-    DisplayModel* dm = req.dm;
-    // free an invisible page of the same DisplayModel ...
-    for (int i = 0; i < n; i++) {
-        auto entry = rc->cache[i];
-        if (entry->dm == dm && !dm->PageVisibleNearby(entry->pageNo)) {
-            bool didDrop = rc->DropCacheEntry(entry);
-            if (didDrop) {
-                return true;
-            }
-        }
+// how far a page is from the visible part of the document (in pages)
+static int GetPageDistance(DisplayModel* dm, int pageNo, int currPageNo) {
+    if (dm->PageVisible(pageNo)) {
+        return 0;
     }
+    if (dm->PageVisibleNearby(pageNo)) {
+        return 1;
+    }
+    return 1 + abs(pageNo - currPageNo);
+}
 
-    // ... or just the oldest cached page
-    for (int i = 0; i < n; i++) {
-        auto entry = rc->cache[i];
-        if (entry->dm == dm) {
-            // don't free pages from the document we're currently displaying
-            // as it leads to flicker
+// evicts cached bitmaps until a bitmap of the given size fits within
+// the memory budget. Returns false if there's no space left at all
+bool RenderCache::FreeIfOverBudget(DisplayModel* dm, size_t bytes) {
+    ScopedCritSec scope(&cacheAccess);
+
+    RenderCacheCost* costs = evictionCosts;
+    while (cacheCount >= MAX_BITMAPS_CACHED || !budget.HasSpaceFor(bytes)) {
+        bool mustFree = cacheCount >= MAX_BITMAPS_CACHED;
+        DisplayModel* lastDm = nullptr;
+        int currPageNo = INVALID_PAGE_NO;
+        for (int i = 0; i < cacheCount; i++) {
+            BitmapCacheEntry* e = cache[i];
+            if (e->dm != lastDm) {
+                lastDm = e->dm;
+                currPageNo = e->dm->CurrentPageNo();
+            }
+            RenderCacheCost& cost = costs[i];
+            cost.bytes = e->bytes;
+            cost.renderMs = e->renderMs;
+            cost.lastUsed = e->lastUsed;
+            cost.distance = GetPageDistance(e->dm, e->pageNo, currPageNo);
+            cost.zoomMatches = !e->outOfDate && e->zoom == e->dm->GetZoomReal(e->pageNo);
+            // entries referenced by someone else than the cache are being painted
+            cost.pinned = e->refs > 1;
+            // don't free visible pages from the document we're currently displaying
+            // as it leads to flicker (unless we're out of cache slots)
             // TODO: it can still flicker if the dm is from a visible tab
             // in a different window, but it's harder to detect
-            continue;
+            if (!mustFree && e->dm == dm && cost.distance == 0) {
+                cost.pinned = true;
+            }
         }
-        bool didDrop = rc->DropCacheEntry(entry);
-        if (didDrop) {
-            return true;
+
+        int idx = RenderCachePickVictim(costs, cacheCount, budget.clock);
+        if (idx < 0) {
+            // we'll temporarily go over budget for the sake of visible pages
+            return !mustFree;
         }
+        BitmapCacheEntry* e = cache[idx];
+        budget.stats.evictions++;
+        DropCacheEntry(e);
     }
-    return false;
+    return true;
 }
 
-void RenderCache::Add(PageRenderRequest& req, RenderedBitmap* bmp) {
+void RenderCache::Add(PageRenderRequest& req, RenderedBitmap* bmp, float renderMs, bool isPreview) {
     ScopedCritSec scope(&cacheAccess);
     CrashIf(!req.dm);
 
@@ -171,15 +250,26 @@ void RenderCache::Add(PageRenderRequest& req, RenderedBitmap* bmp) {
     /* It's possible there still is a cached bitmap with different zoom/rotation */
     FreePage(req.dm, req.pageNo, &req.tile);
 
-    bool hasSpace = FreeIfFull(this, req);
-    CrashIf(!hasSpace); // TODO: FreeIfFull() might actually fail to free
-    CrashIf(cacheCount > MAX_BITMAPS_CACHED);
+    size_t bytes = GetBitmapBytes(bmp);
+    // all cache slots can be taken by bitmaps that are currently being painted,
+    // in which case this bitmap isn't cached (and will be rendered again if needed)
+    bool hasSpace = FreeIfOverBudget(req.dm, bytes);
+    if (!hasSpace) {
+        delete bmp;
+        return;
+    }
+    CrashIf(cacheCount >= MAX_BITMAPS_CACHED);
 
     // Copy the PageRenderRequest as it will be reused
     auto entry = new BitmapCacheEntry(req.dm, req.pageNo, req.rotation, req.zoom, req.tile, bmp);
+    entry->bytes = bytes;
+    entry->renderMs = renderMs;
+    entry->isPreview = isPreview;
+    entry->lastUsed = budget.Touch();
     entry->cacheIdx = cacheCount;
     cache[cacheCount] = entry;
     cacheCount++;
+    budget.Added(bytes);
 }
 
 static RectF GetTileRect(RectF pagerect, TilePosition tile) {
@@ -304,9 +394,7 @@ void RenderCache::Invalidate(DisplayModel* dm, int pageNo, RectF rect) {
     ScopedCritSec scopeReq(&requestAccess);
 
     ClearQueueForDisplayModel(dm, pageNo);
-    if (curReq && curReq->dm == dm && curReq->pageNo == pageNo) {
-        AbortCurrentRequest();
-    }
+    AbortCurrentRequests(dm, pageNo);
 
     ScopedCritSec scopeCache(&cacheAccess);
 
@@ -389,7 +477,7 @@ bool RenderCache::ReduceTileSize() {
     while (requestCount > 0) {
         ClearQueueForDisplayModel(requests[0].dm);
     }
-    AbortCurrentRequest();
+    AbortCurrentRequests();
 
     return true;
 }
@@ -423,14 +511,18 @@ void RenderCache::RequestRendering(DisplayModel* dm, int pageNo, TilePosition ti
     int rotation = NormalizeRotation(dm->GetRotation());
     float zoom = dm->GetZoomReal(pageNo);
 
-    if (curReq && (curReq->pageNo == pageNo) && (curReq->dm == dm) && (curReq->tile == tile)) {
+    PageRenderRequest* curReq = FindCurrentRequest(dm, pageNo, tile);
+    if (curReq) {
         if ((curReq->zoom == zoom) && (curReq->rotation == rotation)) {
             /* we're already rendering exactly the same page */
             return;
         }
         /* Currently rendered page is for the same page but with different zoom
         or rotation, so abort it */
-        AbortCurrentRequest();
+        if (curReq->abortCookie) {
+            curReq->abortCookie->Abort();
+        }
+        curReq->abort = true;
     }
 
     // clear requests for tiles of different resolution and invisible tiles
@@ -533,7 +625,8 @@ bool RenderCache::Render(DisplayModel* dm, int pageNo, int rotation, float zoom,
 int RenderCache::GetRenderDelay(DisplayModel* dm, int pageNo, TilePosition tile) {
     ScopedCritSec scope(&requestAccess);
 
-    if (curReq && curReq->pageNo == pageNo && curReq->dm == dm && curReq->tile == tile) {
+    PageRenderRequest* curReq = FindCurrentRequest(dm, pageNo, tile);
+    if (curReq) {
         return GetTickCount() - curReq->timestamp;
     }
 
@@ -546,7 +639,47 @@ int RenderCache::GetRenderDelay(DisplayModel* dm, int pageNo, TilePosition tile)
     return RENDER_DELAY_UNDEFINED;
 }
 
-bool RenderCache::GetNextRequest(PageRenderRequest* req) {
+// returns the request for this tile that is currently being rendered (if any)
+PageRenderRequest* RenderCache::FindCurrentRequest(DisplayModel* dm, int pageNo, TilePosition tile) {
+    ScopedCritSec scope(&requestAccess);
+    for (int i = 0; i < nWorkers; i++) {
+        PageRenderRequest* req = workers[i].curReq;
+        if (req && req->pageNo == pageNo && req->dm == dm && req->tile == tile) {
+            return req;
+        }
+    }
+    return nullptr;
+}
+
+bool RenderCache::IsRendering(DisplayModel* dm) {
+    ScopedCritSec scope(&requestAccess);
+    if (preloadingDm == dm) {
+        return true;
+    }
+    for (int i = 0; i < nWorkers; i++) {
+        if (workers[i].curReq && workers[i].curReq->dm == dm) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the most recent request for a visible tile is rendered first, so that
+// pre-rendering of nearby pages doesn't delay what the user is looking at
+static int PickNextRequest(PageRenderRequest* requests, int requestCount) {
+    for (int i = requestCount - 1; i >= 0; i--) {
+        PageRenderRequest* req = &requests[i];
+        if (req->renderCb || !req->dm->PageVisible(req->pageNo)) {
+            continue;
+        }
+        if (req->tile.res <= 1 || IsTileVisible(req->dm, req->pageNo, req->tile)) {
+            return i;
+        }
+    }
+    return requestCount - 1;
+}
+
+bool RenderCache::GetNextRequest(RenderWorker* worker) {
     ScopedCritSec scope(&requestAccess);
 
     if (requestCount == 0) {
@@ -555,42 +688,153 @@ bool RenderCache::GetNextRequest(PageRenderRequest* req) {
 
     CrashIf(requestCount < 0);
     CrashIf(requestCount > MAX_PAGE_REQUESTS);
+    int idx = PickNextRequest(requests, requestCount);
+    worker->req = requests[idx];
     requestCount--;
-    *req = requests[requestCount];
-    curReq = req;
+    if (idx < requestCount) {
+        memmove(&(requests[idx]), &(requests[idx + 1]), sizeof(PageRenderRequest) * (requestCount - idx));
+    }
+    worker->curReq = &worker->req;
     CrashIf(requestCount < 0);
-    CrashIf(req->abort);
+    CrashIf(worker->req.abort);
 
+    // there's more work for other workers
+    if (requestCount > 0) {
+        SetEvent(startRendering);
+    }
     return true;
 }
 
-bool RenderCache::ClearCurrentRequest() {
+bool RenderCache::ClearCurrentRequest(RenderWorker* worker) {
     ScopedCritSec scope(&requestAccess);
-    if (curReq) {
-        delete curReq->abortCookie;
+    if (worker->curReq) {
+        delete worker->curReq->abortCookie;
+        worker->curReq->abortCookie = nullptr;
     }
-    curReq = nullptr;
+    worker->curReq = nullptr;
+    worker->curEngine = nullptr;
 
     bool isQueueEmpty = requestCount == 0;
     return isQueueEmpty;
 }
 
+static bool IsEngineBusy(RenderCache* cache, RenderWorker* worker, EngineBase* engine) {
+    for (int i = 0; i < cache->nWorkers; i++) {
+        RenderWorker* other = &cache->workers[i];
+        if (other != worker && other->curEngine == engine) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int CountEngineClones(RenderCache* cache, DisplayModel* dm) {
+    int n = 0;
+    for (int i = 0; i < cache->nWorkers; i++) {
+        RenderWorker* worker = &cache->workers[i];
+        int idx = worker->cloneDms.Find(dm);
+        if (idx >= 0 && worker->clones[idx]) {
+            n++;
+        }
+    }
+    return n;
+}
+
+// Engines serialize rendering internally, so if another worker is already
+// rendering with the document's engine, we render with our own clone instead
+// (which is loaded the same way as for printing)
+EngineBase* RenderCache::GetEngineForWorker(RenderWorker* worker, DisplayModel* dm) {
+    EngineBase* engine = dm->GetEngine();
+    EngineBase* staleClone = nullptr;
+    {
+        ScopedCritSec scope(&requestAccess);
+        // clones are loaded from the file and wouldn't show unsaved changes
+        // (which might have been made since a clone was created)
+        bool hasUnsavedChanges = EngineHasUnsavedAnnotations(engine);
+        int idx = worker->cloneDms.Find(dm);
+        if (idx >= 0 && !hasUnsavedChanges) {
+            EngineBase* clone = worker->clones[idx];
+            worker->curEngine = clone ? clone : engine;
+            return worker->curEngine;
+        }
+        if (idx >= 0) {
+            staleClone = worker->clones[idx];
+            worker->clones.RemoveAt(idx);
+            worker->cloneDms.RemoveAt(idx);
+        }
+        bool useEngine = !IsEngineBusy(this, worker, engine) || hasUnsavedChanges || engine->isExpensiveToClone;
+        // each clone holds a complete copy of the document, so rather wait for
+        // the engine than multiply the memory used for a single document
+        useEngine = useEngine || CountEngineClones(this, dm) >= MAX_ENGINE_CLONES_PER_DOC;
+        if (useEngine) {
+            worker->curEngine = engine;
+        }
+    }
+    delete staleClone;
+    if (worker->curEngine == engine) {
+        return engine;
+    }
+
+    // cloning might take a while, so don't block other threads. This is safe
+    // because clones are only freed in CancelRendering which waits for us
+    EngineBase* clone = engine->Clone();
+    ScopedCritSec scope(&requestAccess);
+    worker->cloneDms.Append(dm);
+    worker->clones.Append(clone);
+    worker->curEngine = clone ? clone : engine;
+    return worker->curEngine;
+}
+
+// must only be called when no worker is rendering for dm
+void RenderCache::FreeEngineClones(DisplayModel* dm) {
+    ScopedCritSec scope(&requestAccess);
+    for (int i = 0; i < nWorkers; i++) {
+        RenderWorker* worker = &workers[i];
+        CrashIf(worker->curReq && worker->curReq->dm == dm);
+        int idx = worker->cloneDms.Find(dm);
+        if (idx < 0) {
+            continue;
+        }
+        delete worker->clones[idx];
+        worker->clones.RemoveAt(idx);
+        worker->cloneDms.RemoveAt(idx);
+    }
+}
+
+// called by a worker that hasn't had anything to render for ENGINE_CLONE_IDLE_MS
+void RenderCache::FreeIdleEngineClones(RenderWorker* worker) {
+    Vec<EngineBase*> clones;
+    {
+        ScopedCritSec scope(&requestAccess);
+        if (worker->curReq) {
+            return;
+        }
+        clones = worker->clones;
+        worker->clones.Reset();
+        worker->cloneDms.Reset();
+    }
+    DeleteVecMembers(clones);
+}
+
 /* Wait until rendering of a page beloging to <dm> has finished. */
 /* TODO: this might take some time, would be good to show a dialog to let the
    user know he has to wait until we finish */
 void RenderCache::CancelRendering(DisplayModel* dm) {
     ClearQueueForDisplayModel(dm);
+    ClearPreloadsForDisplayModel(dm);
 
     for (;;) {
         EnterCriticalSection(&requestAccess);
-        if (!curReq || (curReq->dm != dm)) {
+        if (!IsRendering(dm)) {
             // to be on the safe side
             ClearQueueForDisplayModel(dm);
+            // the document might be about to be closed or reloaded
+            FreeEngineClones(dm);
             LeaveCriticalSection(&requestAccess);
             return;
         }
 
-        AbortCurrentRequest();
+        AbortCurrentRequests(dm);
         LeaveCriticalSection(&requestAccess);
 
         /* TODO: busy loop is not good, but I don't have a better idea */
@@ -620,32 +864,201 @@ void RenderCache::ClearQueueForDisplayModel(DisplayModel* dm, int pageNo, TilePo
     }
 }
 
-void RenderCache::AbortCurrentRequest() {
+// aborts requests currently being rendered (for a given DisplayModel and page or all)
+void RenderCache::AbortCurrentRequests(DisplayModel* dm, int pageNo) {
+    ScopedCritSec scope(&requestAccess);
+    for (int i = 0; i < nWorkers; i++) {
+        PageRenderRequest* curReq = workers[i].curReq;
+        if (!curReq) {
+            continue;
+        }
+        if (dm && (curReq->dm != dm || (pageNo != INVALID_PAGE_NO && curReq->pageNo != pageNo))) {
+            continue;
+        }
+        if (curReq->abortCookie) {
+            curReq->abortCookie->Abort();
+        }
+        curReq->abort = true;
+    }
+}
+
+// the document's cache file is named after the digest of its content
+static WCHAR* GetDiskCachePath(EngineBase* engine) {
+    u8 digest[16];
+    if (!engine->GetFileDigest(digest)) {
+        return nullptr;
+    }
+    AutoFreeWstr dir(AppGenDataFilename(RENDER_CACHE_DISK_DIR_NAME));
+    if (!dir || !dir::CreateAll(dir)) {
+        return nullptr;
+    }
+    AutoFree hex(_MemToHex(&digest));
+    AutoFreeWstr name(strconv::AnsiToWstr(hex));
+    return str::Format(L"%s\\%s.tiles", dir.Get(), name.Get());
+}
+
+// tiles are only identified by page number, zoom and rotation, which doesn't
+// suffice for engines whose layout depends on fonts and window size (ebooks)
+// and isn't worth it for images
+static bool CanCacheOnDisk(EngineBase* engine) {
+    Kind kind = engine->kind;
+    return kind == kindEnginePdf || kind == kindEngineXps || kind == kindEngineDjVu;
+}
+
+// returns nullptr if dm's tiles aren't to be cached on disk (or not yet)
+RenderCacheDisk* RenderCache::GetDiskCache(DisplayModel* dm, EngineBase* engine) {
+    ScopedCritSec scope(&requestAccess);
+    int idx = diskCacheDms.Find(dm);
+    if (idx >= 0) {
+        // tiles of a document with unsaved changes would be stored under
+        // the digest of the unmodified file
+        RenderCacheDisk* disk = diskCaches[idx];
+        return EngineHasUnsavedAnnotations(engine) ? nullptr : disk;
+    }
+    if (!CanCacheOnDisk(engine)) {
+        diskCacheDms.Append(dm);
+        diskCaches.Append(nullptr);
+        return nullptr;
+    }
+    // computing the digest reads the whole file, so PreloadThread does that
+    // (once) while the workers keep rendering without the disk cache
+    if (!diskCachePendingDms.Contains(dm) && preloadingDm != dm) {
+        diskCachePendingDms.Append(dm);
+        SetEvent(startPreloading);
+    }
+    return nullptr;
+}
+
+DisplayModel* RenderCache::GetNextDiskCacheToOpen() {
+    ScopedCritSec scope(&requestAccess);
+    preloadingDm = nullptr;
+    if (diskCachePendingDms.size() == 0) {
+        return nullptr;
+    }
+    preloadingDm = diskCachePendingDms.Pop();
+    return preloadingDm;
+}
+
+// dm can't be closed meanwhile, as CancelRendering waits for preloadingDm
+void RenderCache::OpenDiskCache(DisplayModel* dm) {
+    EngineBase* engine = dm->GetEngine();
+    RenderCacheDisk* disk = nullptr;
+    if (!EngineHasUnsavedAnnotations(engine)) {
+        AutoFreeWstr path(GetDiskCachePath(engine));
+        if (path) {
+            disk = new RenderCacheDisk(path);
+        }
+    }
+
+    ScopedCritSec scope(&requestAccess);
+    if (diskCacheDms.Contains(dm)) {
+        delete disk;
+        return;
+    }
+    diskCacheDms.Append(dm);
+    diskCaches.Append(disk);
+}
+
+void RenderCache::FreeDiskCache(DisplayModel* dm) {
     ScopedCritSec scope(&requestAccess);
-    if (!curReq) {
+    CrashIf(IsRendering(dm));
+    int idx = diskCacheDms.Find(dm);
+    if (idx < 0) {
         return;
     }
-    if (curReq->abortCookie) {
-        curReq->abortCookie->Abort();
+    delete diskCaches[idx];
+    diskCaches.RemoveAt(idx);
+    diskCacheDms.RemoveAt(idx);
+}
+
+static DiskTileKey GetDiskTileKey(PageRenderRequest& req) {
+    DiskTileKey key;
+    key.pageNo = req.pageNo;
+    key.rotation = NormalizeRotation(req.rotation);
+    key.zoom = req.zoom;
+    key.res = req.tile.res;
+    key.row = req.tile.row;
+    key.col = req.tile.col;
+    return key;
+}
+
+// returns a copy of bmp's pixels as a top-down 32-bit DIB (to be free()d)
+static u8* CopyBitmapPixels(RenderedBitmap* bmp) {
+    Size size = bmp->Size();
+    BITMAPINFO bmi{};
+    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+    bmi.bmiHeader.biWidth = size.dx;
+    bmi.bmiHeader.biHeight = -size.dy;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    u8* pixels = AllocArray<u8>((size_t)size.dx * size.dy * 4);
+    if (!pixels) {
+        return nullptr;
+    }
+    HDC hdc = CreateCompatibleDC(nullptr);
+    int ok = GetDIBits(hdc, bmp->GetBitmap(), 0, size.dy, pixels, &bmi, DIB_RGB_COLORS);
+    DeleteDC(hdc);
+    if (!ok) {
+        free(pixels);
+        return nullptr;
     }
-    curReq->abort = true;
+    return pixels;
+}
+
+// shows the worker's request from the disk cache, if it's been stored there
+bool RenderCache::LoadFromDisk(RenderCacheDisk* disk, PageRenderRequest& req, EngineBase* engine) {
+    DiskTile tile;
+    if (!disk->Load(GetDiskTileKey(req), tile)) {
+        return false;
+    }
+    Size size(tile.dx, tile.dy);
+    HANDLE hMap = nullptr;
+    HBITMAP hbmp = CreateMemoryBitmap(size, &hMap);
+    DIBSECTION info{};
+    if (!hbmp || !GetObject(hbmp, sizeof(info), &info) || !info.dsBm.bmBits) {
+        DeleteObject(hbmp);
+        if (hMap) {
+            CloseHandle(hMap);
+        }
+        free(tile.pixels);
+        return false;
+    }
+    memcpy(info.dsBm.bmBits, tile.pixels, (size_t)tile.dx * tile.dy * 4);
+    free(tile.pixels);
+
+    RenderedBitmap* bmp = new RenderedBitmap(hbmp, size, hMap);
+    if (!engine->IsImageCollection()) {
+        UpdateBitmapColors(bmp->GetBitmap(), textColor, backgroundColor);
+    }
+    // keep the original rendering time, so that the tile is evicted as late
+    // as if it had been rendered (and so that previews are still rendered)
+    Add(req, bmp, tile.renderMs);
+    req.dm->RepaintDisplay();
+    return true;
 }
 
 DWORD WINAPI RenderCache::RenderCacheThread(LPVOID data) {
-    RenderCache* cache = (RenderCache*)data;
-    PageRenderRequest req;
+    RenderWorker* worker = (RenderWorker*)data;
+    RenderCache* cache = worker->cache;
+    PageRenderRequest& req = worker->req;
     RenderedBitmap* bmp;
 
     for (;;) {
-        if (cache->ClearCurrentRequest()) {
-            DWORD waitResult = WaitForSingleObject(cache->startRendering, INFINITE);
+        if (cache->ClearCurrentRequest(worker)) {
+            DWORD waitResult = WaitForSingleObject(cache->startRendering, ENGINE_CLONE_IDLE_MS);
+            if (WAIT_TIMEOUT == waitResult) {
+                cache->FreeIdleEngineClones(worker);
+                continue;
+            }
             // Is it not a page render request?
             if (WAIT_OBJECT_0 != waitResult) {
                 continue;
             }
         }
 
-        if (!cache->GetNextRequest(&req)) {
+        if (!cache->GetNextRequest(worker)) {
             continue;
         }
 
@@ -660,17 +1073,25 @@ DWORD WINAPI RenderCache::RenderCacheThread(LPVOID data) {
             continue;
         }
 
-        // make sure that we have extracted page text for
-        // all rendered pages to allow text selection and
-        // searching without any further delays
-        if (!req.dm->textCache->HasTextForPage(req.pageNo)) {
-            req.dm->textCache->GetTextForPage(req.pageNo);
-        }
-
         CrashIf(req.abortCookie != nullptr);
-        EngineBase* engine = req.dm->GetEngine();
+        EngineBase* engine = cache->GetEngineForWorker(worker, req.dm);
+        // bitmaps handed to callbacks (e.g. for printing) aren't cached
+        RenderCacheDisk* disk = req.renderCb ? nullptr : cache->GetDiskCache(req.dm, engine);
+        if (disk && cache->LoadFromDisk(disk, req, engine)) {
+            // the page hasn't been rendered, so its elements haven't been extracted either
+            cache->RequestPreload(req.dm, req.pageNo);
+            continue;
+        }
+        if (cache->ShouldRenderPreview(req)) {
+            cache->RenderPreview(worker, engine);
+            if (req.abort) {
+                continue;
+            }
+        }
         RenderPageArgs args(req.pageNo, req.zoom, req.rotation, &req.pageRect, RenderTarget::View, &req.abortCookie);
+        auto timeStart = TimeGet();
         bmp = engine->RenderPage(args);
+        float renderMs = (float)TimeSinceInMs(timeStart);
         if (req.abort) {
             delete bmp;
             if (req.renderCb) {
@@ -684,16 +1105,173 @@ DWORD WINAPI RenderCache::RenderCacheThread(LPVOID data) {
             req.renderCb->Callback(bmp);
             req.renderCb = (RenderingCallback*)1; // will crash if accessed again, which should not happen
         } else {
+            // the tile is stored with its original colors, so copy it before
+            // they're replaced (and before the bitmap is handed to the cache)
+            DiskTile tile;
+            if (disk && bmp && renderMs >= RENDER_CACHE_DISK_MIN_RENDER_MS) {
+                tile.pixels = CopyBitmapPixels(bmp);
+                tile.dx = bmp->Size().dx;
+                tile.dy = bmp->Size().dy;
+                tile.renderMs = renderMs;
+            }
             // don't replace colors for individual images
             if (bmp && !engine->IsImageCollection()) {
                 UpdateBitmapColors(bmp->GetBitmap(), cache->textColor, cache->backgroundColor);
             }
-            cache->Add(req, bmp);
+            cache->Add(req, bmp, renderMs);
             req.dm->RepaintDisplay();
+            if (tile.pixels) {
+                // the tile has already been shown, so writing it doesn't delay anything
+                disk->Store(GetDiskTileKey(req), tile);
+                free(tile.pixels);
+            }
+            cache->RequestPreload(req.dm, req.pageNo);
         }
     }
 }
 
+// make sure that we have extracted page text and page elements for all
+// rendered pages to allow text selection, searching and clicking links
+// without any further delays. This is done on a separate thread and only
+// while nothing is being rendered, so as not to delay any painting
+void RenderCache::RequestPreload(DisplayModel* dm, int pageNo) {
+    ScopedCritSec scope(&requestAccess);
+    for (size_t i = 0; i < preloadDms.size(); i++) {
+        if (preloadDms.at(i) == dm && preloadPageNos.at(i) == pageNo) {
+            preloadDms.RemoveAt(i);
+            preloadPageNos.RemoveAt(i);
+            break;
+        }
+    }
+    if (preloadDms.size() >= MAX_PRELOAD_REQUESTS) {
+        // the oldest pages are least likely to still be visible
+        preloadDms.RemoveAt(0);
+        preloadPageNos.RemoveAt(0);
+    }
+    preloadDms.Append(dm);
+    preloadPageNos.Append(pageNo);
+    SetEvent(startPreloading);
+}
+
+// returns false if there's nothing to preload or (isBusyOut) if rendering
+// is still in progress
+bool RenderCache::GetNextPreload(DisplayModel** dmOut, int* pageNoOut, bool* isBusyOut) {
+    ScopedCritSec scope(&requestAccess);
+    preloadingDm = nullptr;
+    *isBusyOut = false;
+    if (preloadDms.size() == 0) {
+        return false;
+    }
+    bool isBusy = requestCount > 0;
+    for (int i = 0; i < nWorkers && !isBusy; i++) {
+        isBusy = workers[i].curReq != nullptr;
+    }
+    if (isBusy) {
+        *isBusyOut = true;
+        return false;
+    }
+    preloadingDm = preloadDms.Pop();
+    *dmOut = preloadingDm;
+    *pageNoOut = preloadPageNos.Pop();
+    return true;
+}
+
+void RenderCache::ClearPreloadsForDisplayModel(DisplayModel* dm) {
+    ScopedCritSec scope(&requestAccess);
+    diskCachePendingDms.Remove(dm);
+    for (size_t i = preloadDms.size(); i > 0; i--) {
+        if (preloadDms.at(i - 1) == dm) {
+            preloadDms.RemoveAt(i - 1);
+            preloadPageNos.RemoveAt(i - 1);
+        }
+    }
+}
+
+DWORD WINAPI RenderCache::PreloadThread(LPVOID data) {
+    RenderCache* cache = (RenderCache*)data;
+    for (;;) {
+        // opening a disk cache doesn't have to wait for rendering to finish,
+        // as it doesn't need the engine's context
+        DisplayModel* dm = cache->GetNextDiskCacheToOpen();
+        if (dm) {
+            cache->OpenDiskCache(dm);
+            continue;
+        }
+        int pageNo = 0;
+        bool isBusy = false;
+        if (!cache->GetNextPreload(&dm, &pageNo, &isBusy)) {
+            WaitForSingleObject(cache->startPreloading, isBusy ? PRELOAD_BUSY_WAIT_MS : INFINITE);
+            continue;
+        }
+        if (!dm->PageVisibleNearby(pageNo) || pageNo > dm->PageCount()) {
+            continue;
+        }
+        if (!dm->textCache->HasTextForPage(pageNo)) {
+            dm->textCache->GetTextForPage(pageNo);
+        }
+        dm->GetEngine()->PreloadPageElements(pageNo);
+    }
+}
+
+// a preview is only worth it if there's nothing to show for the tile yet
+// and if rendering pages of this document has been slow so far (usually
+// because they're scans with big images, which decode a lot faster at
+// lower resolutions)
+bool RenderCache::ShouldRenderPreview(PageRenderRequest& req) {
+    if (req.renderCb || req.zoom / PREVIEW_ZOOM_DIVISOR <= 0) {
+        return false;
+    }
+    int rotation = NormalizeRotation(req.rotation);
+
+    ScopedCritSec scope(&cacheAccess);
+    float totalMs = 0;
+    int nRendered = 0;
+    for (int i = 0; i < cacheCount; i++) {
+        BitmapCacheEntry* e = cache[i];
+        if (e->dm != req.dm) {
+            continue;
+        }
+        if (e->pageNo == req.pageNo && e->rotation == rotation && e->tile == req.tile) {
+            return false;
+        }
+        if (!e->isPreview) {
+            totalMs += e->renderMs;
+            nRendered++;
+        }
+    }
+    return nRendered > 0 && totalMs / nRendered >= PREVIEW_MIN_RENDER_MS;
+}
+
+// renders the worker's request at a fraction of the requested zoom and shows
+// that until the full-quality rendering replaces it (in Add). At lower zoom
+// levels, mupdf decodes images subsampled (JPEG 2000 images only decode
+// the lower resolution levels) which is what makes the preview fast
+void RenderCache::RenderPreview(RenderWorker* worker, EngineBase* engine) {
+    PageRenderRequest& req = worker->req;
+    PageRenderRequest preview = req;
+    preview.zoom = req.zoom / PREVIEW_ZOOM_DIVISOR;
+    // aborting req also aborts the preview
+    RenderPageArgs args(req.pageNo, preview.zoom, req.rotation, &req.pageRect, RenderTarget::View, &req.abortCookie);
+    auto timeStart = TimeGet();
+    RenderedBitmap* bmp = engine->RenderPage(args);
+    float renderMs = (float)TimeSinceInMs(timeStart);
+    {
+        // the full-quality rendering gets its own abort cookie
+        ScopedCritSec scope(&requestAccess);
+        delete req.abortCookie;
+        req.abortCookie = nullptr;
+    }
+    if (!bmp || req.abort) {
+        delete bmp;
+        return;
+    }
+    if (!engine->IsImageCollection()) {
+        UpdateBitmapColors(bmp->GetBitmap(), textColor, backgroundColor);
+    }
+    Add(preview, bmp, renderMs, true);
+    req.dm->RepaintDisplay();
+}
+
 // TODO: conceptually, RenderCache is not the right place for code that paints
 //       (this is the only place that knows about Tiles, though)
 int RenderCache::PaintTile(HDC hdc, Rect bounds, DisplayModel* dm, int pageNo, TilePosition tile, Rect tileOnScreen,
@@ -701,6 +1279,10 @@ int RenderCache::PaintTile(HDC hdc, Rect bounds, DisplayModel* dm, int pageNo, T
     float zoom = dm->GetZoomReal(pageNo);
     BitmapCacheEntry* entry = Find(dm, pageNo, dm->GetRotation(), zoom, &tile);
     int renderDelay = 0;
+    {
+        ScopedCritSec scope(&cacheAccess);
+        budget.CountLookup(entry != nullptr);
+    }
 
     if (!entry) {
         if (!isRemoteSession) {
@@ -869,7 +1451,6 @@ int RenderCache::Paint(HDC hdc, Rect bounds, DisplayModel* dm, int pageNo, PageI
         dbglogf("RenderCache::Paint: calling FreePage() pageNo: %d\n", pageNo);
         FreePage(dm, pageNo, &tile);
     }
-    FreeNotVisible();
 #endif
 
     return renderDelayMin;
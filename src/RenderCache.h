@@ -7,11 +7,27 @@ constexpr int RENDER_DELAY_UNDEFINED = std::numeric_limits<int>::max() - 2;
 #define INVALID_TILE_RES ((USHORT)-1)
 
 #define MAX_PAGE_REQUESTS 8
-// keep this value reasonably low, else we'll run out of
-// GDI resources/memory when caching many larger bitmaps
-// TODO: this should be based on amount of memory taken by rendered pages
-// i.e. one big page can use as much memory as lots of small pages
-#define MAX_BITMAPS_CACHED 64
+// upper bound for the number of threads rendering requests in parallel
+// (each of them might need its own copy of a document's engine)
+#define MAX_RENDER_THREADS 8
+// upper bound for the number of engine clones kept per document (over all workers)
+#define MAX_ENGINE_CLONES_PER_DOC 2
+// engine clones are freed once their worker has been idle for this long
+#define ENGINE_CLONE_IDLE_MS 30000
+// the number of cached bitmaps is primarily limited by RenderCache::budget
+// (i.e. by the amount of memory they take). This is an upper bound
+// that prevents us from running out of GDI handles when caching
+// many small bitmaps
+#define MAX_BITMAPS_CACHED 512
+// pages which take longer than this to render are first rendered
+// at a fraction of the requested zoom (see RenderCache::RenderPreview)
+#define PREVIEW_MIN_RENDER_MS 150
+#define PREVIEW_ZOOM_DIVISOR 4
+// upper bound for the number of rendered pages waiting for their
+// text and page elements to be extracted (see PreloadThread)
+#define MAX_PRELOAD_REQUESTS 32
+// how often PreloadThread checks whether rendering has finished
+#define PRELOAD_BUSY_WAIT_MS 100
 
 class RenderingCallback {
   public:
@@ -52,8 +68,17 @@ struct BitmapCacheEntry {
     // owned by the BitmapCacheEntry
     RenderedBitmap* bitmap = nullptr;
     bool outOfDate = false;
+    // a quickly rendered low-resolution bitmap which is still to be
+    // replaced with a full-quality one
+    bool isPreview = false;
     int refs = 1;
 
+    // memory used by bitmap and how long it took to render it
+    // (used for deciding which entries to evict first)
+    size_t bytes = 0;
+    float renderMs = 0.f;
+    u64 lastUsed = 0;
+
     BitmapCacheEntry(DisplayModel* dm, int pageNo, int rotation, float zoom, TilePosition tile,
                      RenderedBitmap* bitmap) {
         this->dm = dm;
@@ -87,19 +112,61 @@ struct PageRenderRequest {
     RenderingCallback* renderCb = nullptr;
 };
 
+class RenderCache;
+class RenderCacheDisk;
+
+/* A thread rendering requests from RenderCache's queue. Workers render in
+   parallel and use their own clone of a document's engine if another
+   worker is already busy rendering with the original one. */
+struct RenderWorker {
+    RenderCache* cache = nullptr;
+    HANDLE thread = nullptr;
+    // the request currently being rendered (nullptr when idle)
+    PageRenderRequest* curReq = nullptr;
+    PageRenderRequest req;
+    // the engine used for rendering curReq
+    EngineBase* curEngine = nullptr;
+
+    // engines cloned for the given DisplayModels (can be nullptr
+    // if an engine can't be cloned)
+    Vec<DisplayModel*> cloneDms;
+    Vec<EngineBase*> clones;
+};
+
 class RenderCache {
   public:
     BitmapCacheEntry* cache[MAX_BITMAPS_CACHED]{};
     int cacheCount = 0;
+    RenderCacheBudget budget;
+    // scratch space for FreeIfOverBudget (too large for the stack)
+    RenderCacheCost evictionCosts[MAX_BITMAPS_CACHED];
     // make sure to never ask for requestAccess in a cacheAccess
     // protected critical section in order to avoid deadlocks
     CRITICAL_SECTION cacheAccess;
 
     PageRenderRequest requests[MAX_PAGE_REQUESTS]{};
     int requestCount = 0;
-    PageRenderRequest* curReq = nullptr;
     CRITICAL_SECTION requestAccess;
-    HANDLE renderThread = nullptr;
+    RenderWorker workers[MAX_RENDER_THREADS];
+    int nWorkers = 0;
+
+    // rendered pages whose text and page elements are still to be extracted
+    // (most recent at the end), protected by requestAccess
+    Vec<DisplayModel*> preloadDms;
+    Vec<int> preloadPageNos;
+    // the document PreloadThread is currently extracting from
+    // (or opening the disk cache for)
+    DisplayModel* preloadingDm = nullptr;
+    HANDLE preloadThread = nullptr;
+    HANDLE startPreloading = nullptr;
+
+    // persistent caches of slowly rendered tiles, one per document
+    // (nullptr for documents whose tiles aren't cached on disk)
+    Vec<DisplayModel*> diskCacheDms;
+    Vec<RenderCacheDisk*> diskCaches;
+    // documents whose disk cache is still to be opened by PreloadThread
+    // (which requires the digest of the whole file)
+    Vec<DisplayModel*> diskCachePendingDms;
 
     Size maxTileSize{};
     bool isRemoteSession = false;
@@ -115,9 +182,14 @@ class RenderCache {
     RenderCache& operator=(RenderCache const&) = delete;
     ~RenderCache();
 
+    // sets the maximum amount of memory used for cached bitmaps
+    // (if sizeMB isn't positive, it's based on the amount of installed memory)
+    void SetMemoryBudget(int sizeMB);
     void RequestRendering(DisplayModel* dm, int pageNo);
     void Render(DisplayModel* dm, int pageNo, int rotation, float zoom, RectF pageRect, RenderingCallback& callback);
     void CancelRendering(DisplayModel* dm);
+    // must be called after CancelRendering when dm's document is closed
+    void FreeDiskCache(DisplayModel* dm);
     bool Exists(DisplayModel* dm, int pageNo, int rotation, float zoom = INVALID_ZOOM, TilePosition* tile = nullptr);
     void FreeForDisplayModel(DisplayModel* dm);
     void KeepForDisplayModel(DisplayModel* oldDm, DisplayModel* newDm);
@@ -127,9 +199,16 @@ class RenderCache {
     // painted, 0 if something has been painted and RENDER_DELAY_FAILED on failure
     int Paint(HDC hdc, Rect bounds, DisplayModel* dm, int pageNo, PageInfo* pageInfo, bool* renderOutOfDateCue);
 
-    bool ClearCurrentRequest();
-    bool GetNextRequest(PageRenderRequest* req);
-    void Add(PageRenderRequest& req, RenderedBitmap* bmp);
+    bool ClearCurrentRequest(RenderWorker* worker);
+    bool GetNextRequest(RenderWorker* worker);
+    EngineBase* GetEngineForWorker(RenderWorker* worker, DisplayModel* dm);
+    void FreeEngineClones(DisplayModel* dm);
+    void FreeIdleEngineClones(RenderWorker* worker);
+    void Add(PageRenderRequest& req, RenderedBitmap* bmp, float renderMs, bool isPreview = false);
+    bool ShouldRenderPreview(PageRenderRequest& req);
+    void RenderPreview(RenderWorker* worker, EngineBase* engine);
+    RenderCacheDisk* GetDiskCache(DisplayModel* dm, EngineBase* engine);
+    bool LoadFromDisk(RenderCacheDisk* disk, PageRenderRequest& req, EngineBase* engine);
 
     USHORT GetTileRes(DisplayModel* dm, int pageNo) const;
     USHORT GetMaxTileRes(DisplayModel* dm, int pageNo, int rotation);
@@ -143,13 +222,23 @@ class RenderCache {
     bool Render(DisplayModel* dm, int pageNo, int rotation, float zoom, TilePosition* tile = nullptr,
                 RectF* pageRect = nullptr, RenderingCallback* renderCb = nullptr);
     void ClearQueueForDisplayModel(DisplayModel* dm, int pageNo = INVALID_PAGE_NO, TilePosition* tile = nullptr);
-    void AbortCurrentRequest();
+    PageRenderRequest* FindCurrentRequest(DisplayModel* dm, int pageNo, TilePosition tile);
+    bool IsRendering(DisplayModel* dm);
+    void AbortCurrentRequests(DisplayModel* dm = nullptr, int pageNo = INVALID_PAGE_NO);
 
     static DWORD WINAPI RenderCacheThread(LPVOID data);
 
+    void RequestPreload(DisplayModel* dm, int pageNo);
+    bool GetNextPreload(DisplayModel** dmOut, int* pageNoOut, bool* isBusyOut);
+    DisplayModel* GetNextDiskCacheToOpen();
+    void OpenDiskCache(DisplayModel* dm);
+    void ClearPreloadsForDisplayModel(DisplayModel* dm);
+    static DWORD WINAPI PreloadThread(LPVOID data);
+
     BitmapCacheEntry* Find(DisplayModel* dm, int pageNo, int rotation, float zoom = INVALID_ZOOM,
                            TilePosition* tile = nullptr);
     bool DropCacheEntry(BitmapCacheEntry* entry);
+    bool FreeIfOverBudget(DisplayModel* dm, size_t bytes);
     void FreePage(DisplayModel* dm = nullptr, int pageNo = -1, TilePosition* tile = nullptr);
     void FreeNotVisible();
 
@@ -0,0 +1,78 @@
+/* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+#include "utils/BaseUtil.h"
+
+#include "RenderCacheBudget.h"
+
+RenderCacheBudget::RenderCacheBudget(size_t maxBytes) : maxBytes(maxBytes) {
+}
+
+// a bitmap bigger than the whole budget still fits into an empty cache
+bool RenderCacheBudget::HasSpaceFor(size_t bytes) const {
+    if (usedBytes == 0) {
+        return true;
+    }
+    return usedBytes + bytes <= maxBytes;
+}
+
+void RenderCacheBudget::Added(size_t bytes) {
+    usedBytes += bytes;
+    stats.peakBytes = std::max(stats.peakBytes, usedBytes);
+}
+
+void RenderCacheBudget::Removed(size_t bytes) {
+    CrashIf(bytes > usedBytes);
+    usedBytes -= std::min(bytes, usedBytes);
+}
+
+u64 RenderCacheBudget::Touch() {
+    return ++clock;
+}
+
+void RenderCacheBudget::CountLookup(bool hit) {
+    if (hit) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+    }
+}
+
+float RenderCacheBudget::HitRate() const {
+    i64 total = stats.hits + stats.misses;
+    if (total == 0) {
+        return 0.f;
+    }
+    return (float)stats.hits / (float)total;
+}
+
+// the higher the score, the better a candidate for eviction. We prefer to evict
+// bitmaps that are far away from the viewport, have been rendered for a different
+// zoom level, haven't been used recently, take a lot of memory and were cheap
+// to render (and will thus be cheap to re-render, should they be needed again)
+float RenderCacheEvictionScore(const RenderCacheCost& cost, u64 now) {
+    float sizeFactor = 1.f + (float)cost.bytes / (1024.f * 1024.f);
+    float distFactor = 1.f + (float)cost.distance * (float)cost.distance;
+    float zoomFactor = cost.zoomMatches ? 1.f : 8.f;
+    u64 age = now > cost.lastUsed ? now - cost.lastUsed : 0;
+    float ageFactor = 1.f + (float)age / 32.f;
+    float renderCostFactor = 1.f + cost.renderMs / 100.f;
+    return sizeFactor * distFactor * zoomFactor * ageFactor / renderCostFactor;
+}
+
+// returns the index of the entry to evict or -1 if all entries are pinned
+int RenderCachePickVictim(const RenderCacheCost* costs, int nCosts, u64 now) {
+    int victim = -1;
+    float maxScore = 0.f;
+    for (int i = 0; i < nCosts; i++) {
+        if (costs[i].pinned) {
+            continue;
+        }
+        float score = RenderCacheEvictionScore(costs[i], now);
+        if (victim == -1 || score > maxScore) {
+            victim = i;
+            maxScore = score;
+        }
+    }
+    return victim;
+}
@@ -0,0 +1,49 @@
+/* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+/* Memory accounting and eviction policy for RenderCache.
+   This part doesn't know about GDI or DisplayModel so that it can be
+   exercised by unit tests (see RenderCacheBudgetTest in SumatraUnitTests.cpp). */
+
+// what the eviction policy needs to know about a cached bitmap
+struct RenderCacheCost {
+    size_t bytes = 0;
+    // how long it took to render the bitmap
+    float renderMs = 0.f;
+    // distance from the visible area in pages (0 for visible pages)
+    int distance = 0;
+    // false if the bitmap was rendered for a different zoom level
+    // than the one currently used (it's only good as a scaled preview)
+    bool zoomMatches = true;
+    // pinned entries are never evicted (e.g. they're being painted)
+    bool pinned = false;
+    // value of RenderCacheBudget::clock when the entry was last used
+    u64 lastUsed = 0;
+};
+
+struct RenderCacheStats {
+    i64 hits = 0;
+    i64 misses = 0;
+    i64 evictions = 0;
+    size_t peakBytes = 0;
+};
+
+struct RenderCacheBudget {
+    size_t maxBytes = 0;
+    size_t usedBytes = 0;
+    // incremented on every use of an entry, used for LRU ordering
+    u64 clock = 0;
+    RenderCacheStats stats;
+
+    explicit RenderCacheBudget(size_t maxBytes = 0);
+
+    [[nodiscard]] bool HasSpaceFor(size_t bytes) const;
+    void Added(size_t bytes);
+    void Removed(size_t bytes);
+    u64 Touch();
+    void CountLookup(bool hit);
+    [[nodiscard]] float HitRate() const;
+};
+
+float RenderCacheEvictionScore(const RenderCacheCost& cost, u64 now);
+int RenderCachePickVictim(const RenderCacheCost* costs, int nCosts, u64 now);
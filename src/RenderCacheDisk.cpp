@@ -0,0 +1,439 @@
+/* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+#include "utils/BaseUtil.h"
+#include "utils/ScopedWin.h"
+#include "utils/FileUtil.h"
+
+#include <zlib.h>
+
+#include "RenderCacheDisk.h"
+
+#define DISK_CACHE_MAGIC 0x43547553L /* SuTC */
+#define DISK_CACHE_VERSION 1
+#define DISK_TILE_MAGIC 0x454c4954L /* TILE */
+
+struct DiskCacheHeader {
+    u32 magic;
+    u32 version;
+    // incremented every time the file is opened
+    u32 session;
+    u32 reserved;
+};
+
+struct DiskTileHeader {
+    u32 magic;
+    i32 pageNo;
+    i32 rotation;
+    float zoom;
+    u16 res;
+    u16 row;
+    u16 col;
+    u16 reserved;
+    i32 dx;
+    i32 dy;
+    float renderMs;
+    u32 lastSession;
+    // size of the deflated pixels following the header
+    u32 dataLen;
+    // crc32 of the deflated pixels
+    u32 crc;
+};
+
+static_assert(sizeof(DiskCacheHeader) == 16, "DiskCacheHeader must be 16 bytes");
+static_assert(sizeof(DiskTileHeader) == 48, "DiskTileHeader must be 48 bytes");
+
+static bool ReadAt(HANDLE h, i64 offset, void* buf, u32 size) {
+    LARGE_INTEGER off;
+    off.QuadPart = offset;
+    if (!SetFilePointerEx(h, off, nullptr, FILE_BEGIN)) {
+        return false;
+    }
+    DWORD n = 0;
+    BOOL ok = ReadFile(h, buf, size, &n, nullptr);
+    return ok && n == size;
+}
+
+static bool WriteAt(HANDLE h, i64 offset, const void* buf, u32 size) {
+    LARGE_INTEGER off;
+    off.QuadPart = offset;
+    if (!SetFilePointerEx(h, off, nullptr, FILE_BEGIN)) {
+        return false;
+    }
+    DWORD n = 0;
+    BOOL ok = WriteFile(h, buf, size, &n, nullptr);
+    return ok && n == size;
+}
+
+static bool Truncate(HANDLE h, i64 size) {
+    LARGE_INTEGER off;
+    off.QuadPart = size;
+    if (!SetFilePointerEx(h, off, nullptr, FILE_BEGIN)) {
+        return false;
+    }
+    return SetEndOfFile(h);
+}
+
+static bool IsValidTileHeader(const DiskTileHeader& hdr) {
+    if (hdr.magic != DISK_TILE_MAGIC || hdr.dx <= 0 || hdr.dy <= 0) {
+        return false;
+    }
+    // refuse tiles bigger than any we'd ever render
+    if (hdr.dx > 1 << 14 || hdr.dy > 1 << 14) {
+        return false;
+    }
+    return hdr.dataLen > 0 && hdr.dataLen <= (u32)RENDER_CACHE_DISK_MAX_FILE_BYTES;
+}
+
+RenderCacheDisk::RenderCacheDisk(const WCHAR* path, i64 maxBytes) : path(str::Dup(path)), maxBytes(maxBytes) {
+    InitializeCriticalSection(&access);
+}
+
+RenderCacheDisk::~RenderCacheDisk() {
+    EnterCriticalSection(&access);
+    if (hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(hFile);
+    }
+    LeaveCriticalSection(&access);
+    DeleteCriticalSection(&access);
+}
+
+// must be called with access held
+bool RenderCacheDisk::Open() {
+    if (triedOpen) {
+        return hFile != INVALID_HANDLE_VALUE;
+    }
+    triedOpen = true;
+
+    // don't share the file so that another instance of SumatraPDF viewing the
+    // same document simply goes without a disk cache instead of corrupting it
+    hFile = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    // RenderCacheDiskCleanUp removes the files which haven't been opened for the longest time
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(hFile, nullptr, nullptr, &now);
+
+    if (!ReadIndex() && !Reset()) {
+        CloseHandle(hFile);
+        hFile = INVALID_HANDLE_VALUE;
+        return false;
+    }
+    return true;
+}
+
+// reads the tile headers and drops everything from the first invalid
+// record on (e.g. if SumatraPDF crashed while appending a tile)
+bool RenderCacheDisk::ReadIndex() {
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size)) {
+        return false;
+    }
+    DiskCacheHeader hdr;
+    if (!ReadAt(hFile, 0, &hdr, sizeof(hdr))) {
+        return false;
+    }
+    if (hdr.magic != DISK_CACHE_MAGIC || hdr.version != DISK_CACHE_VERSION) {
+        return false;
+    }
+    session = hdr.session + 1;
+    hdr.session = session;
+    if (!WriteAt(hFile, 0, &hdr, sizeof(hdr))) {
+        return false;
+    }
+
+    records.Reset();
+    i64 offset = sizeof(DiskCacheHeader);
+    while (offset + (i64)sizeof(DiskTileHeader) <= size.QuadPart) {
+        DiskTileHeader th;
+        if (!ReadAt(hFile, offset, &th, sizeof(th)) || !IsValidTileHeader(th)) {
+            break;
+        }
+        u32 recSize = (u32)sizeof(th) + th.dataLen;
+        if (offset + recSize > size.QuadPart) {
+            break;
+        }
+        DiskTileRecord rec;
+        rec.key.pageNo = th.pageNo;
+        rec.key.rotation = th.rotation;
+        rec.key.zoom = th.zoom;
+        rec.key.res = th.res;
+        rec.key.row = th.row;
+        rec.key.col = th.col;
+        rec.offset = offset;
+        rec.size = recSize;
+        rec.lastSession = th.lastSession;
+        // a tile stored again replaces its earlier record
+        int idx = FindRecord(rec.key);
+        if (idx != -1) {
+            records.RemoveAt(idx);
+        }
+        records.Append(rec);
+        offset += recSize;
+    }
+    fileSize = offset;
+    if (offset < size.QuadPart && !Truncate(hFile, offset)) {
+        return false;
+    }
+
+    // order by session and file position (later records were written later)
+    records.SortTyped([](const DiskTileRecord* a, const DiskTileRecord* b) {
+        if (a->lastSession != b->lastSession) {
+            return a->lastSession < b->lastSession ? -1 : 1;
+        }
+        return a->offset < b->offset ? -1 : a->offset > b->offset ? 1 : 0;
+    });
+    for (DiskTileRecord& rec : records) {
+        rec.lastUsed = ++clock;
+    }
+    return true;
+}
+
+// starts over with an empty file
+bool RenderCacheDisk::Reset() {
+    records.Reset();
+    session = 1;
+    DiskCacheHeader hdr = {DISK_CACHE_MAGIC, DISK_CACHE_VERSION, session, 0};
+    if (!WriteAt(hFile, 0, &hdr, sizeof(hdr)) || !Truncate(hFile, sizeof(hdr))) {
+        return false;
+    }
+    fileSize = sizeof(hdr);
+    return true;
+}
+
+int RenderCacheDisk::FindRecord(const DiskTileKey& key) const {
+    for (int i = 0; i < records.isize(); i++) {
+        if (records.at(i).key == key) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void RenderCacheDisk::Touch(DiskTileRecord& rec) {
+    rec.lastUsed = ++clock;
+    if (rec.lastSession == session) {
+        return;
+    }
+    // persist the use so that the tile survives compaction in later sessions
+    rec.lastSession = session;
+    i64 off = rec.offset + offsetof(DiskTileHeader, lastSession);
+    WriteAt(hFile, off, &rec.lastSession, sizeof(rec.lastSession));
+}
+
+bool RenderCacheDisk::Load(const DiskTileKey& key, DiskTile& tile) {
+    ScopedCritSec scope(&access);
+    if (!Open()) {
+        return false;
+    }
+    int idx = FindRecord(key);
+    if (idx == -1) {
+        return false;
+    }
+    DiskTileRecord& rec = records.at(idx);
+
+    DiskTileHeader th;
+    ScopedMem<u8> data;
+    u8* pixels = nullptr;
+    bool ok = ReadAt(hFile, rec.offset, &th, sizeof(th)) && IsValidTileHeader(th) && th.pageNo == key.pageNo;
+    if (ok) {
+        data.Set(AllocArray<u8>(th.dataLen));
+        ok = data.Get() && ReadAt(hFile, rec.offset + sizeof(th), data.Get(), th.dataLen);
+    }
+    if (ok) {
+        ok = crc32(0, data.Get(), th.dataLen) == th.crc;
+    }
+    if (ok) {
+        uLongf len = (uLongf)th.dx * th.dy * 4;
+        pixels = AllocArray<u8>(len);
+        ok = pixels && uncompress(pixels, &len, data.Get(), th.dataLen) == Z_OK;
+        ok = ok && len == (uLongf)th.dx * th.dy * 4;
+    }
+    if (!ok) {
+        // don't try to read a broken record again
+        free(pixels);
+        records.RemoveAt(idx);
+        return false;
+    }
+
+    Touch(rec);
+    tile.dx = th.dx;
+    tile.dy = th.dy;
+    tile.renderMs = th.renderMs;
+    tile.pixels = pixels;
+    return true;
+}
+
+bool RenderCacheDisk::Store(const DiskTileKey& key, const DiskTile& tile) {
+    if (tile.dx <= 0 || tile.dy <= 0 || !tile.pixels) {
+        return false;
+    }
+    // compress before taking the lock so that Load isn't blocked meanwhile
+    uLong srcLen = (uLong)tile.dx * tile.dy * 4;
+    uLongf dataLen = compressBound(srcLen);
+    ScopedMem<u8> data(AllocArray<u8>(dataLen));
+    if (!data.Get()) {
+        return false;
+    }
+    if (compress2(data.Get(), &dataLen, tile.pixels, srcLen, Z_BEST_SPEED) != Z_OK) {
+        return false;
+    }
+    u32 recSize = (u32)(sizeof(DiskTileHeader) + dataLen);
+    if (recSize > maxBytes / 2) {
+        return false;
+    }
+
+    ScopedCritSec scope(&access);
+    if (!Open()) {
+        return false;
+    }
+    int idx = FindRecord(key);
+    if (idx != -1) {
+        records.RemoveAt(idx);
+    }
+    if (fileSize + recSize > maxBytes) {
+        // make room for more than this tile, so that we don't compact for every tile
+        if (!Compact(maxBytes * 3 / 4 - recSize)) {
+            return false;
+        }
+    }
+
+    DiskTileHeader th{};
+    th.magic = DISK_TILE_MAGIC;
+    th.pageNo = key.pageNo;
+    th.rotation = key.rotation;
+    th.zoom = key.zoom;
+    th.res = key.res;
+    th.row = key.row;
+    th.col = key.col;
+    th.dx = tile.dx;
+    th.dy = tile.dy;
+    th.renderMs = tile.renderMs;
+    th.lastSession = session;
+    th.dataLen = (u32)dataLen;
+    th.crc = crc32(0, data.Get(), (uInt)dataLen);
+
+    i64 offset = fileSize;
+    bool ok = WriteAt(hFile, offset, &th, sizeof(th)) && WriteAt(hFile, offset + sizeof(th), data.Get(), th.dataLen);
+    if (!ok) {
+        // e.g. the disk is full
+        Truncate(hFile, offset);
+        return false;
+    }
+
+    DiskTileRecord rec;
+    rec.key = key;
+    rec.offset = offset;
+    rec.size = recSize;
+    rec.lastSession = session;
+    rec.lastUsed = ++clock;
+    records.Append(rec);
+    fileSize = offset + recSize;
+    return true;
+}
+
+// moves the most recently used records (up to keepBytes) to the
+// front of the file and truncates it after them
+bool RenderCacheDisk::Compact(i64 keepBytes) {
+    Vec<DiskTileRecord> keep;
+    {
+        Vec<DiskTileRecord> byUse(records);
+        byUse.SortTyped([](const DiskTileRecord* a, const DiskTileRecord* b) {
+            return a->lastUsed > b->lastUsed ? -1 : a->lastUsed < b->lastUsed ? 1 : 0;
+        });
+        i64 total = 0;
+        for (DiskTileRecord& rec : byUse) {
+            if (total + rec.size > keepBytes) {
+                break;
+            }
+            total += rec.size;
+            keep.Append(rec);
+        }
+    }
+    // records only ever move towards the start of the file, so moving
+    // them in file order never overwrites a record that's still to be moved
+    keep.SortTyped([](const DiskTileRecord* a, const DiskTileRecord* b) {
+        return a->offset < b->offset ? -1 : a->offset > b->offset ? 1 : 0;
+    });
+
+    records.Reset();
+    i64 offset = sizeof(DiskCacheHeader);
+    bool ok = true;
+    for (DiskTileRecord& rec : keep) {
+        if (rec.offset != offset) {
+            ScopedMem<u8> buf(AllocArray<u8>(rec.size));
+            ok = buf.Get() && ReadAt(hFile, rec.offset, buf.Get(), rec.size) && WriteAt(hFile, offset, buf.Get(), rec.size);
+            if (!ok) {
+                break;
+            }
+            rec.offset = offset;
+        }
+        records.Append(rec);
+        offset += rec.size;
+    }
+    fileSize = offset;
+    if (!Truncate(hFile, offset)) {
+        return Reset();
+    }
+    return ok;
+}
+
+void RenderCacheDisk::RemovePage(int pageNo) {
+    ScopedCritSec scope(&access);
+    // the records are dropped from the index only, their
+    // space is reclaimed when the file is next compacted
+    for (int i = records.isize() - 1; i >= 0; i--) {
+        if (records.at(i).key.pageNo == pageNo) {
+            records.RemoveAt(i);
+        }
+    }
+}
+
+i64 RenderCacheDisk::FileSize() {
+    ScopedCritSec scope(&access);
+    if (!Open()) {
+        return 0;
+    }
+    return fileSize;
+}
+
+struct DiskCacheFile {
+    WCHAR* name;
+    i64 size;
+    FILETIME modified;
+};
+
+void RenderCacheDiskCleanUp(const WCHAR* dir, i64 maxBytes, const WCHAR* pattern) {
+    AutoFreeWstr filePattern(path::Join(dir, pattern));
+
+    Vec<DiskCacheFile> files;
+    WIN32_FIND_DATA fdata;
+    HANDLE hfind = FindFirstFile(filePattern, &fdata);
+    if (INVALID_HANDLE_VALUE == hfind) {
+        return;
+    }
+    do {
+        if (!(fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            i64 size = ((i64)fdata.nFileSizeHigh << 32) | fdata.nFileSizeLow;
+            files.Append({str::Dup(fdata.cFileName), size, fdata.ftLastWriteTime});
+        }
+    } while (FindNextFile(hfind, &fdata));
+    FindClose(hfind);
+
+    // most recently opened first
+    files.SortTyped([](const DiskCacheFile* a, const DiskCacheFile* b) {
+        return CompareFileTime(&b->modified, &a->modified);
+    });
+    i64 total = 0;
+    for (DiskCacheFile& f : files) {
+        total += f.size;
+        if (total > maxBytes) {
+            // fails for files still open in another instance, which is fine
+            AutoFreeWstr filePath(path::Join(dir, f.name));
+            file::Delete(filePath);
+        }
+        free(f.name);
+    }
+}
@@ -0,0 +1,100 @@
+/* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+/* A persistent cache of rendered tiles, so that reopening a document which
+   is slow to render paints from disk instead of rendering again.
+
+   All tiles of a document are stored in a single file named after the digest
+   of the document's content (so that it's never used for a modified file).
+   The file starts with a DiskCacheHeader, followed by a record for each tile:
+   a DiskTileHeader and the tile's deflated pixels. Tiles are appended as
+   they're stored (storing a tile again turns its older record into garbage)
+   and when the file grows over its size limit, it's compacted in place to
+   the tiles used most recently.
+
+   This part doesn't know about GDI or DisplayModel so that it can be
+   exercised by unit tests (see RenderCacheDiskTest in SumatraUnitTests.cpp). */
+
+// relative to the app's data directory (next to the thumbnails)
+#define RENDER_CACHE_DISK_DIR_NAME L"sumatrapdfcache\\pages"
+// upper bound for the size of all cache files together
+#define RENDER_CACHE_DISK_MAX_BYTES (512 * 1024 * 1024)
+// upper bound for the size of a single document's cache file
+#define RENDER_CACHE_DISK_MAX_FILE_BYTES (128 * 1024 * 1024)
+// tiles which render faster than this are quicker to render again than to load
+#define RENDER_CACHE_DISK_MIN_RENDER_MS 100
+
+struct DiskTileKey {
+    int pageNo = 0;
+    int rotation = 0;
+    float zoom = 0.f;
+    // the tile's TilePosition
+    u16 res = 0;
+    u16 row = 0;
+    u16 col = 0;
+
+    bool operator==(const DiskTileKey& other) const {
+        return pageNo == other.pageNo && rotation == other.rotation && zoom == other.zoom && res == other.res &&
+               row == other.row && col == other.col;
+    }
+};
+
+// the pixels of a tile as in a top-down 32-bit DIB section
+struct DiskTile {
+    int dx = 0;
+    int dy = 0;
+    // how long it took to render the tile originally
+    float renderMs = 0.f;
+    // dx * dy * 4 bytes, allocated with malloc
+    u8* pixels = nullptr;
+};
+
+struct DiskTileRecord {
+    DiskTileKey key;
+    // offset of the record's DiskTileHeader in the file
+    i64 offset = 0;
+    // size of the header and the data
+    u32 size = 0;
+    // the number of the session in which the tile was last used
+    u32 lastSession = 0;
+    // for ordering records used in the same session
+    u64 lastUsed = 0;
+};
+
+class RenderCacheDisk {
+  public:
+    explicit RenderCacheDisk(const WCHAR* path, i64 maxBytes = RENDER_CACHE_DISK_MAX_FILE_BYTES);
+    RenderCacheDisk(RenderCacheDisk const&) = delete;
+    RenderCacheDisk& operator=(RenderCacheDisk const&) = delete;
+    ~RenderCacheDisk();
+
+    // returns false if the tile isn't cached or couldn't be read
+    // (on success, the caller must free tile.pixels)
+    bool Load(const DiskTileKey& key, DiskTile& tile);
+    bool Store(const DiskTileKey& key, const DiskTile& tile);
+    void RemovePage(int pageNo);
+    i64 FileSize();
+
+  private:
+    CRITICAL_SECTION access;
+    AutoFreeWstr path;
+    i64 maxBytes = 0;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    bool triedOpen = false;
+    u32 session = 0;
+    u64 clock = 0;
+    i64 fileSize = 0;
+    Vec<DiskTileRecord> records;
+
+    bool Open();
+    bool ReadIndex();
+    bool Reset();
+    int FindRecord(const DiskTileKey& key) const;
+    void Touch(DiskTileRecord& rec);
+    bool Compact(i64 keepBytes);
+};
+
+// deletes the least recently used cache files (matching pattern) in dir
+// until the remaining ones take up at most maxBytes
+void RenderCacheDiskCleanUp(const WCHAR* dir, i64 maxBytes = RENDER_CACHE_DISK_MAX_BYTES,
+                            const WCHAR* pattern = L"*.tiles");
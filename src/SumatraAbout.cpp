@@ -5,6 +5,8 @@
 #include "utils/ScopedWin.h"
 #include "utils/Dpi.h"
 #include "utils/FileUtil.h"
+#include "utils/ThreadUtil.h"
+#include "utils/UITask.h"
 #include "utils/WinUtil.h"
 
 #include "wingui/WinGui.h"
@@ -635,6 +637,64 @@ void DrawAboutPage(WindowInfo* win, HDC hdc) {
 #define DOCLIST_MAX_THUMBNAILS_X 5
 #define DOCLIST_BOTTOM_BOX_DY DpiScale(win->hwndFrame, 50)
 
+struct CreatedThumbnail {
+    WCHAR* filePath;
+    RenderedBitmap* bmp;
+};
+
+static bool gDidCreateMissingThumbnails = false;
+// thumbnails created in the background which are still to be shown
+static Mutex gCreatedThumbnailsMutex;
+static Vec<CreatedThumbnail> gCreatedThumbnails;
+
+static void ShowCreatedThumbnails() {
+    gCreatedThumbnailsMutex.Lock();
+    Vec<CreatedThumbnail> created(gCreatedThumbnails);
+    gCreatedThumbnails.Reset();
+    gCreatedThumbnailsMutex.Unlock();
+
+    for (CreatedThumbnail& t : created) {
+        FileState* ds = gFileHistory.Find(t.filePath, nullptr);
+        if (ds && !ds->thumbnail) {
+            ds->thumbnail = t.bmp;
+        } else {
+            delete t.bmp;
+        }
+        free(t.filePath);
+    }
+    for (WindowInfo* win : gWindows) {
+        if (win->IsAboutWindow()) {
+            win->RedrawAll(true);
+        }
+    }
+}
+
+// creates the thumbnails missing on the start page in the background. Created
+// thumbnails are handed to the UI thread in batches, so that the start page
+// is repainted once for all thumbnails created in the meantime
+static void CreateMissingThumbnailsAsync(FileHistory& fileHistory) {
+    // only try once per session (e.g. password protected documents never get one)
+    if (gDidCreateMissingThumbnails || !HasPermission(Perm::SavePreferences)) {
+        return;
+    }
+    gDidCreateMissingThumbnails = true;
+
+    WStrVec* filePaths = new WStrVec();
+    CollectMissingThumbnails(fileHistory, *filePaths);
+    RunAsync([filePaths] {
+        CreateThumbnails(*filePaths, [](const WCHAR* filePath, RenderedBitmap* bmp) {
+            gCreatedThumbnailsMutex.Lock();
+            bool isFirst = gCreatedThumbnails.size() == 0;
+            gCreatedThumbnails.Append({str::Dup(filePath), bmp});
+            gCreatedThumbnailsMutex.Unlock();
+            if (isFirst) {
+                uitask::Post(ShowCreatedThumbnails);
+            }
+        });
+        delete filePaths;
+    });
+}
+
 void DrawStartPage(WindowInfo* win, HDC hdc, FileHistory& fileHistory, COLORREF textColor, COLORREF backgroundColor) {
     auto col = GetAppColor(AppColor::MainWindowText);
     AutoDeletePen penBorder(CreatePen(PS_SOLID, DOCLIST_SEPARATOR_DY, col));
@@ -715,6 +775,7 @@ void DrawStartPage(WindowInfo* win, HDC hdc, FileHistory& fileHistory, COLORREF
     SelectObject(hdc, GetStockBrush(NULL_BRUSH));
 
     win->staticLinks.Reset();
+    bool missingThumbnails = false;
     for (int h = 0; h < height; h++) {
         for (int w = 0; w < width; w++) {
             if (h * width + w >= (int)list.size()) {
@@ -732,6 +793,7 @@ void DrawStartPage(WindowInfo* win, HDC hdc, FileHistory& fileHistory, COLORREF
             bool loadOk = true;
             if (!state->thumbnail) {
                 loadOk = LoadThumbnail(*state);
+                missingThumbnails |= !loadOk;
             }
             if (loadOk && state->thumbnail) {
                 Size thumbSize = state->thumbnail->Size();
@@ -774,6 +836,10 @@ void DrawStartPage(WindowInfo* win, HDC hdc, FileHistory& fileHistory, COLORREF
         }
     }
 
+    if (missingThumbnails) {
+        CreateMissingThumbnailsAsync(fileHistory);
+    }
+
     /* render bottom links */
     rc.y +=
         DOCLIST_MARGIN_TOP + height * THUMBNAIL_DY + (height - 1) * DOCLIST_MARGIN_BETWEEN_Y + DOCLIST_MARGIN_BOTTOM;
@@ -52,6 +52,7 @@
 #include "EbookController.h"
 #include "FileHistory.h"
 #include "PdfSync.h"
+#include "RenderCacheBudget.h"
 #include "RenderCache.h"
 #include "ProgressUpdateUI.h"
 #include "TextSelection.h"
@@ -629,7 +630,9 @@ struct ControllerCallbackHandler : ControllerCallback {
     void UpdateScrollbars(Size canvas) override;
     void RequestRendering(int pageNo) override;
     void CleanUp(DisplayModel* dm) override;
+    void CancelRendering(DisplayModel* dm) override;
     void RenderThumbnail(DisplayModel* dm, Size size, const onBitmapRenderedCb&) override;
+    void HandleFinishedLayout(DisplayModel* dm) override;
     void GotoLink(PageDestination* dest) override {
         win->linkHandler->GotoLink(dest);
     }
@@ -641,20 +644,14 @@ struct ControllerCallbackHandler : ControllerCallback {
 
 void ControllerCallbackHandler::RenderThumbnail(DisplayModel* dm, Size size, const onBitmapRenderedCb& saveThumbnail) {
     auto engine = dm->GetEngine();
-    RectF pageRect = engine->PageMediabox(1);
-    if (pageRect.IsEmpty()) {
+    float zoom;
+    RectF pageRect;
+    if (!GetThumbnailPageRect(engine, size, &zoom, &pageRect)) {
         // saveThumbnail must always be called for clean-up code
         saveThumbnail(nullptr);
         return;
     }
 
-    pageRect = engine->Transform(pageRect, 1, 1.0f, 0);
-    float zoom = size.dx / (float)pageRect.dx;
-    if (pageRect.dy > (float)size.dy / zoom) {
-        pageRect.dy = (float)size.dy / zoom;
-    }
-    pageRect = engine->Transform(pageRect, 1, 1.0f, 0, true);
-
     // TODO: this is leaking?
     RenderingCallback* callback = new ThumbnailRenderingTask(saveThumbnail);
     gRenderCache.Render(dm, 1, 0, zoom, pageRect, *callback);
@@ -713,9 +710,14 @@ void ControllerCallbackHandler::RequestRendering(int pageNo) {
 
 void ControllerCallbackHandler::CleanUp(DisplayModel* dm) {
     gRenderCache.CancelRendering(dm);
+    gRenderCache.FreeDiskCache(dm);
     gRenderCache.FreeForDisplayModel(dm);
 }
 
+void ControllerCallbackHandler::CancelRendering(DisplayModel* dm) {
+    gRenderCache.CancelRendering(dm);
+}
+
 void ControllerCallbackHandler::FocusFrame(bool always) {
     if (always || !FindWindowInfoByHwnd(GetFocus())) {
         SetFocus(win->hwndFrame);
@@ -739,6 +741,32 @@ void ControllerCallbackHandler::HandleLayoutedPages(EbookController* ctrl, Ebook
     });
 }
 
+static void UpdatePageCountTask(DisplayModel* dm) {
+    WindowInfo* win = FindWindowInfoByController(dm);
+    if (!win) {
+        // the document has been closed in the meantime
+        return;
+    }
+    bool isCurrent = win->ctrl == dm;
+    if (isCurrent) {
+        // the search thread is using the text cache that's about to be replaced
+        AbortFinding(win, false);
+    }
+    int oldPageCount = dm->PageCount();
+    if (!dm->UpdatePageCount() || !isCurrent) {
+        return;
+    }
+    if (dm->PageCount() != oldPageCount) {
+        DeleteOldSelectionInfo(win, true);
+        UpdateToolbarPageText(win, dm->PageCount());
+    }
+    RepaintAsync(win, 0);
+}
+
+void ControllerCallbackHandler::HandleFinishedLayout(DisplayModel* dm) {
+    uitask::Post([=] { UpdatePageCountTask(dm); });
+}
+
 void ControllerCallbackHandler::RequestDelayedLayout(int delay) {
     SetTimer(win->hwndCanvas, EBOOK_LAYOUT_TIMER_ID, delay, nullptr);
 }
@@ -909,7 +937,8 @@ static Controller* CreateControllerForFile(const WCHAR* path, PasswordUI* pwdUI,
     bool ebookInFixedUI = gGlobalPrefs->ebookUI.useFixedPageUI;
 
     // TODO: sniff file content only once
-    EngineBase* engine = CreateEngine(path, pwdUI, chmInFixedUI, ebookInFixedUI);
+    // DisplayModel applies the final page count of lazily laid out ebooks
+    EngineBase* engine = CreateEngine(path, pwdUI, chmInFixedUI, ebookInFixedUI, true);
 
     if (engine) {
         ctrl = new DisplayModel(engine, win->cbHandler);
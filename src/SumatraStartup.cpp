@@ -34,6 +34,8 @@
 #include "Accelerators.h"
 #include "EngineBase.h"
 #include "EngineCreate.h"
+#include "Annotation.h"
+#include "EnginePdf.h"
 #include "DisplayMode.h"
 #include "SettingsStructs.h"
 #include "Controller.h"
@@ -41,7 +43,9 @@
 #include "FileHistory.h"
 #include "GlobalPrefs.h"
 #include "PdfSync.h"
+#include "RenderCacheBudget.h"
 #include "RenderCache.h"
+#include "RenderCacheDisk.h"
 #include "ProgressUpdateUI.h"
 #include "TextSelection.h"
 #include "TextSearch.h"
@@ -1050,6 +1054,12 @@ int APIENTRY WinMain(HINSTANCE hInstance, __unused HINSTANCE hPrevInstance, __un
         BenchFileOrDir(i.pathsToBenchmark);
     }
 
+    if (i.createThumbnails && HasPermission(Perm::SavePreferences)) {
+        WStrVec filePaths;
+        CollectMissingThumbnails(gFileHistory, filePaths);
+        CreateThumbnails(filePaths, nullptr);
+    }
+
     if (i.exitImmediately) {
         goto Exit;
     }
@@ -1057,6 +1067,11 @@ int APIENTRY WinMain(HINSTANCE hInstance, __unused HINSTANCE hPrevInstance, __un
     gCrashOnOpen = i.crashOnOpen;
 
     GetFixedPageUiColors(gRenderCache.textColor, gRenderCache.backgroundColor);
+    gRenderCache.SetMemoryBudget(gGlobalPrefs->renderCacheSizeMB);
+    {
+        AutoFreeWstr indexDir(AppGenDataFilename(PDF_INDEX_DIR_NAME));
+        SetPdfIndexDir(indexDir);
+    }
 
     gIsStartup = true;
     if (!RegisterWinClass()) {
@@ -1249,7 +1264,20 @@ int APIENTRY WinMain(HINSTANCE hInstance, __unused HINSTANCE hPrevInstance, __un
 
     retCode = RunMessageLoop();
     SafeCloseHandle(&hMutex);
+    // thumbnails are still being created in the background if the user
+    // quits right after startup
+    CancelCreatingThumbnails();
     CleanUpThumbnailCache(gFileHistory);
+    {
+        AutoFreeWstr pagesDir(AppGenDataFilename(RENDER_CACHE_DISK_DIR_NAME));
+        if (pagesDir) {
+            RenderCacheDiskCleanUp(pagesDir);
+        }
+        AutoFreeWstr indexDir(AppGenDataFilename(PDF_INDEX_DIR_NAME));
+        if (indexDir) {
+            RenderCacheDiskCleanUp(indexDir, PDF_INDEX_MAX_BYTES, L"*.xref");
+        }
+    }
 
 Exit:
     prefs::UnregisterForFileChanges();
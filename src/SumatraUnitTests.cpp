@@ -15,6 +15,8 @@
 #include "SettingsStructs.h"
 #include "GlobalPrefs.h"
 #include "Flags.h"
+#include "RenderCacheBudget.h"
+#include "RenderCacheDisk.h"
 
 #include <float.h>
 #include <math.h>
@@ -46,6 +48,14 @@ static void ParseCommandLineTest() {
         utassert(nullptr == i.pathsToBenchmark.at(1));
     }
 
+    {
+        Flags i;
+        ParseCommandLine(L"SumatraPDF.exe -create-thumbnails", i);
+        utassert(i.createThumbnails);
+        utassert(i.exitImmediately);
+        utassert(0 == i.fileNames.size());
+    }
+
     {
         Flags i;
         ParseCommandLine(L"SumatraPDF.exe -bench bar.pdf loadonly", i);
@@ -248,6 +258,222 @@ void EngineUtilitiesTest() {
     utassert(page == 0);
 }
 
+static void RenderCacheEvictionTest() {
+    RenderCacheCost costs[3];
+    costs[0].bytes = 1024 * 1024;
+    costs[1] = costs[0];
+    costs[2] = costs[0];
+
+    // pages further away from the viewport go first
+    costs[0].distance = 0;
+    costs[1].distance = 5;
+    costs[2].distance = 1;
+    utassert(1 == RenderCachePickVictim(costs, 3, 0));
+
+    // then those rendered at a different zoom level
+    costs[1].distance = 0;
+    costs[2].zoomMatches = false;
+    utassert(2 == RenderCachePickVictim(costs, 3, 0));
+
+    // then those that are cheap to re-render
+    costs[2].zoomMatches = true;
+    costs[0].renderMs = 500;
+    costs[2].renderMs = 500;
+    utassert(1 == RenderCachePickVictim(costs, 3, 0));
+
+    // pinned entries are never evicted
+    costs[1].pinned = true;
+    utassert(1 != RenderCachePickVictim(costs, 3, 0));
+    costs[0].pinned = true;
+    costs[2].pinned = true;
+    utassert(-1 == RenderCachePickVictim(costs, 3, 0));
+}
+
+struct SimCacheEntry {
+    int pageNo;
+    size_t bytes;
+    float renderMs;
+    u64 lastUsed;
+};
+
+// simulates how RenderCache uses RenderCacheBudget when the
+// pages in [firstVisible, firstVisible + nVisible) are painted
+static void SimulatePaint(RenderCacheBudget& budget, Vec<SimCacheEntry>& cache, int firstVisible, int nVisible) {
+    RenderCacheCost costs[256];
+    // page 1 and then every 50th page is a large poster
+    auto pageBytes = [](int pageNo) -> size_t { return (pageNo % 50 == 1) ? 12 * 1024 * 1024 : 1536 * 1024; };
+
+    // also pre-render the next page
+    for (int pageNo = firstVisible; pageNo <= firstVisible + nVisible; pageNo++) {
+        bool isVisible = pageNo < firstVisible + nVisible;
+        bool found = false;
+        for (SimCacheEntry& e : cache) {
+            if (e.pageNo == pageNo) {
+                e.lastUsed = budget.Touch();
+                found = true;
+            }
+        }
+        if (isVisible) {
+            budget.CountLookup(found);
+        }
+        if (found) {
+            continue;
+        }
+
+        size_t bytes = pageBytes(pageNo);
+        while (!budget.HasSpaceFor(bytes)) {
+            int n = cache.isize();
+            utassert(n <= (int)dimof(costs));
+            for (int i = 0; i < n; i++) {
+                SimCacheEntry& e = cache[i];
+                costs[i] = RenderCacheCost();
+                costs[i].bytes = e.bytes;
+                costs[i].renderMs = e.renderMs;
+                costs[i].lastUsed = e.lastUsed;
+                int dist = e.pageNo - firstVisible;
+                if (dist >= 0 && dist < nVisible) {
+                    costs[i].distance = 0;
+                    costs[i].pinned = true;
+                } else {
+                    costs[i].distance = 1 + std::abs(dist < 0 ? dist : dist - nVisible + 1);
+                }
+            }
+            int idx = RenderCachePickVictim(costs, n, budget.clock);
+            if (idx < 0) {
+                break;
+            }
+            budget.Removed(cache[idx].bytes);
+            budget.stats.evictions++;
+            cache.RemoveAtFast(idx);
+        }
+        // rendering time is roughly proportional to the size of the bitmap
+        SimCacheEntry e{pageNo, bytes, (float)bytes / (64 * 1024), budget.Touch()};
+        cache.Append(e);
+        budget.Added(bytes);
+    }
+}
+
+// replays scroll traces against a memory budget and checks that
+// we stay within budget and that recently viewed pages remain cached
+static void RenderCacheBudgetTest() {
+    constexpr size_t kMaxBytes = 48 * 1024 * 1024;
+    RenderCacheBudget budget(kMaxBytes);
+    Vec<SimCacheEntry> cache;
+
+    // fast scrolling forward through a long document
+    for (int pageNo = 1; pageNo <= 400; pageNo++) {
+        SimulatePaint(budget, cache, pageNo, 2);
+        utassert(budget.usedBytes <= kMaxBytes);
+    }
+    utassert(budget.stats.evictions > 0);
+    utassert(budget.stats.peakBytes <= kMaxBytes);
+
+    // scrolling back a few pages should be served from the cache
+    budget.stats.hits = 0;
+    budget.stats.misses = 0;
+    for (int pageNo = 400; pageNo >= 390; pageNo--) {
+        SimulatePaint(budget, cache, pageNo, 2);
+    }
+    utassert(budget.HitRate() > 0.9f);
+
+    // jumping around in the document and back
+    for (int i = 0; i < 20; i++) {
+        SimulatePaint(budget, cache, 1 + (i * 97) % 2000, 2);
+        SimulatePaint(budget, cache, 1000, 2);
+        utassert(budget.usedBytes <= kMaxBytes);
+    }
+    utassert(budget.stats.peakBytes <= kMaxBytes);
+    // the page we keep returning to should stay cached
+    bool found = false;
+    for (SimCacheEntry& e : cache) {
+        found |= e.pageNo == 1000;
+    }
+    utassert(found);
+}
+
+static DiskTile MakeDiskTile(int dx, int dy, u8 seed) {
+    DiskTile tile;
+    tile.dx = dx;
+    tile.dy = dy;
+    tile.renderMs = 250.f;
+    tile.pixels = AllocArray<u8>((size_t)dx * dy * 4);
+    for (int i = 0; i < dx * dy * 4; i++) {
+        tile.pixels[i] = (u8)(seed + i / 97);
+    }
+    return tile;
+}
+
+static bool LoadsDiskTile(RenderCacheDisk& disk, DiskTileKey key, u8 seed) {
+    DiskTile tile;
+    if (!disk.Load(key, tile)) {
+        return false;
+    }
+    DiskTile expected = MakeDiskTile(tile.dx, tile.dy, seed);
+    bool same = memcmp(tile.pixels, expected.pixels, (size_t)tile.dx * tile.dy * 4) == 0;
+    free(tile.pixels);
+    free(expected.pixels);
+    return same;
+}
+
+// stores tiles, reopens the cache file and checks that the least
+// recently used tiles are the ones dropped when it grows too big
+static void RenderCacheDiskTest() {
+    AutoFreeWstr path(GetTempFilePath(L"tiles"));
+    utassert(path);
+    if (!path) {
+        return;
+    }
+    DiskTileKey keys[16];
+    for (int i = 0; i < (int)dimof(keys); i++) {
+        keys[i].pageNo = 1 + i;
+        keys[i].zoom = 1.5f;
+    }
+
+    {
+        RenderCacheDisk disk(path);
+        for (int i = 0; i < 4; i++) {
+            DiskTile tile = MakeDiskTile(64, 48, (u8)i);
+            utassert(disk.Store(keys[i], tile));
+            free(tile.pixels);
+        }
+        utassert(LoadsDiskTile(disk, keys[2], 2));
+        DiskTileKey other = keys[2];
+        other.rotation = 90;
+        DiskTile tile;
+        utassert(!disk.Load(other, tile));
+    }
+
+    i64 fileSize;
+    {
+        RenderCacheDisk disk(path);
+        for (int i = 0; i < 4; i++) {
+            utassert(LoadsDiskTile(disk, keys[i], (u8)i));
+        }
+        disk.RemovePage(keys[3].pageNo);
+        DiskTile tile;
+        utassert(!disk.Load(keys[3], tile));
+        fileSize = disk.FileSize();
+    }
+
+    {
+        // room for only a few tiles, so that storing more compacts the file
+        RenderCacheDisk disk(path, fileSize * 2);
+        utassert(LoadsDiskTile(disk, keys[0], 0));
+        for (int i = 4; i < (int)dimof(keys); i++) {
+            DiskTile tile = MakeDiskTile(64, 48, (u8)i);
+            utassert(disk.Store(keys[i], tile));
+            free(tile.pixels);
+            utassert(disk.FileSize() <= fileSize * 2);
+        }
+        // the most recently stored tile is always kept
+        utassert(LoadsDiskTile(disk, keys[dimof(keys) - 1], (u8)(dimof(keys) - 1)));
+        DiskTile tile;
+        utassert(!disk.Load(keys[1], tile));
+    }
+
+    file::Delete(path);
+}
+
 void SumatraPDF_UnitTests() {
     colorTest();
     BenchRangeTest();
@@ -255,4 +481,7 @@ void SumatraPDF_UnitTests() {
     ParseCommandLineTest();
     versioncheck_test();
     hexstrTest();
+    RenderCacheEvictionTest();
+    RenderCacheBudgetTest();
+    RenderCacheDiskTest();
 }
@@ -3,6 +3,7 @@
 
 #include "utils/BaseUtil.h"
 #include "utils/ScopedWin.h"
+#include "utils/StrFind.h"
 
 #include "wingui/TreeModel.h"
 
@@ -33,6 +34,7 @@ TextSearch::~TextSearch() {
 
 void TextSearch::Reset() {
     pageText = nullptr;
+    pageTextLen = 0;
     TextSelection::Reset();
 }
 
@@ -118,30 +120,10 @@ void TextSearch::SetLastResult(TextSelection* sel) {
 
     searchHitStartAt = findPage = std::min(startPage, endPage);
     findIndex = (findPage == startPage ? startGlyph : endGlyph) + (int)str::Len(findText);
-    pageText = textCache->GetTextForPage(findPage);
+    pageText = textCache->GetTextForPage(findPage, &pageTextLen);
     forward = true;
 }
 
-static WCHAR CharToLower2(WCHAR c) {
-    WCHAR buf[1] = {c};
-    CharLowerBuffW(buf, 1);
-    return buf[0];
-}
-
-static inline WCHAR CharToLower(WCHAR c) {
-    // fast path that hopefully will be inlined
-    if (c >= 'a' && c <= 'z') {
-        return c;
-    }
-    if (c >= '0' && c <= '9') {
-        return c;
-    }
-    if (c >= 'A' && c <= 'Z') {
-        return c + 32;
-    }
-    return CharToLower2(c);
-}
-
 // try to match "findText" from "start" with whitespace tolerance
 // (ignore all whitespace except after alphanumeric characters)
 TextSearch::PageAndOffset TextSearch::MatchEnd(const WCHAR* start) const {
@@ -169,8 +151,9 @@ TextSearch::PageAndOffset TextSearch::MatchEnd(const WCHAR* start) const {
         if (caseSensitive) {
             isMatch = *match == *end;
         } else {
-            WCHAR matchLower = CharToLower(*match);
-            WCHAR matchEnd = CharToLower(*end);
+            // must fold the same way as strfind::Find() in FindTextInPage
+            WCHAR matchLower = strfind::FoldChar(*match);
+            WCHAR matchEnd = strfind::FoldChar(*end);
             isMatch = matchLower == matchEnd;
         }
         if (isMatch) {
@@ -253,11 +236,8 @@ bool TextSearch::FindTextInPage(int pageNo, TextSearch::PageAndOffset* finalGlyp
             found = GetNextIndex(pageText, findIndex, forward);
         } else if (forward) {
             const WCHAR* s = pageText + findIndex;
-            if (caseSensitive) {
-                found = StrStr(s, anchor);
-            } else {
-                found = StrStrI(s, anchor);
-            }
+            size_t sLen = findIndex < pageTextLen ? (size_t)(pageTextLen - findIndex) : 0;
+            found = strfind::Find(s, sLen, anchor, caseSensitive);
         } else {
             found = StrRStrI(pageText, pageText + findIndex, anchor);
         }
@@ -300,10 +280,18 @@ bool TextSearch::FindStartingAtPage(int pageNo, ProgressUpdateUI* tracker) {
             pageNo += next;
             continue;
         }
+        // a match must start with the anchor, so pages that have already been
+        // indexed in the background and don't contain it can be skipped quickly
+        if (anchor && textCache->CanSkipPage(pageNo, anchor)) {
+            pagesToSkip[pageNo - 1] = true;
+            pageNo += next;
+            continue;
+        }
 
         Reset();
 
-        pageText = textCache->GetTextForPage(pageNo, &findIndex);
+        pageText = textCache->GetTextForPage(pageNo, &pageTextLen);
+        findIndex = pageTextLen;
         if (pageText) {
             if (forward) {
                 findIndex = 0;
@@ -313,7 +301,7 @@ bool TextSearch::FindStartingAtPage(int pageNo, ProgressUpdateUI* tracker) {
                 if (forward) {
                     if (findPage != r.page) {
                         findPage = r.page;
-                        pageText = textCache->GetTextForPage(findPage);
+                        pageText = textCache->GetTextForPage(findPage, &pageTextLen);
                     }
                     findIndex = r.offset;
                 }
@@ -333,6 +321,7 @@ bool TextSearch::FindStartingAtPage(int pageNo, ProgressUpdateUI* tracker) {
 
 TextSel* TextSearch::FindFirst(int page, const WCHAR* text, ProgressUpdateUI* tracker) {
     SetText(text);
+    textCache->StartIndexing(page);
 
     if (FindStartingAtPage(page, tracker)) {
         return &result;
@@ -358,7 +347,7 @@ TextSel* TextSearch::FindNext(ProgressUpdateUI* tracker) {
         if (forward) {
             findPage = finalGlyph.page;
             findIndex = finalGlyph.offset;
-            pageText = textCache->GetTextForPage(findPage);
+            pageText = textCache->GetTextForPage(findPage, &pageTextLen);
         }
         return &result;
     }
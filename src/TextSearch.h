@@ -58,6 +58,7 @@ class TextSearch : public TextSelection {
 
   private:
     const WCHAR* pageText = nullptr;
+    int pageTextLen = 0;
     int findIndex = 0;
 
     WCHAR* lastText = nullptr;
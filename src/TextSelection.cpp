@@ -3,6 +3,8 @@
 
 #include "utils/BaseUtil.h"
 #include "utils/ScopedWin.h"
+#include "utils/StrFind.h"
+#include "utils/ThreadUtil.h"
 
 #include "wingui/TreeModel.h"
 
@@ -17,24 +19,76 @@ bool isWordChar(WCHAR c) {
     return IsCharAlphaNumeric(c) || c == '_';
 }
 
+// extracts the text of pages not yet in the text cache, using its own
+// clone of the engine so that several pages can be extracted in parallel
+// and so that the document's engine remains available for rendering
+// and for the UI (unless the engine is expensive to clone)
+class TextIndexThread : public ThreadBase {
+  public:
+    DocumentTextCache* textCache = nullptr;
+
+    explicit TextIndexThread(DocumentTextCache* textCache);
+    ~TextIndexThread() override = default;
+
+    // ThreadBase
+    void Run() override;
+};
+
+TextIndexThread::TextIndexThread(DocumentTextCache* textCache) : ThreadBase("TextIndexThread") {
+    this->textCache = textCache;
+}
+
+void TextIndexThread::Run() {
+    // cloning might take a while, so it's done here instead of on the UI thread.
+    // Engines which can't be cloned are only indexed on demand (by searching)
+    EngineBase* engine = textCache->engine;
+    bool useClone = !engine->isExpensiveToClone;
+    if (useClone) {
+        engine = engine->Clone();
+    }
+    if (!engine) {
+        return;
+    }
+    while (!WasCancelRequested()) {
+        int pageNo = textCache->ClaimPageToIndex();
+        if (pageNo < 1) {
+            break;
+        }
+        if (textCache->HasTextForPage(pageNo)) {
+            continue;
+        }
+        PageText pageText = engine->ExtractPageText(pageNo);
+        textCache->SetTextForPage(pageNo, pageText);
+    }
+    // don't keep a copy of the document around any longer than necessary
+    if (useClone) {
+        delete engine;
+    }
+}
+
 DocumentTextCache::DocumentTextCache(EngineBase* engine) : engine(engine) {
     nPages = engine->PageCount();
     pagesText = AllocArray<PageText>(nPages);
-    debugSize = nPages * (sizeof(Rect*) + sizeof(WCHAR*) + sizeof(int));
+    trigramSets = AllocArray<u64*>(nPages);
+    debugSize = nPages * (sizeof(Rect*) + sizeof(WCHAR*) + sizeof(int) + sizeof(u64*));
 
     InitializeCriticalSection(&access);
 }
 
 DocumentTextCache::~DocumentTextCache() {
+    StopIndexing();
+
     EnterCriticalSection(&access);
 
-    int nPages = engine->PageCount();
+    // note: the engine's page count might have changed since (cf. EngineBase::UpdatePageCount)
     for (int i = 0; i < nPages; i++) {
         PageText* pageText = &pagesText[i];
         free(pageText->coords);
         free(pageText->text);
+        free(trigramSets[i]);
     }
     free(pagesText);
+    free(trigramSets);
     LeaveCriticalSection(&access);
     DeleteCriticalSection(&access);
 }
@@ -45,21 +99,67 @@ bool DocumentTextCache::HasTextForPage(int pageNo) {
     return pageText->text != nullptr;
 }
 
-const WCHAR* DocumentTextCache::GetTextForPage(int pageNo, int* lenOut, Rect** coordsOut) {
+static inline u32 TrigramBit(WCHAR c1, WCHAR c2, WCHAR c3) {
+    WCHAR trigram[3] = {c1, c2, c3};
+    return MurmurHash2(trigram, sizeof(trigram)) % TEXT_INDEX_BITS;
+}
+
+static u64* BuildTrigramSet(const WCHAR* text, int len) {
+    u64* set = AllocArray<u64>(TEXT_INDEX_BITS / 64);
+    if (!set || len < 3) {
+        return set;
+    }
+    WCHAR c1 = strfind::FoldChar(text[0]);
+    WCHAR c2 = strfind::FoldChar(text[1]);
+    for (int i = 2; i < len; i++) {
+        WCHAR c3 = strfind::FoldChar(text[i]);
+        u32 bit = TrigramBit(c1, c2, c3);
+        set[bit / 64] |= (u64)1 << (bit % 64);
+        c1 = c2;
+        c2 = c3;
+    }
+    return set;
+}
+
+// takes ownership of pageText (which is reset)
+void DocumentTextCache::SetTextForPage(int pageNo, PageText& pageText) {
     CrashIf(pageNo < 1 || pageNo > nPages);
+    if (!pageText.text) {
+        pageText.text = str::Dup(L"");
+        pageText.len = 0;
+    }
+    u64* trigramSet = BuildTrigramSet(pageText.text, pageText.len);
 
     ScopedCritSec scope(&access);
-    PageText* pageText = &pagesText[pageNo - 1];
+    PageText* cached = &pagesText[pageNo - 1];
+    if (cached->text) {
+        // another thread was faster
+        FreePageText(&pageText);
+        free(trigramSet);
+        return;
+    }
+    *cached = pageText;
+    trigramSets[pageNo - 1] = trigramSet;
+    debugSize += (pageText.len + 1) * (int)(sizeof(WCHAR) + sizeof(Rect));
+    if (trigramSet) {
+        debugSize += TEXT_INDEX_BITS / 8;
+    }
+    pageText = {};
+}
 
-    if (!pageText->text) {
-        *pageText = engine->ExtractPageText(pageNo);
-        if (!pageText->text) {
-            pageText->text = str::Dup(L"");
-            pageText->len = 0;
-        }
-        debugSize += (pageText->len + 1) * (int)(sizeof(WCHAR) + sizeof(Rect));
+const WCHAR* DocumentTextCache::GetTextForPage(int pageNo, int* lenOut, Rect** coordsOut) {
+    CrashIf(pageNo < 1 || pageNo > nPages);
+
+    // extracting text can take a while, so don't block other threads
+    // (e.g. TextIndexThread) from accessing the cache in the meantime
+    if (!HasTextForPage(pageNo)) {
+        PageText extracted = engine->ExtractPageText(pageNo);
+        SetTextForPage(pageNo, extracted);
     }
 
+    ScopedCritSec scope(&access);
+    PageText* pageText = &pagesText[pageNo - 1];
+
     if (lenOut) {
         *lenOut = pageText->len;
     }
@@ -69,6 +169,84 @@ const WCHAR* DocumentTextCache::GetTextForPage(int pageNo, int* lenOut, Rect** c
     return pageText->text;
 }
 
+// starts extracting the text of all pages in the background, beginning
+// at startPageNo (where a search is likely to continue)
+void DocumentTextCache::StartIndexing(int startPageNo) {
+    if (indexThreads.size() > 0 || nPages == 0) {
+        return;
+    }
+    indexStartPage = limitValue(startPageNo, 1, nPages);
+    nPagesClaimed = 0;
+
+    SYSTEM_INFO si{};
+    GetSystemInfo(&si);
+    int nThreads = limitValue((int)si.dwNumberOfProcessors, 1, TEXT_INDEX_MAX_THREADS);
+    // not worth cloning the engine for short documents
+    nThreads = std::min(nThreads, nPages / 16 + 1);
+    if (engine->isExpensiveToClone) {
+        // all threads would have to share the document's engine
+        nThreads = 1;
+    }
+    for (int i = 0; i < nThreads; i++) {
+        auto thread = new TextIndexThread(this);
+        indexThreads.Append(thread);
+        thread->Start();
+    }
+}
+
+void DocumentTextCache::StopIndexing() {
+    for (auto thread : indexThreads) {
+        thread->RequestCancel();
+    }
+    for (auto thread : indexThreads) {
+        thread->Join();
+        delete thread;
+    }
+    indexThreads.Reset();
+}
+
+// returns the next page for a TextIndexThread to extract or 0 if all pages
+// have been claimed. Pages are claimed in order, starting at indexStartPage
+int DocumentTextCache::ClaimPageToIndex() {
+    LONG n = InterlockedIncrement(&nPagesClaimed);
+    if (n > nPages) {
+        return 0;
+    }
+    return (indexStartPage - 1 + (int)n - 1) % nPages + 1;
+}
+
+// returns true if the page's text has been indexed and definitely doesn't
+// contain word (case-insensitively). Only words of at least 3 ASCII characters
+// can be checked, any other word might be contained in any page
+bool DocumentTextCache::CanSkipPage(int pageNo, const WCHAR* word) {
+    CrashIf(pageNo < 1 || pageNo > nPages);
+    int len = (int)str::Len(word);
+    if (len < 3) {
+        return false;
+    }
+    for (int i = 0; i < len; i++) {
+        if (word[i] >= 0x80) {
+            return false;
+        }
+    }
+
+    ScopedCritSec scope(&access);
+    u64* set = trigramSets[pageNo - 1];
+    if (!set) {
+        return false;
+    }
+    for (int i = 2; i < len; i++) {
+        WCHAR c1 = strfind::FoldChar(word[i - 2]);
+        WCHAR c2 = strfind::FoldChar(word[i - 1]);
+        WCHAR c3 = strfind::FoldChar(word[i]);
+        u32 bit = TrigramBit(c1, c2, c3);
+        if ((set[bit / 64] & ((u64)1 << (bit % 64))) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 TextSelection::TextSelection(EngineBase* engine, DocumentTextCache* textCache) : engine(engine), textCache(textCache) {
 }
 
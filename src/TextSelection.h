@@ -1,19 +1,41 @@
 /* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
    License: GPLv3 */
 
+// number of bits in the trigram set of a page's text
+#define TEXT_INDEX_BITS (8 * 1024)
+// maximum number of threads extracting text in the background
+#define TEXT_INDEX_MAX_THREADS 4
+
+class TextIndexThread;
+
 struct DocumentTextCache {
     EngineBase* engine{nullptr};
     int nPages{0};
     PageText* pagesText{nullptr};
+    // for every page with extracted text, a set of hashes of all case-folded
+    // character trigrams in its text. This allows searches to skip pages that
+    // can't contain the search text without looking at the text
+    u64** trigramSets{nullptr};
     int debugSize{0};
 
     CRITICAL_SECTION access;
 
+    // extract text of all pages in the background, on cloned engines
+    Vec<TextIndexThread*> indexThreads;
+    int indexStartPage{1};
+    LONG nPagesClaimed{0};
+
     explicit DocumentTextCache(EngineBase* engine);
     ~DocumentTextCache();
 
     bool HasTextForPage(int pageNo);
     const WCHAR* GetTextForPage(int pageNo, int* lenOut = nullptr, Rect** coordsOut = nullptr);
+    void SetTextForPage(int pageNo, PageText& pageText);
+
+    void StartIndexing(int startPageNo);
+    void StopIndexing();
+    int ClaimPageToIndex();
+    bool CanSkipPage(int pageNo, const WCHAR* word);
 };
 
 // TODO: replace with Vec<TextSel>
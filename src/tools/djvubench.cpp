@@ -0,0 +1,203 @@
+/* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+// djvubench decodes and renders all pages of a corpus of .djvu files,
+// once with libdjvu's baseline code and once with its vectorized code
+// (cf. MMXControl in ext/libdjvu/MMX.h). It reports the time spent in
+// both and verifies that the rendered pages match byte for byte.
+
+#define DDJVUAPI /**/
+#define MINILISPAPI /**/
+
+#include "utils/BaseUtil.h"
+#include <ddjvuapi.h>
+#include <MMX.h>
+#include "utils/CmdLineParser.h"
+#include "utils/DirIter.h"
+#include "utils/FileUtil.h"
+#include "utils/Timer.h"
+
+void _submitDebugReportIfFunc(__unused bool cond, __unused const char* condStr) {
+    // no-op implementation to satisfy SubmitBugReport()
+}
+
+#define ErrOut(msg, ...) fwprintf(stderr, TEXT(msg) TEXT("\n"), __VA_ARGS__)
+#define ErrOut1(msg) fwprintf(stderr, TEXT("%s"), TEXT(msg) TEXT("\n"))
+
+struct BenchStats {
+    int nFiles = 0;
+    int nPages = 0;
+    int nMismatches = 0;
+    double decodeMs = 0;
+    double baselineMs = 0;
+    double simdMs = 0;
+};
+
+static void HandleDjVuMessages(ddjvu_context_t* ctx) {
+    ddjvu_message_wait(ctx);
+    while (ddjvu_message_peek(ctx)) {
+        ddjvu_message_pop(ctx);
+    }
+}
+
+// renders the page with the given set of instructions enabled
+// and returns the time it took (or -1 if nothing was rendered)
+static double RenderPage(ddjvu_page_t* page, bool simd, float zoom, Vec<char>& data) {
+    if (simd) {
+        MMXControl::enable_mmx();
+    } else {
+        MMXControl::disable_mmx();
+    }
+
+    bool isBitonal = DDJVU_PAGETYPE_BITONAL == ddjvu_page_get_type(page);
+    ddjvu_format_style_t style = isBitonal ? DDJVU_FORMAT_GREY8 : DDJVU_FORMAT_BGR24;
+    ddjvu_format_t* fmt = ddjvu_format_create(style, 0, nullptr);
+    defer {
+        ddjvu_format_release(fmt);
+    };
+    ddjvu_format_set_row_order(fmt, TRUE);
+
+    uint dx = std::max((uint)(ddjvu_page_get_width(page) * zoom), 1U);
+    uint dy = std::max((uint)(ddjvu_page_get_height(page) * zoom), 1U);
+    ddjvu_rect_t prect = {0, 0, dx, dy};
+    ddjvu_rect_t rrect = prect;
+    size_t stride = (size_t)dx * (isBitonal ? 1 : 3);
+    data.Reset();
+    char* bmpData = data.AppendBlanks(stride * dy);
+    if (!bmpData) {
+        return -1;
+    }
+
+    ddjvu_render_mode_t mode = isBitonal ? DDJVU_RENDER_MASKONLY : DDJVU_RENDER_COLOR;
+    auto t = TimeGet();
+    int ok = ddjvu_page_render(page, mode, &prect, &rrect, fmt, (unsigned long)stride, bmpData);
+    double ms = TimeSinceInMs(t);
+    return ok ? ms : -1;
+}
+
+static bool BenchFile(ddjvu_context_t* ctx, const WCHAR* path, Vec<float>& zooms, BenchStats& stats) {
+    auto pathA(ToUtf8Temp(path));
+    ddjvu_document_t* doc = ddjvu_document_create_by_filename_utf8(ctx, pathA.Get(), FALSE);
+    if (!doc) {
+        ErrOut("Error: failed to open %s", path);
+        return false;
+    }
+    defer {
+        ddjvu_document_release(doc);
+    };
+    while (!ddjvu_document_decoding_done(doc)) {
+        HandleDjVuMessages(ctx);
+    }
+    if (ddjvu_document_decoding_error(doc)) {
+        ErrOut("Error: failed to decode %s", path);
+        return false;
+    }
+
+    int nPages = ddjvu_document_get_pagenum(doc);
+    int nMismatches = 0;
+    double decodeMs = 0, baselineMs = 0, simdMs = 0;
+    Vec<char> baseline, simd;
+    for (int pageNo = 0; pageNo < nPages; pageNo++) {
+        auto t = TimeGet();
+        ddjvu_page_t* page = ddjvu_page_create_by_pageno(doc, pageNo);
+        if (!page) {
+            continue;
+        }
+        while (!ddjvu_page_decoding_done(page)) {
+            HandleDjVuMessages(ctx);
+        }
+        decodeMs += TimeSinceInMs(t);
+        if (ddjvu_page_decoding_error(page)) {
+            ErrOut("Error: failed to decode page %d of %s", pageNo + 1, path);
+            ddjvu_page_release(page);
+            continue;
+        }
+        for (float zoom : zooms) {
+            double ms1 = RenderPage(page, false, zoom, baseline);
+            double ms2 = RenderPage(page, true, zoom, simd);
+            if (ms1 < 0 || ms2 < 0) {
+                continue;
+            }
+            baselineMs += ms1;
+            simdMs += ms2;
+            if (baseline.size() != simd.size() || memcmp(baseline.LendData(), simd.LendData(), simd.size()) != 0) {
+                ErrOut("Error: page %d of %s differs at zoom %.0f%%", pageNo + 1, path, zoom * 100);
+                nMismatches++;
+            }
+        }
+        ddjvu_page_release(page);
+    }
+
+    wprintf(L"%s: %d pages, decode %.0f ms, render %.0f ms (baseline) / %.0f ms (simd)\n", path, nPages, decodeMs,
+            baselineMs, simdMs);
+    stats.nFiles++;
+    stats.nPages += nPages;
+    stats.nMismatches += nMismatches;
+    stats.decodeMs += decodeMs;
+    stats.baselineMs += baselineMs;
+    stats.simdMs += simdMs;
+    return nMismatches == 0;
+}
+
+int main(__unused int argc, __unused char** argv) {
+    setlocale(LC_ALL, "C");
+
+    WStrVec argList;
+    ParseCmdLine(GetCommandLine(), argList);
+    if (argList.size() < 2) {
+    Usage:
+        ErrOut("%s [-zoom <percent>]... <file.djvu or directory>...", path::GetBaseNameTemp(argList.at(0)));
+        return 2;
+    }
+
+    Vec<float> zooms;
+    WStrVec paths;
+    for (size_t i = 1; i < argList.size(); i++) {
+        if (str::Eq(argList.at(i), L"-zoom") && i + 1 < argList.size()) {
+            float zoom;
+            if (!str::Parse(argList.at(++i), L"%f%%%$", &zoom) || zoom <= 0.f) {
+                goto Usage;
+            }
+            zooms.Append(zoom / 100.f);
+        } else if (dir::Exists(argList.at(i))) {
+            DirIter di(argList.at(i), true);
+            for (const WCHAR* path = di.First(); path; path = di.Next()) {
+                if (str::EndsWithI(path, L".djvu") || str::EndsWithI(path, L".djv")) {
+                    paths.Append(str::Dup(path));
+                }
+            }
+        } else {
+            paths.Append(str::Dup(argList.at(i)));
+        }
+    }
+    if (paths.size() == 0) {
+        goto Usage;
+    }
+    if (zooms.size() == 0) {
+        // full resolution exercises the wavelet and color transforms,
+        // reduced sizes additionally exercise the scalers
+        zooms.Append(1.f);
+        zooms.Append(0.33f);
+    }
+
+    MMXControl::enable_mmx();
+    if (MMXControl::sse2flag <= 0 && MMXControl::mmxflag <= 0) {
+        ErrOut1("Warning: no vectorized code is available on this machine");
+    }
+
+    ddjvu_context_t* ctx = ddjvu_context_create("djvubench");
+    BenchStats stats;
+    bool ok = true;
+    for (const WCHAR* path : paths) {
+        ok = BenchFile(ctx, path, zooms, stats) && ok;
+    }
+    ddjvu_context_release(ctx);
+
+    double speedup = stats.simdMs > 0 ? stats.baselineMs / stats.simdMs : 0;
+    wprintf(L"%d files, %d pages, decode %.0f ms, render %.0f ms (baseline) / %.0f ms (simd), %.2fx\n", stats.nFiles,
+            stats.nPages, stats.decodeMs, stats.baselineMs, stats.simdMs, speedup);
+    if (stats.nMismatches > 0) {
+        ErrOut("Error: %d renderings differ", stats.nMismatches);
+    }
+    return ok ? 0 : 1;
+}
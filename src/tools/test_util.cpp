@@ -26,6 +26,7 @@ extern void JsonTest();
 extern void SettingsUtilTest();
 extern void SimpleLogTest();
 extern void SquareTreeTest();
+extern void StrFindTest();
 extern void StrFormatTest();
 extern void StrTest();
 extern void TrivialHtmlParser_UnitTests();
@@ -54,6 +55,7 @@ int main(__unused int argc, __unused char** argv) {
     SettingsUtilTest();
     SimpleLogTest();
     SquareTreeTest();
+    StrFindTest();
     StrTest();
     TrivialHtmlParser_UnitTests();
     VecTest();
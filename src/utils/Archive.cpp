@@ -2,6 +2,7 @@
    License: Simplified BSD (see COPYING.BSD) */
 
 #include "utils/BaseUtil.h"
+#include "utils/Dict.h"
 #include "utils/Archive.h"
 
 #include "utils/StrSlice.h"
@@ -60,26 +61,42 @@ bool MultiFormatArchive::Open(ar_stream* data, const char* archivePath) {
         i->fileSizeUncompressed = ar_entry_get_size(ar_);
         i->filePos = ar_entry_get_offset(ar_);
         i->fileTime = ar_entry_get_filetime(ar_);
+        i->isSolid = ar_entry_is_solid(ar_);
         i->name = str::Dup(&allocator_, name);
         fileInfos_.Append(i);
 
         fileId++;
     }
+    BuildNameIndex();
     return true;
 }
 
 MultiFormatArchive::~MultiFormatArchive() {
+    delete nameToId_;
     ar_close_archive(ar_);
     ar_close(data_);
 }
 
-size_t getFileIdByName(Vec<MultiFormatArchive::FileInfo*>& fileInfos, const char* name) {
-    for (auto fileInfo : fileInfos) {
-        if (str::EqI(fileInfo->name.data(), name)) {
-            return fileInfo->fileId;
+// file names are compared case-insensitively (for ASCII, like str::EqI)
+static char* ToNameIndexKey(const char* name) {
+    char* key = str::Dup(name);
+    for (char* s = key; *s; s++) {
+        if (*s >= 'A' && *s <= 'Z') {
+            *s = (char)(*s - 'A' + 'a');
         }
     }
-    return (size_t)-1;
+    return key;
+}
+
+void MultiFormatArchive::BuildNameIndex() {
+    // the table grows as needed, the default initial size would be wasteful
+    // for the many small archives (e.g. EPUBs)
+    nameToId_ = new dict::MapStrToInt(fileInfos_.size() + 1);
+    for (auto fileInfo : fileInfos_) {
+        AutoFree key = ToNameIndexKey(fileInfo->name.data());
+        // like a linear search, find the first of several files with the same name
+        nameToId_->Insert(key, (int)fileInfo->fileId);
+    }
 }
 
 Vec<MultiFormatArchive::FileInfo*> const& MultiFormatArchive::GetFileInfos() {
@@ -87,7 +104,15 @@ Vec<MultiFormatArchive::FileInfo*> const& MultiFormatArchive::GetFileInfos() {
 }
 
 size_t MultiFormatArchive::GetFileId(const char* fileName) {
-    return getFileIdByName(fileInfos_, fileName);
+    if (!fileName || !nameToId_) {
+        return (size_t)-1;
+    }
+    AutoFree key = ToNameIndexKey(fileName);
+    int fileId;
+    if (!nameToId_->Get(key, &fileId)) {
+        return (size_t)-1;
+    }
+    return (size_t)fileId;
 }
 
 std::span<u8> MultiFormatArchive::GetFileDataByName(const WCHAR* fileName) {
@@ -96,10 +121,53 @@ std::span<u8> MultiFormatArchive::GetFileDataByName(const WCHAR* fileName) {
 }
 
 std::span<u8> MultiFormatArchive::GetFileDataByName(const char* fileName) {
-    size_t fileId = getFileIdByName(fileInfos_, fileName);
+    size_t fileId = GetFileId(fileName);
     return GetFileDataById(fileId);
 }
 
+// uncompresses the rest of the current entry, to bring the decoder of a solid
+// archive to the state needed by the following entry
+static bool SkipEntryData(ar_archive* ar, size_t size) {
+    u8 buf[16 * 1024];
+    while (size > 0) {
+        size_t n = std::min(size, sizeof(buf));
+        if (!ar_entry_uncompress(ar, buf, n)) {
+            return false;
+        }
+        size -= n;
+    }
+    return true;
+}
+
+// positions ar_ at the entry for fileId. For entries of a solid archive that
+// come after solidCursor_ we continue decompressing from there instead of
+// letting unarr restart from the first entry (which makes reading all files
+// of an archive one by one quadratic)
+bool MultiFormatArchive::ParseEntry(size_t fileId) {
+    auto* fileInfo = fileInfos_[fileId];
+    bool canContinue = fileInfo->isSolid && solidCursor_ != (size_t)-1 && solidCursor_ < fileId;
+    if (canContinue) {
+        // ar_ is still positioned at the entry for solidCursor_, so
+        // ar_parse_entry() doesn't consider the following entries out of order
+        for (size_t id = solidCursor_ + 1; id <= fileId; id++) {
+            auto* fi = fileInfos_[id];
+            if (!ar_parse_entry(ar_) || ar_entry_get_offset(ar_) != fi->filePos) {
+                break;
+            }
+            if (id == fileId) {
+                solidCursor_ = (size_t)-1;
+                return true;
+            }
+            if (!SkipEntryData(ar_, fi->fileSizeUncompressed)) {
+                break;
+            }
+            solidCursor_ = id;
+        }
+    }
+    solidCursor_ = (size_t)-1;
+    return ar_parse_entry_at(ar_, fileInfo->filePos);
+}
+
 std::span<u8> MultiFormatArchive::GetFileDataById(size_t fileId) {
     if (fileId == (size_t)-1) {
         return {};
@@ -117,8 +185,7 @@ std::span<u8> MultiFormatArchive::GetFileDataById(size_t fileId) {
     auto* fileInfo = fileInfos_[fileId];
     CrashIf(fileInfo->fileId != fileId);
 
-    auto filePos = fileInfo->filePos;
-    if (!ar_parse_entry_at(ar_, filePos)) {
+    if (!ParseEntry(fileId)) {
         return {};
     }
     size_t size = fileInfo->fileSizeUncompressed;
@@ -130,12 +197,56 @@ std::span<u8> MultiFormatArchive::GetFileDataById(size_t fileId) {
         return {};
     }
     if (!ar_entry_uncompress(ar_, data, size)) {
+        free(data);
         return {};
     }
+    solidCursor_ = fileId;
 
     return {data, size};
 }
 
+// returns at most the first maxSize bytes of a file, which is enough to e.g.
+// sniff the dimensions of an image without uncompressing all of it
+std::span<u8> MultiFormatArchive::GetFileDataPartById(size_t fileId, size_t maxSize) {
+    if (fileId == (size_t)-1) {
+        return {};
+    }
+    CrashIf(fileId >= fileInfos_.size());
+
+    auto* fileInfo = fileInfos_[fileId];
+    CrashIf(fileInfo->fileId != fileId);
+    if (fileInfo->fileSizeUncompressed <= maxSize) {
+        return GetFileDataById(fileId);
+    }
+    if (LoadedUsingUnrarDll()) {
+        return GetFileDataByIdUnarrDll(fileId, maxSize);
+    }
+
+    if (!ar_) {
+        return {};
+    }
+    if (!ParseEntry(fileId)) {
+        return {};
+    }
+    if (addOverflows<size_t>(maxSize, ZERO_PADDING_COUNT)) {
+        return {};
+    }
+    u8* data = AllocArray<u8>(maxSize + ZERO_PADDING_COUNT);
+    if (!data) {
+        return {};
+    }
+    if (!ar_entry_uncompress(ar_, data, maxSize)) {
+        free(data);
+        return {};
+    }
+    // in a solid archive, the following entries need the decoder state from
+    // the end of this one, which is cheaper to get to now than later
+    if (fileInfo->isSolid && SkipEntryData(ar_, fileInfo->fileSizeUncompressed - maxSize)) {
+        solidCursor_ = fileId;
+    }
+    return {data, maxSize};
+}
+
 std::string_view MultiFormatArchive::GetComment() {
     if (!ar_) {
         return {};
@@ -264,18 +375,31 @@ MultiFormatArchive* OpenRarArchive(IStream* stream) {
 // TODO: set include path to ext/ dir
 #include "../../ext/unrar/dll.hpp"
 
+struct UnrarBuffer {
+    str::Slice data;
+    // set if only the beginning of a file is to be extracted
+    bool partial = false;
+};
+
 // return 1 on success. Other values for msg that we don't handle: UCM_CHANGEVOLUME, UCM_NEEDPASSWORD
 static int CALLBACK unrarCallback(UINT msg, LPARAM userData, LPARAM rarBuffer, LPARAM bytesProcessed) {
     if (UCM_PROCESSDATA != msg || !userData) {
         return -1;
     }
-    str::Slice* buf = (str::Slice*)userData;
+    UnrarBuffer* buf = (UnrarBuffer*)userData;
     size_t bytesGot = (size_t)bytesProcessed;
-    if (bytesGot > buf->Left()) {
+    if (bytesGot > buf->data.Left()) {
+        if (!buf->partial) {
+            return -1;
+        }
+        bytesGot = buf->data.Left();
+    }
+    memcpy(buf->data.curr, (char*)rarBuffer, bytesGot);
+    buf->data.curr += bytesGot;
+    // abort extraction once we've got as much as was asked for
+    if (buf->partial && buf->data.Left() == 0) {
         return -1;
     }
-    memcpy(buf->curr, (char*)rarBuffer, bytesGot);
-    buf->curr += bytesGot;
     return 1;
 }
 
@@ -295,12 +419,13 @@ static bool FindFile(HANDLE hArc, RARHeaderDataEx* rarHeader, const WCHAR* fileN
     }
 }
 
-std::span<u8> MultiFormatArchive::GetFileDataByIdUnarrDll(size_t fileId) {
+// extracts at most maxSize bytes from the beginning of the file
+std::span<u8> MultiFormatArchive::GetFileDataByIdUnarrDll(size_t fileId, size_t maxSize) {
     CrashIf(!rarFilePath_);
 
     auto rarPath = ToWstrTemp(rarFilePath_);
 
-    str::Slice uncompressedBuf;
+    UnrarBuffer uncompressedBuf;
 
     RAROpenArchiveDataEx arcData = {0};
     arcData.ArcNameW = rarPath.Get();
@@ -327,6 +452,10 @@ std::span<u8> MultiFormatArchive::GetFileDataByIdUnarrDll(size_t fileId) {
     }
     size = fileInfo->fileSizeUncompressed;
     CrashIf(size != rarHeader.UnpSize);
+    if (size > maxSize) {
+        size = maxSize;
+        uncompressedBuf.partial = true;
+    }
     if (addOverflows<size_t>(size, ZERO_PADDING_COUNT)) {
         ok = false;
         goto Exit;
@@ -337,9 +466,10 @@ std::span<u8> MultiFormatArchive::GetFileDataByIdUnarrDll(size_t fileId) {
         ok = false;
         goto Exit;
     }
-    uncompressedBuf.Set(data, size);
+    uncompressedBuf.data.Set(data, size);
     res = RARProcessFile(hArc, RAR_TEST, nullptr, nullptr);
-    ok = (res == 0) && (uncompressedBuf.Left() == 0);
+    // partial extraction is aborted by unrarCallback, which makes RARProcessFile fail
+    ok = (res == 0 || uncompressedBuf.partial) && (uncompressedBuf.data.Left() == 0);
 
 Exit:
     RARCloseArchive(hArc);
@@ -384,6 +514,7 @@ bool MultiFormatArchive::OpenUnrarFallback(const char* rarPath) {
         i->fileSizeUncompressed = (size_t)rarHeader.UnpSize;
         i->filePos = 0;
         i->fileTime = (i64)rarHeader.FileTime;
+        i->isSolid = false;
         i->name = str::Dup(&allocator_, name.Get());
         fileInfos_.Append(i);
 
@@ -395,5 +526,6 @@ bool MultiFormatArchive::OpenUnrarFallback(const char* rarPath) {
     RARCloseArchive(hArc);
 
     rarFilePath_ = str::Dup(&allocator_, rarPath);
+    BuildNameIndex();
     return true;
 }
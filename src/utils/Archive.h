@@ -8,6 +8,10 @@ typedef struct ar_archive_s ar_archive;
 
 typedef ar_archive* (*archive_opener_t)(ar_stream*);
 
+namespace dict {
+class MapStrToInt;
+}
+
 class MultiFormatArchive {
   public:
     enum class Format { Zip, Rar, SevenZip, Tar };
@@ -20,6 +24,8 @@ class MultiFormatArchive {
 
         // internal use
         i64 filePos;
+        // uncompressing depends on the preceding entries (solid RAR)
+        bool isSolid;
 
         [[nodiscard]] FILETIME GetWinFileTime() const;
     };
@@ -38,6 +44,7 @@ class MultiFormatArchive {
     std::span<u8> GetFileDataByName(const WCHAR* filename);
     std::span<u8> GetFileDataByName(const char* filename);
     std::span<u8> GetFileDataById(size_t fileId);
+    std::span<u8> GetFileDataPartById(size_t fileId, size_t maxSize);
 
     std::string_view GetComment();
 
@@ -50,11 +57,21 @@ class MultiFormatArchive {
     ar_stream* data_ = nullptr;
     ar_archive* ar_ = nullptr;
 
+    // lower-cased file name => fileId, for case-insensitive lookups
+    dict::MapStrToInt* nameToId_ = nullptr;
+
+    // id of the last entry of a solid archive that has been completely
+    // uncompressed. unarr has to restart decompression from the first entry
+    // for out-of-order reads, so we advance from here instead
+    size_t solidCursor_ = (size_t)-1;
+
     // only set when we loaded file infos using unrar.dll fallback
     const char* rarFilePath_ = nullptr;
 
+    void BuildNameIndex();
+    bool ParseEntry(size_t fileId);
     bool OpenUnrarFallback(const char* rarPathUtf);
-    std::span<u8> GetFileDataByIdUnarrDll(size_t fileId);
+    std::span<u8> GetFileDataByIdUnarrDll(size_t fileId, size_t maxSize = (size_t)-1);
     [[nodiscard]] bool LoadedUsingUnrarDll() const {
         return rarFilePath_ != nullptr;
     }
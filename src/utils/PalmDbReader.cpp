@@ -5,6 +5,7 @@
 #include "PalmDbReader.h"
 #include "ByteOrderDecoder.h"
 #include "FileUtil.h"
+#include "SharedFile.h"
 #include "WinUtil.h"
 
 // size of PdbHeader
@@ -23,7 +24,11 @@ bool PdbReader::Parse(std::span<u8> d) {
 }
 
 PdbReader::~PdbReader() {
-    str::Free(data);
+    if (file) {
+        file->Release();
+    } else {
+        str::Free(data);
+    }
 }
 
 static bool DecodePdbHeader(ByteOrderDecoder& dec, PdbHeader* hdr) {
@@ -133,14 +138,25 @@ PdbReader* PdbReader::CreateFromData(std::span<u8> d) {
 }
 
 PdbReader* PdbReader::CreateFromFile(const char* path) {
-    auto d = file::ReadFile(path);
-    std::span<u8> ds = {(u8*)d.data(), d.size()};
-    return CreateFromData(ds);
+    auto filePath = ToWstrTemp(path);
+    return CreateFromFile(filePath.Get());
 }
 
+// records are only accessed on demand, so there's no need to read
+// big files into memory
 PdbReader* PdbReader::CreateFromFile(const WCHAR* filePath) {
-    std::span<u8> d = file::ReadFile(filePath);
-    return CreateFromData(d);
+    SharedFile* sharedFile = SharedFile::Open(filePath);
+    if (!sharedFile) {
+        std::span<u8> d = file::ReadFile(filePath);
+        return CreateFromData(d);
+    }
+    PdbReader* reader = new PdbReader();
+    reader->file = sharedFile;
+    if (!reader->Parse(sharedFile->data)) {
+        delete reader;
+        return nullptr;
+    }
+    return reader;
 }
 
 PdbReader* PdbReader::CreateFromStream(IStream* stream) {
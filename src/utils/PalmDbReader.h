@@ -33,10 +33,14 @@ struct PdbRecordHeader {
     char uniqueID[3] = {0};
 };
 
+class SharedFile;
+
 class PdbReader {
     // content of pdb file
     const u8* data = nullptr;
     size_t dataSize = 0;
+    // if set, data is owned by file instead of us
+    SharedFile* file = nullptr;
 
     // offset of each pdb record within the file + a sentinel
     // value equal to file size to simplify use
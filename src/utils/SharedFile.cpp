@@ -0,0 +1,178 @@
+/* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
+   License: Simplified BSD (see COPYING.BSD) */
+
+#include "utils/BaseUtil.h"
+#include "utils/ScopedWin.h"
+#include "utils/SharedFile.h"
+
+// all currently open SharedFiles
+struct SharedFileCache {
+    CRITICAL_SECTION access;
+    Vec<SharedFile*> files;
+
+    SharedFileCache() {
+        InitializeCriticalSection(&access);
+    }
+    ~SharedFileCache() {
+        DeleteCriticalSection(&access);
+    }
+};
+
+static SharedFileCache gSharedFiles;
+
+// content of files on network shares or removable drives might become
+// unavailable while mapped, which would crash us when accessing it
+static bool IsOnFixedDrive(const WCHAR* path) {
+    WCHAR root[MAX_PATH] = {0};
+    if (!GetVolumePathNameW(path, root, dimof(root))) {
+        return false;
+    }
+    return GetDriveTypeW(root) == DRIVE_FIXED;
+}
+
+SharedFile::~SharedFile() {
+    if (hMapping) {
+        UnmapViewOfFile(data.data());
+        CloseHandle(hMapping);
+    } else {
+        free(data.data());
+    }
+    free(path);
+}
+
+// the content of a mapped file must not change while it's in use (e.g. it's
+// only fingerprinted once, see fz_shared_file_fingerprint), so the file is
+// opened again without allowing others to write to it. It can still be
+// renamed or deleted
+bool SharedFile::Map() {
+    if ((u64)size > (u64)SIZE_MAX) {
+        return false;
+    }
+    DWORD share = FILE_SHARE_READ | FILE_SHARE_DELETE;
+    AutoCloseHandle hFile(CreateFileW(path, GENERIC_READ, share, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+    if (!hFile.IsValid()) {
+        // e.g. another program is currently writing to it
+        return false;
+    }
+    // make sure that it hasn't been modified since it was first opened
+    BY_HANDLE_FILE_INFORMATION info{};
+    if (!GetFileInformationByHandle(hFile, &info)) {
+        return false;
+    }
+    i64 currSize = ((i64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    if (currSize != size || CompareFileTime(&info.ftLastWriteTime, &modified) != 0) {
+        return false;
+    }
+    hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!hMapping) {
+        return false;
+    }
+    // the mapping keeps the file open, so hFile can be closed after this
+    void* d = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (!d) {
+        // e.g. not enough address space for big files in 32-bit builds
+        CloseHandle(hMapping);
+        hMapping = nullptr;
+        return false;
+    }
+    data = {(u8*)d, (size_t)size};
+    return true;
+}
+
+bool SharedFile::Read(HANDLE hFile) {
+    u8* d = AllocArray<u8>((size_t)size);
+    if (!d) {
+        return false;
+    }
+    size_t nRead = 0;
+    while (nRead < (size_t)size) {
+        DWORD toRead = (DWORD)std::min((size_t)size - nRead, (size_t)(1024 * 1024 * 1024));
+        DWORD n = 0;
+        BOOL ok = ReadFile(hFile, d + nRead, toRead, &n, nullptr);
+        if (!ok || n == 0) {
+            free(d);
+            return false;
+        }
+        nRead += n;
+    }
+    data = {d, (size_t)size};
+    return true;
+}
+
+// must be called with gSharedFiles.access held
+SharedFile* SharedFile::FindAndAddRef(const WCHAR* path, i64 size, FILETIME modified) {
+    for (SharedFile* file : gSharedFiles.files) {
+        if (!str::EqI(file->path, path) || file->size != size) {
+            continue;
+        }
+        if (CompareFileTime(&file->modified, &modified) != 0) {
+            continue;
+        }
+        file->refCount++;
+        return file;
+    }
+    return nullptr;
+}
+
+SharedFile* SharedFile::Open(const WCHAR* path) {
+    // don't prevent other programs (e.g. a TeX rebuild) from writing, renaming or
+    // deleting the file while it's being read (see Map for mapped files)
+    DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+    AutoCloseHandle h(CreateFileW(path, GENERIC_READ, share, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+    if (!h.IsValid()) {
+        return nullptr;
+    }
+    BY_HANDLE_FILE_INFORMATION info{};
+    if (!GetFileInformationByHandle(h, &info)) {
+        return nullptr;
+    }
+    i64 size = ((i64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    if (size <= 0) {
+        return nullptr;
+    }
+
+    {
+        ScopedCritSec scope(&gSharedFiles.access);
+        SharedFile* existing = FindAndAddRef(path, size, info.ftLastWriteTime);
+        if (existing) {
+            return existing;
+        }
+    }
+
+    // reading the file can take a while, so don't block others meanwhile
+    SharedFile* file = new SharedFile();
+    file->path = str::Dup(path);
+    file->size = size;
+    file->modified = info.ftLastWriteTime;
+    bool ok;
+    if (size >= SHARED_FILE_MAP_MIN_SIZE) {
+        ok = IsOnFixedDrive(path) && file->Map();
+    } else {
+        ok = file->Read(h);
+    }
+    if (!ok) {
+        delete file;
+        return nullptr;
+    }
+
+    ScopedCritSec scope(&gSharedFiles.access);
+    // another thread might've opened the same file in the meantime
+    SharedFile* existing = FindAndAddRef(path, size, info.ftLastWriteTime);
+    if (existing) {
+        delete file;
+        return existing;
+    }
+    gSharedFiles.files.Append(file);
+    return file;
+}
+
+void SharedFile::Release() {
+    ScopedCritSec scope(&gSharedFiles.access);
+    CrashIf(refCount <= 0);
+    refCount--;
+    if (refCount > 0) {
+        return;
+    }
+    gSharedFiles.files.Remove(this);
+    delete this;
+}
@@ -0,0 +1,41 @@
+/* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
+   License: Simplified BSD (see COPYING.BSD) */
+
+/* Read-only content of a file, shared by everyone who opens the same file
+   (e.g. an engine and its clones used for printing and thumbnails).
+
+   Big files on local drives are memory-mapped so that their content is only
+   paged in as needed. Smaller files are read into memory (only once) so that
+   other programs can still overwrite them while they're open. Mapped files
+   can still be replaced by other programs (e.g. by writing to a temporary file
+   and renaming it) but not modified or truncated. */
+
+// files of at least this size are memory-mapped
+#define SHARED_FILE_MAP_MIN_SIZE (32 * 1024 * 1024)
+
+class SharedFile {
+  public:
+    // must not be modified
+    std::span<u8> data;
+
+    // returns nullptr if the file couldn't be read or mapped
+    // (callers should then fall back to reading the file as a stream)
+    static SharedFile* Open(const WCHAR* path);
+
+    // the data is freed when the last reference is released
+    void Release();
+
+  private:
+    WCHAR* path = nullptr;
+    i64 size = 0;
+    FILETIME modified{};
+    HANDLE hMapping = nullptr;
+    LONG refCount = 1;
+
+    SharedFile() = default;
+    ~SharedFile();
+
+    bool Map();
+    bool Read(HANDLE hFile);
+    static SharedFile* FindAndAddRef(const WCHAR* path, i64 size, FILETIME modified);
+};
@@ -0,0 +1,270 @@
+/* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
+   License: Simplified BSD (see COPYING.BSD) */
+
+#include "utils/BaseUtil.h"
+#include "utils/StrFind.h"
+
+#if IS_INTEL_32 || IS_INTEL_64
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+// allows using AVX2 intrinsics in a single function without compiling
+// the whole file for AVX2 (MSVC doesn't need that)
+#if defined(__clang__) || defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+namespace strfind {
+
+WCHAR FoldCharSlow(WCHAR c) {
+    WCHAR buf[1] = {c};
+    CharLowerBuffW(buf, 1);
+    return buf[0];
+}
+
+static bool MatchesAt(const WCHAR* s, const WCHAR* toFind, size_t len, bool caseSensitive) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == toFind[i]) {
+            continue;
+        }
+        if (caseSensitive || FoldChar(s[i]) != FoldChar(toFind[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const WCHAR* FindScalar(const WCHAR* s, size_t sLen, const WCHAR* toFind, bool caseSensitive) {
+    size_t len = str::Len(toFind);
+    if (len == 0) {
+        return s;
+    }
+    if (len > sLen) {
+        return nullptr;
+    }
+    WCHAR first = caseSensitive ? toFind[0] : FoldChar(toFind[0]);
+    const WCHAR* last = s + (sLen - len);
+    for (; s <= last; s++) {
+        WCHAR c = caseSensitive ? *s : FoldChar(*s);
+        if (c == first && MatchesAt(s, toFind, len, caseSensitive)) {
+            return s;
+        }
+    }
+    return nullptr;
+}
+
+#if IS_INTEL_32 || IS_INTEL_64
+
+// the two characters of the searched string that are compared
+// with the text in parallel
+struct Needle {
+    size_t len = 0;
+    size_t pos1 = 0;
+    size_t pos2 = 0;
+    WCHAR c1 = 0;
+    WCHAR c2 = 0;
+    // a non-ASCII character which FoldChar() maps to c1 resp. c2
+    // (only needed when ignoring case)
+    WCHAR alt1 = 0;
+    WCHAR alt2 = 0;
+};
+
+static WCHAR NonAsciiFoldingTo(WCHAR c) {
+    if (c == 'i') {
+        // LATIN CAPITAL LETTER I WITH DOT ABOVE
+        return 0x130;
+    }
+    if (c == 'k') {
+        // KELVIN SIGN
+        return 0x212A;
+    }
+    return c;
+}
+
+// returns false if the text has to be searched with FindScalar because
+// case is ignored and toFind doesn't contain any ASCII characters
+// (which are the only ones we can lower-case in parallel)
+static bool InitNeedle(Needle& n, const WCHAR* toFind, size_t len, bool caseSensitive) {
+    n.len = len;
+    if (caseSensitive) {
+        n.pos1 = 0;
+        n.pos2 = len - 1;
+        n.c1 = n.alt1 = toFind[n.pos1];
+        n.c2 = n.alt2 = toFind[n.pos2];
+        return true;
+    }
+
+    bool hasAscii = false;
+    for (size_t i = 0; i < len; i++) {
+        if (toFind[i] >= 0x80) {
+            continue;
+        }
+        if (!hasAscii) {
+            n.pos1 = i;
+            hasAscii = true;
+        }
+        n.pos2 = i;
+    }
+    if (!hasAscii) {
+        return false;
+    }
+    n.c1 = FoldChar(toFind[n.pos1]);
+    n.c2 = FoldChar(toFind[n.pos2]);
+    n.alt1 = NonAsciiFoldingTo(n.c1);
+    n.alt2 = NonAsciiFoldingTo(n.c2);
+    return true;
+}
+
+static inline u32 LowestSetBit(u32 v) {
+#if COMPILER_MSVC
+    unsigned long idx;
+    _BitScanForward(&idx, v);
+    return (u32)idx;
+#else
+    return (u32)__builtin_ctz(v);
+#endif
+}
+
+static inline __m128i FoldAsciiSse2(__m128i v) {
+    // characters >= 0x8000 are negative in a signed comparison, so they're
+    // correctly excluded from the 'A' to 'Z' range
+    __m128i isUpper = _mm_and_si128(_mm_cmpgt_epi16(v, _mm_set1_epi16('A' - 1)),
+                                    _mm_cmplt_epi16(v, _mm_set1_epi16('Z' + 1)));
+    return _mm_or_si128(v, _mm_and_si128(isUpper, _mm_set1_epi16(0x20)));
+}
+
+static inline __m128i EqualsSse2(__m128i v, __m128i c, __m128i alt, bool caseSensitive) {
+    if (caseSensitive) {
+        return _mm_cmpeq_epi16(v, c);
+    }
+    __m128i eq = _mm_cmpeq_epi16(FoldAsciiSse2(v), c);
+    return _mm_or_si128(eq, _mm_cmpeq_epi16(v, alt));
+}
+
+const WCHAR* FindSse2(const WCHAR* s, size_t sLen, const WCHAR* toFind, bool caseSensitive) {
+    size_t len = str::Len(toFind);
+    Needle n;
+    if (len == 0 || len > sLen || !InitNeedle(n, toFind, len, caseSensitive)) {
+        return FindScalar(s, sLen, toFind, caseSensitive);
+    }
+    __m128i c1 = _mm_set1_epi16((short)n.c1);
+    __m128i c2 = _mm_set1_epi16((short)n.c2);
+    __m128i alt1 = _mm_set1_epi16((short)n.alt1);
+    __m128i alt2 = _mm_set1_epi16((short)n.alt2);
+
+    // number of positions at which toFind could start
+    size_t nPos = sLen - len + 1;
+    size_t i = 0;
+    for (; i + 8 <= nPos; i += 8) {
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(s + i + n.pos1));
+        __m128i v2 = _mm_loadu_si128((const __m128i*)(s + i + n.pos2));
+        __m128i eq = _mm_and_si128(EqualsSse2(v1, c1, alt1, caseSensitive), EqualsSse2(v2, c2, alt2, caseSensitive));
+        // 2 bits per matching character
+        u32 mask = (u32)_mm_movemask_epi8(eq);
+        while (mask != 0) {
+            u32 bit = LowestSetBit(mask);
+            const WCHAR* candidate = s + i + bit / 2;
+            if (MatchesAt(candidate, toFind, len, caseSensitive)) {
+                return candidate;
+            }
+            mask &= ~(3u << bit);
+        }
+    }
+    return FindScalar(s + i, sLen - i, toFind, caseSensitive);
+}
+
+TARGET_AVX2 static inline __m256i FoldAsciiAvx2(__m256i v) {
+    __m256i isUpper = _mm256_and_si256(_mm256_cmpgt_epi16(v, _mm256_set1_epi16('A' - 1)),
+                                       _mm256_cmpgt_epi16(_mm256_set1_epi16('Z' + 1), v));
+    return _mm256_or_si256(v, _mm256_and_si256(isUpper, _mm256_set1_epi16(0x20)));
+}
+
+TARGET_AVX2 static inline __m256i EqualsAvx2(__m256i v, __m256i c, __m256i alt, bool caseSensitive) {
+    if (caseSensitive) {
+        return _mm256_cmpeq_epi16(v, c);
+    }
+    __m256i eq = _mm256_cmpeq_epi16(FoldAsciiAvx2(v), c);
+    return _mm256_or_si256(eq, _mm256_cmpeq_epi16(v, alt));
+}
+
+// must only be called if CpuHasAvx2()
+TARGET_AVX2 const WCHAR* FindAvx2(const WCHAR* s, size_t sLen, const WCHAR* toFind, bool caseSensitive) {
+    size_t len = str::Len(toFind);
+    Needle n;
+    if (len == 0 || len > sLen || !InitNeedle(n, toFind, len, caseSensitive)) {
+        return FindScalar(s, sLen, toFind, caseSensitive);
+    }
+    __m256i c1 = _mm256_set1_epi16((short)n.c1);
+    __m256i c2 = _mm256_set1_epi16((short)n.c2);
+    __m256i alt1 = _mm256_set1_epi16((short)n.alt1);
+    __m256i alt2 = _mm256_set1_epi16((short)n.alt2);
+
+    size_t nPos = sLen - len + 1;
+    size_t i = 0;
+    for (; i + 16 <= nPos; i += 16) {
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(s + i + n.pos1));
+        __m256i v2 = _mm256_loadu_si256((const __m256i*)(s + i + n.pos2));
+        __m256i eq =
+            _mm256_and_si256(EqualsAvx2(v1, c1, alt1, caseSensitive), EqualsAvx2(v2, c2, alt2, caseSensitive));
+        u32 mask = (u32)_mm256_movemask_epi8(eq);
+        while (mask != 0) {
+            u32 bit = LowestSetBit(mask);
+            const WCHAR* candidate = s + i + bit / 2;
+            if (MatchesAt(candidate, toFind, len, caseSensitive)) {
+                return candidate;
+            }
+            mask &= ~(3u << bit);
+        }
+    }
+    // at most 15 positions left, not worth a full AVX2 iteration
+    return FindSse2(s + i, sLen - i, toFind, caseSensitive);
+}
+
+static bool DetectAvx2() {
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool hasOsXSave = (info[2] & (1 << 27)) != 0;
+    bool hasAvx = (info[2] & (1 << 28)) != 0;
+    if (!hasOsXSave || !hasAvx) {
+        return false;
+    }
+    // the OS must also preserve the YMM registers across context switches
+    u64 xcr0 = _xgetbv(0);
+    if ((xcr0 & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+}
+
+bool CpuHasAvx2() {
+    // racing threads compute the same value, so no locking is needed
+    static int hasAvx2 = -1;
+    if (hasAvx2 < 0) {
+        hasAvx2 = DetectAvx2() ? 1 : 0;
+    }
+    return hasAvx2 == 1;
+}
+
+#endif
+
+const WCHAR* Find(const WCHAR* s, size_t sLen, const WCHAR* toFind, bool caseSensitive) {
+#if IS_INTEL_32 || IS_INTEL_64
+    if (CpuHasAvx2()) {
+        return FindAvx2(s, sLen, toFind, caseSensitive);
+    }
+    // SSE2 is part of the minimum CPU requirements
+    return FindSse2(s, sLen, toFind, caseSensitive);
+#else
+    return FindScalar(s, sLen, toFind, caseSensitive);
+#endif
+}
+
+} // namespace strfind
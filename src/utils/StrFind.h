@@ -0,0 +1,37 @@
+/* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
+   License: Simplified BSD (see COPYING.BSD) */
+
+/* Searching for a string in a (potentially long) text, optionally ignoring case.
+   Characters are compared after lower-casing them with FoldChar().
+
+   Candidate positions are found by comparing two characters of the searched
+   string with 8 (SSE2) or 16 (AVX2) positions of the text at once. The fastest
+   implementation supported by the CPU is picked at runtime. */
+
+namespace strfind {
+
+WCHAR FoldCharSlow(WCHAR c);
+
+// lower-cases c (with a fast path for ASCII)
+inline WCHAR FoldChar(WCHAR c) {
+    if (c < 0x80) {
+        if (c >= 'A' && c <= 'Z') {
+            return c + 32;
+        }
+        return c;
+    }
+    return FoldCharSlow(c);
+}
+
+// finds the first occurence of toFind in s[0..sLen)
+const WCHAR* Find(const WCHAR* s, size_t sLen, const WCHAR* toFind, bool caseSensitive);
+
+// exposed for tests and benchmarks, use Find() instead
+const WCHAR* FindScalar(const WCHAR* s, size_t sLen, const WCHAR* toFind, bool caseSensitive);
+#if IS_INTEL_32 || IS_INTEL_64
+const WCHAR* FindSse2(const WCHAR* s, size_t sLen, const WCHAR* toFind, bool caseSensitive);
+const WCHAR* FindAvx2(const WCHAR* s, size_t sLen, const WCHAR* toFind, bool caseSensitive);
+bool CpuHasAvx2();
+#endif
+
+} // namespace strfind
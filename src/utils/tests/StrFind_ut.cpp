@@ -0,0 +1,122 @@
+/* Copyright 2021 the SumatraPDF project authors (see AUTHORS file).
+   License: Simplified BSD (see COPYING.BSD) */
+
+#include "utils/BaseUtil.h"
+#include "utils/StrFind.h"
+#include "utils/Timer.h"
+
+// must be last due to assert() over-write
+#include "utils/UtAssert.h"
+
+using FindFunc = const WCHAR* (*)(const WCHAR*, size_t, const WCHAR*, bool);
+
+// includes characters that are folded to ASCII and non-ASCII letters
+static const WCHAR gChars[] = {'a', 'b', 'A', 'B', 'i', 'I', 'k', 0x130, 0x212A, 0xC1, 0xE1, 0x416, 0x436, ' ', '-'};
+
+static WCHAR GenRandChar() {
+    return gChars[rand() % dimof(gChars)];
+}
+
+// straightforward implementation to compare the optimized ones against
+static const WCHAR* FindReference(const WCHAR* s, size_t sLen, const WCHAR* toFind, bool caseSensitive) {
+    size_t len = str::Len(toFind);
+    for (size_t i = 0; i + len <= sLen; i++) {
+        bool matches = true;
+        for (size_t j = 0; j < len && matches; j++) {
+            WCHAR c1 = s[i + j], c2 = toFind[j];
+            matches = caseSensitive ? c1 == c2 : strfind::FoldChar(c1) == strfind::FoldChar(c2);
+        }
+        if (matches) {
+            return s + i;
+        }
+    }
+    return nullptr;
+}
+
+static void StrFindCheck(FindFunc find) {
+    const WCHAR* s = L"The quick brown fox jumps over the lazy dog. THE END";
+    size_t sLen = str::Len(s);
+    utassert(find(s, sLen, L"the", true) == s + 31);
+    utassert(find(s, sLen, L"the", false) == s);
+    utassert(find(s, sLen, L"THE END", true) == s + 45);
+    utassert(find(s, sLen, L"dog. the", false) == s + 40);
+    utassert(find(s, sLen, L"dogs", false) == nullptr);
+    utassert(find(s, sLen, L"", false) == s);
+    // must not look past the given length
+    utassert(find(s, sLen - 1, L"END", false) == nullptr);
+    utassert(find(s, 2, L"The", true) == nullptr);
+
+    WCHAR text[200];
+    WCHAR toFind[8];
+    for (int i = 0; i < 20000; i++) {
+        size_t textLen = (size_t)(rand() % (dimof(text) - 1));
+        for (size_t j = 0; j < textLen; j++) {
+            text[j] = GenRandChar();
+        }
+        text[textLen] = 0;
+        size_t len = 1 + (size_t)(rand() % (dimof(toFind) - 1));
+        for (size_t j = 0; j < len; j++) {
+            toFind[j] = GenRandChar();
+        }
+        toFind[len] = 0;
+        bool caseSensitive = (rand() % 2) == 0;
+        utassert(find(text, textLen, toFind, caseSensitive) == FindReference(text, textLen, toFind, caseSensitive));
+    }
+}
+
+static double StrFindTime(FindFunc find, const WCHAR* text, size_t textLen, const WCHAR* toFind) {
+    auto t = TimeGet();
+    for (int i = 0; i < 20; i++) {
+        const WCHAR* s = text;
+        size_t n = textLen;
+        while (const WCHAR* found = find(s, n, toFind, false)) {
+            n -= found + 1 - s;
+            s = found + 1;
+        }
+    }
+    return TimeSinceInMs(t);
+}
+
+static const WCHAR* FindStrStrI(const WCHAR* s, __unused size_t sLen, const WCHAR* toFind,
+                                __unused bool caseSensitive) {
+    return StrStrIW(s, toFind);
+}
+
+// compares the optimized implementations with the previously used StrStrI
+// on text similar to what TextSearch looks at
+static void StrFindBench() {
+    const WCHAR* words[] = {L"Lorem",      L"ipsum",      L"dolor", L"sit", L"amet,",
+                            L"consectetur", L"adipiscing", L"elit.", L"\n"};
+    str::WStr text;
+    while (text.size() < 1024 * 1024) {
+        text.AppendChar(' ');
+        text.Append(words[rand() % dimof(words)]);
+    }
+    text.Append(L" needle");
+    const WCHAR* toFind = L"needle";
+
+    double msStrStrI = StrFindTime(FindStrStrI, text.Get(), text.size(), toFind);
+    double msScalar = StrFindTime(strfind::FindScalar, text.Get(), text.size(), toFind);
+    printf("StrFindBench: StrStrI: %.2f ms, scalar: %.2f ms", msStrStrI, msScalar);
+#if IS_INTEL_32 || IS_INTEL_64
+    double msSse2 = StrFindTime(strfind::FindSse2, text.Get(), text.size(), toFind);
+    printf(", SSE2: %.2f ms", msSse2);
+    if (strfind::CpuHasAvx2()) {
+        double msAvx2 = StrFindTime(strfind::FindAvx2, text.Get(), text.size(), toFind);
+        printf(", AVX2: %.2f ms", msAvx2);
+    }
+#endif
+    printf("\n");
+}
+
+void StrFindTest() {
+    StrFindCheck(strfind::Find);
+    StrFindCheck(strfind::FindScalar);
+#if IS_INTEL_32 || IS_INTEL_64
+    StrFindCheck(strfind::FindSse2);
+    if (strfind::CpuHasAvx2()) {
+        StrFindCheck(strfind::FindAvx2);
+    }
+#endif
+    StrFindBench();
+}